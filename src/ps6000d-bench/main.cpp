@@ -0,0 +1,351 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief End-to-end throughput benchmark for ps6000d
+
+	Connects to a running ps6000d (typically started with --simulate), configures a capture over the SCPI socket,
+	then consumes waveforms from the data plane socket as fast as it can, ACKing each one like a real client.
+	Reports waveforms/s, MB/s on the wire and trigger-to-trigger dead time, followed by the server's own PERF?
+	statistics.
+ */
+
+#include "../../lib/log/log.h"
+#include "../../lib/xptools/Socket.h"
+#include <chrono>
+#include <cinttypes>
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+void help();
+bool SendCommand(Socket& sock, const string& cmd);
+bool Query(Socket& sock, const string& cmd, string& reply);
+
+void help()
+{
+	fprintf(stderr,
+			"ps6000d-bench [general options] [logger options]\n"
+			"\n"
+			"  [general options]:\n"
+			"    --help                        : this message...\n"
+			"    --host hostname               : server to connect to (default localhost)\n"
+			"    --scpi-port port              : SCPI control plane port (default 5025)\n"
+			"    --waveform-port port          : binary waveform data port (default 5026)\n"
+			"    --channels num                : number of analog channels to enable (default 1)\n"
+			"    --rate Hz                     : sample rate (default 1250000000)\n"
+			"    --depth samples               : memory depth (default 1000000)\n"
+			"    --segments num                : rapid block mode segments (default 1)\n"
+			"    --pipeline depth              : server block mode pipeline depth (default 1)\n"
+			"    --bits num                    : ADC resolution (default: leave unchanged)\n"
+			"    --format INT16|PACKED         : sample encoding (default INT16)\n"
+			"    --compress NONE|RICE          : waveform compression (default NONE)\n"
+			"    --seconds num                 : how long to run (default 10)\n"
+			"\n"
+			"  [logger options]:\n"
+			"    levels: ERROR, WARNING, NOTICE, VERBOSE, DEBUG\n"
+			"    --quiet|-q                    : reduce logging level by one step\n"
+			"    --verbose                     : set logging level to VERBOSE\n"
+			"    --debug                       : set logging level to DEBUG\n"
+			"    --logfile|-l <filename>       : output log messages to file\n"
+		   );
+}
+
+/**
+	@brief Sends one SCPI command
+ */
+bool SendCommand(Socket& sock, const string& cmd)
+{
+	LogDebug("> %s\n", cmd.c_str());
+	string line = cmd + "\n";
+	return sock.SendLooped((const unsigned char*)line.c_str(), line.length());
+}
+
+/**
+	@brief Sends a SCPI query and waits for the reply line
+ */
+bool Query(Socket& sock, const string& cmd, string& reply)
+{
+	if(!SendCommand(sock, cmd))
+		return false;
+
+	reply = "";
+	while(true)
+	{
+		unsigned char c;
+		if(!sock.RecvLooped(&c, 1))
+			return false;
+		if(c == '\n')
+			break;
+		reply += c;
+	}
+	LogDebug("< %s\n", reply.c_str());
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	Severity console_verbosity = Severity::NOTICE;
+
+	string host = "localhost";
+	uint16_t scpi_port = 5025;
+	uint16_t waveform_port = 5026;
+	size_t channels = 1;
+	uint64_t rate = 1250000000;
+	uint64_t depth = 1000000;
+	size_t segments = 1;
+	size_t pipeline = 1;
+	size_t bits = 0;
+	string format = "INT16";
+	string compress = "NONE";
+	double seconds = 10;
+	for(int i=1; i<argc; i++)
+	{
+		string s(argv[i]);
+
+		if(ParseLoggerArguments(i, argc, argv, console_verbosity))
+			continue;
+
+		if(s == "--help")
+		{
+			help();
+			return 0;
+		}
+		else if( (s == "--host") && (i+1 < argc) )
+			host = argv[++i];
+		else if( (s == "--scpi-port") && (i+1 < argc) )
+			scpi_port = atoi(argv[++i]);
+		else if( (s == "--waveform-port") && (i+1 < argc) )
+			waveform_port = atoi(argv[++i]);
+		else if( (s == "--channels") && (i+1 < argc) )
+			channels = atoi(argv[++i]);
+		else if( (s == "--rate") && (i+1 < argc) )
+			rate = atof(argv[++i]);
+		else if( (s == "--depth") && (i+1 < argc) )
+			depth = atof(argv[++i]);
+		else if( (s == "--segments") && (i+1 < argc) )
+			segments = atoi(argv[++i]);
+		else if( (s == "--pipeline") && (i+1 < argc) )
+			pipeline = atoi(argv[++i]);
+		else if( (s == "--bits") && (i+1 < argc) )
+			bits = atoi(argv[++i]);
+		else if( (s == "--format") && (i+1 < argc) )
+			format = argv[++i];
+		else if( (s == "--compress") && (i+1 < argc) )
+			compress = argv[++i];
+		else if( (s == "--seconds") && (i+1 < argc) )
+			seconds = atof(argv[++i]);
+		else
+		{
+			fprintf(stderr, "Unrecognized command-line argument \"%s\", use --help\n", s.c_str());
+			return 1;
+		}
+	}
+
+	g_log_sinks.emplace(g_log_sinks.begin(), new ColoredSTDLogSink(console_verbosity));
+
+	//Control plane first, the server only accepts the data connection once a SCPI client is there
+	Socket scpi(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+	if(!scpi.Connect(host, scpi_port))
+	{
+		LogError("Failed to connect to %s:%d\n", host.c_str(), scpi_port);
+		return 1;
+	}
+	scpi.DisableNagle();
+
+	string reply;
+	if(!Query(scpi, "*IDN?", reply))
+		return 1;
+	LogNotice("Connected to %s\n", reply.c_str());
+	if(!Query(scpi, "CHANS?", reply))
+		return 1;
+	size_t numAnalog = stoi(reply);
+	channels = min(channels, numAnalog);
+
+	//Configure the capture
+	for(size_t i=0; i<numAnalog; i++)
+		SendCommand(scpi, string(1, 'A' + i) + ((i < channels) ? ":ON" : ":OFF"));
+	if(bits)
+		SendCommand(scpi, "BITS " + to_string(bits));
+	SendCommand(scpi, "SEGMENTS " + to_string(segments));
+	SendCommand(scpi, "PIPELINE " + to_string(pipeline));
+	SendCommand(scpi, "FORMAT " + format);
+	SendCommand(scpi, "COMPRESS " + compress);
+	SendCommand(scpi, "RATE " + to_string(rate));
+	SendCommand(scpi, "DEPTH " + to_string(depth));
+	SendCommand(scpi, "PERF:RESET");
+	bool packed = (format == "PACKED") || (compress != "NONE");
+	bool compressed = (compress != "NONE");
+
+	Socket data(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+	if(!data.Connect(host, waveform_port))
+	{
+		LogError("Failed to connect to %s:%d\n", host.c_str(), waveform_port);
+		return 1;
+	}
+	data.DisableNagle();
+
+	LogNotice("Running %zu channel(s), %" PRIu64 " samples at %" PRIu64 " Hz for %.1f seconds...\n",
+		channels, depth, rate, seconds);
+	SendCommand(scpi, "START");
+
+	#pragma pack(push, 1)
+	struct
+	{
+		uint32_t sequence;
+		uint16_t numChannels;
+		int64_t fs_per_sample;
+	} wfmhdr;
+	#pragma pack(pop)
+
+	vector<unsigned char> scratch;
+	size_t waveforms = 0;
+	uint64_t bytes = 0;
+	double captureTime = 0;
+	auto start = chrono::steady_clock::now();
+	double elapsed = 0;
+	bool ok = true;
+	while(elapsed < seconds)
+	{
+		if(!data.RecvLooped((unsigned char*)&wfmhdr, sizeof(wfmhdr)))
+		{
+			ok = false;
+			break;
+		}
+		uint64_t wfmBytes = sizeof(wfmhdr);
+
+		//Restart the clock when the first waveform comes in, so setup time doesn't count
+		if(waveforms == 0)
+			start = chrono::steady_clock::now();
+
+		uint64_t numSamples = 0;
+		for(size_t i=0; ok && (i<wfmhdr.numChannels); i++)
+		{
+			//Channel number and sample count, then scale/offset/trigphase (analog) or just trigphase
+			uint64_t common[2];
+			unsigned char rest[12 + 1 + 8];
+			if(!data.RecvLooped((unsigned char*)common, sizeof(common)))
+			{
+				ok = false;
+				break;
+			}
+			bool digital = (common[0] >= numAnalog);
+			size_t restLen = (digital ? 4 : 12) + (packed ? 1 : 0) + (compressed ? 8 : 0);
+			if(!data.RecvLooped(rest, restLen))
+			{
+				ok = false;
+				break;
+			}
+			numSamples = common[1];
+
+			size_t sampleBits = packed ? rest[digital ? 4 : 12] : 16;
+			uint64_t len;
+			if(compressed)
+				memcpy(&len, rest + restLen - 8, sizeof(len));
+			else if(digital && packed)
+				len = numSamples;
+			else if(sampleBits >= 16)
+				len = numSamples * 2;
+			else
+				len = (numSamples * sampleBits + 7) / 8;
+
+			scratch.resize(len);
+			if( (len != 0) && !data.RecvLooped(&scratch[0], len) )
+			{
+				ok = false;
+				break;
+			}
+			wfmBytes += sizeof(common) + restLen + len;
+		}
+		if(!ok)
+			break;
+
+		//ACK it so the server keeps sending
+		if(!data.SendLooped((const unsigned char*)&wfmhdr.sequence, sizeof(wfmhdr.sequence)))
+		{
+			ok = false;
+			break;
+		}
+
+		//First waveform only starts the clock
+		if(waveforms > 0)
+		{
+			bytes += wfmBytes;
+			captureTime += numSamples * wfmhdr.fs_per_sample * 1e-15;
+		}
+		waveforms ++;
+		elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+
+	SendCommand(scpi, "STOP");
+	if(!ok)
+		LogWarning("Lost connection to the server\n");
+
+	size_t measured = (waveforms > 0) ? (waveforms - 1) : 0;
+	if( (measured == 0) || (elapsed <= 0) )
+	{
+		LogError("No waveforms received\n");
+		return 1;
+	}
+
+	double wfmRate = measured / elapsed;
+	double period = elapsed / measured;
+	double acquire = captureTime / measured;
+	LogNotice("%zu waveforms in %.2f s\n", measured, elapsed);
+	{
+		LogIndenter li;
+		LogNotice("Waveform rate:   %.2f WFM/s\n", wfmRate);
+		LogNotice("Throughput:      %.2f MB/s\n", bytes / elapsed * 1e-6);
+		LogNotice("Dead time:       %.1f us per trigger (%.1f %% of the time)\n",
+			(period - acquire) * 1e6, 100 * (1 - acquire / period));
+	}
+
+	if(Query(scpi, "PERF?", reply))
+	{
+		LogNotice("Server statistics (us):\n");
+		LogIndenter li;
+		size_t pos = 0;
+		while(pos < reply.length())
+		{
+			size_t end = reply.find(';', pos);
+			if(end == string::npos)
+				end = reply.length();
+			if(end > pos)
+				LogNotice("%s\n", reply.substr(pos, end - pos).c_str());
+			pos = end + 1;
+		}
+	}
+
+	return 0;
+}
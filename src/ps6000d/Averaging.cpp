@@ -0,0 +1,158 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Server side averaging of block mode captures
+ */
+#include "ps6000d.h"
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+#ifdef HAVE_X86_SIMD
+void AccumulateSamples_AVX2(const int16_t* in, int32_t* sum, size_t count);
+#endif
+
+/**
+	@brief Adds a waveform to a running per-sample sum (SSE2 or NEON where available, otherwise scalar)
+
+	@param in		Input samples
+	@param sum		Running sums, one per sample
+	@param count	Number of samples
+ */
+void AccumulateSamples(const int16_t* in, int32_t* sum, size_t count)
+{
+	size_t i = 0;
+
+#ifdef HAVE_X86_SIMD
+	if(__builtin_cpu_supports("avx2"))
+	{
+		AccumulateSamples_AVX2(in, sum, count);
+		return;
+	}
+
+	for(; i + 8 <= count; i += 8)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+
+		//Sign extend to 32 bits
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+
+		__m128i* p = reinterpret_cast<__m128i*>(sum + i);
+		_mm_storeu_si128(p, _mm_add_epi32(_mm_loadu_si128(p), lo));
+		_mm_storeu_si128(p + 1, _mm_add_epi32(_mm_loadu_si128(p + 1), hi));
+	}
+#elif defined(__ARM_NEON)
+	for(; i + 8 <= count; i += 8)
+	{
+		int16x8_t v = vld1q_s16(in + i);
+		vst1q_s32(sum + i, vaddw_s16(vld1q_s32(sum + i), vget_low_s16(v)));
+		vst1q_s32(sum + i + 4, vaddw_s16(vld1q_s32(sum + i + 4), vget_high_s16(v)));
+	}
+#endif
+
+	for(; i<count; i++)
+		sum[i] += in[i];
+}
+
+#ifdef HAVE_X86_SIMD
+/**
+	@brief AVX2 version of AccumulateSamples()
+ */
+__attribute__((target("avx2")))
+void AccumulateSamples_AVX2(const int16_t* in, int32_t* sum, size_t count)
+{
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8)
+	{
+		__m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+		__m256i* p = reinterpret_cast<__m256i*>(sum + i);
+		_mm256_storeu_si256(p, _mm256_add_epi32(_mm256_loadu_si256(p), v));
+	}
+	for(; i<count; i++)
+		sum[i] += in[i];
+}
+#endif
+
+/**
+	@brief Adds the squares of a waveform's samples to a running per-sample sum, for the variance
+ */
+void AccumulateSquares(const int16_t* in, int64_t* sumsq, size_t count)
+{
+	for(size_t i=0; i<count; i++)
+	{
+		int32_t v = in[i];
+		sumsq[i] += v * v;
+	}
+}
+
+/**
+	@brief Turns running sums into the mean of each sample, rounded to the nearest ADC code
+
+	@param sum		Running sums
+	@param n		Number of waveforms summed
+	@param out		Output samples
+	@param count	Number of samples
+ */
+void FinishAverage(const int32_t* sum, size_t n, int16_t* out, size_t count)
+{
+	double scale = 1.0 / n;
+	for(size_t i=0; i<count; i++)
+		out[i] = static_cast<int16_t>(lrint(sum[i] * scale));
+}
+
+/**
+	@brief Computes the variance of each sample from running sums, in ADC codes squared
+
+	@param sum		Running sums
+	@param sumsq	Running sums of squares
+	@param n		Number of waveforms summed
+	@param out		Output variances
+	@param count	Number of samples
+ */
+void FinishVariance(const int32_t* sum, const int64_t* sumsq, size_t n, float* out, size_t count)
+{
+	double scale = 1.0 / n;
+	for(size_t i=0; i<count; i++)
+	{
+		double mean = sum[i] * scale;
+		out[i] = max(sumsq[i] * scale - mean*mean, 0.0);
+	}
+}
@@ -0,0 +1,421 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Cache of model capabilities (sample rates, timebases and memory depths)
+
+	Working these out means a long cascade of model number checks plus one GetTimebase call per candidate timebase,
+	and the answer only depends on resolution, which channels and pods are on, and the segment count. So each
+	configuration is probed once, the first time it's seen, and later queries are answered from the cache.
+ */
+#include "ps6000d.h"
+#include <math.h>
+
+#define FS_PER_SECOND 1e15
+
+using namespace std;
+
+/**
+	@brief Everything that changes the answers from GetTimebase
+ */
+struct CapabilityKey
+{
+	size_t adcBits;
+	uint32_t channelMask;
+	uint32_t podMask;
+	size_t numSegments;
+
+	bool operator<(const CapabilityKey& rhs) const
+	{
+		if(adcBits != rhs.adcBits)
+			return adcBits < rhs.adcBits;
+		if(channelMask != rhs.channelMask)
+			return channelMask < rhs.channelMask;
+		if(podMask != rhs.podMask)
+			return podMask < rhs.podMask;
+		return numSegments < rhs.numSegments;
+	}
+};
+
+static map<CapabilityKey, ScopeCapabilities> g_capabilityCache;
+
+/**
+	@brief Finds every sample rate the scope will accept in its current configuration, and the timebase for each
+ */
+static void EnumerateSampleRates(ScopeCapabilities& caps)
+{
+	vector<size_t> vec;
+	double previousIntervalNs = 0;
+
+	//Enumerate timebases
+	switch(g_pico_type)
+	{
+		case PICO2000A:
+			if(g_model.find("2205MSO") != string::npos)
+			{
+				vec =
+				{
+					0,1,2,4,5,8,10,16,20,25,32,40,50,64,80,100,125,128,160,200,250,320,400,500,640,800,1000,1250,1280,1600,2000,2500,3200,4000,5000,6400,8000,10000,12500,12800,16000,20000,25000,32000,40000,50000,64000,80000,100000
+				};
+			}
+			else if( g_model=="2206" || g_model=="2206A" || g_model=="2206B" || g_model=="2205AMSO" || g_model=="2405A" )
+			{
+				//!! 500 MS/s maximum sampling rate models
+				vec =
+				{
+					0,1,2,3,4,6,7,10,12,22,27,42,52,82,102,127,202,252,402,502,627,802,1002,1252,2002,2502,3127,4002,5002,6252,8002,10002,12502,15627,20002,25002,31252,40002,50002,62502
+				};
+			}
+			else
+			{
+				//!! 1 GS/s maximum sampling rate models
+				vec =
+				{
+					0,1,2,3,4,6,7,10,12,18,22,27,42,52,82,102,127,162,202,252,402,502,627,802,1002,1252,1602,2002,2502,3127,4002,5002,6252,8002,10002,12502,15627,16002,20002,25002,31252,40002,50002,62502,80002,100002,125002
+				};
+			}
+			break;
+		case PICO3000A:
+			if( (g_model[1]=='2') and (g_model[4]=='A' or g_model[4]=='B') )
+			{
+				//PicoScope 3000A and 3000B Series 2-Channel USB 2.0 Oscilloscopes
+				vec =
+				{
+					0,1,2,3,4,6,7,10,12,22,27,42,52,82,102,127,202,252,402,502,627,802,1002,1252,2002,2502,3127,4002,5002,6252,8002,10002,12502,15627,20002,25002,31252,40002,50002,62502
+				};
+			}
+			if( (g_model.find("MSO") != string::npos) and (g_model[4]!='D') )
+			{
+				//PicoScope 3000 Series USB 2.0 MSOs
+				vec =
+				{
+					0,1,2,3,5,6,9,11,17,21,26,41,51,81,101,126,161,201,251,401,501,626,801,1001,1251,1601,2001,2501,3126,4001,5001,6251,8001,10001,12501,15626,16001,20001,25001,31251,40001,50001,62501,80001,100001,125001
+				};
+			}
+			else
+			{
+				//PicoScope 3000A and 3000B Series 4-Channel USB 2.0 Oscilloscopes
+				//PicoScope 3207A and 3207B USB 3.0 Oscilloscopes
+				//PicoScope 3000D Series USB 3.0 Oscilloscopes and MSOs
+				vec =
+				{
+					0,1,2,3,4,6,7,10,12,18,22,27,42,52,82,102,127,162,202,252,402,502,627,802,1002,1252,1602,2002,2502,3127,4002,5002,6252,8002,10002,12502,15627,16002,20002,25002,31252,40002,50002,62502,80002,100002,125002
+				};
+			}
+			break;
+		case PICO4000A:
+			if(g_model.find("4444") != string::npos)
+			{
+				//PicoScope 4444
+				vec =
+				{
+					0,1,2,3,4,6,7,10,12,18,22,27,34,42,52,66,82,102,127,162,202,252,322,402,502,627,642,802,1002,1252,1602,2002,2502,3202,4002,5002,6252,6402,8002,10002,12502,16002,20002,25002,32002,40002,50002
+				};
+			}
+			else
+			{
+				//PicoScope 4824 and 4000A Series
+				vec =
+				{
+					0,1,3,7,9,15,19,31,39,63,79,99,127,159,199,255,319,399,511,639,799,999,1023,1279,1599,1999,2559,3199,3999,5119,6399,7999,9999,10239,12799,15999,19999,25599,31999,39999,51199,63999,79999
+				};
+			}
+			break;
+		case PICO5000A:
+			switch(g_adcBits)
+			{
+				case 8:
+				{
+					vec =
+					{
+						0,1,2,3,4,6,7,10,12,18,22,27,42,52,82,102,127,162,202,252,402,502,627,802,1002,1252,1602,2002,2502,3127,4002,5002,6252,8002,10002,12502,15627,16002,20002,25002,31252,40002,50002,62502,80002,100002,125002
+					};
+					break;
+				}
+
+				case 12:
+				{
+					vec =
+					{
+						1,2,3,4,5,7,8,11,13,23,28,43,53,83,103,128,203,253,403,503,628,803,1003,1253,2003,2503,3128,4003,5003,6253,8003,10003,12503,15628,20003,25003,31253,40003,50003,62503
+					};
+					break;
+				}
+
+				case 14:
+				{
+					vec =
+					{
+						3,4,6,7,10,12,18,22,27,42,52,82,102,127,162,202,252,402,502,627,802,1002,1252,1602,2002,2502,3127,4002,5002,6252,8002,10002,12502,15627,16002,20002,25002,31252,40002,50002,62502,80002,100002,125002
+					};
+					break;
+				}
+
+				case 15:
+				{
+					vec =
+					{
+						3,4,6,7,10,12,18,22,27,42,52,82,102,127,162,202,252,402,502,627,802,1002,1252,1602,2002,2502,3127,4002,5002,6252,8002,10002,12502,15627,16002,20002,25002,31252,40002,50002,62502,80002,100002,125002
+					};
+					break;
+				}
+
+				case 16:
+				{
+					vec =
+					{
+						4,5,7,8,11,13,23,28,43,53,83,103,128,203,253,403,503,628,803,1003,1253,2003,2503,3128,4003,5003,6253,8003,10003,12503,15628,20003,25003,31253,40003,50003,62503
+					};
+				}
+			}
+			break;
+		case PICOSIM:
+		case PICO6000A:
+			//PicoScope 6428E-D
+			if(g_model[3] == '8')
+			{
+				vec =
+				{
+					0,1,2,3,4,5,6,7,10,15,25,30,55,105,130,205,255,505,630,1005,1255,2005,2505,3130,5005,6255,10005,12505,15630,20005,25005,31255,50005,62505,78130,100005,125005,156255
+				};
+			}
+			//PicoScope 6000E Series except the PicoScope 6428E-D
+			else
+			{
+				vec =
+				{
+					0,1,2,3,4,5,6,9,14,24,29,54,104,129,204,254,504,629,1004,1254,2004,2504,3129,5004,6254,10004,12504,15629,20004,25004,31254,50004,62504,78129,100004,125004,156254
+				};
+			}
+			break;
+		case PICOPSOSPA:
+			//All desired sample rates in picoseconds
+			vec =
+			{
+				200,400,800,1000,1600,3200,6400,8000,10000,12500,12800,16000,20000,25000,32000,40000,50000,64000,80000,100000,125000,128000,160000,200000,250000,320000,400000,500000,640000,800000,1000000,1250000,1280000,1600000,2000000,2500000,3200000,4000000,5000000,6400000,8000000,10000000,12500000,12800000,16000000,20000000,25000000,32000000,40000000,50000000,64000000,80000000,100000000,125000000,128000000,160000000,200000000,250000000,320000000,400000000,500000000,640000000,800000000,1000000000
+			};
+			break;
+	}
+
+	for(auto i : vec)
+	{
+		double intervalNs;
+		float intervalNs_f;
+		uint64_t maxSamples;
+		int32_t maxSamples_int;
+		PICO_STATUS status = PICO_RESERVED_1;
+
+		switch(g_pico_type)
+		{
+			case PICO2000A:
+				status = ps2000aGetTimebase2(g_hScope, i, 1, &intervalNs_f, 1, &maxSamples_int, 0);
+				maxSamples = maxSamples_int;
+				intervalNs = intervalNs_f;
+				break;
+			case PICO3000A:
+				status = ps3000aGetTimebase2(g_hScope, i, 1, &intervalNs_f, 1, &maxSamples_int, 0);
+				maxSamples = maxSamples_int;
+				intervalNs = intervalNs_f;
+				break;
+			case PICO4000A:
+				status = ps4000aGetTimebase2(g_hScope, i, 1, &intervalNs_f, &maxSamples_int, 0);
+				maxSamples = maxSamples_int;
+				intervalNs = intervalNs_f;
+				break;
+			case PICO5000A:
+				status = ps5000aGetTimebase2(g_hScope, i, 1, &intervalNs_f, &maxSamples_int, 0);
+				maxSamples = maxSamples_int;
+				intervalNs = intervalNs_f;
+				break;
+			case PICO6000A:
+				status = ps6000aGetTimebase(g_hScope, i, 1, &intervalNs, &maxSamples, 0);
+				break;
+			case PICOPSOSPA:
+				status = psospaGetTimebase(g_hScope, i, 1, &intervalNs, &maxSamples, 0);
+				if(std::abs((intervalNs * 1000) - i) > 1)
+					status = PICO_INVALID_TIMEBASE;		//Avoid irregular sample rates
+				if(intervalNs == previousIntervalNs)
+					status = PICO_INVALID_TIMEBASE;		//Avoid multiple entries of the same rate
+				if(PICO_OK == status)
+					previousIntervalNs = intervalNs;
+				break;
+			case PICOSIM:
+				status = simGetTimebase(g_hScope, i, 1, &intervalNs, &maxSamples, 0);
+				break;
+		}
+
+		if(PICO_OK == status)
+		{
+			size_t intervalFs = intervalNs * 1e6f;
+			size_t rate = FS_PER_SECOND / intervalFs;
+			caps.rates.push_back(rate);
+			caps.timebases.emplace(rate, i);
+			//LogDebug("GetTimebase:\t%ld\t%f\t%f\n", i, (1e12f / i), (FS_PER_SECOND / intervalFs));
+		}
+		else if( (PICO_INVALID_TIMEBASE == status) || (PICO_INVALID_CHANNEL == status) || (PICO_NO_CHANNELS_OR_PORTS_ENABLED == status) )
+		{
+			//Requested timebase not possible
+			//This is common and harmless if we ask for e.g. timebase 0 when too many channels are active.
+			continue;
+		}
+		else
+			LogWarning("GetTimebase failed, code %d / 0x%x\n", status, status);
+	}
+}
+
+/**
+	@brief Finds the memory depths the scope will accept in its current configuration
+ */
+static void EnumerateSampleDepths(ScopeCapabilities& caps)
+{
+	double intervalNs;
+	float intervalNs_f;
+	uint64_t maxSamples;
+	int32_t maxSamples_int;
+
+	PICO_STATUS status;
+	status = PICO_RESERVED_1;
+
+	//Ask for max memory depth at timebase number 10
+	//We cannot use the first few timebases because those are sometimes not available depending on channel count etc
+	int ntimebase = 10;
+	switch(g_pico_type)
+	{
+		case PICO2000A:
+			status = ps2000aGetTimebase2(g_hScope, ntimebase, 1, &intervalNs_f, 1, &maxSamples_int, 0);
+			maxSamples = maxSamples_int;
+			intervalNs = intervalNs_f;
+			break;
+		case PICO3000A:
+			status = ps3000aGetTimebase2(g_hScope, ntimebase, 1, &intervalNs_f, 1, &maxSamples_int, 0);
+			maxSamples = maxSamples_int;
+			intervalNs = intervalNs_f;
+			break;
+		case PICO4000A:
+			status = ps4000aGetTimebase2(g_hScope, ntimebase, 1, &intervalNs_f, &maxSamples_int, 0);
+			maxSamples = maxSamples_int;
+			intervalNs = intervalNs_f;
+			break;
+		case PICO5000A:
+			status = ps5000aGetTimebase2(g_hScope, ntimebase, 1, &intervalNs_f, &maxSamples_int, 0);
+			maxSamples = maxSamples_int;
+			intervalNs = intervalNs_f;
+			break;
+		case PICO6000A:
+			status = ps6000aGetTimebase(g_hScope, ntimebase, 1, &intervalNs, &maxSamples, 0);
+			break;
+		case PICOPSOSPA:
+			status = psospaGetTimebase(g_hScope, 40000, 1, &intervalNs, &maxSamples, 0);
+			break;
+		case PICOSIM:
+			status = simGetTimebase(g_hScope, ntimebase, 1, &intervalNs, &maxSamples, 0);
+			break;
+	}
+
+	if(PICO_OK == status)
+	{
+		//Seems like there's no restrictions on actual memory depth other than an upper bound.
+		//To keep things simple, report 1-2-5 series from 1K samples up to the actual max depth
+
+		for(size_t base = 1000; base < maxSamples; base *= 10)
+		{
+			const size_t muls[] = {1, 2, 4, 5, 8};
+			for(auto m : muls)
+			{
+				size_t depth = m * base;
+				if(depth < maxSamples)
+					caps.depths.push_back(depth);
+			}
+		}
+
+		caps.depths.push_back(maxSamples);
+	}
+}
+
+/**
+	@brief Builds the cache key of the current configuration
+
+	Must be called with g_mutex held.
+ */
+static CapabilityKey CurrentCapabilityKey()
+{
+	CapabilityKey key;
+	key.adcBits = g_adcBits;
+	key.channelMask = 0;
+	key.podMask = 0;
+	key.numSegments = g_numSegments;
+	for(size_t i=0; i<g_numChannels; i++)
+	{
+		if(g_channelOn[i])
+			key.channelMask |= (1 << i);
+	}
+	for(size_t i=0; i<g_numDigitalPods; i++)
+	{
+		if(g_msoPodEnabled[i])
+			key.podMask |= (1 << i);
+	}
+	return key;
+}
+
+/**
+	@brief Checks if the capabilities of the current configuration are cached, i.e. GetCapabilities() won't touch
+	the hardware
+
+	Must be called with g_mutex held.
+ */
+bool HaveCapabilities()
+{
+	return g_capabilityCache.find(CurrentCapabilityKey()) != g_capabilityCache.end();
+}
+
+/**
+	@brief Returns the capabilities of the scope in its current configuration, probing the hardware on a cache miss
+
+	Entries are never invalidated explicitly: resolution, channel and pod enables and segment count are all part of
+	the key, so changing any of them simply selects (or creates) a different entry.
+
+	Must be called with g_mutex held, and the driver idle unless HaveCapabilities() is true.
+ */
+const ScopeCapabilities& GetCapabilities()
+{
+	CapabilityKey key = CurrentCapabilityKey();
+	auto it = g_capabilityCache.find(key);
+	if(it != g_capabilityCache.end())
+		return it->second;
+
+	LogTrace("Probing capabilities (%zu bits, channels 0x%x, pods 0x%x, %zu segments)\n",
+		key.adcBits, key.channelMask, key.podMask, key.numSegments);
+
+	auto& caps = g_capabilityCache[key];
+	EnumerateSampleRates(caps);
+	EnumerateSampleDepths(caps);
+	return caps;
+}
@@ -0,0 +1,287 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Lossless compression of waveform data, and the worker pool it runs on
+
+	Stream format (all bit fields LSB first, packed with no padding until the end of the stream):
+
+		Samples are first reduced to their ADC codes (shifted right by 16 - bits), then delta encoded against the
+		previous sample (the first sample against zero). Deltas are zigzag mapped to unsigned values
+		(0, -1, 1, -2 ... -> 0, 1, 2, 3 ...) and split into blocks of 256 (the last block may be shorter).
+
+		Each block starts with a 4-bit Rice parameter k, followed by one code per value: the quotient (value >> k)
+		in unary (that many 1 bits, then a 0), then the low k bits of the value. A quotient of 24 or more is
+		escaped as 24 1 bits followed by the value as a raw 17-bit field.
+ */
+#include "ps6000d.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+
+using namespace std;
+
+//Compressing waveforms before sending (COMPRESS command)
+CompressionMode g_compressionMode = COMPRESS_NONE;
+
+static const size_t g_riceBlockSize = 256;
+static const uint32_t g_riceEscape = 24;
+static const size_t g_riceRawBits = 17;
+
+/**
+	@brief Appends bit fields to a byte buffer
+ */
+class BitWriter
+{
+public:
+	BitWriter(vector<uint8_t>& out)
+		: m_out(out)
+		, m_acc(0)
+		, m_nbits(0)
+	{}
+
+	void Write(uint64_t value, size_t bits)
+	{
+		m_acc |= value << m_nbits;
+		m_nbits += bits;
+		while(m_nbits >= 8)
+		{
+			m_out.push_back(m_acc & 0xff);
+			m_acc >>= 8;
+			m_nbits -= 8;
+		}
+	}
+
+	//Writes a run of 1 bits
+	void WriteOnes(size_t count)
+	{
+		while(count >= 32)
+		{
+			Write(0xffffffff, 32);
+			count -= 32;
+		}
+		Write((1ULL << count) - 1, count);
+	}
+
+	void Flush()
+	{
+		if(m_nbits)
+			m_out.push_back(m_acc & 0xff);
+		m_acc = 0;
+		m_nbits = 0;
+	}
+
+protected:
+	vector<uint8_t>& m_out;
+	uint64_t m_acc;
+	size_t m_nbits;
+};
+
+/**
+	@brief Compresses one channel's samples
+
+	@param in			Input samples, as returned by the driver
+	@param numSamples	Number of samples
+	@param bits			Resolution of the data (8 for MSO pods)
+	@param digital		True for MSO pod data (lines in the low byte) rather than ADC codes
+	@param out			Compressed stream (replaces any existing content)
+ */
+void CompressSamples(const int16_t* in, size_t numSamples, size_t bits, bool digital, vector<uint8_t>& out)
+{
+	out.clear();
+	out.reserve(numSamples);
+	BitWriter writer(out);
+
+	size_t shift = (digital || (bits >= 16)) ? 0 : (16 - bits);
+	int32_t last = 0;
+
+	uint32_t values[g_riceBlockSize];
+	for(size_t base=0; base<numSamples; base += g_riceBlockSize)
+	{
+		size_t count = min(g_riceBlockSize, numSamples - base);
+
+		//Delta and zigzag
+		uint64_t sum = 0;
+		for(size_t i=0; i<count; i++)
+		{
+			int32_t code = digital ? (in[base+i] & 0xff) : (in[base+i] >> shift);
+			int32_t delta = code - last;
+			last = code;
+			values[i] = (static_cast<uint32_t>(delta) << 1) ^ static_cast<uint32_t>(delta >> 31);
+			sum += values[i];
+		}
+
+		//Pick the Rice parameter: roughly log2 of the mean, then check the neighbours
+		size_t mean = sum / count;
+		size_t guess = 0;
+		while( (guess < 15) && ((2ULL << guess) <= mean) )
+			guess ++;
+
+		size_t bestK = guess;
+		uint64_t bestCost = UINT64_MAX;
+		for(size_t k = (guess > 0) ? guess-1 : 0; k <= min(guess+1, static_cast<size_t>(15)); k++)
+		{
+			uint64_t cost = 0;
+			for(size_t i=0; i<count; i++)
+			{
+				uint32_t q = values[i] >> k;
+				cost += (q >= g_riceEscape) ? (g_riceEscape + g_riceRawBits) : (q + 1 + k);
+			}
+			if(cost < bestCost)
+			{
+				bestCost = cost;
+				bestK = k;
+			}
+		}
+
+		//Encode the block
+		writer.Write(bestK, 4);
+		for(size_t i=0; i<count; i++)
+		{
+			uint32_t q = values[i] >> bestK;
+			if(q >= g_riceEscape)
+			{
+				writer.WriteOnes(g_riceEscape);
+				writer.Write(values[i], g_riceRawBits);
+			}
+			else
+			{
+				//q ones, a zero, then k low bits, in one field where it fits
+				if(q + 1 + bestK <= 56)
+					writer.Write( ((1ULL << q) - 1) | (static_cast<uint64_t>(values[i] & ((1 << bestK) - 1)) << (q+1)),
+						q + 1 + bestK);
+				else
+				{
+					writer.WriteOnes(q);
+					writer.Write(0, 1);
+					writer.Write(values[i] & ((1 << bestK) - 1), bestK);
+				}
+			}
+		}
+	}
+
+	writer.Flush();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Worker pool
+
+//Jobs waiting for a worker, protected by g_compressionMutex
+mutex g_compressionMutex;
+condition_variable g_compressionCondition;
+deque<function<void()> > g_compressionJobs;
+size_t g_compressionWorkerCount = 0;
+
+//Number of compression workers (--compress-threads), 0 for one per --compress-cores core, or all cores but one
+size_t g_compressionThreads = 0;
+
+void CompressionWorkerThread();
+
+/**
+	@brief Starts the compression worker threads, if they aren't running yet
+ */
+void StartCompressionWorkers()
+{
+	lock_guard<mutex> lock(g_compressionMutex);
+	if(g_compressionWorkerCount)
+		return;
+
+	//One worker per core we're pinned to, otherwise leave a core for the waveform and SCPI threads
+	size_t count = g_compressionThreads;
+	if( (count == 0) && !g_compressCores.empty() )
+		count = g_compressCores.size();
+	if(count == 0)
+	{
+		count = thread::hardware_concurrency();
+		if(count > 1)
+			count --;
+	}
+	if(count < 1)
+		count = 1;
+
+	//Workers run for the life of the process
+	LogDebug("Starting %zu compression worker threads\n", count);
+	for(size_t i=0; i<count; i++)
+		thread(CompressionWorkerThread).detach();
+	g_compressionWorkerCount = count;
+}
+
+void CompressionWorkerThread()
+{
+#ifdef __linux__
+	pthread_setname_np(pthread_self(), "Compression");
+#endif
+	TuneCompressionThread();
+
+	while(true)
+	{
+		function<void()> job;
+		{
+			unique_lock<mutex> lock(g_compressionMutex);
+			g_compressionCondition.wait(lock, [] { return !g_compressionJobs.empty(); });
+			job = g_compressionJobs.front();
+			g_compressionJobs.pop_front();
+		}
+		job();
+	}
+}
+
+/**
+	@brief Compresses a batch of channels in parallel on the worker pool, returning once all are done
+ */
+void CompressChannels(vector<CompressionJob>& jobs)
+{
+	StartCompressionWorkers();
+
+	mutex doneMutex;
+	condition_variable doneCondition;
+	size_t remaining = jobs.size();
+
+	{
+		lock_guard<mutex> lock(g_compressionMutex);
+		for(auto& job : jobs)
+		{
+			CompressionJob* pjob = &job;
+			g_compressionJobs.push_back([pjob, &doneMutex, &doneCondition, &remaining]
+			{
+				CompressSamples(pjob->in, pjob->numSamples, pjob->bits, pjob->digital, *pjob->out);
+
+				lock_guard<mutex> dlock(doneMutex);
+				remaining --;
+				doneCondition.notify_all();
+			});
+		}
+		g_compressionCondition.notify_all();
+	}
+
+	unique_lock<mutex> lock(doneMutex);
+	doneCondition.wait(lock, [&remaining] { return remaining == 0; });
+}
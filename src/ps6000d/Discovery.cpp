@@ -0,0 +1,207 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Finding the instrument at startup
+
+	A failed psXXXXOpenUnit can take seconds, so when no --series is given we don't just try every API in turn.
+	The series each unit had last time is remembered in a small cache file and tried first; otherwise each API's
+	psXXXXEnumerateUnits (which is much faster than a failed open) is asked which family has the unit.
+ */
+#include "ps6000d.h"
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+//File the series of each unit opened is saved to (--unit-cache), empty if disabled (--no-unit-cache)
+string g_unitCachePath = DefaultUnitCachePath();
+
+//Enumerate all API families at once (--parallel-probe)
+bool g_parallelProbe = false;
+
+//Cache key for "the first unit found", when no --serial is given
+static const char* g_anyUnitKey = "*";
+
+/**
+	@brief Returns the default location of the unit cache, in the user's cache directory
+ */
+string DefaultUnitCachePath()
+{
+#ifdef _WIN32
+	const char* dir = getenv("LOCALAPPDATA");
+	if(!dir)
+		return "";
+	return string(dir) + "\\ps6000d-units";
+#else
+	const char* dir = getenv("XDG_CACHE_HOME");
+	if(dir && dir[0])
+		return string(dir) + "/ps6000d-units";
+	dir = getenv("HOME");
+	if(!dir)
+		return "";
+	return string(dir) + "/.cache/ps6000d-units";
+#endif
+}
+
+/**
+	@brief Loads the unit cache: one "serial series" pair per line
+ */
+static map<string, int> LoadUnitCache()
+{
+	map<string, int> cache;
+	if(g_unitCachePath.empty())
+		return cache;
+
+	FILE* fp = fopen(g_unitCachePath.c_str(), "r");
+	if(!fp)
+		return cache;
+
+	char serial[128];
+	int series;
+	while(2 == fscanf(fp, "%127s %d", serial, &series))
+		cache[serial] = series;
+	fclose(fp);
+	return cache;
+}
+
+/**
+	@brief Looks up the series a unit had the last time it was opened
+
+	@param serial	Serial number, or empty for whatever unit was opened last without one
+
+	@return The series, or 0 if it isn't known
+ */
+int LookupCachedSeries(const string& serial)
+{
+	auto cache = LoadUnitCache();
+	auto it = cache.find(serial.empty() ? g_anyUnitKey : serial);
+	if(it == cache.end())
+		return 0;
+
+	LogDebug("Unit cache says %s is a %d000 series instrument\n",
+		serial.empty() ? "the last unit" : serial.c_str(), it->second);
+	return it->second;
+}
+
+/**
+	@brief Remembers the series of a unit, for the next start
+
+	@param serial	Serial number, or empty for "the first unit found"
+	@param series	Its series
+ */
+void SaveCachedSeries(const string& serial, int series)
+{
+	if(g_unitCachePath.empty())
+		return;
+
+	auto cache = LoadUnitCache();
+	auto& entry = cache[serial.empty() ? g_anyUnitKey : serial];
+	if(entry == series)
+		return;
+	entry = series;
+
+	//With --all-units every worker may save at once. Each writes its own temporary file and renames it over the
+	//cache, so readers always see a complete file. One worker's entry can still lose the race, which only costs
+	//a probe at the next start.
+#ifdef _WIN32
+	string tmpPath = g_unitCachePath + "." + to_string(_getpid()) + ".tmp";
+#else
+	string tmpPath = g_unitCachePath + "." + to_string(getpid()) + ".tmp";
+#endif
+	FILE* fp = fopen(tmpPath.c_str(), "w");
+	if(!fp)
+	{
+		LogDebug("Failed to write unit cache %s\n", tmpPath.c_str());
+		return;
+	}
+	for(auto it : cache)
+		fprintf(fp, "%s %d\n", it.first.c_str(), it.second);
+	bool ok = (fclose(fp) == 0);
+
+#ifdef _WIN32
+	ok = ok && MoveFileExA(tmpPath.c_str(), g_unitCachePath.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+	ok = ok && (rename(tmpPath.c_str(), g_unitCachePath.c_str()) == 0);
+#endif
+	if(!ok)
+	{
+		LogDebug("Failed to write unit cache %s\n", g_unitCachePath.c_str());
+		remove(tmpPath.c_str());
+	}
+}
+
+/**
+	@brief Asks each API family which one has a unit, without opening anything
+
+	Families are checked in the same order as the open fallback (2000 series first). With --parallel-probe they're
+	all enumerated at once, otherwise one at a time until the unit is found.
+
+	@param serial	Serial number of the unit, or empty for the first unit found
+
+	@return The series of the unit, or 0 if no API knows about it
+ */
+int FindSeriesOfUnit(const string& serial)
+{
+	static const int series[] = {2, 3, 4, 5, 6};
+	static const size_t count = sizeof(series) / sizeof(series[0]);
+
+	vector<vector<string> > found(count);
+	if(g_parallelProbe)
+	{
+		vector<thread> threads;
+		for(size_t i=0; i<count; i++)
+			threads.push_back(thread([&found, i] { found[i] = EnumerateUnits(series[i]); }));
+		for(auto& t : threads)
+			t.join();
+	}
+
+	for(size_t i=0; i<count; i++)
+	{
+		if(!g_parallelProbe)
+			found[i] = EnumerateUnits(series[i]);
+
+		for(auto& s : found[i])
+		{
+			if(serial.empty() || (s == serial) )
+			{
+				LogDebug("Found %s on the %d000 series API\n", s.c_str(), series[i]);
+				return series[i];
+			}
+		}
+	}
+	return 0;
+}
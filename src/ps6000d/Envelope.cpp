@@ -0,0 +1,216 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Min/max envelope (peak detect) reduction of waveforms
+ */
+#include "ps6000d.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+void BucketMinMax(const int16_t* in, size_t count, int16_t& vmin, int16_t& vmax);
+#ifdef HAVE_X86_SIMD
+void BucketMinMax_AVX2(const int16_t* in, size_t count, int16_t& vmin, int16_t& vmax);
+#endif
+
+/**
+	@brief Reduces a waveform to a min/max envelope
+
+	The samples are split into columns buckets of (nearly) equal size. Each bucket produces two output samples: its
+	minimum then its maximum, so the envelope can be sent as an ordinary waveform of 2*columns samples.
+
+	@param in			Input samples
+	@param numSamples	Number of input samples, must be at least columns
+	@param columns		Number of buckets
+	@param out			Output buffer, 2*columns samples
+ */
+void ComputeEnvelope(const int16_t* in, size_t numSamples, size_t columns, int16_t* out)
+{
+#ifdef HAVE_X86_SIMD
+	bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+	for(size_t col=0; col<columns; col++)
+	{
+		size_t start = (col * numSamples) / columns;
+		size_t end = ((col+1) * numSamples) / columns;
+
+#ifdef HAVE_X86_SIMD
+		if(avx2)
+			BucketMinMax_AVX2(in + start, end - start, out[col*2], out[col*2 + 1]);
+		else
+#endif
+			BucketMinMax(in + start, end - start, out[col*2], out[col*2 + 1]);
+	}
+}
+
+/**
+	@brief Reduces an MSO pod waveform to an envelope
+
+	Same layout as ComputeEnvelope(), but each bucket produces the AND of its samples (lines that stayed high)
+	followed by the OR (lines that were high at any point), which is the logic analyzer equivalent of peak detect.
+ */
+void ComputeDigitalEnvelope(const int16_t* in, size_t numSamples, size_t columns, int16_t* out)
+{
+	for(size_t col=0; col<columns; col++)
+	{
+		size_t start = (col * numSamples) / columns;
+		size_t end = ((col+1) * numSamples) / columns;
+
+		int16_t vand = 0xff;
+		int16_t vor = 0;
+		for(size_t i=start; i<end; i++)
+		{
+			vand &= in[i];
+			vor |= in[i];
+		}
+		out[col*2] = vand;
+		out[col*2 + 1] = vor;
+	}
+}
+
+/**
+	@brief Finds the min and max of a bucket (SSE2 or NEON where available, otherwise scalar)
+ */
+void BucketMinMax(const int16_t* in, size_t count, int16_t& vmin, int16_t& vmax)
+{
+	int16_t lo = INT16_MAX;
+	int16_t hi = INT16_MIN;
+	size_t i = 0;
+
+#ifdef HAVE_X86_SIMD
+	if(count >= 8)
+	{
+		__m128i mn = _mm_set1_epi16(INT16_MAX);
+		__m128i mx = _mm_set1_epi16(INT16_MIN);
+		for(; i + 8 <= count; i += 8)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+			mn = _mm_min_epi16(mn, v);
+			mx = _mm_max_epi16(mx, v);
+		}
+
+		int16_t tmpmin[8];
+		int16_t tmpmax[8];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(tmpmin), mn);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(tmpmax), mx);
+		for(size_t j=0; j<8; j++)
+		{
+			lo = min(lo, tmpmin[j]);
+			hi = max(hi, tmpmax[j]);
+		}
+	}
+#elif defined(__ARM_NEON)
+	if(count >= 8)
+	{
+		int16x8_t mn = vdupq_n_s16(INT16_MAX);
+		int16x8_t mx = vdupq_n_s16(INT16_MIN);
+		for(; i + 8 <= count; i += 8)
+		{
+			int16x8_t v = vld1q_s16(in + i);
+			mn = vminq_s16(mn, v);
+			mx = vmaxq_s16(mx, v);
+		}
+
+		int16_t tmpmin[8];
+		int16_t tmpmax[8];
+		vst1q_s16(tmpmin, mn);
+		vst1q_s16(tmpmax, mx);
+		for(size_t j=0; j<8; j++)
+		{
+			lo = min(lo, tmpmin[j]);
+			hi = max(hi, tmpmax[j]);
+		}
+	}
+#endif
+
+	for(; i<count; i++)
+	{
+		lo = min(lo, in[i]);
+		hi = max(hi, in[i]);
+	}
+
+	vmin = lo;
+	vmax = hi;
+}
+
+#ifdef HAVE_X86_SIMD
+/**
+	@brief AVX2 version of BucketMinMax()
+ */
+__attribute__((target("avx2")))
+void BucketMinMax_AVX2(const int16_t* in, size_t count, int16_t& vmin, int16_t& vmax)
+{
+	if(count < 32)
+	{
+		BucketMinMax(in, count, vmin, vmax);
+		return;
+	}
+
+	__m256i mn = _mm256_set1_epi16(INT16_MAX);
+	__m256i mx = _mm256_set1_epi16(INT16_MIN);
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+		mn = _mm256_min_epi16(mn, v);
+		mx = _mm256_max_epi16(mx, v);
+	}
+
+	int16_t tmpmin[16];
+	int16_t tmpmax[16];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(tmpmin), mn);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(tmpmax), mx);
+
+	int16_t lo = INT16_MAX;
+	int16_t hi = INT16_MIN;
+	for(size_t j=0; j<16; j++)
+	{
+		lo = min(lo, tmpmin[j]);
+		hi = max(hi, tmpmax[j]);
+	}
+	for(; i<count; i++)
+	{
+		lo = min(lo, in[i]);
+		hi = max(hi, in[i]);
+	}
+
+	vmin = lo;
+	vmax = hi;
+}
+#endif
@@ -0,0 +1,155 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Limit mask testing of block mode captures
+ */
+#include "ps6000d.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+//Mask test config, protected by g_mutex. The mask is replaced rather than modified while the waveform thread
+//might be using it (see MASK:SET), so the waveform thread can keep a reference without holding the lock.
+bool g_maskEnabled = false;
+shared_ptr<MaskSet> g_mask = make_shared<MaskSet>();
+
+//Segments tested since the last MASK:RESET, updated by the waveform thread
+atomic<uint64_t> g_maskPassCount(0);
+atomic<uint64_t> g_maskFailCount(0);
+
+#ifdef HAVE_X86_SIMD
+bool CheckMask_AVX2(const int16_t* in, const int16_t* lower, const int16_t* upper, size_t count);
+#endif
+
+/**
+	@brief Sets the limits of a range of samples in a channel's mask
+
+	The mask grows as needed. Samples that were never set have no limits.
+
+	@param mask		The channel's mask
+	@param first	First sample index
+	@param last		Last sample index (inclusive)
+	@param lower	Lowest allowed ADC code
+	@param upper	Highest allowed ADC code
+ */
+void SetMaskRegion(ChannelMask& mask, size_t first, size_t last, int16_t lower, int16_t upper)
+{
+	if(mask.lower.size() <= last)
+	{
+		mask.lower.resize(last + 1, INT16_MIN);
+		mask.upper.resize(last + 1, INT16_MAX);
+	}
+	for(size_t i=first; i<=last; i++)
+	{
+		mask.lower[i] = lower;
+		mask.upper[i] = upper;
+	}
+}
+
+/**
+	@brief Checks that every sample is within its limits (SSE2 or NEON where available, otherwise scalar)
+
+	@param in		Input samples
+	@param lower	Lowest allowed value of each sample
+	@param upper	Highest allowed value of each sample
+	@param count	Number of samples
+
+	@return True if the waveform passes
+ */
+bool CheckMask(const int16_t* in, const int16_t* lower, const int16_t* upper, size_t count)
+{
+	size_t i = 0;
+
+#ifdef HAVE_X86_SIMD
+	if(__builtin_cpu_supports("avx2"))
+		return CheckMask_AVX2(in, lower, upper, count);
+
+	for(; i + 8 <= count; i += 8)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+		__m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lower + i));
+		__m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(upper + i));
+		__m128i bad = _mm_or_si128(_mm_cmplt_epi16(v, lo), _mm_cmpgt_epi16(v, hi));
+		if(_mm_movemask_epi8(bad))
+			return false;
+	}
+#elif defined(__ARM_NEON)
+	for(; i + 8 <= count; i += 8)
+	{
+		int16x8_t v = vld1q_s16(in + i);
+		uint16x8_t bad = vorrq_u16(vcltq_s16(v, vld1q_s16(lower + i)), vcgtq_s16(v, vld1q_s16(upper + i)));
+		uint64x2_t bad64 = vreinterpretq_u64_u16(bad);
+		if(vgetq_lane_u64(bad64, 0) | vgetq_lane_u64(bad64, 1))
+			return false;
+	}
+#endif
+
+	for(; i<count; i++)
+	{
+		if( (in[i] < lower[i]) || (in[i] > upper[i]) )
+			return false;
+	}
+	return true;
+}
+
+#ifdef HAVE_X86_SIMD
+/**
+	@brief AVX2 version of CheckMask()
+ */
+__attribute__((target("avx2")))
+bool CheckMask_AVX2(const int16_t* in, const int16_t* lower, const int16_t* upper, size_t count)
+{
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+		__m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lower + i));
+		__m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(upper + i));
+		__m256i bad = _mm256_or_si256(_mm256_cmpgt_epi16(lo, v), _mm256_cmpgt_epi16(v, hi));
+		if(_mm256_movemask_epi8(bad))
+			return false;
+	}
+	for(; i<count; i++)
+	{
+		if( (in[i] < lower[i]) || (in[i] > upper[i]) )
+			return false;
+	}
+	return true;
+}
+#endif
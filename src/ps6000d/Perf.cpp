@@ -0,0 +1,248 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Latency and throughput instrumentation of the acquisition loop
+
+	Each stage keeps a histogram of durations in logarithmic buckets (four per octave of nanoseconds), plus totals
+	for the mean, max and byte rate. Everything is a relaxed atomic so the waveform, sender and driver threads can
+	record without taking a lock; readers may see a sample counted in one field and not yet in another, which is
+	fine for statistics.
+ */
+#include "ps6000d.h"
+#include <atomic>
+#include <chrono>
+#include <inttypes.h>
+#include <math.h>
+
+using namespace std;
+
+//Four sub-buckets per power of two, covering 1 ns to about 18 minutes
+#define PERF_SUB_BUCKETS 4
+#define PERF_NUM_BUCKETS (40 * PERF_SUB_BUCKETS)
+
+struct PerfHistogram
+{
+	atomic<uint64_t> buckets[PERF_NUM_BUCKETS];
+	atomic<uint64_t> count;
+	atomic<uint64_t> totalNs;
+	atomic<uint64_t> maxNs;
+	atomic<uint64_t> bytes;
+};
+
+static PerfHistogram g_perf[PERF_STAGE_COUNT];
+
+static const char* g_perfStageNames[PERF_STAGE_COUNT] =
+{
+	"ARM",
+	"STOP",
+	"BUFFERS",
+	"DOWNLOAD",
+	"SEND",
+	"ACKWAIT",
+	"REARM"
+};
+
+//Time the trigger was last armed, for PERF_ARM_TO_READY
+static atomic<uint64_t> g_perfArmTime(0);
+
+static size_t PerfBucket(uint64_t ns);
+static uint64_t PerfBucketValue(size_t bucket);
+static uint64_t PerfPercentile(const PerfHistogram& h, uint64_t count, double fraction);
+
+/**
+	@brief Returns a monotonic timestamp in nanoseconds
+ */
+uint64_t PerfTimestamp()
+{
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+	@brief Records one pass through a stage that started at the given PerfTimestamp()
+
+	@param stage	Stage being timed
+	@param start	Timestamp at the start of the stage
+	@param bytes	Bytes moved during the stage, if any
+ */
+void PerfRecord(PerfStage stage, uint64_t start, uint64_t bytes)
+{
+	uint64_t now = PerfTimestamp();
+	uint64_t ns = (now > start) ? (now - start) : 0;
+
+	auto& h = g_perf[stage];
+	h.buckets[PerfBucket(ns)].fetch_add(1, memory_order_relaxed);
+	h.count.fetch_add(1, memory_order_relaxed);
+	h.totalNs.fetch_add(ns, memory_order_relaxed);
+	h.bytes.fetch_add(bytes, memory_order_relaxed);
+
+	uint64_t prevMax = h.maxNs.load(memory_order_relaxed);
+	while( (ns > prevMax) && !h.maxNs.compare_exchange_weak(prevMax, ns, memory_order_relaxed) )
+	{}
+}
+
+/**
+	@brief Notes that the trigger was just armed
+ */
+void PerfMarkArmed()
+{
+	g_perfArmTime.store(PerfTimestamp(), memory_order_relaxed);
+}
+
+/**
+	@brief Notes that the driver reported a capture complete, closing the arm to ready interval
+ */
+void PerfMarkReady()
+{
+	uint64_t armed = g_perfArmTime.exchange(0, memory_order_relaxed);
+	if(armed != 0)
+		PerfRecord(PERF_ARM_TO_READY, armed);
+}
+
+/**
+	@brief Clears all statistics
+ */
+void PerfReset()
+{
+	for(auto& h : g_perf)
+	{
+		for(auto& b : h.buckets)
+			b.store(0, memory_order_relaxed);
+		h.count.store(0, memory_order_relaxed);
+		h.totalNs.store(0, memory_order_relaxed);
+		h.maxNs.store(0, memory_order_relaxed);
+		h.bytes.store(0, memory_order_relaxed);
+	}
+}
+
+/**
+	@brief Formats the statistics of every stage, for PERF? and the periodic log line
+
+	One semicolon separated entry per stage: name, sample count, then mean, median, 99th percentile and max
+	in microseconds. Stages that move data also report their throughput in MB/s while active.
+ */
+string PerfReport()
+{
+	string ret;
+	for(size_t i=0; i<PERF_STAGE_COUNT; i++)
+	{
+		auto& h = g_perf[i];
+		uint64_t count = h.count.load(memory_order_relaxed);
+		uint64_t total = h.totalNs.load(memory_order_relaxed);
+		uint64_t bytes = h.bytes.load(memory_order_relaxed);
+
+		char tmp[256];
+		snprintf(tmp, sizeof(tmp), "%s:n=%" PRIu64 ",mean=%.1f,p50=%.1f,p99=%.1f,max=%.1f",
+			g_perfStageNames[i],
+			count,
+			count ? (total * 1e-3 / count) : 0,
+			PerfPercentile(h, count, 0.5) * 1e-3,
+			PerfPercentile(h, count, 0.99) * 1e-3,
+			h.maxNs.load(memory_order_relaxed) * 1e-3);
+		ret += tmp;
+
+		if(bytes && total)
+		{
+			snprintf(tmp, sizeof(tmp), ",MBps=%.1f", bytes * 1e3 / total);
+			ret += tmp;
+		}
+		ret += ";";
+	}
+	return ret;
+}
+
+/**
+	@brief Logs the statistics every ten seconds while there's something new to report
+ */
+void PerfPeriodicLog()
+{
+	static uint64_t lastLog = 0;
+	static uint64_t lastCount = 0;
+
+	uint64_t now = PerfTimestamp();
+	if( (now - lastLog) < 10000000000ULL)
+		return;
+	lastLog = now;
+
+	uint64_t count = g_perf[PERF_DOWNLOAD].count.load(memory_order_relaxed);
+	if(count == lastCount)
+		return;
+	lastCount = count;
+
+	LogVerbose("perf: %s\n", PerfReport().c_str());
+}
+
+/**
+	@brief Maps a duration to its histogram bucket
+ */
+static size_t PerfBucket(uint64_t ns)
+{
+	if(ns < PERF_SUB_BUCKETS)
+		return ns;
+
+	//Octave is the position of the top bit, sub-bucket the next two bits below it
+	size_t octave = 63 - __builtin_clzll(ns);
+	size_t sub = (ns >> (octave - 2)) & (PERF_SUB_BUCKETS - 1);
+	return min(static_cast<size_t>((octave - 1) * PERF_SUB_BUCKETS + sub), static_cast<size_t>(PERF_NUM_BUCKETS - 1));
+}
+
+/**
+	@brief Returns the midpoint of a histogram bucket, in nanoseconds
+ */
+static uint64_t PerfBucketValue(size_t bucket)
+{
+	if(bucket < PERF_SUB_BUCKETS)
+		return bucket;
+
+	size_t octave = bucket / PERF_SUB_BUCKETS + 1;
+	size_t sub = bucket % PERF_SUB_BUCKETS;
+	uint64_t width = 1ULL << (octave - 2);
+	return (1ULL << octave) + sub*width + width/2;
+}
+
+/**
+	@brief Estimates a percentile of a stage's durations from its histogram
+ */
+static uint64_t PerfPercentile(const PerfHistogram& h, uint64_t count, double fraction)
+{
+	if(count == 0)
+		return 0;
+
+	uint64_t target = ceil(count * fraction);
+	uint64_t seen = 0;
+	for(size_t i=0; i<PERF_NUM_BUCKETS; i++)
+	{
+		seen += h.buckets[i].load(memory_order_relaxed);
+		if(seen >= target)
+			return PerfBucketValue(i);
+	}
+	return h.maxNs.load(memory_order_relaxed);
+}
@@ -0,0 +1,1154 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Per-family implementations of PicoBackend
+ */
+#include "ps6000d.h"
+#include <string.h>
+
+using namespace std;
+
+PicoBackend* g_backend = NULL;
+
+int64_t ScaleTimeOffset(int64_t offset, int units);
+bool StreamingIntervalUnit(int64_t interval_fs, int64_t& fsPerUnit);
+void PREF4 OnStreamingReady(
+	int16_t handle,
+	int32_t noOfSamples,
+	uint32_t startIndex,
+	int16_t overflow,
+	uint32_t triggerAt,
+	int16_t triggered,
+	int16_t autoStop,
+	void* pParameter);
+
+/**
+	@brief Converts a trigger time offset to femtoseconds
+
+	@param offset	Offset in the given units
+	@param units	FS, PS, NS, US, MS, S. Same numbering in all APIs.
+ */
+int64_t ScaleTimeOffset(int64_t offset, int units)
+{
+	const int64_t unitScale[] = {1LL, 1000LL, 1000000LL, 1000000000LL, 1000000000000LL, 1000000000000000LL};
+	if( (units >= 0) && (units <= 5) )
+		return offset * unitScale[units];
+	return offset;
+}
+
+/**
+	@brief Picks the unit of the integer sample interval streaming mode APIs take, keeping enough precision
+
+	@param interval_fs	Sample interval
+	@param fsPerUnit	Receives the size of the unit, in fs
+
+	@return True for picoseconds, false for nanoseconds
+ */
+bool StreamingIntervalUnit(int64_t interval_fs, int64_t& fsPerUnit)
+{
+	bool usePs = (interval_fs < 1000000000LL);
+	fsPerUnit = usePs ? 1000 : 1000000;
+	return usePs;
+}
+
+/**
+	@brief Streaming callback of the 2000A/3000A/4000A/5000A APIs, called from within GetStreamingLatestValues
+ */
+void PREF4 OnStreamingReady(
+	int16_t /*handle*/,
+	int32_t noOfSamples,
+	uint32_t startIndex,
+	int16_t overflow,
+	uint32_t /*triggerAt*/,
+	int16_t /*triggered*/,
+	int16_t /*autoStop*/,
+	void* pParameter)
+{
+	auto values = reinterpret_cast<StreamingValues*>(pParameter);
+	values->numSamples = max(noOfSamples, 0);
+	values->startIndex = startIndex;
+	values->overflow = overflow;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// 2000A series
+
+class PS2000ABackend : public PicoBackend
+{
+public:
+	PS2000ABackend(int16_t handle)
+	: PicoBackend(handle)
+	{}
+
+	virtual PICO_STATUS CloseUnit()
+	{ return ps2000aCloseUnit(m_handle); }
+
+	virtual bool SetChannel(size_t chan)
+	{
+		ps2000aSetChannel(m_handle, (PS2000A_CHANNEL)chan, g_channelOn[chan],
+							(PS2000A_COUPLING)g_coupling[chan], g_range_2000a[chan], -g_offset[chan]);
+		int16_t scaleVal;
+		ps2000aMaximumValue(m_handle, &scaleVal);
+		g_scaleValue = scaleVal;
+
+		//The trigger is reconfigured on every frontend change of its channel, even when turning it off
+		return true;
+	}
+
+	virtual PICO_STATUS RunBlock(size_t nPreTrigger, size_t nPostTrigger, uint32_t timebase, void* pParameter)
+	{
+		return ps2000aRunBlock(m_handle, nPreTrigger, nPostTrigger, timebase, 1, NULL, 0, OnBlockReady, pParameter);
+	}
+
+	virtual PICO_STATUS Stop()
+	{ return ps2000aStop(m_handle); }
+
+	virtual int RatioMode(DownsampleMode mode)
+	{
+		switch(mode)
+		{
+			case DOWNSAMPLE_DECIMATE:	return PS2000A_RATIO_MODE_DECIMATE;
+			case DOWNSAMPLE_AVERAGE:	return PS2000A_RATIO_MODE_AVERAGE;
+			case DOWNSAMPLE_AGGREGATE:	return PS2000A_RATIO_MODE_AGGREGATE;
+			default:					return PS2000A_RATIO_MODE_NONE;
+		}
+	}
+
+	virtual PICO_STATUS ClearDataBuffers(PICO_CHANNEL channel, DownsampleMode mode)
+	{
+		if(mode == DOWNSAMPLE_AGGREGATE)
+			return ps2000aSetDataBuffers(m_handle, (PS2000A_CHANNEL)channel, NULL, NULL, 0, 0,
+				(PS2000A_RATIO_MODE)RatioMode(mode));
+		else
+			return ps2000aSetDataBuffer(m_handle, (PS2000A_CHANNEL)channel, NULL, 0, 0,
+				(PS2000A_RATIO_MODE)RatioMode(mode));
+	}
+
+	virtual PICO_STATUS SetDataBuffer(
+		PICO_CHANNEL channel,
+		int16_t* buffer,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode)
+	{
+		return ps2000aSetDataBuffer(m_handle, (PS2000A_CHANNEL)channel, buffer, len, segment,
+			(PS2000A_RATIO_MODE)RatioMode(mode));
+	}
+
+	virtual PICO_STATUS SetDataBuffers(
+		PICO_CHANNEL channel,
+		int16_t* bufferMax,
+		int16_t* bufferMin,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode)
+	{
+		return ps2000aSetDataBuffers(m_handle, (PS2000A_CHANNEL)channel, bufferMax, bufferMin, len, segment,
+			(PS2000A_RATIO_MODE)RatioMode(mode));
+	}
+
+	virtual PICO_STATUS GetValues(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow)
+	{
+		uint32_t numSamples_int = numSamples;
+		PICO_STATUS status = ps2000aGetValues(m_handle, startIndex, &numSamples_int, ratio,
+			(PS2000A_RATIO_MODE)RatioMode(mode), 0, overflow);
+		numSamples = numSamples_int;
+		return status;
+	}
+
+	virtual PICO_STATUS GetValuesBulk(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		size_t lastSegment,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow)
+	{
+		uint32_t numSamples_int = numSamples;
+		PICO_STATUS status;
+
+		//Bulk downloads always start at the beginning of the segment, fetch a region one segment at a time
+		if(startIndex != 0)
+		{
+			status = PICO_OK;
+			for(size_t seg=0; (seg <= lastSegment) && (status == PICO_OK); seg++)
+			{
+				numSamples_int = numSamples;
+				status = ps2000aGetValues(m_handle, startIndex, &numSamples_int, ratio,
+					(PS2000A_RATIO_MODE)RatioMode(mode), seg, &overflow[seg]);
+			}
+		}
+		else
+		{
+			status = ps2000aGetValuesBulk(m_handle, &numSamples_int, 0, lastSegment, ratio,
+				(PS2000A_RATIO_MODE)RatioMode(mode), overflow);
+		}
+		numSamples = numSamples_int;
+		return status;
+	}
+
+	virtual PICO_STATUS GetTriggerTimeOffsets(size_t numSegments, int64_t* offsets_fs)
+	{
+		vector<PS2000A_TIME_UNITS> units(numSegments);
+		PICO_STATUS status = ps2000aGetValuesTriggerTimeOffsetBulk64(m_handle, offsets_fs,
+			&units[0], 0, numSegments - 1);
+		for(size_t i=0; i<numSegments; i++)
+			offsets_fs[i] = ScaleTimeOffset(offsets_fs[i], units[i]);
+		return status;
+	}
+
+	virtual PICO_STATUS RunStreaming(int64_t& interval_fs, size_t bufferLen)
+	{
+		int64_t fsPerUnit;
+		bool usePs = StreamingIntervalUnit(interval_fs, fsPerUnit);
+		uint32_t interval = interval_fs / fsPerUnit;
+		PICO_STATUS status = ps2000aRunStreaming(m_handle, &interval, usePs ? PS2000A_PS : PS2000A_NS,
+			0, bufferLen, 0, 1, PS2000A_RATIO_MODE_NONE, bufferLen);
+		interval_fs = interval * fsPerUnit;
+		return status;
+	}
+
+	virtual PICO_STATUS GetStreamingLatestValues(const vector<PICO_CHANNEL>& /*channels*/, StreamingValues& values)
+	{
+		values = {0, 0, 0, false};
+		return ps2000aGetStreamingLatestValues(m_handle, OnStreamingReady, &values);
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// 3000A series
+
+class PS3000ABackend : public PicoBackend
+{
+public:
+	PS3000ABackend(int16_t handle)
+	: PicoBackend(handle)
+	{}
+
+	virtual PICO_STATUS CloseUnit()
+	{ return ps3000aCloseUnit(m_handle); }
+
+	virtual bool SetChannel(size_t chan)
+	{
+		ps3000aSetChannel(m_handle, (PS3000A_CHANNEL)chan, g_channelOn[chan],
+							(PS3000A_COUPLING)g_coupling[chan], g_range_3000a[chan], -g_offset[chan]);
+		ps3000aSetBandwidthFilter(m_handle, (PS3000A_CHANNEL)chan, (PS3000A_BANDWIDTH_LIMITER)g_bandwidth_3000a[chan]);
+		int16_t scaleVal;
+		ps3000aMaximumValue(m_handle, &scaleVal);
+		g_scaleValue = scaleVal;
+
+		//The trigger is reconfigured on every frontend change of its channel, even when turning it off
+		return true;
+	}
+
+	virtual PICO_STATUS RunBlock(size_t nPreTrigger, size_t nPostTrigger, uint32_t timebase, void* pParameter)
+	{
+		return ps3000aRunBlock(m_handle, nPreTrigger, nPostTrigger, timebase, 1, NULL, 0, OnBlockReady, pParameter);
+	}
+
+	virtual PICO_STATUS Stop()
+	{ return ps3000aStop(m_handle); }
+
+	virtual int RatioMode(DownsampleMode mode)
+	{
+		switch(mode)
+		{
+			case DOWNSAMPLE_DECIMATE:	return PS3000A_RATIO_MODE_DECIMATE;
+			case DOWNSAMPLE_AVERAGE:	return PS3000A_RATIO_MODE_AVERAGE;
+			case DOWNSAMPLE_AGGREGATE:	return PS3000A_RATIO_MODE_AGGREGATE;
+			default:					return PS3000A_RATIO_MODE_NONE;
+		}
+	}
+
+	virtual PICO_STATUS ClearDataBuffers(PICO_CHANNEL channel, DownsampleMode mode)
+	{
+		if(mode == DOWNSAMPLE_AGGREGATE)
+			return ps3000aSetDataBuffers(m_handle, (PS3000A_CHANNEL)channel, NULL, NULL, 0, 0,
+				(PS3000A_RATIO_MODE)RatioMode(mode));
+		else
+			return ps3000aSetDataBuffer(m_handle, (PS3000A_CHANNEL)channel, NULL, 0, 0,
+				(PS3000A_RATIO_MODE)RatioMode(mode));
+	}
+
+	virtual PICO_STATUS SetDataBuffer(
+		PICO_CHANNEL channel,
+		int16_t* buffer,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode)
+	{
+		return ps3000aSetDataBuffer(m_handle, (PS3000A_CHANNEL)channel, buffer, len, segment,
+			(PS3000A_RATIO_MODE)RatioMode(mode));
+	}
+
+	virtual PICO_STATUS SetDataBuffers(
+		PICO_CHANNEL channel,
+		int16_t* bufferMax,
+		int16_t* bufferMin,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode)
+	{
+		return ps3000aSetDataBuffers(m_handle, (PS3000A_CHANNEL)channel, bufferMax, bufferMin, len, segment,
+			(PS3000A_RATIO_MODE)RatioMode(mode));
+	}
+
+	virtual PICO_STATUS GetValues(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow)
+	{
+		uint32_t numSamples_int = numSamples;
+		PICO_STATUS status = ps3000aGetValues(m_handle, startIndex, &numSamples_int, ratio,
+			(PS3000A_RATIO_MODE)RatioMode(mode), 0, overflow);
+		numSamples = numSamples_int;
+		return status;
+	}
+
+	virtual PICO_STATUS GetValuesBulk(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		size_t lastSegment,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow)
+	{
+		uint32_t numSamples_int = numSamples;
+		PICO_STATUS status;
+
+		//Bulk downloads always start at the beginning of the segment, fetch a region one segment at a time
+		if(startIndex != 0)
+		{
+			status = PICO_OK;
+			for(size_t seg=0; (seg <= lastSegment) && (status == PICO_OK); seg++)
+			{
+				numSamples_int = numSamples;
+				status = ps3000aGetValues(m_handle, startIndex, &numSamples_int, ratio,
+					(PS3000A_RATIO_MODE)RatioMode(mode), seg, &overflow[seg]);
+			}
+		}
+		else
+		{
+			status = ps3000aGetValuesBulk(m_handle, &numSamples_int, 0, lastSegment, ratio,
+				(PS3000A_RATIO_MODE)RatioMode(mode), overflow);
+		}
+		numSamples = numSamples_int;
+		return status;
+	}
+
+	virtual PICO_STATUS GetTriggerTimeOffsets(size_t numSegments, int64_t* offsets_fs)
+	{
+		vector<PS3000A_TIME_UNITS> units(numSegments);
+		PICO_STATUS status = ps3000aGetValuesTriggerTimeOffsetBulk64(m_handle, offsets_fs,
+			&units[0], 0, numSegments - 1);
+		for(size_t i=0; i<numSegments; i++)
+			offsets_fs[i] = ScaleTimeOffset(offsets_fs[i], units[i]);
+		return status;
+	}
+
+	virtual PICO_STATUS RunStreaming(int64_t& interval_fs, size_t bufferLen)
+	{
+		int64_t fsPerUnit;
+		bool usePs = StreamingIntervalUnit(interval_fs, fsPerUnit);
+		uint32_t interval = interval_fs / fsPerUnit;
+		PICO_STATUS status = ps3000aRunStreaming(m_handle, &interval, usePs ? PS3000A_PS : PS3000A_NS,
+			0, bufferLen, 0, 1, PS3000A_RATIO_MODE_NONE, bufferLen);
+		interval_fs = interval * fsPerUnit;
+		return status;
+	}
+
+	virtual PICO_STATUS GetStreamingLatestValues(const vector<PICO_CHANNEL>& /*channels*/, StreamingValues& values)
+	{
+		values = {0, 0, 0, false};
+		return ps3000aGetStreamingLatestValues(m_handle, OnStreamingReady, &values);
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// 4000A series
+
+class PS4000ABackend : public PicoBackend
+{
+public:
+	PS4000ABackend(int16_t handle)
+	: PicoBackend(handle)
+	{}
+
+	virtual PICO_STATUS CloseUnit()
+	{ return ps4000aCloseUnit(m_handle); }
+
+	virtual bool SetChannel(size_t chan)
+	{
+		ps4000aSetChannel(m_handle, (PS4000A_CHANNEL)chan, g_channelOn[chan],
+							(PS4000A_COUPLING)g_coupling[chan], g_range[chan], -g_offset[chan]);
+		ps4000aSetBandwidthFilter(m_handle, (PS4000A_CHANNEL)chan, (PS4000A_BANDWIDTH_LIMITER)g_bandwidth_5000a[chan]);
+		int16_t scaleVal;
+		ps4000aMaximumValue(m_handle, &scaleVal);
+		g_scaleValue = scaleVal;
+
+		//The trigger is reconfigured on every frontend change of its channel, even when turning it off
+		return true;
+	}
+
+	virtual PICO_STATUS RunBlock(size_t nPreTrigger, size_t nPostTrigger, uint32_t timebase, void* pParameter)
+	{
+		return ps4000aRunBlock(m_handle, nPreTrigger, nPostTrigger, timebase, NULL, 0, OnBlockReady, pParameter);
+	}
+
+	virtual PICO_STATUS Stop()
+	{ return ps4000aStop(m_handle); }
+
+	virtual int RatioMode(DownsampleMode mode)
+	{
+		switch(mode)
+		{
+			case DOWNSAMPLE_DECIMATE:	return PS4000A_RATIO_MODE_DECIMATE;
+			case DOWNSAMPLE_AVERAGE:	return PS4000A_RATIO_MODE_AVERAGE;
+			case DOWNSAMPLE_AGGREGATE:	return PS4000A_RATIO_MODE_AGGREGATE;
+			default:					return PS4000A_RATIO_MODE_NONE;
+		}
+	}
+
+	virtual PICO_STATUS ClearDataBuffers(PICO_CHANNEL channel, DownsampleMode mode)
+	{
+		if(mode == DOWNSAMPLE_AGGREGATE)
+			return ps4000aSetDataBuffers(m_handle, (PS4000A_CHANNEL)channel, NULL, NULL, 0, 0,
+				(PS4000A_RATIO_MODE)RatioMode(mode));
+		else
+			return ps4000aSetDataBuffer(m_handle, (PS4000A_CHANNEL)channel, NULL, 0, 0,
+				(PS4000A_RATIO_MODE)RatioMode(mode));
+	}
+
+	virtual PICO_STATUS SetDataBuffer(
+		PICO_CHANNEL channel,
+		int16_t* buffer,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode)
+	{
+		return ps4000aSetDataBuffer(m_handle, (PS4000A_CHANNEL)channel, buffer, len, segment,
+			(PS4000A_RATIO_MODE)RatioMode(mode));
+	}
+
+	virtual PICO_STATUS SetDataBuffers(
+		PICO_CHANNEL channel,
+		int16_t* bufferMax,
+		int16_t* bufferMin,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode)
+	{
+		return ps4000aSetDataBuffers(m_handle, (PS4000A_CHANNEL)channel, bufferMax, bufferMin, len, segment,
+			(PS4000A_RATIO_MODE)RatioMode(mode));
+	}
+
+	virtual PICO_STATUS GetValues(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow)
+	{
+		uint32_t numSamples_int = numSamples;
+		PICO_STATUS status = ps4000aGetValues(m_handle, startIndex, &numSamples_int, ratio,
+			(PS4000A_RATIO_MODE)RatioMode(mode), 0, overflow);
+		numSamples = numSamples_int;
+		return status;
+	}
+
+	virtual PICO_STATUS GetValuesBulk(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		size_t lastSegment,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow)
+	{
+		uint32_t numSamples_int = numSamples;
+		PICO_STATUS status;
+
+		//Bulk downloads always start at the beginning of the segment, fetch a region one segment at a time
+		if(startIndex != 0)
+		{
+			status = PICO_OK;
+			for(size_t seg=0; (seg <= lastSegment) && (status == PICO_OK); seg++)
+			{
+				numSamples_int = numSamples;
+				status = ps4000aGetValues(m_handle, startIndex, &numSamples_int, ratio,
+					(PS4000A_RATIO_MODE)RatioMode(mode), seg, &overflow[seg]);
+			}
+		}
+		else
+		{
+			status = ps4000aGetValuesBulk(m_handle, &numSamples_int, 0, lastSegment, ratio,
+				(PS4000A_RATIO_MODE)RatioMode(mode), overflow);
+		}
+		numSamples = numSamples_int;
+		return status;
+	}
+
+	virtual PICO_STATUS GetTriggerTimeOffsets(size_t numSegments, int64_t* offsets_fs)
+	{
+		vector<PS4000A_TIME_UNITS> units(numSegments);
+		PICO_STATUS status = ps4000aGetValuesTriggerTimeOffsetBulk64(m_handle, offsets_fs,
+			&units[0], 0, numSegments - 1);
+		for(size_t i=0; i<numSegments; i++)
+			offsets_fs[i] = ScaleTimeOffset(offsets_fs[i], units[i]);
+		return status;
+	}
+
+	virtual PICO_STATUS RunStreaming(int64_t& interval_fs, size_t bufferLen)
+	{
+		int64_t fsPerUnit;
+		bool usePs = StreamingIntervalUnit(interval_fs, fsPerUnit);
+		uint32_t interval = interval_fs / fsPerUnit;
+		PICO_STATUS status = ps4000aRunStreaming(m_handle, &interval, usePs ? PS4000A_PS : PS4000A_NS,
+			0, bufferLen, 0, 1, PS4000A_RATIO_MODE_NONE, bufferLen);
+		interval_fs = interval * fsPerUnit;
+		return status;
+	}
+
+	virtual PICO_STATUS GetStreamingLatestValues(const vector<PICO_CHANNEL>& /*channels*/, StreamingValues& values)
+	{
+		values = {0, 0, 0, false};
+		return ps4000aGetStreamingLatestValues(m_handle, OnStreamingReady, &values);
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// 5000A series
+
+class PS5000ABackend : public PicoBackend
+{
+public:
+	PS5000ABackend(int16_t handle)
+	: PicoBackend(handle)
+	{}
+
+	virtual PICO_STATUS CloseUnit()
+	{ return ps5000aCloseUnit(m_handle); }
+
+	virtual bool SetChannel(size_t chan)
+	{
+		ps5000aSetChannel(m_handle, (PS5000A_CHANNEL)chan, g_channelOn[chan],
+							(PS5000A_COUPLING)g_coupling[chan], g_range_5000a[chan], -g_offset[chan]);
+		ps5000aSetBandwidthFilter(m_handle, (PS5000A_CHANNEL)chan, (PS5000A_BANDWIDTH_LIMITER)g_bandwidth_5000a[chan]);
+		int16_t scaleVal;
+		ps5000aMaximumValue(m_handle, &scaleVal);
+		g_scaleValue = scaleVal;
+
+		//The trigger is reconfigured on every frontend change of its channel, even when turning it off
+		return true;
+	}
+
+	virtual PICO_STATUS RunBlock(size_t nPreTrigger, size_t nPostTrigger, uint32_t timebase, void* pParameter)
+	{
+		return ps5000aRunBlock(m_handle, nPreTrigger, nPostTrigger, timebase, NULL, 0, OnBlockReady, pParameter);
+	}
+
+	virtual PICO_STATUS Stop()
+	{ return ps5000aStop(m_handle); }
+
+	virtual int RatioMode(DownsampleMode mode)
+	{
+		switch(mode)
+		{
+			case DOWNSAMPLE_DECIMATE:	return PS5000A_RATIO_MODE_DECIMATE;
+			case DOWNSAMPLE_AVERAGE:	return PS5000A_RATIO_MODE_AVERAGE;
+			case DOWNSAMPLE_AGGREGATE:	return PS5000A_RATIO_MODE_AGGREGATE;
+			default:					return PS5000A_RATIO_MODE_NONE;
+		}
+	}
+
+	virtual PICO_STATUS ClearDataBuffers(PICO_CHANNEL channel, DownsampleMode mode)
+	{
+		if(mode == DOWNSAMPLE_AGGREGATE)
+			return ps5000aSetDataBuffers(m_handle, (PS5000A_CHANNEL)channel, NULL, NULL, 0, 0,
+				(PS5000A_RATIO_MODE)RatioMode(mode));
+		else
+			return ps5000aSetDataBuffer(m_handle, (PS5000A_CHANNEL)channel, NULL, 0, 0,
+				(PS5000A_RATIO_MODE)RatioMode(mode));
+	}
+
+	virtual PICO_STATUS SetDataBuffer(
+		PICO_CHANNEL channel,
+		int16_t* buffer,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode)
+	{
+		return ps5000aSetDataBuffer(m_handle, (PS5000A_CHANNEL)channel, buffer, len, segment,
+			(PS5000A_RATIO_MODE)RatioMode(mode));
+	}
+
+	virtual PICO_STATUS SetDataBuffers(
+		PICO_CHANNEL channel,
+		int16_t* bufferMax,
+		int16_t* bufferMin,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode)
+	{
+		return ps5000aSetDataBuffers(m_handle, (PS5000A_CHANNEL)channel, bufferMax, bufferMin, len, segment,
+			(PS5000A_RATIO_MODE)RatioMode(mode));
+	}
+
+	virtual PICO_STATUS GetValues(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow)
+	{
+		uint32_t numSamples_int = numSamples;
+		PICO_STATUS status = ps5000aGetValues(m_handle, startIndex, &numSamples_int, ratio,
+			(PS5000A_RATIO_MODE)RatioMode(mode), 0, overflow);
+		numSamples = numSamples_int;
+		return status;
+	}
+
+	virtual PICO_STATUS GetValuesBulk(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		size_t lastSegment,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow)
+	{
+		uint32_t numSamples_int = numSamples;
+		PICO_STATUS status;
+
+		//Bulk downloads always start at the beginning of the segment, fetch a region one segment at a time
+		if(startIndex != 0)
+		{
+			status = PICO_OK;
+			for(size_t seg=0; (seg <= lastSegment) && (status == PICO_OK); seg++)
+			{
+				numSamples_int = numSamples;
+				status = ps5000aGetValues(m_handle, startIndex, &numSamples_int, ratio,
+					(PS5000A_RATIO_MODE)RatioMode(mode), seg, &overflow[seg]);
+			}
+		}
+		else
+		{
+			status = ps5000aGetValuesBulk(m_handle, &numSamples_int, 0, lastSegment, ratio,
+				(PS5000A_RATIO_MODE)RatioMode(mode), overflow);
+		}
+		numSamples = numSamples_int;
+		return status;
+	}
+
+	virtual PICO_STATUS GetTriggerTimeOffsets(size_t numSegments, int64_t* offsets_fs)
+	{
+		vector<PS5000A_TIME_UNITS> units(numSegments);
+		PICO_STATUS status = ps5000aGetValuesTriggerTimeOffsetBulk64(m_handle, offsets_fs,
+			&units[0], 0, numSegments - 1);
+		for(size_t i=0; i<numSegments; i++)
+			offsets_fs[i] = ScaleTimeOffset(offsets_fs[i], units[i]);
+		return status;
+	}
+
+	virtual PICO_STATUS RunStreaming(int64_t& interval_fs, size_t bufferLen)
+	{
+		int64_t fsPerUnit;
+		bool usePs = StreamingIntervalUnit(interval_fs, fsPerUnit);
+		uint32_t interval = interval_fs / fsPerUnit;
+		PICO_STATUS status = ps5000aRunStreaming(m_handle, &interval, usePs ? PS5000A_PS : PS5000A_NS,
+			0, bufferLen, 0, 1, PS5000A_RATIO_MODE_NONE, bufferLen);
+		interval_fs = interval * fsPerUnit;
+		return status;
+	}
+
+	virtual PICO_STATUS GetStreamingLatestValues(const vector<PICO_CHANNEL>& /*channels*/, StreamingValues& values)
+	{
+		values = {0, 0, 0, false};
+		return ps5000aGetStreamingLatestValues(m_handle, OnStreamingReady, &values);
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// 6000 series (6000E and 6000A)
+
+class PS6000ABackend : public PicoBackend
+{
+public:
+	PS6000ABackend(int16_t handle)
+	: PicoBackend(handle)
+	{}
+
+	virtual PICO_STATUS CloseUnit()
+	{ return ps6000aCloseUnit(m_handle); }
+
+	virtual bool SetChannel(size_t chan)
+	{
+		if(!g_channelOn[chan])
+		{
+			ps6000aSetChannelOff(m_handle, (PICO_CHANNEL)chan);
+			return false;
+		}
+
+		PICO_DEVICE_RESOLUTION currentRes;
+		int16_t scaleVal;
+		ps6000aSetChannelOn(m_handle, (PICO_CHANNEL)chan,
+			g_coupling[chan], g_range[chan], -g_offset[chan], g_bandwidth[chan]);
+		ps6000aGetDeviceResolution(m_handle, &currentRes);
+		ps6000aGetAdcLimits(m_handle, currentRes, 0, &scaleVal);
+		g_scaleValue = scaleVal;
+		return true;
+	}
+
+	virtual PICO_STATUS RunBlock(size_t nPreTrigger, size_t nPostTrigger, uint32_t timebase, void* pParameter)
+	{
+		return ps6000aRunBlock(m_handle, nPreTrigger, nPostTrigger, timebase, NULL, 0, OnBlockReady, pParameter);
+	}
+
+	virtual PICO_STATUS Stop()
+	{ return ps6000aStop(m_handle); }
+
+	virtual int RatioMode(DownsampleMode mode)
+	{
+		switch(mode)
+		{
+			case DOWNSAMPLE_DECIMATE:	return PICO_RATIO_MODE_DECIMATE;
+			case DOWNSAMPLE_AVERAGE:	return PICO_RATIO_MODE_AVERAGE;
+			case DOWNSAMPLE_AGGREGATE:	return PICO_RATIO_MODE_AGGREGATE;
+			default:					return PICO_RATIO_MODE_RAW;
+		}
+	}
+
+	//PICO_CLEAR_ALL removes buffers of every ratio mode
+	virtual PICO_STATUS ClearDataBuffers(PICO_CHANNEL channel, DownsampleMode /*mode*/)
+	{
+		return ps6000aSetDataBuffer(m_handle, channel, NULL, 0, PICO_INT16_T, 0, PICO_RATIO_MODE_RAW, PICO_CLEAR_ALL);
+	}
+
+	virtual PICO_STATUS SetDataBuffer(
+		PICO_CHANNEL channel,
+		int16_t* buffer,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode)
+	{
+		return ps6000aSetDataBuffer(m_handle, channel, buffer, len, PICO_INT16_T, segment,
+			(PICO_RATIO_MODE)RatioMode(mode), PICO_ADD);
+	}
+
+	virtual PICO_STATUS SetDataBuffers(
+		PICO_CHANNEL channel,
+		int16_t* bufferMax,
+		int16_t* bufferMin,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode)
+	{
+		return ps6000aSetDataBuffers(m_handle, channel, bufferMax, bufferMin, len, PICO_INT16_T, segment,
+			(PICO_RATIO_MODE)RatioMode(mode), PICO_ADD);
+	}
+
+	virtual PICO_STATUS GetValues(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow)
+	{
+		return ps6000aGetValues(m_handle, startIndex, &numSamples, ratio, (PICO_RATIO_MODE)RatioMode(mode), 0, overflow);
+	}
+
+	virtual PICO_STATUS GetValuesBulk(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		size_t lastSegment,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow)
+	{
+		return ps6000aGetValuesBulk(m_handle, startIndex, &numSamples, 0, lastSegment, ratio,
+			(PICO_RATIO_MODE)RatioMode(mode), overflow);
+	}
+
+	virtual PICO_STATUS GetTriggerTimeOffsets(size_t numSegments, int64_t* offsets_fs)
+	{
+		vector<PICO_TIME_UNITS> units(numSegments);
+		PICO_STATUS status = ps6000aGetValuesTriggerTimeOffsetBulk(m_handle, offsets_fs, &units[0], 0, numSegments - 1);
+		for(size_t i=0; i<numSegments; i++)
+			offsets_fs[i] = ScaleTimeOffset(offsets_fs[i], units[i]);
+		return status;
+	}
+
+	virtual PICO_STATUS RunStreaming(int64_t& interval_fs, size_t bufferLen)
+	{
+		int64_t fsPerUnit;
+		bool usePs = StreamingIntervalUnit(interval_fs, fsPerUnit);
+		double interval = interval_fs / fsPerUnit;
+		PICO_STATUS status = ps6000aRunStreaming(m_handle, &interval, usePs ? PICO_PS : PICO_NS,
+			0, bufferLen, 0, 1, PICO_RATIO_MODE_RAW);
+		interval_fs = interval * fsPerUnit;
+		return status;
+	}
+
+	//Progress is reported per channel, and full buffers have to be handed back
+	virtual PICO_STATUS GetStreamingLatestValues(const vector<PICO_CHANNEL>& channels, StreamingValues& values)
+	{
+		values = {0, 0, 0, false};
+		vector<PICO_STREAMING_DATA_INFO> infos;
+		for(auto ch : channels)
+		{
+			PICO_STREAMING_DATA_INFO di;
+			memset(&di, 0, sizeof(di));
+			di.channel_ = ch;
+			di.mode_ = PICO_RATIO_MODE_RAW;
+			di.type_ = PICO_INT16_T;
+			infos.push_back(di);
+		}
+		if(infos.empty())
+			return PICO_OK;
+
+		PICO_STREAMING_DATA_TRIGGER_INFO trig;
+		PICO_STATUS status = ps6000aGetStreamingLatestValues(m_handle, &infos[0], infos.size(), &trig);
+		if(status == PICO_WAITING_FOR_DATA_BUFFERS)
+		{
+			values.needBuffers = true;
+			status = PICO_OK;
+		}
+		values.numSamples = infos[0].noOfSamples_;
+		values.startIndex = infos[0].startIndex_;
+		for(auto& di : infos)
+			values.overflow |= di.overflow_;
+		return status;
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// PicoScope OS API (3000E)
+
+class PSOSPABackend : public PicoBackend
+{
+public:
+	PSOSPABackend(int16_t handle)
+	: PicoBackend(handle)
+	{}
+
+	virtual PICO_STATUS CloseUnit()
+	{ return psospaCloseUnit(m_handle); }
+
+	virtual bool SetChannel(size_t chan)
+	{
+		if(!g_channelOn[chan])
+		{
+			psospaSetChannelOff(m_handle, (PICO_CHANNEL)chan);
+			return false;
+		}
+
+		PICO_DEVICE_RESOLUTION currentRes;
+		int16_t scaleVal;
+		psospaSetChannelOn(m_handle, (PICO_CHANNEL)chan,
+			g_coupling[chan], -g_range_3000e[chan], g_range_3000e[chan], PICO_X1_PROBE_NV, -g_offset[chan],
+			g_bandwidth[chan]);
+		psospaGetDeviceResolution(m_handle, &currentRes);
+		psospaGetAdcLimits(m_handle, currentRes, 0, &scaleVal);
+		g_scaleValue = scaleVal;
+		return true;
+	}
+
+	virtual PICO_STATUS RunBlock(size_t nPreTrigger, size_t nPostTrigger, uint32_t timebase, void* pParameter)
+	{
+		return psospaRunBlock(m_handle, nPreTrigger, nPostTrigger, timebase, NULL, 0, OnBlockReady, pParameter);
+	}
+
+	virtual PICO_STATUS Stop()
+	{ return psospaStop(m_handle); }
+
+	virtual int RatioMode(DownsampleMode mode)
+	{
+		switch(mode)
+		{
+			case DOWNSAMPLE_DECIMATE:	return PICO_RATIO_MODE_DECIMATE;
+			case DOWNSAMPLE_AVERAGE:	return PICO_RATIO_MODE_AVERAGE;
+			case DOWNSAMPLE_AGGREGATE:	return PICO_RATIO_MODE_AGGREGATE;
+			default:					return PICO_RATIO_MODE_RAW;
+		}
+	}
+
+	//PICO_CLEAR_ALL removes buffers of every ratio mode
+	virtual PICO_STATUS ClearDataBuffers(PICO_CHANNEL channel, DownsampleMode /*mode*/)
+	{
+		return psospaSetDataBuffer(m_handle, channel, NULL, 0, PICO_INT16_T, 0, PICO_RATIO_MODE_RAW, PICO_CLEAR_ALL);
+	}
+
+	virtual PICO_STATUS SetDataBuffer(
+		PICO_CHANNEL channel,
+		int16_t* buffer,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode)
+	{
+		return psospaSetDataBuffer(m_handle, channel, buffer, len, PICO_INT16_T, segment,
+			(PICO_RATIO_MODE)RatioMode(mode), PICO_ADD);
+	}
+
+	virtual PICO_STATUS SetDataBuffers(
+		PICO_CHANNEL channel,
+		int16_t* bufferMax,
+		int16_t* bufferMin,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode)
+	{
+		return psospaSetDataBuffers(m_handle, channel, bufferMax, bufferMin, len, PICO_INT16_T, segment,
+			(PICO_RATIO_MODE)RatioMode(mode), PICO_ADD);
+	}
+
+	virtual PICO_STATUS GetValues(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow)
+	{
+		return psospaGetValues(m_handle, startIndex, &numSamples, ratio, (PICO_RATIO_MODE)RatioMode(mode), 0, overflow);
+	}
+
+	virtual PICO_STATUS GetValuesBulk(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		size_t lastSegment,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow)
+	{
+		return psospaGetValuesBulk(m_handle, startIndex, &numSamples, 0, lastSegment, ratio,
+			(PICO_RATIO_MODE)RatioMode(mode), overflow);
+	}
+
+	virtual PICO_STATUS GetTriggerTimeOffsets(size_t numSegments, int64_t* offsets_fs)
+	{
+		vector<PICO_TIME_UNITS> units(numSegments);
+		PICO_STATUS status = psospaGetValuesTriggerTimeOffsetBulk(m_handle, offsets_fs, &units[0], 0, numSegments - 1);
+		for(size_t i=0; i<numSegments; i++)
+			offsets_fs[i] = ScaleTimeOffset(offsets_fs[i], units[i]);
+		return status;
+	}
+
+	virtual PICO_STATUS RunStreaming(int64_t& interval_fs, size_t bufferLen)
+	{
+		int64_t fsPerUnit;
+		bool usePs = StreamingIntervalUnit(interval_fs, fsPerUnit);
+		double interval = interval_fs / fsPerUnit;
+		PICO_STATUS status = psospaRunStreaming(m_handle, &interval, usePs ? PICO_PS : PICO_NS,
+			0, bufferLen, 0, 1, PICO_RATIO_MODE_RAW);
+		interval_fs = interval * fsPerUnit;
+		return status;
+	}
+
+	//Progress is reported per channel, and full buffers have to be handed back
+	virtual PICO_STATUS GetStreamingLatestValues(const vector<PICO_CHANNEL>& channels, StreamingValues& values)
+	{
+		values = {0, 0, 0, false};
+		vector<PICO_STREAMING_DATA_INFO> infos;
+		for(auto ch : channels)
+		{
+			PICO_STREAMING_DATA_INFO di;
+			memset(&di, 0, sizeof(di));
+			di.channel_ = ch;
+			di.mode_ = PICO_RATIO_MODE_RAW;
+			di.type_ = PICO_INT16_T;
+			infos.push_back(di);
+		}
+		if(infos.empty())
+			return PICO_OK;
+
+		PICO_STREAMING_DATA_TRIGGER_INFO trig;
+		PICO_STATUS status = psospaGetStreamingLatestValues(m_handle, &infos[0], infos.size(), &trig);
+		if(status == PICO_WAITING_FOR_DATA_BUFFERS)
+		{
+			values.needBuffers = true;
+			status = PICO_OK;
+		}
+		values.numSamples = infos[0].noOfSamples_;
+		values.startIndex = infos[0].startIndex_;
+		for(auto& di : infos)
+			values.overflow |= di.overflow_;
+		return status;
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Simulated instrument
+
+class SimBackend : public PicoBackend
+{
+public:
+	SimBackend(int16_t handle)
+	: PicoBackend(handle)
+	{}
+
+	virtual PICO_STATUS CloseUnit()
+	{ return simCloseUnit(m_handle); }
+
+	virtual bool SetChannel(size_t chan)
+	{
+		simSetChannel(m_handle, chan, g_channelOn[chan], g_roundedRange[chan], -g_offset[chan]);
+		if(!g_channelOn[chan])
+			return false;
+
+		int16_t scaleVal;
+		simGetAdcLimits(m_handle, &scaleVal);
+		g_scaleValue = scaleVal;
+		return true;
+	}
+
+	virtual PICO_STATUS RunBlock(size_t nPreTrigger, size_t nPostTrigger, uint32_t timebase, void* pParameter)
+	{
+		return simRunBlock(m_handle, nPreTrigger, nPostTrigger, timebase, NULL, 0, OnBlockReady, pParameter);
+	}
+
+	virtual PICO_STATUS Stop()
+	{ return simStop(m_handle); }
+
+	virtual int RatioMode(DownsampleMode mode)
+	{
+		switch(mode)
+		{
+			case DOWNSAMPLE_DECIMATE:	return PICO_RATIO_MODE_DECIMATE;
+			case DOWNSAMPLE_AVERAGE:	return PICO_RATIO_MODE_AVERAGE;
+			case DOWNSAMPLE_AGGREGATE:	return PICO_RATIO_MODE_AGGREGATE;
+			default:					return PICO_RATIO_MODE_RAW;
+		}
+	}
+
+	//PICO_CLEAR_ALL removes buffers of every ratio mode
+	virtual PICO_STATUS ClearDataBuffers(PICO_CHANNEL channel, DownsampleMode /*mode*/)
+	{
+		return simSetDataBuffer(m_handle, channel, NULL, 0, 0, PICO_RATIO_MODE_RAW, PICO_CLEAR_ALL);
+	}
+
+	virtual PICO_STATUS SetDataBuffer(
+		PICO_CHANNEL channel,
+		int16_t* buffer,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode)
+	{
+		return simSetDataBuffer(m_handle, channel, buffer, len, segment,
+			(PICO_RATIO_MODE)RatioMode(mode), PICO_ADD);
+	}
+
+	virtual PICO_STATUS SetDataBuffers(
+		PICO_CHANNEL channel,
+		int16_t* bufferMax,
+		int16_t* bufferMin,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode)
+	{
+		return simSetDataBuffers(m_handle, channel, bufferMax, bufferMin, len, segment,
+			(PICO_RATIO_MODE)RatioMode(mode), PICO_ADD);
+	}
+
+	virtual PICO_STATUS GetValues(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow)
+	{
+		return simGetValues(m_handle, startIndex, &numSamples, ratio, (PICO_RATIO_MODE)RatioMode(mode), 0, overflow);
+	}
+
+	virtual PICO_STATUS GetValuesBulk(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		size_t lastSegment,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow)
+	{
+		return simGetValuesBulk(m_handle, startIndex, &numSamples, 0, lastSegment, ratio,
+			(PICO_RATIO_MODE)RatioMode(mode), overflow);
+	}
+
+	virtual PICO_STATUS GetTriggerTimeOffsets(size_t numSegments, int64_t* offsets_fs)
+	{
+		//every simulated trigger lands exactly on a sample
+		for(size_t i=0; i<numSegments; i++)
+			offsets_fs[i] = 0;
+		return PICO_OK;
+	}
+
+	//streaming isn't simulated
+	virtual PICO_STATUS RunStreaming(int64_t& /*interval_fs*/, size_t /*bufferLen*/)
+	{ return PICO_NOT_SUPPORTED_BY_THIS_DEVICE; }
+
+	virtual PICO_STATUS GetStreamingLatestValues(const vector<PICO_CHANNEL>& /*channels*/, StreamingValues& values)
+	{
+		values = {0, 0, 0, false};
+		return PICO_NOT_SUPPORTED_BY_THIS_DEVICE;
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Factory
+
+/**
+	@brief Creates the backend for an opened unit
+ */
+PicoBackend* CreateBackend(PicoScopeType type, int16_t handle)
+{
+	switch(type)
+	{
+		case PICO2000A:
+			return new PS2000ABackend(handle);
+		case PICO3000A:
+			return new PS3000ABackend(handle);
+		case PICO4000A:
+			return new PS4000ABackend(handle);
+		case PICO5000A:
+			return new PS5000ABackend(handle);
+		case PICO6000A:
+			return new PS6000ABackend(handle);
+		case PICOPSOSPA:
+			return new PSOSPABackend(handle);
+		case PICOSIM:
+			return new SimBackend(handle);
+	}
+
+	return NULL;
+}
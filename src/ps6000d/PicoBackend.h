@@ -0,0 +1,182 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Declaration of PicoBackend
+ */
+
+#ifndef PicoBackend_h
+#define PicoBackend_h
+
+//New data reported by a streaming mode poll
+struct StreamingValues
+{
+	//Position of the new samples in the attached buffers
+	size_t startIndex;
+	size_t numSamples;
+
+	//Over range flags, a bit per analog channel
+	int16_t overflow;
+
+	//The buffers are full and have to be attached again once copied out (6000E and PSOSPA)
+	bool needBuffers;
+};
+
+/**
+	@brief Acquisition fast path of one driver API family
+
+	Wraps the driver calls made once or more per waveform (arm, stop, buffer setup, download, channel setup, streaming).
+	One implementation per API family is picked when the unit is opened, so the hot path doesn't branch on the scope
+	type and each family can be optimized on its own. Slow path configuration (trigger, AWG, MSO pods...) still goes
+	through switch(g_pico_type).
+
+	Unless otherwise noted, every method must be called with g_mutex held.
+ */
+class PicoBackend
+{
+public:
+	PicoBackend(int16_t handle)
+	: m_handle(handle)
+	{}
+
+	virtual ~PicoBackend()
+	{}
+
+	int16_t GetHandle()
+	{ return m_handle; }
+
+	virtual PICO_STATUS CloseUnit() =0;
+
+	/**
+		@brief Pushes the configuration of one analog channel to the instrument and updates g_scaleValue
+
+		@return True if the channel is enabled and the trigger on it may need to be reconfigured
+	 */
+	virtual bool SetChannel(size_t chan) =0;
+
+	/**
+		@brief Arms a block mode capture. OnBlockReady() is called with pParameter once it's complete.
+	 */
+	virtual PICO_STATUS RunBlock(size_t nPreTrigger, size_t nPostTrigger, uint32_t timebase, void* pParameter) =0;
+
+	virtual PICO_STATUS Stop() =0;
+
+	/**
+		@brief Converts a downsampling mode to the ratio mode constant of this API
+	 */
+	virtual int RatioMode(DownsampleMode mode) =0;
+
+	/**
+		@brief Removes a channel's buffers, which were attached for the given downsampling mode
+	 */
+	virtual PICO_STATUS ClearDataBuffers(PICO_CHANNEL channel, DownsampleMode mode) =0;
+
+	/**
+		@brief Attaches the buffer of one segment
+	 */
+	virtual PICO_STATUS SetDataBuffer(
+		PICO_CHANNEL channel,
+		int16_t* buffer,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode) =0;
+
+	/**
+		@brief Attaches the max and min buffers of one segment (aggregate mode)
+	 */
+	virtual PICO_STATUS SetDataBuffers(
+		PICO_CHANNEL channel,
+		int16_t* bufferMax,
+		int16_t* bufferMin,
+		size_t len,
+		size_t segment,
+		DownsampleMode mode) =0;
+
+	/**
+		@brief Downloads segment 0 of a block mode capture
+
+		@param startIndex	First sample to download, counted in raw samples from the start of the capture
+		@param numSamples	Number of samples requested, receives the number actually downloaded
+	 */
+	virtual PICO_STATUS GetValues(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow) =0;
+
+	/**
+		@brief Downloads segments 0 to lastSegment of a rapid block capture, in a single transfer where possible
+
+		@param startIndex	First sample to download from each segment
+		@param numSamples	Number of samples requested per segment, receives the number actually downloaded
+	 */
+	virtual PICO_STATUS GetValuesBulk(
+		uint64_t startIndex,
+		uint64_t& numSamples,
+		size_t lastSegment,
+		uint32_t ratio,
+		DownsampleMode mode,
+		int16_t* overflow) =0;
+
+	/**
+		@brief Reads the hardware trigger time offsets of segments 0 to numSegments-1, in femtoseconds
+	 */
+	virtual PICO_STATUS GetTriggerTimeOffsets(size_t numSegments, int64_t* offsets_fs) =0;
+
+	/**
+		@brief Starts a streaming mode acquisition into buffers attached with SetDataBuffer(..., DOWNSAMPLE_NONE)
+
+		@param interval_fs	Requested sample interval, receives the closest one the driver can actually do
+		@param bufferLen	Length of each attached buffer, in samples
+	 */
+	virtual PICO_STATUS RunStreaming(int64_t& interval_fs, size_t bufferLen) =0;
+
+	/**
+		@brief Polls for new streaming mode samples
+
+		@param channels		Channels and MSO pods with a buffer attached
+		@param values		Receives where the new samples are
+
+		@return PICO_BUSY if the driver has nothing new yet
+	 */
+	virtual PICO_STATUS GetStreamingLatestValues(const std::vector<PICO_CHANNEL>& channels, StreamingValues& values) =0;
+
+protected:
+	int16_t m_handle;
+};
+
+PicoBackend* CreateBackend(PicoScopeType type, int16_t handle);
+
+extern PicoBackend* g_backend;
+
+#endif
@@ -76,8 +76,56 @@
 		[chan]:THRESH [mV]
 			Sets MSO channel threshold to mV millivolts
 
-		BITS [num]
-			Sets ADC bit depth
+		ACK:BYTES [bytes]
+			Limits the data plane bytes sent but not yet ACKed (0 = no limit, default). One waveform is always
+			allowed in flight, however large. Combined with ACK:WINDOW, whichever is reached first applies.
+
+		ACK:BYTES?
+			Returns the flow control window in bytes
+
+		ACK:WINDOW [waveforms]
+			Limits the number of waveforms sent but not yet ACKed (0 = no limit, default 5)
+
+		ACK:WINDOW?
+			Returns the flow control window in waveforms
+
+		AVERAGE [count]
+			Averages block mode captures in the server (0 or 1 = off, default; at most 65535). Only every count'th
+			capture is sent, holding the per-sample mean (at 16 bit resolution) of the last count captures; each
+			segment of a rapid block capture counts as one. The waveform header is then followed by a uint32_t number
+			of captures averaged. The sums restart when the depth, channels, range or offset change.
+			MSO pods are not averaged, they carry the data of the last capture.
+
+		AVERAGE?
+			Returns the number of captures averaged
+
+		AVERAGE:VARIANCE [0|1]
+			When averaging, also sends the per-sample variance (in ADC codes squared) of each analog channel as
+			numSamples float values after the channel's samples. Not sent for waveforms reduced by ENVELOPE.
+
+		AVERAGE:VARIANCE?
+			Returns 1 if the variance is sent, 0 otherwise
+
+		BITS [num|FAST|PRECISE]
+			Sets ADC bit depth. FAST selects the lowest resolution the scope supports (highest rate and
+			deepest memory), PRECISE the highest. The sample rate and memory depth are moved to the nearest
+			setting valid at the new resolution; re-read RATES? and DEPTHS? afterwards.
+
+		BITS?
+			Returns the ADC bit depth
+
+		BITSLIST?
+			Returns a comma separated list of supported ADC bit depths
+
+		COMPRESS [NONE|RICE]
+			Selects lossless compression of block mode waveforms on the data plane socket.
+			NONE (default) sends samples as selected by FORMAT.
+			RICE delta encodes the ADC codes and Rice codes the result (stream format in Compression.cpp).
+			Channel headers are then extended as in FORMAT PACKED, then followed by a uint64_t length of the
+			compressed stream in bytes, which replaces the samples.
+
+		COMPRESS?
+			Returns the compression mode
 
 		DEPTH [num]
 			Sets memory depth
@@ -85,18 +133,199 @@
 		DEPTHS?
 			Returns the set of available memory depths
 
+		DOWNSAMPLE [ratio]
+			Sets the hardware downsampling ratio used when downloading block mode captures (default 1).
+			Only used when DOWNSAMPLEMODE is not NONE. Each waveform has DEPTH/ratio samples spaced
+			ratio sample intervals apart.
+
+		DOWNSAMPLE?
+			Returns the hardware downsampling ratio
+
+		DOWNSAMPLEMODE [NONE|DECIMATE|AVERAGE|AGGREGATE]
+			Selects how the scope reduces block mode captures before download.
+			NONE (default) downloads raw samples.
+			DECIMATE keeps every ratio'th sample, AVERAGE sends the mean of each group of ratio samples.
+			AGGREGATE sends the max and min of each group as alternating samples (at twice the downsampled rate).
+
+		DOWNSAMPLEMODE?
+			Returns the hardware downsampling mode
+
+		ENVELOPE [columns]
+			Enables software peak detect with the given number of columns (0 = off, default).
+			Block mode waveforms with more than columns samples are reduced to a min/max envelope before sending:
+			each column becomes two samples (min then max; AND then OR of the lines for MSO pods), with the
+			sample interval and trigger phase scaled to match. The full capture is kept in memory until the next one.
+
+		ENVELOPE?
+			Returns the number of envelope columns
+
 		EXIT
 			Terminates the connection
 
+		FETCH
+			Resends the full data of the last capture whose envelope was sent, as a normal waveform
+
+		FETCH:REST
+			Downloads all of the last capture from the scope again and sends it, after only its region of interest
+			was sent (see ROI:FIRST). Only possible until the scope is re-armed, e.g. after a SINGLE capture.
+
 		FORCE
 			Forces a single acquisition
 
+		FORMAT [INT16|PACKED]
+			Selects the sample encoding of block mode waveforms on the data plane socket.
+			INT16 (default) sends every sample as int16_t.
+			PACKED appends a uint8_t sample width (in bits) to every channel header, and sends analog samples at the
+			ADC resolution: int8_t in 8 bit mode, a dense little-endian bit stream of two's complement values in
+			other modes below 16 bits, otherwise int16_t. The channel scale is adjusted to match. MSO pods are sent
+			as one byte per sample.
+
+		FORMAT?
+			Returns the sample encoding
+
+		MASK [ON|OFF]
+			Enables the limit mask test (default OFF). Each block mode capture (after averaging, if on) is checked
+			against the mask; captures where every segment stays within the limits are not sent, they only count
+			as a pass. Captures with a failing segment are sent in full.
+
+		MASK?
+			Returns ON if the mask test is enabled, OFF otherwise
+
+		MASK:CLEAR
+			Removes the limits of every channel
+
+		MASK:FAIL?
+			Returns the number of segments that failed the mask test since MASK:RESET
+
+		MASK:PASS?
+			Returns the number of segments that passed the mask test since MASK:RESET
+
+		MASK:RESET
+			Clears the pass and fail counts
+
+		MASK:SET [chan],[first],[last],[lower],[upper]
+			Sets the allowed range of samples first to last (inclusive, counted as sent on the data plane) of an
+			analog channel to lower...upper, in the ADC codes sent with FORMAT INT16. Samples whose range was never
+			set, and channels without a mask, always pass.
+
+		MODE [BLOCK|STREAMING]
+			Selects the acquisition mode.
+			BLOCK (default) captures triggered waveforms of DEPTH samples each.
+			STREAMING continuously acquires at RATE, ignoring the trigger, and sends gap-free chunks of data.
+			Each chunk has the normal waveform header followed by a uint64_t index of its first sample,
+			counted from the start of streaming (restarts at zero whenever streaming is restarted).
+			DEPTH sets the size of the streaming buffer.
+
+		MODE?
+			Returns the acquisition mode
+
+		PERF?
+			Returns latency and throughput statistics for each stage of the acquisition loop, as semicolon
+			separated entries of the form name:n=count,mean=us,p50=us,p99=us,max=us[,MBps=rate]. Stages are
+			ARM (trigger armed to capture complete), STOP, BUFFERS (buffer allocation and SetDataBuffer),
+			DOWNLOAD (GetValues), SEND (headers and samples), ACKWAIT (backpressure) and REARM.
+			Times are in microseconds, MBps is bytes moved per second spent in the stage.
+			The same line is logged every 10 seconds at verbose level while captures are running.
+
+		PERF:RESET
+			Clears the PERF? statistics
+
+		PIPELINE [depth]
+			Sets the number of block mode buffer sets (1-8, default 1). With 2 or more, the scope is
+			re-armed as soon as a capture has been downloaded and the previous capture is sent to the
+			client in the background, overlapping re-arm with network transmission.
+			1 = download, send, then re-arm (lowest memory use).
+
+		PIPELINE?
+			Returns the block mode pipeline depth
+
+		PROTOCOL [1|2]
+			Selects the framing of data plane waveforms, from the next capture on (default 1).
+			1 sends the packed headers described above, one waveform per segment.
+			2 sends frames of fixed width, 8 byte aligned headers (FrameHeader in ps6000d.h) holding every segment of
+			a capture under one sequence number, with per-channel overflow, encoding and compression fields and the
+			trigger time. FORMAT, COMPRESS, ROI, AVERAGE and ENVELOPE are reported in the headers instead of extending
+			them. Applies to subscribers and recordings too.
+
+		PROTOCOL?
+			Returns the data plane protocol version
+
+		PROTOCOL:VERSIONS?
+			Returns a comma separated list of supported data plane protocol versions. Servers without it only
+			support version 1.
+
 		RATE [num]
 			Sets sample rate
 
 		RATES?
 			Returns a comma separated list of sampling rates (in femtoseconds)
 
+		RECORD?
+			Returns ON if captures are being recorded, OFF otherwise (including once the file is full)
+
+		RECORD:BEGIN [path]
+			Starts recording every block mode capture (after averaging and the mask test, if on) and every streaming
+			mode chunk to a new file on the server, RECORD:SIZE bytes long. Each waveform is stored exactly as it
+			would be sent on the data plane, behind a RecordFileHeader and an index with the sequence number,
+			download time and offset of each one. Streaming chunks are flagged RECORD_STREAMING in the index.
+			Captures that arrive while the previous one is still being written are dropped from the recording.
+			Not supported on Windows.
+
+		RECORD:COUNT?
+			Returns the number of waveforms in the recording
+
+		RECORD:DROPPED?
+			Returns the number of captures dropped from the recording because the disk didn't keep up
+
+		RECORD:END
+			Stops recording and flushes the file to disk. The file stays open for RECORD:REPLAY.
+
+		RECORD:REPLAY [first],[last]
+			Sends recorded waveforms first to last (inclusive, counted from 0) on the data plane, as they were
+			recorded but with new sequence numbers. The client must expect the PROTOCOL, FORMAT, COMPRESS, ROI and
+			AVERAGE settings they were recorded with.
+
+		RECORD:SIZE [MB]
+			Sets the size of the next recording file (default 1024). The whole file is allocated up front.
+
+		RECORD:SIZE?
+			Returns the size of the next recording file in MB
+
+		ROI:FIRST [sample]
+			Sets the first sample of each segment to download, counted from the start of the capture (default 0).
+			With a region of interest set (ROI:FIRST or ROI:LENGTH not 0), only that part of each block mode capture
+			is read from the scope, and the waveform header is followed by an int64_t time of the first sample from
+			the start of the capture, in fs. The first sample is rounded down to a multiple of the downsampling ratio.
+
+		ROI:FIRST?
+			Returns the first sample of the region of interest
+
+		ROI:LENGTH [samples]
+			Sets the number of samples of each segment to download (0 = up to the end of the segment, default).
+
+		ROI:LENGTH?
+			Returns the region of interest length
+
+		SEGMENTS [num]
+			Sets the number of memory segments (rapid block mode). Each trigger fills one segment and all
+			segments are downloaded and sent as a burst of waveforms once the last one has been captured.
+			1 = normal block mode (default).
+
+		SEGMENTS?
+			Returns the number of memory segments
+
+		SETUP:BEGIN
+			Starts a batch of setting changes. Until SETUP:COMMIT, channel and timebase changes are pushed to the
+			scope as usual, but the trigger is only reconfigured (and the capture re-armed) once, at the end.
+			Send this before restoring a saved setup.
+
+		SETUP:COMMIT
+			Ends a batch of setting changes and applies the pending trigger update and re-arm, if any.
+			START, SINGLE and FORCE also end the batch, as does disconnecting.
+
+		SHM:NAME?
+			Returns the name of the shared memory object used by TRANSPORT SHM (for shm_open)
+
 		SINGLE
 			Arms the trigger in one-shot mode
 
@@ -106,20 +335,64 @@
 		STOP
 			Disarms the trigger
 
+		TRANSPORT [TCP|SHM]
+			Selects how waveforms are delivered on the next data plane connection (send before connecting).
+			TCP (default) sends everything on the data plane socket.
+			SHM writes each waveform, in the same layout, into a slot of a shared memory ring (see SHM:NAME? and
+			ShmRingHeader) and only sends a 16 byte doorbell on the socket: uint32_t slot, uint32_t reserved,
+			uint64_t length. A slot of 0xffffffff means the waveform follows inline on the socket instead.
+			A slot is reused only once its waveform has been ACKed. Same host only, not supported on Windows.
+
+		TRANSPORT?
+			Returns the data plane transport
+
 		TRIG:DELAY [delay]
 			Sets trigger delay (in fs)
 
 		TRIG:EDGE:DIR [direction]
 			Sets trigger direction. Legal values are RISING, FALLING, or ANY.
+			For pulse width triggers, RISING times positive pulses and FALLING negative ones.
 
 		TRIG:LEV [level]
-			Selects trigger level (in volts)
+			Selects trigger level (in volts). Upper threshold of window and runt triggers.
+
+		TRIG:LOWER [level]
+			Selects the lower threshold of window and runt triggers (in volts)
+
+		TRIG:MODE [mode]
+			Selects the trigger type. Legal values are EDGE, WINDOW, RUNT, PULSE, or PATTERN.
+			Everything but EDGE uses the hardware advanced trigger (6000E, 3000E and 5000A only, other models
+			fall back to an edge trigger). WINDOW, RUNT and PULSE need an analog source.
+
+		TRIG:PATTERN [pattern]
+			Sets the MSO lane pattern for PATTERN triggers, one character per lane starting at pod 0 lane 0:
+			0, 1, R (rising), F (falling), E (either edge) or X (don't care). Missing lanes are X.
+
+		TRIG:PWLOWER [width]
+		TRIG:PWUPPER [width]
+			Sets the pulse width limits of PULSE triggers (in fs). LESS uses the upper limit, GREATER the lower.
+
+		TRIG:PWTYPE [type]
+			Selects which pulses PULSE triggers on. Legal values are LESS, GREATER, INSIDE (both limits)
+			or OUTSIDE.
+
+		TRIG:RUNT [polarity]
+			Selects the polarity of RUNT triggers. Legal values are POSITIVE or NEGATIVE.
 
 		TRIG:SOU [chan]
 			Selects the channel as the trigger source
 
+		TRIG:WINDOW [condition]
+			Selects when WINDOW triggers fire. Legal values are ENTER, EXIT, ANY (enter or exit), INSIDE or
+			OUTSIDE (the last two are level sensitive).
+
 		TODO: SetDigitalPortInteractionCallback to determine when pods are connected/removed
 
+		AWG:DATA [samples]
+			Uploads a user waveform for AWG:SHAPE ARBITRARY. The command is followed on the control socket by
+			that many raw little-endian int16_t samples (no trailing newline), full scale being the AWG:RANGE
+			amplitude. Up to the model's arbitrary buffer size.
+
 		AWG:DUTY [duty cycle]
 			Sets duty cycle of function generator output
 
@@ -133,7 +406,7 @@
 			Sets p-p voltage of the function generator output
 
 		AWG:SHAPE [waveform type]
-			Sets waveform type
+			Sets waveform type. ARBITRARY plays the waveform uploaded with AWG:DATA.
 
 		AWG:START
 			Starts the function generator
@@ -146,11 +419,11 @@
 #include "PicoSCPIServer.h"
 #include <string.h>
 #include <math.h>
+#include <inttypes.h>
+#include <algorithm>
 
 #define __USE_MINGW_ANSI_STDIO 1 // Required for MSYS2 mingw64 to support format "%z" ...
 
-#define FS_PER_SECOND 1e15
-
 using namespace std;
 
 //Channel state
@@ -170,7 +443,8 @@ map<size_t, PICO_BANDWIDTH_LIMITER> g_bandwidth;
 map<size_t, enPS3000ABandwidthLimiter> g_bandwidth_3000a;
 map<size_t, enPS4000ABandwidthLimiter> g_bandwidth_4000a;
 map<size_t, enPS5000ABandwidthLimiter> g_bandwidth_5000a;
-size_t g_memDepth = 1000000;
+size_t g_memDepth = 1000000;		//as requested, the capture may be shorter (see EffectiveMemDepth())
+size_t g_segmentMaxDepth = SIZE_MAX;	//deepest capture each memory segment holds, set by UpdateSegments()
 size_t g_scaleValue = 32512;
 size_t g_adcBits = 8;
 int64_t g_sampleInterval = 0;	//in fs
@@ -188,6 +462,43 @@ bool g_triggerArmed = false;
 bool g_triggerOneShot = false;
 bool g_memDepthChanged = false;
 
+//Rapid block mode config
+size_t g_numSegments = 1;
+size_t g_numSegmentsDuringArm = 1;
+
+//Streaming mode config
+bool g_streamingMode = false;
+bool g_streamingModeDuringArm = false;
+
+//Number of buffer sets in the block mode capture pipeline
+size_t g_pipelineDepth = 1;
+
+//Software peak detect, number of columns (0 = off)
+size_t g_envelopeColumns = 0;
+
+//Data plane sample encoding
+WireFormat g_wireFormat = FORMAT_INT16;
+
+//Data plane framing (PROTOCOL), 1 for clients that don't know about versions
+unsigned int g_protocolVersion = 1;
+
+//Server side averaging: number of captures per average (1 = off), and whether the variance is sent too
+size_t g_averageCount = 1;
+bool g_averageVariance = false;
+
+//Region of interest of block mode downloads, in samples from the start of each segment (length 0 = to the end)
+uint64_t g_roiStart = 0;
+uint64_t g_roiLength = 0;
+
+//The last capture has been downloaded and the scope hasn't been re-armed since, so FETCH:REST can read it again
+bool g_captureInDriver = false;
+
+//Hardware downsampling config
+uint32_t g_downsampleRatio = 1;
+uint32_t g_downsampleRatioDuringArm = 1;
+DownsampleMode g_downsampleMode = DOWNSAMPLE_NONE;
+DownsampleMode g_downsampleModeDuringArm = DOWNSAMPLE_NONE;
+
 //Trigger state (for now, only simple single-channel trigger supported)
 int64_t g_triggerDelay = 0;
 PICO_THRESHOLD_DIRECTION g_triggerDirection = PICO_RISING;
@@ -208,11 +519,18 @@ bool g_lastTriggerWasForced = false;
 
 std::mutex g_mutex;
 
+//SETUP:BEGIN / SETUP:COMMIT batching, protected by g_mutex
+bool g_setupBatch = false;
+bool g_triggerUpdatePending = false;
+bool g_rearmPending = false;
+
 //AWG config
 float g_awgRange = 0;
 float g_awgOffset = 0;
 bool g_awgOn = false;
 double g_awgFreq = 1000;
+double g_awgDuty = 50;
+bool g_awgArbitrary = false;	//AWG:SHAPE ARBITRARY, plays the AWG:DATA waveform
 int32_t g_awgBufferSize = 8192;
 PS2000A_EXTRA_OPERATIONS g_awgPS2000AOperation = PS2000A_ES_OFF;
 PS2000A_WAVE_TYPE g_awgPS2000AWaveType = PS2000A_SINE;
@@ -252,8 +570,23 @@ const map<string, WaveformType> g_waveformTypes =
 	{"ARBITRARY",  {PICO_ARBITRARY,  PS2000A_MAX_WAVE_TYPES, PS2000A_ES_OFF,     PS3000A_MAX_WAVE_TYPES, PS3000A_ES_OFF,     PS4000A_MAX_WAVE_TYPES, PS4000A_ES_OFF,     PS5000A_MAX_WAVE_TYPES,  PS5000A_ES_OFF}}       //FIX: PS3000A_MAX_WAVE_TYPES is used as placeholder for arbitrary generation till a better workaround is found
 };
 
-int16_t* g_arbitraryWaveform;
+//Table played by the 2000A-5000A arbitrary generator (for square waves and AWG:DATA), and its length in samples.
+//Points into g_squareWaveCache or g_userArbWaveform.
+int16_t* g_arbitraryWaveform = NULL;
+int32_t g_arbitraryLength = 0;
+
+//Square wave tables by duty cycle (in 0.01% steps), so switching between shapes or duty cycles doesn't regenerate them
+map<long, vector<int16_t> > g_squareWaveCache;
+
+//Arbitrary waveform uploaded with AWG:DATA
+vector<int16_t> g_userArbWaveform;
+
+//Largest AWG:DATA upload we read off the socket, anything bigger is assumed to be garbage
+static const size_t g_maxArbitraryUpload = 1024 * 1024;
+
 void GenerateSquareWave(int16_t* &waveform, size_t bufferSize, double dutyCycle, int16_t amplitude = 32767);
+vector<int16_t>& GetSquareWave(double dutyCycle);
+void SelectArbitraryTable(vector<int16_t>& table);
 void ReconfigAWG();
 
 extern uint32_t g_lastTxSeq;
@@ -304,13 +637,23 @@ PicoSCPIServer::PicoSCPIServer(ZSOCKET sock)
 			break;
 		}
 	}
-	g_arbitraryWaveform = new int16_t[g_awgBufferSize];
+
+	//The tables only depend on the model, so they're kept across connections
+	if(!g_arbitraryWaveform)
+		SelectArbitraryTable(GetSquareWave(g_awgDuty));
 }
 
 PicoSCPIServer::~PicoSCPIServer()
 {
 	LogVerbose("Client disconnected\n");
 
+	//Don't leave a half applied batch behind for the next client
+	{
+		DriverLock lock;
+		if(g_setupBatch)
+			CommitSetup();
+	}
+
 	//Disable all channels when a client disconnects to put the scope in a "safe" state
 	for(auto& it : g_channelOn)
 	{
@@ -334,6 +677,9 @@ PicoSCPIServer::~PicoSCPIServer()
 			case PICOPSOSPA:
 				psospaSetChannelOff(g_hScope, (PICO_CHANNEL)it.first);
 				break;
+			case PICOSIM:
+				simSetChannel(g_hScope, it.first, false, 1, 0);
+				break;
 		}
 
 		it.second = false;
@@ -362,6 +708,9 @@ PicoSCPIServer::~PicoSCPIServer()
 			case PICOPSOSPA:
 				psospaSetDigitalPortOff(g_hScope, (PICO_CHANNEL)(PICO_PORT0 + i));
 				break;
+			case PICOSIM:
+				//no digital ports in the simulator
+				break;
 		}
 		g_msoPodEnabled[i] = false;
 	}
@@ -405,7 +754,7 @@ bool PicoSCPIServer::OnQuery(
 	}
 	else if(cmd == "PRESENT")
 	{
-		lock_guard<mutex> lock(g_mutex);
+		DriverLock lock;
 
 		switch(g_series)
 		{
@@ -482,6 +831,7 @@ bool PicoSCPIServer::OnQuery(
 				if(g_bandwidth_5000a[channelId] == PS5000A_BW_20MHZ)
 					ret = "20";
 				break;
+			case PICOSIM:
 			case PICO6000A:
 				if(g_bandwidth[channelId] == PICO_BW_20MHZ)
 					ret = "20";
@@ -506,9 +856,165 @@ bool PicoSCPIServer::OnQuery(
 		SendReply(ret);
 	}
 
-	else if(cmd == "OFLIM")
+	else if(cmd == "BITS")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_adcBits));
+	}
+
+	else if(cmd == "BITSLIST")
+	{
+		string ret;
+		for(auto b : GetADCResolutions())
+			ret += to_string(b) + ",";
+		SendReply(ret);
+	}
+
+	else if(cmd == "SEGMENTS")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_numSegments));
+	}
+
+	else if(cmd == "MODE")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(g_streamingMode ? "STREAMING" : "BLOCK");
+	}
+
+	else if(cmd == "PIPELINE")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_pipelineDepth));
+	}
+
+	else if(cmd == "ENVELOPE")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_envelopeColumns));
+	}
+
+	//Lock free, so it doesn't disturb the waveform thread
+	else if(cmd == "PERF")
+		SendReply(PerfReport());
+
+	else if( (subject == "ACK") && (cmd == "WINDOW") )
+		SendReply(to_string(g_ackWindowWaveforms));
+
+	else if( (subject == "ACK") && (cmd == "BYTES") )
+		SendReply(to_string(g_ackWindowBytes));
+
+	else if(cmd == "COMPRESS")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply( (g_compressionMode == COMPRESS_RICE) ? "RICE" : "NONE");
+	}
+
+	else if(cmd == "TRANSPORT")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply( (g_transport == TRANSPORT_SHM) ? "SHM" : "TCP");
+	}
+
+	else if( (subject == "PROTOCOL") && (cmd == "VERSIONS") )
+		SendReply("1,2");
+
+	else if(cmd == "PROTOCOL")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_protocolVersion));
+	}
+
+	else if( (subject == "AVERAGE") && (cmd == "VARIANCE") )
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(g_averageVariance ? "1" : "0");
+	}
+
+	//Lock free, so it doesn't disturb the waveform thread
+	else if( (subject == "MASK") && (cmd == "PASS") )
+		SendReply(to_string(g_maskPassCount));
+
+	else if( (subject == "MASK") && (cmd == "FAIL") )
+		SendReply(to_string(g_maskFailCount));
+
+	else if(cmd == "MASK")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(g_maskEnabled ? "ON" : "OFF");
+	}
+
+	else if(cmd == "AVERAGE")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_averageCount));
+	}
+
+	else if( (subject == "ROI") && (cmd == "FIRST") )
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_roiStart));
+	}
+
+	else if( (subject == "ROI") && (cmd == "LENGTH") )
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_roiLength));
+	}
+
+	else if( (subject == "SHM") && (cmd == "NAME") )
+		SendReply(g_shmName);
+
+	else if( (subject == "RECORD") && (cmd == "COUNT") )
+		SendReply(to_string(RecordCount(g_record)));
+
+	else if( (subject == "RECORD") && (cmd == "DROPPED") )
+		SendReply(to_string(RecordDropCount()));
+
+	else if( (subject == "RECORD") && (cmd == "SIZE") )
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_recordSize >> 20));
+	}
+
+	else if(cmd == "RECORD")
+		SendReply(IsRecording() ? "ON" : "OFF");
+
+	else if(cmd == "FORMAT")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply( (g_wireFormat == FORMAT_PACKED) ? "PACKED" : "INT16");
+	}
+
+	else if(cmd == "DOWNSAMPLE")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_downsampleRatio));
+	}
+
+	else if(cmd == "DOWNSAMPLEMODE")
 	{
 		lock_guard<mutex> lock(g_mutex);
+		switch(g_downsampleMode)
+		{
+			case DOWNSAMPLE_DECIMATE:
+				SendReply("DECIMATE");
+				break;
+			case DOWNSAMPLE_AVERAGE:
+				SendReply("AVERAGE");
+				break;
+			case DOWNSAMPLE_AGGREGATE:
+				SendReply("AGGREGATE");
+				break;
+			default:
+				SendReply("NONE");
+				break;
+		}
+	}
+
+	else if(cmd == "OFLIM")
+	{
+		DriverLock lock;
 		string ret = "0";
 
 		double maxoff;
@@ -544,6 +1050,9 @@ bool PicoSCPIServer::OnQuery(
 			case PICOPSOSPA:
 				psospaGetAnalogueOffsetLimits(g_hScope, -g_range_3000e[channelId], g_range_3000e[channelId], PICO_X1_PROBE_NV, g_coupling[channelId], &maxoff, &minoff);
 				break;
+			case PICOSIM:
+				simGetAnalogueOffsetLimits(g_hScope, g_roundedRange[channelId], &maxoff, &minoff);
+				break;
 		}
 		ret = to_string(maxoff);
 		SendReply(ret);
@@ -584,302 +1093,34 @@ size_t PicoSCPIServer::GetAnalogChannelCount()
 
 vector<size_t> PicoSCPIServer::GetSampleRates()
 {
-	vector<size_t> rates;
-	vector<size_t> vec;
-	double previousIntervalNs = 0;
-	lock_guard<mutex> lock(g_mutex);
-	//Enumerate timebases
-	switch(g_pico_type)
-	{
-		case PICO2000A:
-			if(g_model.find("2205MSO") != string::npos)
-			{
-				vec =
-				{
-					0,1,2,4,5,8,10,16,20,25,32,40,50,64,80,100,125,128,160,200,250,320,400,500,640,800,1000,1250,1280,1600,2000,2500,3200,4000,5000,6400,8000,10000,12500,12800,16000,20000,25000,32000,40000,50000,64000,80000,100000
-				};
-			}
-			else if( g_model=="2206" || g_model=="2206A" || g_model=="2206B" || g_model=="2205AMSO" || g_model=="2405A" )
-			{
-				//!! 500 MS/s maximum sampling rate models
-				vec =
-				{
-					0,1,2,3,4,6,7,10,12,22,27,42,52,82,102,127,202,252,402,502,627,802,1002,1252,2002,2502,3127,4002,5002,6252,8002,10002,12502,15627,20002,25002,31252,40002,50002,62502
-				};
-			}
-			else
-			{
-				//!! 1 GS/s maximum sampling rate models
-				vec =
-				{
-					0,1,2,3,4,6,7,10,12,18,22,27,42,52,82,102,127,162,202,252,402,502,627,802,1002,1252,1602,2002,2502,3127,4002,5002,6252,8002,10002,12502,15627,16002,20002,25002,31252,40002,50002,62502,80002,100002,125002
-				};
-			}
-			break;
-		case PICO3000A:
-			if( (g_model[1]=='2') and (g_model[4]=='A' or g_model[4]=='B') )
-			{
-				//PicoScope 3000A and 3000B Series 2-Channel USB 2.0 Oscilloscopes
-				vec =
-				{
-					0,1,2,3,4,6,7,10,12,22,27,42,52,82,102,127,202,252,402,502,627,802,1002,1252,2002,2502,3127,4002,5002,6252,8002,10002,12502,15627,20002,25002,31252,40002,50002,62502
-				};
-			}
-			if( (g_model.find("MSO") != string::npos) and (g_model[4]!='D') )
-			{
-				//PicoScope 3000 Series USB 2.0 MSOs
-				vec =
-				{
-					0,1,2,3,5,6,9,11,17,21,26,41,51,81,101,126,161,201,251,401,501,626,801,1001,1251,1601,2001,2501,3126,4001,5001,6251,8001,10001,12501,15626,16001,20001,25001,31251,40001,50001,62501,80001,100001,125001
-				};
-			}
-			else
-			{
-				//PicoScope 3000A and 3000B Series 4-Channel USB 2.0 Oscilloscopes
-				//PicoScope 3207A and 3207B USB 3.0 Oscilloscopes
-				//PicoScope 3000D Series USB 3.0 Oscilloscopes and MSOs
-				vec =
-				{
-					0,1,2,3,4,6,7,10,12,18,22,27,42,52,82,102,127,162,202,252,402,502,627,802,1002,1252,1602,2002,2502,3127,4002,5002,6252,8002,10002,12502,15627,16002,20002,25002,31252,40002,50002,62502,80002,100002,125002
-				};
-			}
-			break;
-		case PICO4000A:
-			if(g_model.find("4444") != string::npos)
-			{
-				//PicoScope 4444
-				vec =
-				{
-					0,1,2,3,4,6,7,10,12,18,22,27,34,42,52,66,82,102,127,162,202,252,322,402,502,627,642,802,1002,1252,1602,2002,2502,3202,4002,5002,6252,6402,8002,10002,12502,16002,20002,25002,32002,40002,50002
-				};
-			}
-			else
-			{
-				//PicoScope 4824 and 4000A Series
-				vec =
-				{
-					0,1,3,7,9,15,19,31,39,63,79,99,127,159,199,255,319,399,511,639,799,999,1023,1279,1599,1999,2559,3199,3999,5119,6399,7999,9999,10239,12799,15999,19999,25599,31999,39999,51199,63999,79999
-				};
-			}
-			break;
-		case PICO5000A:
-			switch(g_adcBits)
-			{
-				case 8:
-				{
-					vec =
-					{
-						0,1,2,3,4,6,7,10,12,18,22,27,42,52,82,102,127,162,202,252,402,502,627,802,1002,1252,1602,2002,2502,3127,4002,5002,6252,8002,10002,12502,15627,16002,20002,25002,31252,40002,50002,62502,80002,100002,125002
-					};
-					break;
-				}
-
-				case 12:
-				{
-					vec =
-					{
-						1,2,3,4,5,7,8,11,13,23,28,43,53,83,103,128,203,253,403,503,628,803,1003,1253,2003,2503,3128,4003,5003,6253,8003,10003,12503,15628,20003,25003,31253,40003,50003,62503
-					};
-					break;
-				}
-
-				case 14:
-				{
-					vec =
-					{
-						3,4,6,7,10,12,18,22,27,42,52,82,102,127,162,202,252,402,502,627,802,1002,1252,1602,2002,2502,3127,4002,5002,6252,8002,10002,12502,15627,16002,20002,25002,31252,40002,50002,62502,80002,100002,125002
-					};
-					break;
-				}
-
-				case 15:
-				{
-					vec =
-					{
-						3,4,6,7,10,12,18,22,27,42,52,82,102,127,162,202,252,402,502,627,802,1002,1252,1602,2002,2502,3127,4002,5002,6252,8002,10002,12502,15627,16002,20002,25002,31252,40002,50002,62502,80002,100002,125002
-					};
-					break;
-				}
+	//Only wait for a download in progress if the hardware has to be probed
+	unique_lock<mutex> lock(g_mutex);
+	if(!HaveCapabilities())
+		WaitForDriverIdle(lock);
+	return GetCapabilities().rates;
+}
 
-				case 16:
-				{
-					vec =
-					{
-						4,5,7,8,11,13,23,28,43,53,83,103,128,203,253,403,503,628,803,1003,1253,2003,2503,3128,4003,5003,6253,8003,10003,12503,15628,20003,25003,31253,40003,50003,62503
-					};
-				}
-			}
-			break;
-		case PICO6000A:
-			//PicoScope 6428E-D
-			if(g_model[3] == '8')
-			{
-				vec =
-				{
-					0,1,2,3,4,5,6,7,10,15,25,30,55,105,130,205,255,505,630,1005,1255,2005,2505,3130,5005,6255,10005,12505,15630,20005,25005,31255,50005,62505,78130,100005,125005,156255
-				};
-			}
-			//PicoScope 6000E Series except the PicoScope 6428E-D
-			else
-			{
-				vec =
-				{
-					0,1,2,3,4,5,6,9,14,24,29,54,104,129,204,254,504,629,1004,1254,2004,2504,3129,5004,6254,10004,12504,15629,20004,25004,31254,50004,62504,78129,100004,125004,156254
-				};
-			}
-			break;
-		case PICOPSOSPA:
-			//All desired sample rates in picoseconds
-			vec =
-			{
-				200,400,800,1000,1600,3200,6400,8000,10000,12500,12800,16000,20000,25000,32000,40000,50000,64000,80000,100000,125000,128000,160000,200000,250000,320000,400000,500000,640000,800000,1000000,1250000,1280000,1600000,2000000,2500000,3200000,4000000,5000000,6400000,8000000,10000000,12500000,12800000,16000000,20000000,25000000,32000000,40000000,50000000,64000000,80000000,100000000,125000000,128000000,160000000,200000000,250000000,320000000,400000000,500000000,640000000,800000000,1000000000
-			};
-			break;
-	}
+vector<size_t> PicoSCPIServer::GetSampleDepths()
+{
+	unique_lock<mutex> lock(g_mutex);
+	if(!HaveCapabilities())
+		WaitForDriverIdle(lock);
+	return GetCapabilities().depths;
+}
 
-	for(auto i : vec)
-	{
-		double intervalNs;
-		float intervalNs_f;
-		uint64_t maxSamples;
-		int32_t maxSamples_int;
-		PICO_STATUS status = PICO_RESERVED_1;
-
-		switch(g_pico_type)
-		{
-			case PICO2000A:
-				status = ps2000aGetTimebase2(g_hScope, i, 1, &intervalNs_f, 1, &maxSamples_int, 0);
-				maxSamples = maxSamples_int;
-				intervalNs = intervalNs_f;
-				break;
-			case PICO3000A:
-				status = ps3000aGetTimebase2(g_hScope, i, 1, &intervalNs_f, 1, &maxSamples_int, 0);
-				maxSamples = maxSamples_int;
-				intervalNs = intervalNs_f;
-				break;
-			case PICO4000A:
-				status = ps4000aGetTimebase2(g_hScope, i, 1, &intervalNs_f, &maxSamples_int, 0);
-				maxSamples = maxSamples_int;
-				intervalNs = intervalNs_f;
-				break;
-			case PICO5000A:
-				status = ps5000aGetTimebase2(g_hScope, i, 1, &intervalNs_f, &maxSamples_int, 0);
-				maxSamples = maxSamples_int;
-				intervalNs = intervalNs_f;
-				break;
-			case PICO6000A:
-				status = ps6000aGetTimebase(g_hScope, i, 1, &intervalNs, &maxSamples, 0);
-				break;
-			case PICOPSOSPA:
-				status = psospaGetTimebase(g_hScope, i, 1, &intervalNs, &maxSamples, 0);
-				if(std::abs((intervalNs * 1000) - i) > 1)
-					status = PICO_INVALID_TIMEBASE;		//Avoid irregular sample rates
-				if(intervalNs == previousIntervalNs)
-					status = PICO_INVALID_TIMEBASE;		//Avoid multiple entries of the same rate
-				if(PICO_OK == status)
-					previousIntervalNs = intervalNs;
-				break;
-		}
-
-		if(PICO_OK == status)
-		{
-			size_t intervalFs = intervalNs * 1e6f;
-			rates.push_back(FS_PER_SECOND / intervalFs);
-			//LogDebug("GetTimebase:\t%ld\t%f\t%f\n", i, (1e12f / i), (FS_PER_SECOND / intervalFs));
-		}
-		else if( (PICO_INVALID_TIMEBASE == status) || (PICO_INVALID_CHANNEL == status) || (PICO_NO_CHANNELS_OR_PORTS_ENABLED == status) )
-		{
-			//Requested timebase not possible
-			//This is common and harmless if we ask for e.g. timebase 0 when too many channels are active.
-			continue;
-		}
-		else
-			LogWarning("GetTimebase failed, code %d / 0x%x\n", status, status);
-	}
-	return rates;
-}
-
-vector<size_t> PicoSCPIServer::GetSampleDepths()
-{
-	vector<size_t> depths;
-
-	lock_guard<mutex> lock(g_mutex);
-	double intervalNs;
-	float intervalNs_f;
-	uint64_t maxSamples;
-	int32_t maxSamples_int;
-
-	PICO_STATUS status;
-	status = PICO_RESERVED_1;
-
-	//Ask for max memory depth at timebase number 10
-	//We cannot use the first few timebases because those are sometimes not available depending on channel count etc
-	int ntimebase = 10;
-	switch(g_pico_type)
-	{
-		case PICO2000A:
-			status = ps2000aGetTimebase2(g_hScope, ntimebase, 1, &intervalNs_f, 1, &maxSamples_int, 0);
-			maxSamples = maxSamples_int;
-			intervalNs = intervalNs_f;
-			break;
-		case PICO3000A:
-			status = ps3000aGetTimebase2(g_hScope, ntimebase, 1, &intervalNs_f, 1, &maxSamples_int, 0);
-			maxSamples = maxSamples_int;
-			intervalNs = intervalNs_f;
-			break;
-		case PICO4000A:
-			status = ps4000aGetTimebase2(g_hScope, ntimebase, 1, &intervalNs_f, &maxSamples_int, 0);
-			maxSamples = maxSamples_int;
-			intervalNs = intervalNs_f;
-			break;
-		case PICO5000A:
-			status = ps5000aGetTimebase2(g_hScope, ntimebase, 1, &intervalNs_f, &maxSamples_int, 0);
-			maxSamples = maxSamples_int;
-			intervalNs = intervalNs_f;
-			break;
-		case PICO6000A:
-			status = ps6000aGetTimebase(g_hScope, ntimebase, 1, &intervalNs, &maxSamples, 0);
-			break;
-		case PICOPSOSPA:
-			status = psospaGetTimebase(g_hScope, 40000, 1, &intervalNs, &maxSamples, 0);
-			break;
-	}
-
-	if(PICO_OK == status)
-	{
-		//Seems like there's no restrictions on actual memory depth other than an upper bound.
-		//To keep things simple, report 1-2-5 series from 1K samples up to the actual max depth
-
-		for(size_t base = 1000; base < maxSamples; base *= 10)
-		{
-			const size_t muls[] = {1, 2, 4, 5, 8};
-			for(auto m : muls)
-			{
-				size_t depth = m * base;
-				if(depth < maxSamples)
-					depths.push_back(depth);
-			}
-		}
-
-		depths.push_back(maxSamples);
-	}
-
-	return depths;
-}
-
-bool PicoSCPIServer::OnCommand(
-	const string& line,
-	const string& subject,
-	const string& cmd,
-	const vector<string>& args)
-{
-	//Function generator is different from normal channels
-	//(uses range/offs commands so must go before normal bridge processing!)
-	if(subject == "AWG")
+bool PicoSCPIServer::OnCommand(
+	const string& line,
+	const string& subject,
+	const string& cmd,
+	const vector<string>& args)
+{
+	//Function generator is different from normal channels
+	//(uses range/offs commands so must go before normal bridge processing!)
+	if(subject == "AWG")
 	{
 		if(cmd == "START")
 		{
-			lock_guard<mutex> lock(g_mutex);
+			DriverLock lock;
 			g_awgOn = true;
 			ReconfigAWG();
 		}
@@ -896,7 +1137,7 @@ bool PicoSCPIServer::OnCommand(
 			 *
 			 * This ensures clean signal termination without residual voltage levels.
 			 */
-			lock_guard<mutex> lock(g_mutex);
+			DriverLock lock;
 			float tempRange = g_awgRange;
 			float tempOffset = g_awgOffset;
 			uint32_t status = PICO_OK;
@@ -1002,6 +1243,7 @@ bool PicoSCPIServer::OnCommand(
 					g_awgOffset = tempOffset;
 					g_awgOn = false;
 					break;
+				case PICOSIM:
 				case PICO6000A:
 					g_awgOn = false;
 					ReconfigAWG();
@@ -1018,48 +1260,93 @@ bool PicoSCPIServer::OnCommand(
 		{
 			if(cmd == "FREQ")
 			{
-				lock_guard<mutex> lock(g_mutex);
-				g_awgFreq = stof(args[0]);
+				DriverLock lock;
+				double freq = stof(args[0]);
 				//Frequency must not be zero
-				if(g_awgFreq<1e-3)
-					g_awgFreq = 1;
+				if(freq<1e-3)
+					freq = 1;
+
+				//Sweeps often send the same value again, don't touch the hardware for nothing
+				if(freq == g_awgFreq)
+					return true;
+				g_awgFreq = freq;
+				UpdateAWGFrequency();
+			}
+
+			//Binary upload: the samples follow the command on the control socket as raw little-endian int16_t,
+			//full scale being +/- AWG:RANGE
+			else if(cmd == "DATA")
+			{
+				//Signed, so a negative count isn't wrapped to a huge one. It has no payload to skip.
+				long long requested = stoll(args[0]);
+				if(requested < 0)
+				{
+					LogError("Invalid arbitrary waveform length %lld\n", requested);
+					return false;
+				}
+				size_t count = requested;
+
+				//Too big to buffer: the payload is still on the socket and must not be parsed as commands,
+				//so read and discard it in bounded chunks
+				if(count > g_maxArbitraryUpload)
+				{
+					LogError("Arbitrary waveform of %zu samples is too big to receive\n", count);
+					uint8_t discard[4096];
+					size_t remaining = (count > SIZE_MAX / sizeof(int16_t)) ? SIZE_MAX : count * sizeof(int16_t);
+					while(remaining > 0)
+					{
+						size_t chunk = min(remaining, sizeof(discard));
+						if(!m_socket.RecvLooped(discard, chunk))
+							break;
+						remaining -= chunk;
+					}
+					return false;
+				}
+				vector<int16_t> samples(count);
+				if( (count != 0) && !m_socket.RecvLooped((uint8_t*)&samples[0], count * sizeof(int16_t)) )
+					return false;
+				if( (count == 0) || (count > static_cast<size_t>(g_awgBufferSize)) )
+				{
+					LogError("Arbitrary waveform length %zu not supported (1-%d samples)\n", count, g_awgBufferSize);
+					return false;
+				}
+
+				DriverLock lock;
+				bool inUse = (g_arbitraryWaveform == g_userArbWaveform.data());
+				g_userArbWaveform.swap(samples);
+				if(inUse || g_awgArbitrary)
+					SelectArbitraryTable(g_userArbWaveform);
+				if(!g_awgArbitrary)
+					return true;
 
+				uint32_t status = PICO_OK;
 				switch(g_pico_type)
 				{
-					case PICO2000A:
-						//handled by ReconfigAWG()
-						break;
-					case PICO3000A:
-						//handled by ReconfigAWG()
-						break;
-					case PICO4000A:
-						//handled by ReconfigAWG()
-						break;
-					case PICO5000A:
-						//handled by ReconfigAWG()
-						break;
 					case PICO6000A:
-					{
-						auto status = ps6000aSigGenFrequency(g_hScope, g_awgFreq);
-						if(status != PICO_OK)
-							LogError("ps6000aSigGenFrequency failed, code 0x%x (freq=%f)\n", status, g_awgFreq);
+						status = ps6000aSigGenWaveform(g_hScope, PICO_ARBITRARY, &g_userArbWaveform[0], count);
+						if(PICO_OK != status)
+							LogError("ps6000aSigGenWaveform failed, code 0x%x\n", status);
+						ApplyAWG();
 						break;
-					}
 					case PICOPSOSPA:
-					{
-						auto status = psospaSigGenFrequency(g_hScope, g_awgFreq);
-						if(status != PICO_OK)
-							LogError("psospaSigGenFrequency failed, code 0x%x (freq=%f)\n", status, g_awgFreq);
+						status = psospaSigGenWaveform(g_hScope, PICO_ARBITRARY, &g_userArbWaveform[0], count);
+						if(PICO_OK != status)
+							LogError("psospaSigGenWaveform failed, code 0x%x\n", status);
+						ApplyAWG();
+						break;
+					default:
+						ReconfigAWG();
 						break;
-					}
 				}
-				ReconfigAWG();
 			}
 
 			else if(cmd == "DUTY")
 			{
-				lock_guard<mutex> lock(g_mutex);
+				DriverLock lock;
 				auto duty = stof(args[0]) * 100;
+				if(duty == g_awgDuty)
+					return true;
+				g_awgDuty = duty;
 				uint32_t status = PICO_OK;
 
 				switch(g_pico_type)
@@ -1068,7 +1355,10 @@ bool PicoSCPIServer::OnCommand(
 						/* DutyCycle of square wave can not be controlled in ps2000a built in generator,
 						Must be implemented via Arbitrary*/
 						if( g_awgPS2000AWaveType == PS2000A_SQUARE )
-							GenerateSquareWave(g_arbitraryWaveform, g_awgBufferSize, (double) duty);
+						{
+							SelectArbitraryTable(GetSquareWave(duty));
+							ReconfigAWG();
+						}
 						else
 							LogError("PICO2000A DUTY TODO code\n");
 						break;
@@ -1076,7 +1366,10 @@ bool PicoSCPIServer::OnCommand(
 						/* DutyCycle of square wave can not be controlled in ps3000a built in generator,
 						Must be implemented via Arbitrary*/
 						if( g_awgPS3000AWaveType == PS3000A_SQUARE )
-							GenerateSquareWave(g_arbitraryWaveform, g_awgBufferSize, (double) duty);
+						{
+							SelectArbitraryTable(GetSquareWave(duty));
+							ReconfigAWG();
+						}
 						else
 							LogError("PICO3000A DUTY TODO code\n");
 						break;
@@ -1084,7 +1377,10 @@ bool PicoSCPIServer::OnCommand(
 						/* DutyCycle of square wave can not be controlled in ps4000a built in generator,
 						Must be implemented via Arbitrary*/
 						if( g_awgPS4000AWaveType == PS4000A_SQUARE )
-							GenerateSquareWave(g_arbitraryWaveform, g_awgBufferSize, (double) duty);
+						{
+							SelectArbitraryTable(GetSquareWave(duty));
+							ReconfigAWG();
+						}
 						else
 							LogError("PICO4000A DUTY TODO code\n");
 						break;
@@ -1092,7 +1388,10 @@ bool PicoSCPIServer::OnCommand(
 						/* DutyCycle of square wave can not be controlled in ps3000a built in generator,
 						Must be implemented via Arbitrary*/
 						if( g_awgPS5000AWaveType == PS5000A_SQUARE )
-							GenerateSquareWave(g_arbitraryWaveform, g_awgBufferSize, (double) duty);
+						{
+							SelectArbitraryTable(GetSquareWave(duty));
+							ReconfigAWG();
+						}
 						else
 							LogError("PICO5000A DUTY TODO code\n");
 						break;
@@ -1100,36 +1399,46 @@ bool PicoSCPIServer::OnCommand(
 						status = ps6000aSigGenWaveformDutyCycle(g_hScope, duty);
 						if(status != PICO_OK)
 							LogError("ps6000aSigGenWaveformDutyCycle failed, code 0x%x\n", status);
-						//ReconfigAWG();
+						ApplyAWG();
 						break;
 					case PICOPSOSPA:
 						status = psospaSigGenWaveformDutyCycle(g_hScope, duty);
 						if(status != PICO_OK)
 							LogError("psospaSigGenWaveformDutyCycle failed, code 0x%x\n", status);
+						ApplyAWG();
+						break;
+					case PICOSIM:
+						//no function generator in the simulator
 						break;
 				}
-				ReconfigAWG();
 			}
 
+			//No SDK call changes only the offset or amplitude on 2000A-5000A, so these still reconfigure everything
 			else if(cmd == "OFFS")
 			{
-				lock_guard<mutex> lock(g_mutex);
-				g_awgOffset = stof(args[0]);
+				DriverLock lock;
+				float offset = stof(args[0]);
+				if(offset == g_awgOffset)
+					return true;
+				g_awgOffset = offset;
 
 				ReconfigAWG();
 			}
 
 			else if(cmd == "RANGE")
 			{
-				lock_guard<mutex> lock(g_mutex);
-				g_awgRange = stof(args[0]);
+				DriverLock lock;
+				float range = stof(args[0]);
+				if(range == g_awgRange)
+					return true;
+				g_awgRange = range;
 
 				ReconfigAWG();
 			}
 
 			else if(cmd == "SHAPE")
 			{
-				lock_guard<mutex> lock(g_mutex);
+				DriverLock lock;
 
 				auto waveform = g_waveformTypes.find(args[0]);
 				if(waveform == g_waveformTypes.end())
@@ -1138,6 +1447,7 @@ bool PicoSCPIServer::OnCommand(
 					return true;
 				}
 
+				bool userWaveform = (args[0] == "ARBITRARY") && !g_userArbWaveform.empty();
 				uint32_t status = PICO_OK;
 				switch(g_pico_type)
 				{
@@ -1148,17 +1458,8 @@ bool PicoSCPIServer::OnCommand(
 							LogError("Noise/PRBS generation not supported by some 2xxxA Models\n");
 							return true;
 						}
-						if( (g_awgPS2000AWaveType == PS2000A_SQUARE) )
-						{
-							GenerateSquareWave(g_arbitraryWaveform, g_awgBufferSize, 50);
-						}
 						g_awgPS2000AWaveType = waveform->second.type2000;
 						g_awgPS2000AOperation = waveform->second.op2000;
-						if(args[0] == "ARBITRARY")
-						{
-							//TODO: find a more flexible way to specify arb buffer
-							LogError("PICO2000A ARBITRARY TODO code\n");
-						}
 						break;
 					case PICO3000A:
 						if( ( (args[0] == "WHITENOISE") || (args[0] == "PRBS") )
@@ -1167,70 +1468,53 @@ bool PicoSCPIServer::OnCommand(
 							LogError("Noise/PRBS generation not supported by 3xxxA Models\n");
 							return true;
 						}
-						if( (g_awgPS3000AWaveType == PS3000A_SQUARE) )
-						{
-							GenerateSquareWave(g_arbitraryWaveform, g_awgBufferSize, 50);
-						}
 						g_awgPS3000AWaveType = waveform->second.type3000;
 						g_awgPS3000AOperation = waveform->second.op3000;
-						if(args[0] == "ARBITRARY")
-						{
-							//TODO: find a more flexible way to specify arb buffer
-							LogError("PICO3000A ARBITRARY TODO code\n");
-						}
 						break;
 					case PICO4000A:
-						if( (g_awgPS4000AWaveType == PS4000A_SQUARE) )
-						{
-							GenerateSquareWave(g_arbitraryWaveform, g_awgBufferSize, 50);
-						}
 						g_awgPS4000AWaveType = waveform->second.type4000;
 						g_awgPS4000AOperation = waveform->second.op4000;
-						if(args[0] == "ARBITRARY")
-						{
-							//TODO: find a more flexible way to specify arb buffer
-							LogError("PICO4000A ARBITRARY TODO code\n");
-						}
 						break;
 					case PICO5000A:
-						if( (g_awgPS5000AWaveType == PS5000A_SQUARE) )
-						{
-							GenerateSquareWave(g_arbitraryWaveform, g_awgBufferSize, 50);
-						}
 						g_awgPS5000AWaveType = waveform->second.type5000;
 						g_awgPS5000AOperation = waveform->second.op5000;
-
-
-						if(args[0] == "ARBITRARY")
-						{
-							//TODO: find a more flexible way to specify arb buffer
-							LogError("PICO5000A ARBITRARY TODO code\n");
-						}
 						break;
 					case PICO6000A:
-						status = ps6000aSigGenWaveform(g_hScope, waveform->second.type6000, NULL, 0);
-						if(PICO_OK != status)
-							LogError("ps6000aSigGenWaveform failed, code 0x%x\n", status);
-						ReconfigAWG();
-						if(args[0] == "ARBITRARY")
+						if(userWaveform)
 						{
-							//TODO: ReconfigAWG() can handle this already, must only fill the buffer
-							LogError("PICO6000A ARBITRARY TODO code\n");
+							status = ps6000aSigGenWaveform(
+								g_hScope, PICO_ARBITRARY, &g_userArbWaveform[0], g_userArbWaveform.size());
 						}
+						else
+							status = ps6000aSigGenWaveform(g_hScope, waveform->second.type6000, NULL, 0);
+						if(PICO_OK != status)
+							LogError("ps6000aSigGenWaveform failed, code 0x%x\n", status);
 						break;
 					case PICOPSOSPA:
-						status = psospaSigGenWaveform(g_hScope, waveform->second.type6000, NULL, 0);
-						if(PICO_OK != status)
-							LogError("psospaSigGenWaveform failed, code 0x%x\n", status);
-						ReconfigAWG();
-						if(args[0] == "ARBITRARY")
+						if(userWaveform)
 						{
-							//TODO: ReconfigAWG() can handle this already, must only fill the buffer
-							LogError("PICOPSOSPA ARBITRARY TODO code\n");
+							status = psospaSigGenWaveform(
+								g_hScope, PICO_ARBITRARY, &g_userArbWaveform[0], g_userArbWaveform.size());
 						}
+						else
+							status = psospaSigGenWaveform(g_hScope, waveform->second.type6000, NULL, 0);
+						if(PICO_OK != status)
+							LogError("psospaSigGenWaveform failed, code 0x%x\n", status);
+						break;
+					case PICOSIM:
+						//no function generator in the simulator
 						break;
 				}
 
+				//Square waves (on 2000A-5000A) and user waveforms go through the arbitrary generator
+				g_awgArbitrary = (args[0] == "ARBITRARY");
+				if(g_awgArbitrary && !userWaveform)
+					LogError("No arbitrary waveform has been uploaded with AWG:DATA\n");
+				if(userWaveform)
+					SelectArbitraryTable(g_userArbWaveform);
+				else if(args[0] == "SQUARE")
+					SelectArbitraryTable(GetSquareWave(g_awgDuty));
+
 				ReconfigAWG();
 			}
 			else
@@ -1239,176 +1523,417 @@ bool PicoSCPIServer::OnCommand(
 		else
 			LogError("Unrecognized AWG command %s\n", line.c_str());
 	}
+
+	//Advanced trigger types (TRIG:MODE EDGE goes to SetTriggerTypeEdge via the bridge)
+	else if( (subject == "TRIG") && (args.size() == 1) && (cmd != "MODE" || args[0] != "EDGE") &&
+		( (cmd == "MODE") || (cmd == "LOWER") || (cmd == "WINDOW") || (cmd == "RUNT") || (cmd == "PWTYPE") ||
+		  (cmd == "PWLOWER") || (cmd == "PWUPPER") || (cmd == "PATTERN") ) )
+	{
+		DriverLock lock;
+
+		if(cmd == "MODE")
+		{
+			if(args[0] == "WINDOW")
+				g_triggerMode = TRIGGER_WINDOW;
+			else if(args[0] == "RUNT")
+				g_triggerMode = TRIGGER_RUNT;
+			else if(args[0] == "PULSE")
+				g_triggerMode = TRIGGER_PULSE;
+			else if( (args[0] == "PATTERN") && (g_numDigitalPods > 0) )
+				g_triggerMode = TRIGGER_PATTERN;
+			else
+			{
+				LogError("Unsupported trigger mode %s\n", args[0].c_str());
+				return true;
+			}
+		}
+		else if(cmd == "LOWER")
+			g_triggerLowerVoltage = stof(args[0]);
+		else if(cmd == "WINDOW")
+		{
+			if(args[0] == "ENTER")
+				g_windowDirection = PICO_ENTER;
+			else if(args[0] == "EXIT")
+				g_windowDirection = PICO_EXIT;
+			else if(args[0] == "ANY")
+				g_windowDirection = PICO_ENTER_OR_EXIT;
+			else if(args[0] == "INSIDE")
+				g_windowDirection = PICO_INSIDE;
+			else if(args[0] == "OUTSIDE")
+				g_windowDirection = PICO_OUTSIDE;
+			else
+			{
+				LogError("Unrecognized window condition %s\n", args[0].c_str());
+				return true;
+			}
+		}
+		else if(cmd == "RUNT")
+		{
+			if(args[0] == "POSITIVE")
+				g_runtDirection = PICO_POSITIVE_RUNT;
+			else if(args[0] == "NEGATIVE")
+				g_runtDirection = PICO_NEGATIVE_RUNT;
+			else
+			{
+				LogError("Unrecognized runt polarity %s\n", args[0].c_str());
+				return true;
+			}
+		}
+		else if(cmd == "PWTYPE")
+		{
+			if(args[0] == "LESS")
+				g_pulseWidthType = PICO_PW_TYPE_LESS_THAN;
+			else if(args[0] == "GREATER")
+				g_pulseWidthType = PICO_PW_TYPE_GREATER_THAN;
+			else if(args[0] == "INSIDE")
+				g_pulseWidthType = PICO_PW_TYPE_IN_RANGE;
+			else if(args[0] == "OUTSIDE")
+				g_pulseWidthType = PICO_PW_TYPE_OUT_OF_RANGE;
+			else
+			{
+				LogError("Unrecognized pulse width type %s\n", args[0].c_str());
+				return true;
+			}
+		}
+		else if(cmd == "PWLOWER")
+			g_pulseWidthLower = max(stoll(args[0]), 0LL);
+		else if(cmd == "PWUPPER")
+			g_pulseWidthUpper = max(stoll(args[0]), 0LL);
+		else if(cmd == "PATTERN")
+		{
+			string pattern;
+			if(!ParseTriggerPattern(args[0], pattern))
+			{
+				LogError("Invalid trigger pattern %s\n", args[0].c_str());
+				return true;
+			}
+			g_triggerPattern = pattern;
+		}
+
+		UpdateTrigger();
+	}
+
 	else if(BridgeSCPIServer::OnCommand(line, subject, cmd, args))
 		return true;
 
 	else if( (cmd == "BITS") && (args.size() == 1) )
 	{
-		lock_guard<mutex> lock(g_mutex);
-		int bits = stoi(args[0]);
-		switch(g_pico_type)
+		//Named profiles pick the fastest or most precise mode the scope has
+		int bits;
+		vector<int> resolutions = GetADCResolutions();
+		if(args[0] == "FAST")
+			bits = resolutions.front();
+		else if(args[0] == "PRECISE")
+			bits = resolutions.back();
+		else
+			bits = stoi(args[0]);
+
+		//Hold back trigger updates and the re-arm until the timebase is valid at the new resolution, then re-arm
+		//once. If a SETUP:BEGIN batch is already open, SETUP:COMMIT does it.
+		bool ownBatch;
 		{
-			case PICO2000A:
-				g_adcBits = 8;
-				return false;
-				break;
-			case PICO3000A:
-				g_adcBits = 8;
-				return false;
-				break;
-			case PICO4000A:
-				if(g_model.find("4444") != string::npos)
-				{
-					ps4000aStop(g_hScope);
+			lock_guard<mutex> lock(g_mutex);
+			ownBatch = !g_setupBatch;
+			g_setupBatch = true;
+		}
 
-					//Changing the ADC resolution necessitates reallocation of the buffers
-					//due to different memory usage.
-					g_memDepthChanged = true;
+		bool ok = SetADCResolution(bits);
 
-					switch(bits)
-					{
-						case 12:
-							g_adcBits = bits;
-							ps4000aSetDeviceResolution(g_hScope, PS4000A_DR_12BIT);
-							break;
+		//Available rates and depths depend on resolution
+		if(ok)
+			RevalidateTimebase();
 
-						case 14:
-							g_adcBits = bits;
-							ps4000aSetDeviceResolution(g_hScope, PS4000A_DR_14BIT);
-							break;
+		if(ownBatch)
+		{
+			DriverLock lock;
+			CommitSetup();
+		}
+		return ok;
+	}
 
-						default:
-							LogError("User requested invalid resolution (%d bits)\n", bits);
-					}
+	else if( (cmd == "SEGMENTS") && (args.size() == 1) )
+	{
+		DriverLock lock;
 
-					if(g_triggerArmed)
-						StartCapture(false);
-					//update all active channels
-					for(size_t i=0; i<g_numChannels; i++)
-					{
-						if(g_channelOn[i])
-							UpdateChannel(i);
-					}
-				}
-				else
-				{
-					g_adcBits = 12;
-					return false;
-				}
-				break;
-			case PICO5000A:
-				ps5000aStop(g_hScope);
+		size_t oldSegments = g_numSegments;
+		g_numSegments = max(stoi(args[0]), 1);
 
-				//Changing the ADC resolution necessitates reallocation of the buffers
-				//due to different memory usage.
-				g_memDepthChanged = true;
+		//Segmentation can only be changed while the scope is stopped
+		Stop();
+		if(!UpdateSegments())
+		{
+			g_numSegments = oldSegments;
+			UpdateSegments();
+		}
 
-				switch(bits)
-				{
-					case 8:
-						g_adcBits = bits;
-						ps5000aSetDeviceResolution(g_hScope, PS5000A_DR_8BIT);
-						break;
+		if(g_triggerArmed)
+			StartCapture(false);
+	}
 
-					case 12:
-						g_adcBits = bits;
-						ps5000aSetDeviceResolution(g_hScope, PS5000A_DR_12BIT);
-						break;
+	else if( (cmd == "MODE") && (args.size() == 1) )
+	{
+		DriverLock lock;
 
-					case 14:
-						g_adcBits = bits;
-						ps5000aSetDeviceResolution(g_hScope, PS5000A_DR_14BIT);
-						break;
+		if(args[0] == "STREAMING")
+			g_streamingMode = true;
+		else if(args[0] == "BLOCK")
+			g_streamingMode = false;
+		else
+		{
+			LogError("Unrecognized acquisition mode %s\n", args[0].c_str());
+			return false;
+		}
 
-					case 15:
-						g_adcBits = bits;
-						ps5000aSetDeviceResolution(g_hScope, PS5000A_DR_15BIT);
-						break;
+		//Restart in the new mode
+		Stop();
+		if(g_triggerArmed)
+			StartCapture(false);
+	}
 
-					case 16:
-						g_adcBits = bits;
-						ps5000aSetDeviceResolution(g_hScope, PS5000A_DR_16BIT);
-						break;
+	else if( (cmd == "PIPELINE") && (args.size() == 1) )
+	{
+		//Waveform thread picks up the new depth before the next capture
+		lock_guard<mutex> lock(g_mutex);
+		g_pipelineDepth = min(max(stoi(args[0]), 1), 8);
+	}
 
-					default:
-						LogError("User requested invalid resolution (%d bits)\n", bits);
-				}
+	else if( (cmd == "ENVELOPE") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+		g_envelopeColumns = max(stoi(args[0]), 0);
+	}
 
-				if(g_triggerArmed)
-					StartCapture(false);
-				//update all active channels
-				for(size_t i=0; i<g_numChannels; i++)
-				{
-					if(g_channelOn[i])
-						UpdateChannel(i);
-				}
-				break;
-			case PICO6000A:
-				ps6000aStop(g_hScope);
+	else if( (subject == "FETCH") && (cmd == "REST") )
+		RequestRestFetch();
 
-				//Even though we didn't actually change memory, apparently calling ps6000aSetDeviceResolution
-				//will invalidate the existing buffers and make ps6000aGetValues() fail with PICO_BUFFERS_NOT_SET.
-				g_memDepthChanged = true;
+	//Recording runs in its own thread, none of this needs the driver
+	else if( (subject == "RECORD") && (cmd == "BEGIN") && (args.size() == 1) )
+	{
+		uint64_t size;
+		{
+			lock_guard<mutex> lock(g_mutex);
+			size = g_recordSize;
+		}
+		if(!StartRecording(args[0], size))
+			return false;
+	}
 
-				switch(bits)
-				{
-					case 8:
-						g_adcBits = bits;
-						ps6000aSetDeviceResolution(g_hScope, PICO_DR_8BIT);
-						break;
+	else if( (subject == "RECORD") && (cmd == "END") )
+		StopRecording();
 
-					case 10:
-						g_adcBits = bits;
-						ps6000aSetDeviceResolution(g_hScope, PICO_DR_10BIT);
-						break;
+	else if( (subject == "RECORD") && (cmd == "REPLAY") && (args.size() == 2) )
+	{
+		uint64_t first = stoull(args[0]);
+		uint64_t last = stoull(args[1]);
+		if(last < first)
+		{
+			LogError("Replay range %" PRIu64 "-%" PRIu64 " is empty\n", first, last);
+			return false;
+		}
+		RequestReplay(first, last);
+	}
 
-					case 12:
-						g_adcBits = bits;
-						ps6000aSetDeviceResolution(g_hScope, PICO_DR_12BIT);
-						break;
+	else if( (subject == "RECORD") && (cmd == "SIZE") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+		g_recordSize = static_cast<uint64_t>(max(stoll(args[0]), 1LL)) << 20;
+	}
 
-					default:
-						LogError("User requested invalid resolution (%d bits)\n", bits);
-				}
+	else if(cmd == "FETCH")
+		RequestFullFetch();
 
-				if(g_triggerArmed)
-					StartCapture(false);
-				//update all active channels
-				for(size_t i=0; i<g_numChannels; i++)
-				{
-					if(g_channelOn[i])
-						UpdateChannel(i);
-				}
-				break;
-			case PICOPSOSPA:
-				psospaStop(g_hScope);
-				g_memDepthChanged = true;
+	else if( (subject == "MASK") && (cmd == "RESET") )
+	{
+		g_maskPassCount = 0;
+		g_maskFailCount = 0;
+	}
 
-				switch(bits)
-				{
-					case 8:
-						g_adcBits = bits;
-						psospaSetDeviceResolution(g_hScope, PICO_DR_8BIT);
-						break;
+	//The mask is replaced rather than modified, the waveform thread may still be testing against the old one
+	else if( (subject == "MASK") && (cmd == "CLEAR") )
+	{
+		lock_guard<mutex> lock(g_mutex);
+		g_mask = make_shared<MaskSet>();
+	}
 
-					case 10:
-						g_adcBits = bits;
-						psospaSetDeviceResolution(g_hScope, PICO_DR_10BIT);
-						break;
+	else if( (subject == "MASK") && (cmd == "SET") && (args.size() == 5) )
+	{
+		size_t chan;
+		if(!GetChannelID(args[0], chan) || (chan >= g_numChannels) )
+		{
+			LogError("Mask channel %s is not an analog channel\n", args[0].c_str());
+			return false;
+		}
+		size_t first = stoull(args[1]);
+		size_t last = stoull(args[2]);
+		if(last < first)
+		{
+			LogError("Mask region %zu-%zu is empty\n", first, last);
+			return false;
+		}
 
-					default:
-						LogError("User requested invalid resolution (%d bits)\n", bits);
-				}
+		//Nothing past the end of the memory can ever be tested
+		lock_guard<mutex> lock(g_mutex);
+		if(first >= g_memDepth)
+			return true;
+		last = min(last, g_memDepth - 1);
+		if(g_mask.use_count() > 1)
+			g_mask = make_shared<MaskSet>(*g_mask);
+		SetMaskRegion((*g_mask)[chan], first, last, stoi(args[3]), stoi(args[4]));
+	}
 
-				if(g_triggerArmed)
-					StartCapture(false);
-				//update all active channels
-				for(size_t i=0; i<g_numChannels; i++)
-				{
-					if(g_channelOn[i])
-						UpdateChannel(i);
-				}
-				break;
+	else if( (cmd == "MASK") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		if(args[0] == "ON")
+			g_maskEnabled = true;
+		else if(args[0] == "OFF")
+			g_maskEnabled = false;
+		else
+		{
+			LogError("Unrecognized mask mode %s\n", args[0].c_str());
+			return false;
+		}
+	}
+
+	//Takes effect at the next download
+	else if( (subject == "AVERAGE") && (cmd == "VARIANCE") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+		g_averageVariance = (stoi(args[0]) != 0);
+	}
+
+	else if( (cmd == "AVERAGE") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+		g_averageCount = min(max(stoi(args[0]), 1), 65535);
+	}
+
+	else if( (subject == "ROI") && (cmd == "FIRST") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+		g_roiStart = max(stoll(args[0]), 0LL);
+	}
+
+	else if( (subject == "ROI") && (cmd == "LENGTH") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+		g_roiLength = max(stoll(args[0]), 0LL);
+	}
+
+	else if( (subject == "PERF") && (cmd == "RESET") )
+		PerfReset();
+
+	//Picked up by the sender before the next waveform
+	else if( (subject == "ACK") && (cmd == "WINDOW") && (args.size() == 1) )
+		g_ackWindowWaveforms = max(stoi(args[0]), 0);
+
+	else if( (subject == "ACK") && (cmd == "BYTES") && (args.size() == 1) )
+		g_ackWindowBytes = max(stoll(args[0]), 0LL);
+
+	else if( (subject == "SETUP") && (cmd == "BEGIN") )
+	{
+		lock_guard<mutex> lock(g_mutex);
+		g_setupBatch = true;
+	}
+
+	else if( (subject == "SETUP") && (cmd == "COMMIT") )
+	{
+		DriverLock lock;
+		CommitSetup();
+	}
+
+	else if( (cmd == "COMPRESS") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		if(args[0] == "NONE")
+			g_compressionMode = COMPRESS_NONE;
+		else if(args[0] == "RICE")
+		{
+			g_compressionMode = COMPRESS_RICE;
+			StartCompressionWorkers();
+		}
+		else
+		{
+			LogError("Unrecognized compression mode %s\n", args[0].c_str());
+			return false;
+		}
+	}
+
+	else if( (cmd == "TRANSPORT") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		if(args[0] == "TCP")
+			g_transport = TRANSPORT_TCP;
+		else if(args[0] == "SHM")
+		{
+#ifdef _WIN32
+			LogError("Shared memory transport is not supported on Windows\n");
+			return false;
+#else
+			g_transport = TRANSPORT_SHM;
+#endif
+		}
+		else
+		{
+			LogError("Unrecognized transport %s\n", args[0].c_str());
+			return false;
+		}
+	}
+
+	else if( (cmd == "PROTOCOL") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		if( (args[0] == "1") || (args[0] == "2") )
+			g_protocolVersion = stoi(args[0]);
+		else
+		{
+			LogError("Unsupported data plane protocol version %s\n", args[0].c_str());
+			return false;
+		}
+	}
+
+	else if( (cmd == "FORMAT") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		if(args[0] == "INT16")
+			g_wireFormat = FORMAT_INT16;
+		else if(args[0] == "PACKED")
+			g_wireFormat = FORMAT_PACKED;
+		else
+		{
+			LogError("Unrecognized sample format %s\n", args[0].c_str());
+			return false;
+		}
+	}
+
+	else if( (cmd == "DOWNSAMPLE") && (args.size() == 1) )
+	{
+		//Takes effect at the next arm
+		lock_guard<mutex> lock(g_mutex);
+		g_downsampleRatio = max(stoi(args[0]), 1);
+	}
+
+	else if( (cmd == "DOWNSAMPLEMODE") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		if(args[0] == "NONE")
+			g_downsampleMode = DOWNSAMPLE_NONE;
+		else if(args[0] == "DECIMATE")
+			g_downsampleMode = DOWNSAMPLE_DECIMATE;
+		else if(args[0] == "AVERAGE")
+			g_downsampleMode = DOWNSAMPLE_AVERAGE;
+		else if(args[0] == "AGGREGATE")
+			g_downsampleMode = DOWNSAMPLE_AGGREGATE;
+		else
+		{
+			LogError("Unrecognized downsampling mode %s\n", args[0].c_str());
+			return false;
 		}
 	}
 
@@ -1421,7 +1946,7 @@ bool PicoSCPIServer::OnCommand(
 			channelId = min(static_cast<size_t>(subject[0] - 'A'), g_numChannels);
 			//channelIsDigital = false;
 		}
-		lock_guard<mutex> lock(g_mutex);
+		DriverLock lock;
 
 		int freq_mhz = stoi(args[0]);
 		SetChannelBandwidthLimiter(channelId, freq_mhz);
@@ -1476,6 +2001,7 @@ void PicoSCPIServer::SetChannelBandwidthLimiter(size_t chan, unsigned int limit_
 			else
 				g_bandwidth_5000a[chan] = PS5000A_BW_FULL;
 			break;
+		case PICOSIM:
 		case PICO6000A:
 			if(limit_mhz == 20)
 				g_bandwidth[chan] = PICO_BW_20MHZ;
@@ -1529,7 +2055,7 @@ void PicoSCPIServer::ReconfigAWG()
 			if(g_awgPS2000AWaveType == PS2000A_SQUARE || g_awgPS2000AWaveType == PS2000A_MAX_WAVE_TYPES)
 			{
 				uint32_t delta= 0;
-				status = ps2000aSigGenFrequencyToPhase(g_hScope, g_awgFreq, PS2000A_SINGLE, g_awgBufferSize, &delta);
+				status = ps2000aSigGenFrequencyToPhase(g_hScope, g_awgFreq, PS2000A_SINGLE, g_arbitraryLength, &delta);
 				if(status != PICO_OK)
 					LogError("ps2000aSigGenFrequencyToPhase failed, code 0x%x\n", status);
 				status =  ps2000aSetSigGenArbitrary(
@@ -1541,7 +2067,7 @@ void PicoSCPIServer::ReconfigAWG()
 							  0,
 							  0,
 							  g_arbitraryWaveform,
-							  g_awgBufferSize,
+							  g_arbitraryLength,
 							  PS2000A_UP,          // sweepType
 							  PS2000A_ES_OFF,      // operation
 							  PS2000A_SINGLE,      // indexMode
@@ -1582,7 +2108,7 @@ void PicoSCPIServer::ReconfigAWG()
 			if(g_awgPS3000AWaveType == PS3000A_SQUARE || g_awgPS3000AWaveType == PS3000A_MAX_WAVE_TYPES)
 			{
 				uint32_t delta= 0;
-				status = ps3000aSigGenFrequencyToPhase(g_hScope, g_awgFreq, PS3000A_SINGLE, g_awgBufferSize, &delta);
+				status = ps3000aSigGenFrequencyToPhase(g_hScope, g_awgFreq, PS3000A_SINGLE, g_arbitraryLength, &delta);
 				if(status != PICO_OK)
 					LogError("ps3000aSigGenFrequencyToPhase failed, code 0x%x\n", status);
 				status =  ps3000aSetSigGenArbitrary(
@@ -1594,7 +2120,7 @@ void PicoSCPIServer::ReconfigAWG()
 							  0,
 							  0,
 							  g_arbitraryWaveform,
-							  g_awgBufferSize,
+							  g_arbitraryLength,
 							  PS3000A_UP,          // sweepType
 							  PS3000A_ES_OFF,      // operation
 							  PS3000A_SINGLE,      // indexMode
@@ -1635,7 +2161,7 @@ void PicoSCPIServer::ReconfigAWG()
 			if(g_awgPS4000AWaveType == PS4000A_SQUARE || g_awgPS4000AWaveType == PS4000A_MAX_WAVE_TYPES)
 			{
 				uint32_t delta= 0;
-				status = ps4000aSigGenFrequencyToPhase(g_hScope, g_awgFreq, PS4000A_SINGLE, g_awgBufferSize, &delta);
+				status = ps4000aSigGenFrequencyToPhase(g_hScope, g_awgFreq, PS4000A_SINGLE, g_arbitraryLength, &delta);
 				if(status != PICO_OK)
 					LogError("ps3000aSigGenFrequencyToPhase failed, code 0x%x\n", status);
 				status =  ps4000aSetSigGenArbitrary(
@@ -1647,7 +2173,7 @@ void PicoSCPIServer::ReconfigAWG()
 							  0,
 							  0,
 							  g_arbitraryWaveform,
-							  g_awgBufferSize,
+							  g_arbitraryLength,
 							  PS4000A_UP,          // sweepType
 							  PS4000A_ES_OFF,      // operation
 							  PS4000A_SINGLE,      // indexMode
@@ -1684,98 +2210,600 @@ void PicoSCPIServer::ReconfigAWG()
 				StartCapture(false);
 			break;
 		case PICO5000A:
-			Stop(); // Need to stop acquisition when setting the AWG to avoid "PICO_BUSY" errors
+			Stop(); // Need to stop acquisition when setting the AWG to avoid "PICO_BUSY" errors
+			if(g_awgPS5000AWaveType == PS5000A_SQUARE || g_awgPS5000AWaveType == PS5000A_MAX_WAVE_TYPES)
+			{
+				uint32_t delta= 0;
+				status = ps5000aSigGenFrequencyToPhase(g_hScope, g_awgFreq, PS5000A_SINGLE, g_arbitraryLength, &delta);
+				if(status != PICO_OK)
+					LogError("ps5000aSigGenFrequencyToPhase failed, code 0x%x\n", status);
+				status =  ps5000aSetSigGenArbitrary(
+							  g_hScope,
+							  tempOffset*1e6,
+							  tempRange*1e6*2,
+							  delta,
+							  delta,
+							  0,
+							  0,
+							  g_arbitraryWaveform,
+							  g_arbitraryLength,
+							  PS5000A_UP,          // sweepType
+							  PS5000A_ES_OFF,      // operation
+							  PS5000A_SINGLE,      // indexMode
+							  PS3000A_SHOT_SWEEP_TRIGGER_CONTINUOUS_RUN,
+							  0,
+							  PS5000A_SIGGEN_RISING,
+							  PS5000A_SIGGEN_NONE,
+							  0);
+				if(status != PICO_OK)
+					LogError("ps5000aSetSigGenArbitrary failed, code 0x%x\n", status);
+			}
+			else
+			{
+				status = ps5000aSetSigGenBuiltInV2(
+								  g_hScope,
+								  tempOffset*1e6,        //Offset Voltage in µV
+								  tempRange*1e6*2,       // Peak to Peak Range in µV
+								  g_awgPS5000AWaveType,
+								  freq,
+								  freq,
+								  inc,
+								  dwell,
+								  PS5000A_UP,
+								  g_awgPS5000AOperation,
+								  PS3000A_SHOT_SWEEP_TRIGGER_CONTINUOUS_RUN,  //run forever
+								  0,  //dont use sweeps
+								  PS5000A_SIGGEN_RISING,
+								  PS5000A_SIGGEN_NONE,
+								  0);                         // Tigger level (-32767 to 32767 -> -5 to 5 V)
+				if(PICO_OK != status)
+					LogError("ps5000aSetSigGenBuiltInV2 failed, code 0x%x\n", status);
+			}
+			if(g_triggerArmed)
+				StartCapture(false);
+			break;
+		case PICO6000A:
+			status = ps6000aSigGenRange(g_hScope, g_awgRange, g_awgOffset);
+			if(PICO_OK != status)
+				LogError("ps6000aSigGenRange failed, code 0x%x\n", status);
+			ApplyAWG();
+			break;
+		case PICOPSOSPA:
+			status = psospaSigGenRange(g_hScope, g_awgRange, g_awgOffset);
+			if(PICO_OK != status)
+				LogError("psospaSigGenRange failed, code 0x%x\n", status);
+			ApplyAWG();
+			break;
+		case PICOSIM:
+			//no function generator in the simulator
+			break;
+	}
+}
+
+/**
+	@brief Pushes the staged function generator settings to the hardware (6000E and PSOSPA only)
+
+	Those APIs set each property separately and only apply them here, so a change of one property only needs its own
+	call and this one.
+ */
+void PicoSCPIServer::ApplyAWG()
+{
+	double freq = g_awgFreq;
+	double inc = 0;
+	double dwell = 0;
+	uint32_t status = PICO_OK;
+
+	switch(g_pico_type)
+	{
+		case PICO6000A:
+			status = ps6000aSigGenApply(
+						 g_hScope,
+						 g_awgOn,
+						 false,		//sweep enable
+						 false,		//trigger enable
+						 true,		//automatic DDS sample frequency
+						 false,		//do not override clock and prescale
+						 &freq,
+						 &freq,
+						 &inc,
+						 &dwell);
+			if(PICO_OK != status)
+				LogError("ps6000aSigGenApply failed, code 0x%x\n", status);
+			break;
+		case PICOPSOSPA:
+			status = psospaSigGenApply(
+						 g_hScope,
+						 g_awgOn,
+						 0,		//sweep enable
+						 0,		//trigger enable
+						 &freq,
+						 &freq,
+						 &inc,
+						 &dwell);
+			if(PICO_OK != status)
+			{
+				LogError("psospaSigGenApply failed, code 0x%x\n", status);
+				LogError("psospaSigGenApply failed, freq %f\n", freq);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+/**
+	@brief Changes the function generator frequency without reloading the waveform or the other settings
+ */
+void PicoSCPIServer::UpdateAWGFrequency()
+{
+	double freq = g_awgFreq;
+	uint32_t delta = 0;
+	uint32_t status = PICO_OK;
+
+	//The 2000A-5000A APIs have no separate apply step, so while the output is off there's nothing to update.
+	//AWG:START pushes the whole configuration anyway.
+	switch(g_pico_type)
+	{
+		case PICO2000A:
+			if(!g_awgOn)
+				break;
+			Stop(); // Need to stop acquisition when setting the AWG to avoid "PICO_BUSY" errors
+			if(g_awgPS2000AWaveType == PS2000A_SQUARE || g_awgPS2000AWaveType == PS2000A_MAX_WAVE_TYPES)
+			{
+				status = ps2000aSigGenFrequencyToPhase(g_hScope, freq, PS2000A_SINGLE, g_arbitraryLength, &delta);
+				if(status != PICO_OK)
+					LogError("ps2000aSigGenFrequencyToPhase failed, code 0x%x\n", status);
+				status = ps2000aSetSigGenPropertiesArbitrary(
+							  g_hScope,
+							  delta,
+							  delta,
+							  0,
+							  0,
+							  PS2000A_UP,
+							  PS2000A_SHOT_SWEEP_TRIGGER_CONTINUOUS_RUN,
+							  0,
+							  PS2000A_SIGGEN_RISING,
+							  PS2000A_SIGGEN_NONE,
+							  0);
+				if(status != PICO_OK)
+					LogError("ps2000aSetSigGenPropertiesArbitrary failed, code 0x%x\n", status);
+			}
+			else
+			{
+				status = ps2000aSetSigGenPropertiesBuiltIn(
+							  g_hScope,
+							  freq,
+							  freq,
+							  0,
+							  0,
+							  PS2000A_UP,
+							  PS2000A_SHOT_SWEEP_TRIGGER_CONTINUOUS_RUN,
+							  0,
+							  PS2000A_SIGGEN_RISING,
+							  PS2000A_SIGGEN_NONE,
+							  0);
+				if(status != PICO_OK)
+					LogError("ps2000aSetSigGenPropertiesBuiltIn failed, code 0x%x\n", status);
+			}
+			if(g_triggerArmed)
+				StartCapture(false);
+			break;
+		case PICO3000A:
+			if(!g_awgOn)
+				break;
+			Stop();
+			if(g_awgPS3000AWaveType == PS3000A_SQUARE || g_awgPS3000AWaveType == PS3000A_MAX_WAVE_TYPES)
+			{
+				status = ps3000aSigGenFrequencyToPhase(g_hScope, freq, PS3000A_SINGLE, g_arbitraryLength, &delta);
+				if(status != PICO_OK)
+					LogError("ps3000aSigGenFrequencyToPhase failed, code 0x%x\n", status);
+				status = ps3000aSetSigGenPropertiesArbitrary(
+							  g_hScope,
+							  delta,
+							  delta,
+							  0,
+							  0,
+							  PS3000A_UP,
+							  PS3000A_SHOT_SWEEP_TRIGGER_CONTINUOUS_RUN,
+							  0,
+							  PS3000A_SIGGEN_RISING,
+							  PS3000A_SIGGEN_NONE,
+							  0);
+				if(status != PICO_OK)
+					LogError("ps3000aSetSigGenPropertiesArbitrary failed, code 0x%x\n", status);
+			}
+			else
+			{
+				status = ps3000aSetSigGenPropertiesBuiltIn(
+							  g_hScope,
+							  freq,
+							  freq,
+							  0,
+							  0,
+							  PS3000A_UP,
+							  PS3000A_SHOT_SWEEP_TRIGGER_CONTINUOUS_RUN,
+							  0,
+							  PS3000A_SIGGEN_RISING,
+							  PS3000A_SIGGEN_NONE,
+							  0);
+				if(status != PICO_OK)
+					LogError("ps3000aSetSigGenPropertiesBuiltIn failed, code 0x%x\n", status);
+			}
+			if(g_triggerArmed)
+				StartCapture(false);
+			break;
+		case PICO4000A:
+			if(!g_awgOn)
+				break;
+			Stop();
+			if(g_awgPS4000AWaveType == PS4000A_SQUARE || g_awgPS4000AWaveType == PS4000A_MAX_WAVE_TYPES)
+			{
+				status = ps4000aSigGenFrequencyToPhase(g_hScope, freq, PS4000A_SINGLE, g_arbitraryLength, &delta);
+				if(status != PICO_OK)
+					LogError("ps4000aSigGenFrequencyToPhase failed, code 0x%x\n", status);
+				status = ps4000aSetSigGenPropertiesArbitrary(
+							  g_hScope,
+							  delta,
+							  delta,
+							  0,
+							  0,
+							  PS4000A_UP,
+							  PS3000A_SHOT_SWEEP_TRIGGER_CONTINUOUS_RUN,
+							  0,
+							  PS4000A_SIGGEN_RISING,
+							  PS4000A_SIGGEN_NONE,
+							  0);
+				if(status != PICO_OK)
+					LogError("ps4000aSetSigGenPropertiesArbitrary failed, code 0x%x\n", status);
+			}
+			else
+			{
+				status = ps4000aSetSigGenPropertiesBuiltIn(
+							  g_hScope,
+							  freq,
+							  freq,
+							  0,
+							  0,
+							  PS4000A_UP,
+							  PS3000A_SHOT_SWEEP_TRIGGER_CONTINUOUS_RUN,
+							  0,
+							  PS4000A_SIGGEN_RISING,
+							  PS4000A_SIGGEN_NONE,
+							  0);
+				if(status != PICO_OK)
+					LogError("ps4000aSetSigGenPropertiesBuiltIn failed, code 0x%x\n", status);
+			}
+			if(g_triggerArmed)
+				StartCapture(false);
+			break;
+		case PICO5000A:
+			if(!g_awgOn)
+				break;
+			Stop();
 			if(g_awgPS5000AWaveType == PS5000A_SQUARE || g_awgPS5000AWaveType == PS5000A_MAX_WAVE_TYPES)
 			{
-				uint32_t delta= 0;
-				status = ps5000aSigGenFrequencyToPhase(g_hScope, g_awgFreq, PS5000A_SINGLE, g_awgBufferSize, &delta);
+				status = ps5000aSigGenFrequencyToPhase(g_hScope, freq, PS5000A_SINGLE, g_arbitraryLength, &delta);
 				if(status != PICO_OK)
 					LogError("ps5000aSigGenFrequencyToPhase failed, code 0x%x\n", status);
-				status =  ps5000aSetSigGenArbitrary(
+				status = ps5000aSetSigGenPropertiesArbitrary(
 							  g_hScope,
-							  tempOffset*1e6,
-							  tempRange*1e6*2,
 							  delta,
 							  delta,
 							  0,
 							  0,
-							  g_arbitraryWaveform,
-							  g_awgBufferSize,
-							  PS5000A_UP,          // sweepType
-							  PS5000A_ES_OFF,      // operation
-							  PS5000A_SINGLE,      // indexMode
+							  PS5000A_UP,
 							  PS3000A_SHOT_SWEEP_TRIGGER_CONTINUOUS_RUN,
 							  0,
 							  PS5000A_SIGGEN_RISING,
 							  PS5000A_SIGGEN_NONE,
 							  0);
 				if(status != PICO_OK)
-					LogError("ps5000aSetSigGenArbitrary failed, code 0x%x\n", status);
+					LogError("ps5000aSetSigGenPropertiesArbitrary failed, code 0x%x\n", status);
 			}
 			else
 			{
-				status = ps5000aSetSigGenBuiltInV2(
-								  g_hScope,
-								  tempOffset*1e6,        //Offset Voltage in µV
-								  tempRange*1e6*2,       // Peak to Peak Range in µV
-								  g_awgPS5000AWaveType,
-								  freq,
-								  freq,
-								  inc,
-								  dwell,
-								  PS5000A_UP,
-								  g_awgPS5000AOperation,
-								  PS3000A_SHOT_SWEEP_TRIGGER_CONTINUOUS_RUN,  //run forever
-								  0,  //dont use sweeps
-								  PS5000A_SIGGEN_RISING,
-								  PS5000A_SIGGEN_NONE,
-								  0);                         // Tigger level (-32767 to 32767 -> -5 to 5 V)
-				if(PICO_OK != status)
-					LogError("ps5000aSetSigGenBuiltInV2 failed, code 0x%x\n", status);
+				status = ps5000aSetSigGenPropertiesBuiltIn(
+							  g_hScope,
+							  freq,
+							  freq,
+							  0,
+							  0,
+							  PS5000A_UP,
+							  PS3000A_SHOT_SWEEP_TRIGGER_CONTINUOUS_RUN,
+							  0,
+							  PS5000A_SIGGEN_RISING,
+							  PS5000A_SIGGEN_NONE,
+							  0);
+				if(status != PICO_OK)
+					LogError("ps5000aSetSigGenPropertiesBuiltIn failed, code 0x%x\n", status);
 			}
 			if(g_triggerArmed)
 				StartCapture(false);
 			break;
 		case PICO6000A:
-			status = ps6000aSigGenRange(g_hScope, g_awgRange, g_awgOffset);
-			if(PICO_OK != status)
-				LogError("ps6000aSigGenRange failed, code 0x%x\n", status);
+			status = ps6000aSigGenFrequency(g_hScope, freq);
+			if(status != PICO_OK)
+				LogError("ps6000aSigGenFrequency failed, code 0x%x (freq=%f)\n", status, freq);
+			ApplyAWG();
+			break;
+		case PICOPSOSPA:
+			status = psospaSigGenFrequency(g_hScope, freq);
+			if(status != PICO_OK)
+				LogError("psospaSigGenFrequency failed, code 0x%x (freq=%f)\n", status, freq);
+			ApplyAWG();
+			break;
+		case PICOSIM:
+			//no function generator in the simulator
+			break;
+	}
+}
 
-			status = ps6000aSigGenApply(
-						 g_hScope,
-						 g_awgOn,
-						 false,		//sweep enable
-						 false,		//trigger enable
-						 true,		//automatic DDS sample frequency
-						 false,		//do not override clock and prescale
-						 &freq,
-						 &freq,
-						 &inc,
-						 &dwell);
-			if(PICO_OK != status)
-				LogError("ps6000aSigGenApply failed, code 0x%x\n", status);
+/**
+	@brief Returns the ADC resolutions (in bits) supported by the connected scope, lowest first
+ */
+vector<int> PicoSCPIServer::GetADCResolutions()
+{
+	switch(g_pico_type)
+	{
+		case PICO4000A:
+			if(g_model.find("4444") != string::npos)
+				return {12, 14};
+			return {12};
+
+		case PICO5000A:
+			return {8, 12, 14, 15, 16};
+
+		case PICO6000A:
+		case PICOSIM:
+			return {8, 10, 12};
+
+		case PICOPSOSPA:
+			return {8, 10};
+
+		case PICO2000A:
+		case PICO3000A:
+		default:
+			return {8};
+	}
+}
+
+/**
+	@brief Changes the ADC resolution, restarting the capture if it was running
+
+	@return True if the scope is now running at the requested resolution
+ */
+bool PicoSCPIServer::SetADCResolution(int bits)
+{
+	//Reject anything the scope can't do before stopping it
+	auto resolutions = GetADCResolutions();
+	if(find(resolutions.begin(), resolutions.end(), bits) == resolutions.end())
+	{
+		LogError("User requested invalid resolution (%d bits)\n", bits);
+		return false;
+	}
+
+	DriverLock lock;
+	switch(g_pico_type)
+	{
+		case PICO2000A:
+			g_adcBits = 8;
+			return false;
+			break;
+		case PICO3000A:
+			g_adcBits = 8;
+			return false;
+			break;
+		case PICO4000A:
+			if(g_model.find("4444") != string::npos)
+			{
+				ps4000aStop(g_hScope);
+
+				//Changing the ADC resolution necessitates reallocation of the buffers
+				//due to different memory usage.
+				g_memDepthChanged = true;
+
+				switch(bits)
+				{
+					case 12:
+						g_adcBits = bits;
+						ps4000aSetDeviceResolution(g_hScope, PS4000A_DR_12BIT);
+						break;
+
+					case 14:
+						g_adcBits = bits;
+						ps4000aSetDeviceResolution(g_hScope, PS4000A_DR_14BIT);
+						break;
+
+					default:
+						LogError("User requested invalid resolution (%d bits)\n", bits);
+				}
+
+				//update all active channels
+				for(size_t i=0; i<g_numChannels; i++)
+				{
+					if(g_channelOn[i])
+						UpdateChannel(i);
+				}
+			}
+			else
+			{
+				g_adcBits = 12;
+				return false;
+			}
+			break;
+		case PICO5000A:
+			ps5000aStop(g_hScope);
+
+			//Changing the ADC resolution necessitates reallocation of the buffers
+			//due to different memory usage.
+			g_memDepthChanged = true;
+
+			switch(bits)
+			{
+				case 8:
+					g_adcBits = bits;
+					ps5000aSetDeviceResolution(g_hScope, PS5000A_DR_8BIT);
+					break;
+
+				case 12:
+					g_adcBits = bits;
+					ps5000aSetDeviceResolution(g_hScope, PS5000A_DR_12BIT);
+					break;
+
+				case 14:
+					g_adcBits = bits;
+					ps5000aSetDeviceResolution(g_hScope, PS5000A_DR_14BIT);
+					break;
+
+				case 15:
+					g_adcBits = bits;
+					ps5000aSetDeviceResolution(g_hScope, PS5000A_DR_15BIT);
+					break;
+
+				case 16:
+					g_adcBits = bits;
+					ps5000aSetDeviceResolution(g_hScope, PS5000A_DR_16BIT);
+					break;
+
+				default:
+					LogError("User requested invalid resolution (%d bits)\n", bits);
+			}
+
+			//update all active channels
+			for(size_t i=0; i<g_numChannels; i++)
+			{
+				if(g_channelOn[i])
+					UpdateChannel(i);
+			}
+			break;
+		case PICO6000A:
+			ps6000aStop(g_hScope);
+
+			//Even though we didn't actually change memory, apparently calling ps6000aSetDeviceResolution
+			//will invalidate the existing buffers and make ps6000aGetValues() fail with PICO_BUFFERS_NOT_SET.
+			g_memDepthChanged = true;
+
+			switch(bits)
+			{
+				case 8:
+					g_adcBits = bits;
+					ps6000aSetDeviceResolution(g_hScope, PICO_DR_8BIT);
+					break;
+
+				case 10:
+					g_adcBits = bits;
+					ps6000aSetDeviceResolution(g_hScope, PICO_DR_10BIT);
+					break;
+
+				case 12:
+					g_adcBits = bits;
+					ps6000aSetDeviceResolution(g_hScope, PICO_DR_12BIT);
+					break;
+
+				default:
+					LogError("User requested invalid resolution (%d bits)\n", bits);
+			}
+
+			//update all active channels
+			for(size_t i=0; i<g_numChannels; i++)
+			{
+				if(g_channelOn[i])
+					UpdateChannel(i);
+			}
 			break;
 		case PICOPSOSPA:
-			status = psospaSigGenRange(g_hScope, g_awgRange, g_awgOffset);
-			if(PICO_OK != status)
-				LogError("psospaSigGenRange failed, code 0x%x\n", status);
+			psospaStop(g_hScope);
+			g_memDepthChanged = true;
 
-			status = psospaSigGenApply(
-						 g_hScope,
-						 g_awgOn,
-						 0,		//sweep enable
-						 0,		//trigger enable
-						 &freq,
-						 &freq,
-						 &inc,
-						 &dwell);
-			if(PICO_OK != status)
+			switch(bits)
 			{
-				LogError("psospaSigGenApply failed, code 0x%x\n", status);
-				LogError("psospaSigGenApply failed, freq %f\n", freq);
+				case 8:
+					g_adcBits = bits;
+					psospaSetDeviceResolution(g_hScope, PICO_DR_8BIT);
+					break;
+
+				case 10:
+					g_adcBits = bits;
+					psospaSetDeviceResolution(g_hScope, PICO_DR_10BIT);
+					break;
+
+				default:
+					LogError("User requested invalid resolution (%d bits)\n", bits);
+			}
+
+			//update all active channels
+			for(size_t i=0; i<g_numChannels; i++)
+			{
+				if(g_channelOn[i])
+					UpdateChannel(i);
+			}
+			break;
+		case PICOSIM:
+			simStop(g_hScope);
+			g_memDepthChanged = true;
+
+			if(PICO_OK == simSetDeviceResolution(g_hScope, bits))
+				g_adcBits = bits;
+			else
+				LogError("User requested invalid resolution (%d bits)\n", bits);
+
+			//update all active channels
+			for(size_t i=0; i<g_numChannels; i++)
+			{
+				if(g_channelOn[i])
+					UpdateChannel(i);
 			}
 			break;
 	}
+
+	//The scope is stopped now. The caller re-arms once the timebase is valid again (see CommitSetup).
+	g_rearmPending = true;
+
+	return (g_adcBits == static_cast<size_t>(bits));
+}
+
+/**
+	@brief Moves the sample rate and memory depth to the nearest valid setting after a resolution change
+
+	Timebase numbering (and the fastest available rate and deepest memory) depend on resolution,
+	so the current timebase may now be something else or not exist at all.
+ */
+void PicoSCPIServer::RevalidateTimebase()
+{
+	size_t rate;
+	size_t depth;
+	{
+		lock_guard<mutex> lock(g_mutex);
+		rate = g_sampleRate;
+		depth = g_memDepth;
+	}
+
+	//Use the fastest rate that isn't above the old one
+	auto rates = GetSampleRates();
+	if(!rates.empty())
+	{
+		size_t best = 0;
+		size_t slowest = SIZE_MAX;
+		for(auto r : rates)
+		{
+			if( (r <= rate) && (r > best) )
+				best = r;
+			slowest = min(slowest, r);
+		}
+		if(best == 0)
+			best = slowest;
+		if(best != rate)
+			LogDebug("Sample rate %zu not available at this resolution, using %zu\n", rate, best);
+		SetSampleRate(best);
+	}
+
+	//Clamp memory depth
+	auto depths = GetSampleDepths();
+	if(!depths.empty() && (depth > depths.back()))
+	{
+		LogDebug("Memory depth %zu not available at this resolution, using %zu\n", depth, depths.back());
+		SetSampleDepth(depths.back());
+	}
 }
 
 bool PicoSCPIServer::GetChannelID(const std::string& subject, size_t& id_out)
@@ -1828,7 +2856,10 @@ BridgeSCPIServer::ChannelType PicoSCPIServer::GetChannelType(size_t channel)
 
 void PicoSCPIServer::AcquisitionStart(bool oneShot)
 {
-	lock_guard<mutex> lock(g_mutex);
+	DriverLock lock;
+
+	if(g_setupBatch)
+		CommitSetup();
 
 	if(g_triggerArmed)
 	{
@@ -1868,7 +2899,10 @@ void PicoSCPIServer::AcquisitionStart(bool oneShot)
 
 void PicoSCPIServer::AcquisitionForceTrigger()
 {
-	lock_guard<mutex> lock(g_mutex);
+	DriverLock lock;
+
+	if(g_setupBatch)
+		CommitSetup();
 
 	//Clear out any old trigger config
 	if(g_triggerArmed)
@@ -1885,17 +2919,18 @@ void PicoSCPIServer::AcquisitionStop()
 {
 	lock_guard<mutex> lock(g_mutex);
 
-	Stop();
-
 	//Convert any in-progress trigger to one shot.
 	//This ensures that if a waveform is halfway through being downloaded, we won't re-arm the trigger after it finishes.
+	//The waveform thread stops the scope before downloading, so there's no need to wait for it here.
+	if(!g_driverBusy)
+		Stop();
 	g_triggerOneShot = true;
 	g_triggerArmed = false;
 }
 
 void PicoSCPIServer::SetChannelEnabled(size_t chIndex, bool enabled)
 {
-	lock_guard<mutex> lock(g_mutex);
+	DriverLock lock;
 	uint32_t status = PICO_OK;
 
 	if(GetChannelType(chIndex) == CH_DIGITAL)
@@ -1953,6 +2988,9 @@ void PicoSCPIServer::SetChannelEnabled(size_t chIndex, bool enabled)
 					else
 						g_msoPodEnabled[podIndex] = true;
 					break;
+				case PICOSIM:
+					//no digital ports in the simulator
+					break;
 			}
 		}
 		else
@@ -1997,6 +3035,9 @@ void PicoSCPIServer::SetChannelEnabled(size_t chIndex, bool enabled)
 					else
 						g_msoPodEnabled[podIndex] = false;
 					break;
+				case PICOSIM:
+					//no digital ports in the simulator
+					break;
 			}
 		}
 	}
@@ -2014,7 +3055,7 @@ void PicoSCPIServer::SetChannelEnabled(size_t chIndex, bool enabled)
 
 void PicoSCPIServer::SetAnalogCoupling(size_t chIndex, const std::string& coupling)
 {
-	lock_guard<mutex> lock(g_mutex);
+	DriverLock lock;
 	int channelId = chIndex & 0xff;
 
 	if(coupling == "DC1M")
@@ -2029,7 +3070,7 @@ void PicoSCPIServer::SetAnalogCoupling(size_t chIndex, const std::string& coupli
 
 void PicoSCPIServer::SetAnalogRange(size_t chIndex, double range_V)
 {
-	lock_guard<mutex> lock(g_mutex);
+	DriverLock lock;
 
 	size_t channelId = chIndex & 0xff;
 	//range_V is peak-to-peak whereas the Pico modes are V-peak,
@@ -2277,6 +3318,7 @@ void PicoSCPIServer::SetAnalogRange(size_t chIndex, double range_V)
 				g_roundedRange[channelId] = 0.01;
 			}
 			break;
+		case PICOSIM:
 		case PICO6000A:
 			//6000E series can use intelligent probes.
 			//Model 6428E-D is 50 ohm only and has a limited range.
@@ -2439,7 +3481,7 @@ void PicoSCPIServer::SetAnalogRange(size_t chIndex, double range_V)
 
 void PicoSCPIServer::SetAnalogOffset(size_t chIndex, double offset_V)
 {
-	lock_guard<mutex> lock(g_mutex);
+	DriverLock lock;
 
 	int channelId = chIndex & 0xff;
 
@@ -2477,6 +3519,9 @@ void PicoSCPIServer::SetAnalogOffset(size_t chIndex, double offset_V)
 		case PICOPSOSPA:
 			psospaGetAnalogueOffsetLimits(g_hScope, -g_range_3000e[channelId], g_range_3000e[channelId], PICO_X1_PROBE_NV, g_coupling[channelId], &maxoff, &minoff);
 			break;
+		case PICOSIM:
+			simGetAnalogueOffsetLimits(g_hScope, g_roundedRange[channelId], &maxoff, &minoff);
+			break;
 	}
 	offset_V = min(maxoff, offset_V);
 	offset_V = max(minoff, offset_V);
@@ -2516,7 +3561,7 @@ void PicoSCPIServer::SetDigitalThreshold(size_t chIndex, double threshold_V)
 
 	LogTrace("Setting MSO pod %d lane %d threshold to %f (code %d)\n", channelId, laneId, threshold_V, code);
 
-	lock_guard<mutex> lock(g_mutex);
+	DriverLock lock;
 
 	//Update the pod if currently active
 	if(g_msoPodEnabled[channelId])
@@ -2529,7 +3574,7 @@ void PicoSCPIServer::SetDigitalHysteresis(size_t chIndex, double hysteresis)
 	if( (g_series != 6) )
 		return;
 
-	lock_guard<mutex> lock(g_mutex);
+	DriverLock lock;
 
 	int channelId = chIndex & 0xff;
 
@@ -2554,159 +3599,170 @@ void PicoSCPIServer::SetDigitalHysteresis(size_t chIndex, double hysteresis)
 
 void PicoSCPIServer::SetSampleRate(uint64_t rate_hz)
 {
-	lock_guard<mutex> lock(g_mutex);
+	DriverLock lock;
 	int timebase = 0;
 	//Convert sample rate to sample period
 	g_sampleInterval = 1e15 / rate_hz;
 	double period_ns = 1e9 / rate_hz;
 	double clkdiv = period_ns / 0.2;
 
-	switch(g_pico_type)
+	//Rates we reported in GetSampleRates() were found by probing, so we already know the exact timebase
+	auto& caps = GetCapabilities();
+	auto it = caps.timebases.find(rate_hz);
+	if(it != caps.timebases.end())
+		timebase = it->second;
+
+	//Otherwise fall back to the datasheet formulas
+	else
 	{
-		case PICO2000A:
-			if(g_model.find("2205MSO") != string::npos)
-			{
-				if(period_ns < 5)
-					timebase = 0;
-				else
-					timebase = round(100e6/rate_hz);
-			}
-			else if( g_model=="2206" || g_model=="2206A" || g_model=="2206B" || g_model=="2205AMSO" || g_model=="2405A" )
-			{
-				//!! 500 MS/s maximum sampling rate models
-				if(period_ns < 4)
-					timebase = 0;
-				else if(period_ns < 16)
-					timebase = round(log(5e8/rate_hz)/log(2));
-				else
-					timebase = round((625e5/rate_hz)+2);
-			}
-			else
-			{
-				//!! 1 GS/s maximum sampling rate models
-				if(period_ns < 2)
-					timebase = 0;
-				else if(period_ns < 8)
-					timebase = round(log(1e9/rate_hz)/log(2));
-				else
-					timebase = round((125e6/rate_hz)+2);
-			}
-			break;
-		case PICO3000A:
-			if( (g_model[1]=='2') and (g_model[4]=='A' or g_model[4]=='B') )
-			{
-				//!! A different implementation is needed for:
-				//!!   PicoScope 3000A and 3000B Series 2-Channel USB 2.0 Oscilloscopes
-				if(period_ns < 4)
-					timebase = 0;
-				else if(period_ns < 16)
-					timebase = round(log(5e8/rate_hz)/log(2));
-				else
-					timebase = round((625e5/rate_hz)+2);
-			}
-			if( (g_model.find("MSO") != string::npos) and (g_model[4]!='D') )
-			{
-				//!! And another one for:
-				//!!   PicoScope 3000 Series USB 2.0 MSOs
-				if(period_ns < 4)
-					timebase = 0;
-				else if(period_ns < 8)
-					timebase = round(log(5e8/rate_hz)/log(2));
-				else
-					timebase = round((125e6/rate_hz)+1);
-			}
-			else
-			{
-				//!! This part is applicable to the following devices:
-				//!!   PicoScope 3000A and 3000B Series 4-Channel USB 2.0 Oscilloscopes
-				//!!   PicoScope 3207A and 3207B USB 3.0 Oscilloscopes
-				//!!   PicoScope 3000D Series USB 3.0 Oscilloscopes and MSOs
-				if(period_ns < 2)
-					timebase = 0;
-				else if(period_ns < 8)
-					timebase = round(log(1e9/rate_hz)/log(2));
-				else
-					timebase = round((125e6/rate_hz)+2);
-			}
-			break;
-		case PICO4000A:
-			if(g_model.find("4444") != string::npos)
-			{
-				if(period_ns < 5)
-					timebase = 0;
-				else if(period_ns < 40)
-					timebase = round(log(4e8/rate_hz)/log(2));
+		switch(g_pico_type)
+		{
+			case PICO2000A:
+				if(g_model.find("2205MSO") != string::npos)
+				{
+					if(period_ns < 5)
+						timebase = 0;
+					else
+						timebase = round(100e6/rate_hz);
+				}
+				else if( g_model=="2206" || g_model=="2206A" || g_model=="2206B" || g_model=="2205AMSO" || g_model=="2405A" )
+				{
+					//!! 500 MS/s maximum sampling rate models
+					if(period_ns < 4)
+						timebase = 0;
+					else if(period_ns < 16)
+						timebase = round(log(5e8/rate_hz)/log(2));
+					else
+						timebase = round((625e5/rate_hz)+2);
+				}
 				else
-					timebase = round((50e6/rate_hz)+2);
-			}
-			else
-				timebase = trunc((80e6/rate_hz)-1);
-			break;
-		case PICO5000A:
-			switch(g_adcBits)
-			{
-				case 8:
 				{
+					//!! 1 GS/s maximum sampling rate models
 					if(period_ns < 2)
 						timebase = 0;
 					else if(period_ns < 8)
 						timebase = round(log(1e9/rate_hz)/log(2));
 					else
 						timebase = round((125e6/rate_hz)+2);
-					break;
 				}
-
-				case 12:
+				break;
+			case PICO3000A:
+				if( (g_model[1]=='2') and (g_model[4]=='A' or g_model[4]=='B') )
 				{
+					//!! A different implementation is needed for:
+					//!!   PicoScope 3000A and 3000B Series 2-Channel USB 2.0 Oscilloscopes
 					if(period_ns < 4)
-						timebase = 1;
+						timebase = 0;
 					else if(period_ns < 16)
-						timebase = round(log(5e8/rate_hz)/log(2)+1);
+						timebase = round(log(5e8/rate_hz)/log(2));
 					else
-						timebase = round((625e5/rate_hz)+3);
-					break;
+						timebase = round((625e5/rate_hz)+2);
 				}
-
-				case 14:
-				case 15:
+				if( (g_model.find("MSO") != string::npos) and (g_model[4]!='D') )
+				{
+					//!! And another one for:
+					//!!   PicoScope 3000 Series USB 2.0 MSOs
+					if(period_ns < 4)
+						timebase = 0;
+					else if(period_ns < 8)
+						timebase = round(log(5e8/rate_hz)/log(2));
+					else
+						timebase = round((125e6/rate_hz)+1);
+				}
+				else
 				{
-					if(period_ns < 16)
-						timebase = 3;
+					//!! This part is applicable to the following devices:
+					//!!   PicoScope 3000A and 3000B Series 4-Channel USB 2.0 Oscilloscopes
+					//!!   PicoScope 3207A and 3207B USB 3.0 Oscilloscopes
+					//!!   PicoScope 3000D Series USB 3.0 Oscilloscopes and MSOs
+					if(period_ns < 2)
+						timebase = 0;
+					else if(period_ns < 8)
+						timebase = round(log(1e9/rate_hz)/log(2));
 					else
 						timebase = round((125e6/rate_hz)+2);
-					break;
 				}
-
-				case 16:
+				break;
+			case PICO4000A:
+				if(g_model.find("4444") != string::npos)
 				{
-					if(period_ns < 32)
-						timebase = 4;
+					if(period_ns < 5)
+						timebase = 0;
+					else if(period_ns < 40)
+						timebase = round(log(4e8/rate_hz)/log(2));
 					else
-						timebase = round((625e5/rate_hz)+3);
-					break;
+						timebase = round((50e6/rate_hz)+2);
 				}
-			}
-			break;
-		case PICO6000A:
-			if(period_ns < 5)
-				timebase = round(log(clkdiv)/log(2));
-			else
-				timebase = round(clkdiv/32) + 4;
+				else
+					timebase = trunc((80e6/rate_hz)-1);
+				break;
+			case PICO5000A:
+				switch(g_adcBits)
+				{
+					case 8:
+					{
+						if(period_ns < 2)
+							timebase = 0;
+						else if(period_ns < 8)
+							timebase = round(log(1e9/rate_hz)/log(2));
+						else
+							timebase = round((125e6/rate_hz)+2);
+						break;
+					}
 
-			//6428E-D is calculated differently
-			if(g_model[3] == '8')
-			{
-				if(clkdiv < 1)
-					timebase = 0;
+					case 12:
+					{
+						if(period_ns < 4)
+							timebase = 1;
+						else if(period_ns < 16)
+							timebase = round(log(5e8/rate_hz)/log(2)+1);
+						else
+							timebase = round((625e5/rate_hz)+3);
+						break;
+					}
+
+					case 14:
+					case 15:
+					{
+						if(period_ns < 16)
+							timebase = 3;
+						else
+							timebase = round((125e6/rate_hz)+2);
+						break;
+					}
+
+					case 16:
+					{
+						if(period_ns < 32)
+							timebase = 4;
+						else
+							timebase = round((625e5/rate_hz)+3);
+						break;
+					}
+				}
+				break;
+			case PICOSIM:
+			case PICO6000A:
+				if(period_ns < 5)
+					timebase = round(log(clkdiv)/log(2));
 				else
-					timebase = timebase + 1;
-			}
-			break;
-		case PICOPSOSPA:
-			g_sampleInterval = 1e15 / rate_hz;
-			timebase = 1e12 / rate_hz;
-			//LogError("SetSampleRate Error unknown g_series\n");
-			break;
+					timebase = round(clkdiv/32) + 4;
+
+				//6428E-D is calculated differently
+				if(g_model[3] == '8')
+				{
+					if(clkdiv < 1)
+						timebase = 0;
+					else
+						timebase = timebase + 1;
+				}
+				break;
+			case PICOPSOSPA:
+				g_sampleInterval = 1e15 / rate_hz;
+				timebase = 1e12 / rate_hz;
+				//LogError("SetSampleRate Error unknown g_series\n");
+				break;
+		}
 	}
 
 	g_timebase = timebase;
@@ -2716,7 +3772,7 @@ void PicoSCPIServer::SetSampleRate(uint64_t rate_hz)
 
 void PicoSCPIServer::SetSampleDepth(uint64_t depth)
 {
-	lock_guard<mutex> lock(g_mutex);
+	DriverLock lock;
 	g_memDepth = depth;
 
 	UpdateTrigger();
@@ -2724,7 +3780,7 @@ void PicoSCPIServer::SetSampleDepth(uint64_t depth)
 
 void PicoSCPIServer::SetTriggerDelay(uint64_t delay_fs)
 {
-	lock_guard<mutex> lock(g_mutex);
+	DriverLock lock;
 
 	g_triggerDelay = delay_fs;
 	UpdateTrigger();
@@ -2732,7 +3788,7 @@ void PicoSCPIServer::SetTriggerDelay(uint64_t delay_fs)
 
 void PicoSCPIServer::SetTriggerSource(size_t chIndex)
 {
-	lock_guard<mutex> lock(g_mutex);
+	DriverLock lock;
 
 	auto type = GetChannelType(chIndex);
 	switch(type)
@@ -2783,7 +3839,7 @@ void PicoSCPIServer::SetTriggerSource(size_t chIndex)
 
 void PicoSCPIServer::SetTriggerLevel(double level_V)
 {
-	lock_guard<mutex> lock(g_mutex);
+	DriverLock lock;
 
 	g_triggerVoltage = level_V;
 	UpdateTrigger();
@@ -2791,7 +3847,10 @@ void PicoSCPIServer::SetTriggerLevel(double level_V)
 
 void PicoSCPIServer::SetTriggerTypeEdge()
 {
-	//all triggers are edge, nothing to do here until we start supporting other trigger types
+	DriverLock lock;
+
+	g_triggerMode = TRIGGER_EDGE;
+	UpdateTrigger();
 }
 
 bool PicoSCPIServer::IsTriggerArmed()
@@ -2801,7 +3860,7 @@ bool PicoSCPIServer::IsTriggerArmed()
 
 void PicoSCPIServer::SetEdgeTriggerEdge(const string& edge)
 {
-	lock_guard<mutex> lock(g_mutex);
+	DriverLock lock;
 
 	if(edge == "RISING")
 		g_triggerDirection = PICO_RISING;
@@ -2818,105 +3877,11 @@ void PicoSCPIServer::SetEdgeTriggerEdge(const string& edge)
  */
 void UpdateChannel(size_t chan)
 {
-	int16_t scaleVal;
-
-	switch(g_pico_type)
-	{
-		case PICO2000A:
-			ps2000aSetChannel(g_hScope, (PS2000A_CHANNEL)chan, g_channelOn[chan],
-							  (PS2000A_COUPLING)g_coupling[chan], g_range_2000a[chan], -g_offset[chan]);
-			ps2000aMaximumValue(g_hScope, &scaleVal);
-			g_scaleValue = scaleVal;
-
-			//We use software triggering based on raw ADC codes.
-			//Any time we change the frontend configuration on the trigger channel, it has to be reconfigured.
-			//TODO: handle multi-input triggers
-			if(chan == g_triggerChannel)
-				UpdateTrigger();
-			break;
-		case PICO3000A:
-			ps3000aSetChannel(g_hScope, (PS3000A_CHANNEL)chan, g_channelOn[chan],
-							  (PS3000A_COUPLING)g_coupling[chan], g_range_3000a[chan], -g_offset[chan]);
-			ps3000aSetBandwidthFilter(g_hScope, (PS3000A_CHANNEL)chan,
-									  (PS3000A_BANDWIDTH_LIMITER)g_bandwidth_3000a[chan]);
-			ps3000aMaximumValue(g_hScope, &scaleVal);
-			g_scaleValue = scaleVal;
-
-			//We use software triggering based on raw ADC codes.
-			//Any time we change the frontend configuration on the trigger channel, it has to be reconfigured.
-			//TODO: handle multi-input triggers
-			if(chan == g_triggerChannel)
-				UpdateTrigger();
-			break;
-		case PICO4000A:
-			ps4000aSetChannel(g_hScope, (PS4000A_CHANNEL)chan, g_channelOn[chan],
-							  (PS4000A_COUPLING)g_coupling[chan], g_range[chan], -g_offset[chan]);
-			ps4000aSetBandwidthFilter(g_hScope, (PS4000A_CHANNEL)chan,
-									  (PS4000A_BANDWIDTH_LIMITER)g_bandwidth_5000a[chan]);
-			ps4000aMaximumValue(g_hScope, &scaleVal);
-			g_scaleValue = scaleVal;
-
-			//We use software triggering based on raw ADC codes.
-			//Any time we change the frontend configuration on the trigger channel, it has to be reconfigured.
-			//TODO: handle multi-input triggers
-			if(chan == g_triggerChannel)
-				UpdateTrigger();
-			break;
-		case PICO5000A:
-			ps5000aSetChannel(g_hScope, (PS5000A_CHANNEL)chan, g_channelOn[chan],
-							  (PS5000A_COUPLING)g_coupling[chan], g_range_5000a[chan], -g_offset[chan]);
-			ps5000aSetBandwidthFilter(g_hScope, (PS5000A_CHANNEL)chan,
-									  (PS5000A_BANDWIDTH_LIMITER)g_bandwidth_5000a[chan]);
-			ps5000aMaximumValue(g_hScope, &scaleVal);
-			g_scaleValue = scaleVal;
-
-			//LogDebug(" - UpdateChannel %zu, range %f, scaleVal %d \n", chan, g_roundedRange[chan], scaleVal);
-
-			//We use software triggering based on raw ADC codes.
-			//Any time we change the frontend configuration on the trigger channel, it has to be reconfigured.
-			//TODO: handle multi-input triggers
-			if(chan == g_triggerChannel)
-				UpdateTrigger();
-			break;
-		case PICO6000A:
-			if(g_channelOn[chan])
-			{
-				PICO_DEVICE_RESOLUTION currentRes;
-				ps6000aSetChannelOn(g_hScope, (PICO_CHANNEL)chan,
-									g_coupling[chan], g_range[chan], -g_offset[chan], g_bandwidth[chan]);
-				ps6000aGetDeviceResolution(g_hScope, &currentRes);
-				ps6000aGetAdcLimits(g_hScope, currentRes, 0, &scaleVal);
-				g_scaleValue = scaleVal;
-
-				//We use software triggering based on raw ADC codes.
-				//Any time we change the frontend configuration on the trigger channel, it has to be reconfigured.
-				//TODO: handle multi-input triggers
-				if(chan == g_triggerChannel)
-					UpdateTrigger();
-			}
-			else
-				ps6000aSetChannelOff(g_hScope, (PICO_CHANNEL)chan);
-			break;
-		case PICOPSOSPA:
-			if(g_channelOn[chan])
-			{
-				PICO_DEVICE_RESOLUTION currentRes;
-				psospaSetChannelOn(g_hScope, (PICO_CHANNEL)chan,
-									g_coupling[chan], -g_range_3000e[chan], g_range_3000e[chan], PICO_X1_PROBE_NV, -g_offset[chan], g_bandwidth[chan]);
-				psospaGetDeviceResolution(g_hScope, &currentRes);
-				psospaGetAdcLimits(g_hScope, currentRes, 0, &scaleVal);
-				g_scaleValue = scaleVal;
-
-				//We use software triggering based on raw ADC codes.
-				//Any time we change the frontend configuration on the trigger channel, it has to be reconfigured.
-				//TODO: handle multi-input triggers
-				if(chan == g_triggerChannel)
-					UpdateTrigger();
-			}
-			else
-				psospaSetChannelOff(g_hScope, (PICO_CHANNEL)chan);
-			break;
-	}
+	//We use software triggering based on raw ADC codes.
+	//Any time we change the frontend configuration on the trigger channel, it has to be reconfigured.
+	//TODO: handle multi-input triggers
+	if(g_backend->SetChannel(chan) && (chan == g_triggerChannel))
+		UpdateTrigger();
 }
 
 /**
@@ -2924,6 +3889,14 @@ void UpdateChannel(size_t chan)
  */
 void UpdateTrigger(bool force)
 {
+	//Within a SETUP:BEGIN / SETUP:COMMIT batch, only the last update is pushed to the scope
+	if(g_setupBatch && !force)
+	{
+		g_triggerUpdatePending = true;
+		return;
+	}
+	g_triggerUpdatePending = false;
+
 	//Timeout, in microseconds, before initiating a trigger
 	//Force trigger is really just a one-shot auto trigger with a 1us delay.
 	uint32_t timeout = 0;
@@ -2966,6 +3939,25 @@ void UpdateTrigger(bool force)
 	if(triggerDelaySamples < 0)
 		delay = -triggerDelaySamples;
 
+	//Window, runt, pulse width and pattern triggers go through the advanced trigger API (see Triggers.cpp).
+	//If the scope can't do them, fall back to an edge trigger on the same source and level.
+	if(g_triggerMode != TRIGGER_EDGE)
+	{
+		float lower_code = (g_triggerLowerVoltage - offset) / scale;
+		if(lower_code > 32767)
+			lower_code = 32767;
+		if(lower_code < -32767)
+			lower_code = -32767;
+
+		if(UpdateAdvancedTrigger(round(trig_code), round(lower_code), delay, timeout))
+		{
+			if(g_triggerArmed)
+				StartCapture(true);
+			return;
+		}
+	}
+	ClearAdvancedTrigger();
+
 	switch(g_pico_type)
 	{
 		case PICO2000A:
@@ -3427,75 +4419,141 @@ void UpdateTrigger(bool force)
 					LogWarning("Force trigger doesn't currently work if trigger source is digital\n");
 			}
 			break;
+		case PICOSIM:
+			//The simulated signal always crosses the trigger level, only the auto trigger timeout matters
+			simSetSimpleTrigger(g_hScope, timeout);
+			break;
 	}
 
 	if(g_triggerArmed)
 		StartCapture(true);
 }
 
-void Stop()
+/**
+	@brief Ends a SETUP:BEGIN batch, pushing the pending trigger configuration and re-arming once
+
+	Must be called with the driver idle (see DriverLock).
+ */
+void CommitSetup()
+{
+	g_setupBatch = false;
+
+	bool rearm = g_rearmPending;
+	g_rearmPending = false;
+	if(g_triggerUpdatePending)
+		UpdateTrigger();	//re-arms as well if needed
+	else if(rearm && g_triggerArmed)
+		StartCapture(false);
+}
+
+/**
+	@brief Pushes memory segmentation (rapid block mode) configuration to the instrument
+
+	The scope must be stopped when this is called.
+
+	@return True on success, false if the requested number of segments is not supported
+ */
+bool UpdateSegments()
 {
+	PICO_STATUS status = PICO_OK;
+	uint64_t maxSamples = 0;
+	int32_t maxSamples_int = 0;
+
 	switch(g_pico_type)
 	{
 		case PICO2000A:
-			ps2000aStop(g_hScope);
+			status = ps2000aMemorySegments(g_hScope, g_numSegments, &maxSamples_int);
+			if(status == PICO_OK)
+				status = ps2000aSetNoOfCaptures(g_hScope, g_numSegments);
+			maxSamples = maxSamples_int;
 			break;
 		case PICO3000A:
-			ps3000aStop(g_hScope);
+			status = ps3000aMemorySegments(g_hScope, g_numSegments, &maxSamples_int);
+			if(status == PICO_OK)
+				status = ps3000aSetNoOfCaptures(g_hScope, g_numSegments);
+			maxSamples = maxSamples_int;
 			break;
 		case PICO4000A:
-			ps4000aStop(g_hScope);
+			status = ps4000aMemorySegments(g_hScope, g_numSegments, &maxSamples_int);
+			if(status == PICO_OK)
+				status = ps4000aSetNoOfCaptures(g_hScope, g_numSegments);
+			maxSamples = maxSamples_int;
 			break;
 		case PICO5000A:
-			ps5000aStop(g_hScope);
+			status = ps5000aMemorySegments(g_hScope, g_numSegments, &maxSamples_int);
+			if(status == PICO_OK)
+				status = ps5000aSetNoOfCaptures(g_hScope, g_numSegments);
+			maxSamples = maxSamples_int;
 			break;
 		case PICO6000A:
-			ps6000aStop(g_hScope);
+			status = ps6000aMemorySegments(g_hScope, g_numSegments, &maxSamples);
+			if(status == PICO_OK)
+				status = ps6000aSetNoOfCaptures(g_hScope, g_numSegments);
 			break;
 		case PICOPSOSPA:
-			psospaStop(g_hScope);
+			status = psospaMemorySegments(g_hScope, g_numSegments, &maxSamples);
+			if(status == PICO_OK)
+				status = psospaSetNoOfCaptures(g_hScope, g_numSegments);
+			break;
+		case PICOSIM:
+			status = simMemorySegments(g_hScope, g_numSegments, &maxSamples);
+			if(status == PICO_OK)
+				status = simSetNoOfCaptures(g_hScope, g_numSegments);
 			break;
 	}
+
+	if(status != PICO_OK)
+	{
+		LogError("psXXXXMemorySegments failed for %zu segments (code 0x%x)\n", g_numSegments, status);
+		return false;
+	}
+
+	//Each segment has to fit the whole capture. The requested depth is kept, so fewer segments give it back.
+	LogTrace("%zu segments, max %zu samples per segment\n", g_numSegments, (size_t)maxSamples);
+	g_segmentMaxDepth = maxSamples;
+	if(g_memDepth > g_segmentMaxDepth)
+		LogWarning("Memory depth limited to %zu samples to fit %zu segments\n", (size_t)maxSamples, g_numSegments);
+
+	//Buffers need to be reallocated for the new segment layout
+	g_memDepthChanged = true;
+	return true;
+}
+
+/**
+	@brief Returns the memory depth captures are actually armed with: the requested one, if it fits in a segment
+ */
+size_t EffectiveMemDepth()
+{
+	return min(g_memDepth, g_segmentMaxDepth);
+}
+
+void Stop()
+{
+	g_backend->Stop();
 }
 
 PICO_STATUS StartInternal()
 {
+	if(g_streamingMode)
+		return StartStreaming();
+
 	//Calculate pre/post trigger time configuration based on trigger delay
 	int64_t triggerDelaySamples = g_triggerDelay / g_sampleInterval;
-	size_t nPreTrigger = min(max(triggerDelaySamples, (int64_t)0L), (int64_t)g_memDepth);
-	size_t nPostTrigger = g_memDepth - nPreTrigger;
-	int32_t nPreTrigger_int = nPreTrigger;
-	int32_t nPostTrigger_int = nPostTrigger;
+	size_t nPreTrigger = min(max(triggerDelaySamples, (int64_t)0L), (int64_t)g_captureMemDepth);
+	size_t nPostTrigger = g_captureMemDepth - nPreTrigger;
 	g_triggerSampleIndex = nPreTrigger;
 
-	switch(g_pico_type)
-	{
-		case PICO2000A:
-			return ps2000aRunBlock(g_hScope, nPreTrigger_int, nPostTrigger_int, g_timebase, 1, NULL, 0, NULL, NULL);
-			break;
-		case PICO3000A:
-			return ps3000aRunBlock(g_hScope, nPreTrigger_int, nPostTrigger_int, g_timebase, 1, NULL, 0, NULL, NULL);
-			break;
-		case PICO4000A:
-			return ps4000aRunBlock(g_hScope, nPreTrigger_int, nPostTrigger_int, g_timebase, NULL, 0, NULL, NULL);
-			break;
-		case PICO5000A:
-			return ps5000aRunBlock(g_hScope, nPreTrigger_int, nPostTrigger_int, g_timebase, NULL, 0, NULL, NULL);
-			break;
-		case PICO6000A:
-			return ps6000aRunBlock(g_hScope, nPreTrigger, nPostTrigger, g_timebase, NULL, 0, NULL, NULL);
-			break;
-		case PICOPSOSPA:
-			return psospaRunBlock(g_hScope, nPreTrigger, nPostTrigger, g_timebase, NULL, 0, NULL, NULL);
-			break;
-		default:
-			//return PICO_OK;
-			return PICO_CANCELLED;
-	}
+	//The driver calls OnBlockReady() to wake up the waveform thread once the capture is complete
+	void* readyParam = PrepareBlockReady();
+
+	return g_backend->RunBlock(nPreTrigger, nPostTrigger, g_timebase, readyParam);
 }
 
 void StartCapture(bool stopFirst, bool force)
 {
+	g_rearmPending = false;
+	g_captureInDriver = false;
+
 	//If previous trigger was forced, we need to reconfigure the trigger to be not-forced now
 	if(g_lastTriggerWasForced && !force)
 	{
@@ -3508,10 +4566,16 @@ void StartCapture(bool stopFirst, bool force)
 	g_channelOnDuringArm = g_channelOn;
 	for(size_t i=0; i<g_numDigitalPods; i++)
 		g_msoPodEnabledDuringArm[i] = g_msoPodEnabled[i];
-	if(g_captureMemDepth != g_memDepth)
+	if(g_captureMemDepth != EffectiveMemDepth())
 		g_memDepthChanged = true;
-	g_captureMemDepth = g_memDepth;
+	g_captureMemDepth = EffectiveMemDepth();
 	g_sampleIntervalDuringArm = g_sampleInterval;
+	if(g_numSegmentsDuringArm != g_numSegments)
+		g_memDepthChanged = true;
+	g_numSegmentsDuringArm = g_numSegments;
+	g_streamingModeDuringArm = g_streamingMode;
+	g_downsampleRatioDuringArm = g_downsampleRatio;
+	g_downsampleModeDuringArm = g_downsampleMode;
 
 	LogTrace("StartCapture stopFirst %d memdepth %zu\n", stopFirst, g_captureMemDepth);
 
@@ -3541,6 +4605,7 @@ void StartCapture(bool stopFirst, bool force)
 	}
 
 	g_triggerArmed = true;
+	PerfMarkArmed();
 }
 
 bool EnableMsoPod(size_t npod)
@@ -3616,10 +4681,53 @@ bool EnableMsoPod(size_t npod)
 			}
 			break;
 		}
+		case PICOSIM:
+			//no digital ports in the simulator
+			return false;
 	}
 	return true;
 }
 
+/**
+	@brief Returns the square wave table for a duty cycle (in percent), generating it if it isn't cached yet
+ */
+vector<int16_t>& GetSquareWave(double dutyCycle)
+{
+	long key = lround(dutyCycle * 100);
+	auto it = g_squareWaveCache.find(key);
+	if(it != g_squareWaveCache.end())
+		return it->second;
+
+	//Don't let a duty cycle sweep grow the cache forever. Keep the table in use, g_arbitraryWaveform points to it.
+	if(g_squareWaveCache.size() >= 16)
+	{
+		for(auto jt = g_squareWaveCache.begin(); jt != g_squareWaveCache.end(); )
+		{
+			if(jt->second.data() == g_arbitraryWaveform)
+				jt ++;
+			else
+				jt = g_squareWaveCache.erase(jt);
+		}
+	}
+
+	auto& table = g_squareWaveCache[key];
+	table.resize(g_awgBufferSize);
+	int16_t* p = &table[0];
+	GenerateSquareWave(p, table.size(), dutyCycle);
+	return table;
+}
+
+/**
+	@brief Makes a table the one played by the 2000A-5000A arbitrary generator (takes effect at the next ReconfigAWG())
+ */
+void SelectArbitraryTable(vector<int16_t>& table)
+{
+	if(table.empty())
+		return;
+	g_arbitraryWaveform = &table[0];
+	g_arbitraryLength = table.size();
+}
+
 void GenerateSquareWave(int16_t* &waveform, size_t bufferSize, double dutyCycle, int16_t amplitude)
 {
 	// Validate inputs
@@ -71,6 +71,12 @@ protected:
 	virtual ChannelType GetChannelType(size_t channel);
 
 	void ReconfigAWG();
+	void ApplyAWG();
+	void UpdateAWGFrequency();
+
+	std::vector<int> GetADCResolutions();
+	bool SetADCResolution(int bits);
+	void RevalidateTimebase();
 
 	//Command methods
 	virtual void AcquisitionStart(bool oneShot = false);
@@ -0,0 +1,310 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Record to disk
+
+	Block mode waveforms are written to a preallocated, memory-mapped file in exactly the layout they'd have on the
+	data plane socket. The file starts with a RecordFileHeader (padded to 4 kB), followed by a fixed size array of
+	RecordIndexEntry and the data region, so a reader can seek straight to any waveform.
+
+	Writes come from the recorder's own thread (see StartRecording()), never from the waveform thread, so a slow
+	disk only costs dropped recordings rather than a late re-arm.
+ */
+#include "ps6000d.h"
+#include <string.h>
+#include <inttypes.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+//The current (or last) recording, kept open after RECORD:END so it can be replayed
+RecordFile g_record;
+
+//Bytes to preallocate for the next recording (RECORD:SIZE)
+uint64_t g_recordSize = 1024LL * 1024 * 1024;
+
+//Space reserved for the header, and alignment of the index and data regions
+static const uint64_t g_recordHeaderSize = 4096;
+
+//Recorded data is handed to the kernel for writeback in batches of this size
+static const uint64_t g_recordFlushBytes = 64 * 1024 * 1024;
+
+/**
+	@brief Creates a recording file and maps it
+
+	The whole file is allocated up front so running out of disk space shows up here, not halfway through a
+	recording. There is one index entry for every 64 kB of file, and at least 1024.
+
+	@param file		The recording
+	@param path		Path of the file, replaced if it exists
+	@param size		Total size of the file in bytes
+
+	@return False if the file couldn't be created
+ */
+bool RecordOpen(RecordFile& file, const string& path, uint64_t size)
+{
+#ifdef _WIN32
+	(void)file;
+	(void)path;
+	(void)size;
+	LogError("Recording is not supported on Windows\n");
+	return false;
+#else
+	lock_guard<mutex> lock(file.lock);
+	if(file.base)
+		return false;
+
+	uint64_t indexCapacity = max(size / 65536, static_cast<uint64_t>(1024));
+	uint64_t dataOffset = g_recordHeaderSize + indexCapacity * sizeof(RecordIndexEntry);
+	dataOffset = (dataOffset + g_recordHeaderSize - 1) & ~(g_recordHeaderSize - 1);
+	if(size <= dataOffset)
+	{
+		LogError("Recording size of %" PRIu64 " bytes is too small\n", size);
+		return false;
+	}
+
+	file.fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(file.fd < 0)
+	{
+		LogError("Failed to create recording file %s\n", path.c_str());
+		return false;
+	}
+
+	void* p = MAP_FAILED;
+#ifdef __linux__
+	int err = posix_fallocate(file.fd, 0, size);
+#else
+	int err = ftruncate(file.fd, size);
+#endif
+	if(err == 0)
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+	if(p == MAP_FAILED)
+	{
+		LogError("Failed to allocate %" PRIu64 " MB for recording file %s\n", size >> 20, path.c_str());
+		close(file.fd);
+		unlink(path.c_str());
+		file.fd = -1;
+		return false;
+	}
+	madvise(p, size, MADV_SEQUENTIAL);
+
+	file.base = static_cast<uint8_t*>(p);
+	file.mapSize = size;
+	file.path = path;
+	file.flushed = 0;
+	file.full = false;
+
+	auto hdr = reinterpret_cast<RecordFileHeader*>(file.base);
+	memset(hdr, 0, sizeof(RecordFileHeader));
+	hdr->magic = RECORD_MAGIC;
+	hdr->version = 1;
+	strncpy(hdr->model, g_model.c_str(), sizeof(hdr->model) - 1);
+	strncpy(hdr->serial, g_serial.c_str(), sizeof(hdr->serial) - 1);
+	hdr->indexOffset = g_recordHeaderSize;
+	hdr->indexCapacity = indexCapacity;
+	hdr->dataOffset = dataOffset;
+	hdr->dataSize = size - dataOffset;
+
+	LogVerbose("Recording to %s (%" PRIu64 " MB, up to %" PRIu64 " waveforms)\n",
+		path.c_str(), size >> 20, indexCapacity);
+	return true;
+#endif
+}
+
+/**
+	@brief Writes everything recorded so far to disk, and waits for it to get there
+ */
+void RecordFlush(RecordFile& file)
+{
+#ifndef _WIN32
+	lock_guard<mutex> lock(file.lock);
+	if(file.base)
+		msync(file.base, file.mapSize, MS_SYNC);
+#else
+	(void)file;
+#endif
+}
+
+/**
+	@brief Finishes a recording, trimming the file to the space actually used
+ */
+void RecordClose(RecordFile& file)
+{
+#ifndef _WIN32
+	lock_guard<mutex> lock(file.lock);
+	if(!file.base)
+		return;
+
+	auto hdr = reinterpret_cast<RecordFileHeader*>(file.base);
+	hdr->dataSize = hdr->dataUsed;
+	uint64_t used = hdr->dataOffset + hdr->dataUsed;
+	LogVerbose("Closed recording %s (%" PRIu64 " waveforms, %" PRIu64 " MB)\n",
+		file.path.c_str(), hdr->recordCount, used >> 20);
+
+	msync(file.base, file.mapSize, MS_SYNC);
+	munmap(file.base, file.mapSize);
+	if(0 != ftruncate(file.fd, used))
+		LogWarning("Failed to trim recording file %s\n", file.path.c_str());
+	close(file.fd);
+#endif
+	file.base = nullptr;
+	file.fd = -1;
+	file.mapSize = 0;
+}
+
+/**
+	@brief Appends one waveform to the recording
+
+	The data and its index entry are written before the record count is bumped, so a reader never sees a partial
+	waveform. The first waveform also fills in the channel settings of the file header.
+
+	@param file			The recording
+	@param chunks		The waveform, as it would be passed to SendGathered()
+	@param bytes		Total size of the chunks
+	@param sequence		Sequence number of the waveform in the recording
+	@param flags		RecordFlags describing its layout
+	@param timestamp	Time of the download, ns since the epoch
+	@param interval		Sample interval in fs
+	@param scale		Scale of each analog channel in the capture
+	@param offset		Offset of each analog channel in the capture
+
+	@return False if the file is full (or isn't open)
+ */
+bool RecordAppend(
+	RecordFile& file,
+	const vector<SendChunk>& chunks,
+	uint64_t bytes,
+	uint32_t sequence,
+	uint32_t flags,
+	int64_t timestamp,
+	int64_t interval,
+	const map<size_t, float>& scale,
+	const map<size_t, float>& offset)
+{
+	lock_guard<mutex> lock(file.lock);
+	if(!file.base || file.full)
+		return false;
+
+	auto hdr = reinterpret_cast<RecordFileHeader*>(file.base);
+	if( (hdr->recordCount >= hdr->indexCapacity) || (hdr->dataUsed + bytes > hdr->dataSize) )
+	{
+		LogWarning("Recording file %s is full, stopping after %" PRIu64 " waveforms\n",
+			file.path.c_str(), hdr->recordCount);
+		file.full = true;
+		return false;
+	}
+
+	if(hdr->recordCount == 0)
+	{
+		hdr->fs_per_sample = interval;
+		for(auto it : scale)
+		{
+			if(it.first >= RECORD_MAX_CHANNELS)
+				continue;
+			hdr->scale[it.first] = it.second;
+			hdr->offset[it.first] = offset.at(it.first);
+			hdr->numChannels = max(hdr->numChannels, static_cast<uint32_t>(it.first + 1));
+		}
+	}
+
+	uint8_t* p = file.base + hdr->dataOffset + hdr->dataUsed;
+	for(auto& c : chunks)
+	{
+		memcpy(p, c.data, c.len);
+		p += c.len;
+	}
+
+	auto index = reinterpret_cast<RecordIndexEntry*>(file.base + hdr->indexOffset);
+	auto& entry = index[hdr->recordCount];
+	entry.sequence = sequence;
+	entry.flags = flags;
+	entry.timestamp = timestamp;
+	entry.offset = hdr->dataUsed;
+	entry.length = bytes;
+
+	atomic_thread_fence(memory_order_release);
+	hdr->dataUsed += bytes;
+	hdr->recordCount ++;
+
+	//Start writeback in big sequential batches instead of leaving it all to the page cache
+#ifdef __linux__
+	if(hdr->dataUsed - file.flushed >= g_recordFlushBytes)
+	{
+		sync_file_range(file.fd, hdr->dataOffset + file.flushed, hdr->dataUsed - file.flushed, SYNC_FILE_RANGE_WRITE);
+		file.flushed = hdr->dataUsed;
+	}
+#endif
+	return true;
+}
+
+/**
+	@brief Returns the number of complete waveforms in the recording
+ */
+uint64_t RecordCount(RecordFile& file)
+{
+	lock_guard<mutex> lock(file.lock);
+	if(!file.base)
+		return 0;
+	return reinterpret_cast<RecordFileHeader*>(file.base)->recordCount;
+}
+
+/**
+	@brief Copies one recorded waveform out of the file
+
+	@param file		The recording
+	@param i		Index of the waveform, starting at 0
+	@param out		Receives the waveform, as it was recorded
+	@param flags	If not null, receives its RecordFlags
+
+	@return False if there is no such waveform
+ */
+bool RecordRead(RecordFile& file, uint64_t i, vector<uint8_t>& out, uint32_t* flags)
+{
+	lock_guard<mutex> lock(file.lock);
+	if(!file.base)
+		return false;
+
+	auto hdr = reinterpret_cast<RecordFileHeader*>(file.base);
+	if(i >= hdr->recordCount)
+		return false;
+
+	auto& entry = reinterpret_cast<RecordIndexEntry*>(file.base + hdr->indexOffset)[i];
+	const uint8_t* p = file.base + hdr->dataOffset + entry.offset;
+	out.assign(p, p + entry.length);
+	if(flags)
+		*flags = entry.flags;
+	return true;
+}
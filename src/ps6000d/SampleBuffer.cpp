@@ -0,0 +1,140 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Allocation of sample buffers handed to the Pico driver
+ */
+#include "ps6000d.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+//Lock sample buffers into RAM (--lock-buffers)
+bool g_lockSampleBuffers = false;
+
+size_t SampleBufferPageSize();
+
+/**
+	@brief Returns the allocation granularity of sample buffers
+ */
+size_t SampleBufferPageSize()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/**
+	@brief Rounds a buffer size up to a whole number of pages, in samples
+ */
+size_t RoundUpSampleBuffer(size_t samples)
+{
+	size_t pageSamples = SampleBufferPageSize() / sizeof(int16_t);
+	return ((samples + pageSamples - 1) / pageSamples) * pageSamples;
+}
+
+/**
+	@brief Allocates a page aligned sample buffer
+
+	The driver DMAs directly into these buffers and we send straight out of them, so they're mapped fresh from the OS
+	(zero filled, no heap fragmentation), use transparent huge pages where available and are optionally locked in RAM
+	so neither path takes page faults.
+
+	@param samples	Buffer size in samples, must come from RoundUpSampleBuffer()
+
+	@return The buffer, or NULL on failure
+ */
+int16_t* AllocateSampleBuffer(size_t samples)
+{
+	size_t len = samples * sizeof(int16_t);
+	if(len == 0)
+		return NULL;
+
+#ifdef _WIN32
+	void* buf = VirtualAlloc(NULL, len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if(buf == NULL)
+	{
+		LogError("Failed to allocate %zu byte sample buffer\n", len);
+		return NULL;
+	}
+	if(g_lockSampleBuffers && !VirtualLock(buf, len))
+		LogWarning("Failed to lock %zu byte sample buffer in memory\n", len);
+#else
+	void* buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(buf == MAP_FAILED)
+	{
+		LogError("Failed to allocate %zu byte sample buffer\n", len);
+		return NULL;
+	}
+
+	//Before anything touches it, so the pages come from the right node
+	BindToNumaNode(buf, len);
+
+	#ifdef MADV_HUGEPAGE
+		//Deep captures are hundreds of MB, cut TLB pressure during the download and send
+		const size_t hugePageSize = 2 * 1024 * 1024;
+		if(len >= hugePageSize)
+			madvise(buf, len, MADV_HUGEPAGE);
+	#endif
+
+	if(g_lockSampleBuffers && (mlock(buf, len) != 0))
+		LogWarning("Failed to lock %zu byte sample buffer in memory (check RLIMIT_MEMLOCK)\n", len);
+#endif
+
+	return static_cast<int16_t*>(buf);
+}
+
+/**
+	@brief Frees a buffer allocated by AllocateSampleBuffer()
+
+	@param buf		The buffer (may be NULL)
+	@param samples	Size it was allocated with
+ */
+void FreeSampleBuffer(int16_t* buf, size_t samples)
+{
+	if(buf == NULL)
+		return;
+
+#ifdef _WIN32
+	(void)samples;
+	VirtualFree(buf, 0, MEM_RELEASE);
+#else
+	munmap(buf, samples * sizeof(int16_t));
+#endif
+}
@@ -0,0 +1,217 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Packing of samples into the compact wire formats
+ */
+#include "ps6000d.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+using namespace std;
+
+void PackSamplesScalar(const int16_t* in, uint8_t* out, size_t numSamples, size_t bits);
+#ifdef HAVE_X86_SIMD
+size_t PackSamples8_SSE2(const int16_t* in, uint8_t* out, size_t numSamples);
+size_t PackSamples10_SSSE3(const int16_t* in, uint8_t* out, size_t numSamples);
+size_t PackSamples12_SSSE3(const int16_t* in, uint8_t* out, size_t numSamples);
+#endif
+
+/**
+	@brief Returns the number of bytes PackSamples() writes for a block of samples
+ */
+size_t PackedSampleSize(size_t numSamples, size_t bits)
+{
+	if(bits >= 16)
+		return numSamples * sizeof(int16_t);
+	return (numSamples * bits + 7) / 8;
+}
+
+/**
+	@brief Packs ADC samples down to their actual resolution
+
+	The driver scales every resolution to the full int16_t range, leaving the low (16 - bits) bits empty.
+	8 bit data is sent as int8_t. Other resolutions below 16 bits are sent as a dense little-endian bit stream of
+	bits-wide two's complement values (sample n occupies stream bits n*bits to n*bits + bits - 1).
+
+	@param in			Input samples
+	@param out			Output buffer, PackedSampleSize() plus 16 bytes of slack for the vector stores
+	@param numSamples	Number of samples to pack
+	@param bits			ADC resolution
+ */
+void PackSamples(const int16_t* in, uint8_t* out, size_t numSamples, size_t bits)
+{
+	if(bits >= 16)
+	{
+		memcpy(out, in, numSamples * sizeof(int16_t));
+		return;
+	}
+
+	//Vectorized kernels handle multiples of 8 or 16 samples, which always end on a byte boundary
+	size_t done = 0;
+#ifdef HAVE_X86_SIMD
+	if(bits == 8)
+		done = PackSamples8_SSE2(in, out, numSamples);
+	else if( (bits == 10) && __builtin_cpu_supports("ssse3") )
+		done = PackSamples10_SSSE3(in, out, numSamples);
+	else if( (bits == 12) && __builtin_cpu_supports("ssse3") )
+		done = PackSamples12_SSSE3(in, out, numSamples);
+#endif
+
+	PackSamplesScalar(in + done, out + (done * bits) / 8, numSamples - done, bits);
+}
+
+/**
+	@brief Packs MSO pod samples to one byte each (the 8 lines of a pod are in the low byte)
+ */
+void PackDigitalSamples(const int16_t* in, uint8_t* out, size_t numSamples)
+{
+	size_t i = 0;
+
+#ifdef HAVE_X86_SIMD
+	__m128i mask = _mm_set1_epi16(0xff);
+	for(; i + 16 <= numSamples; i += 16)
+	{
+		__m128i a = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)), mask);
+		__m128i b = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 8)), mask);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(a, b));
+	}
+#endif
+
+	for(; i<numSamples; i++)
+		out[i] = in[i] & 0xff;
+}
+
+/**
+	@brief Generic bit packer, used for odd resolutions and the tail end of the vectorized kernels
+ */
+void PackSamplesScalar(const int16_t* in, uint8_t* out, size_t numSamples, size_t bits)
+{
+	size_t shift = 16 - bits;
+	uint32_t mask = (1 << bits) - 1;
+
+	uint64_t acc = 0;
+	size_t nbits = 0;
+	for(size_t i=0; i<numSamples; i++)
+	{
+		acc |= static_cast<uint64_t>((in[i] >> shift) & mask) << nbits;
+		nbits += bits;
+		while(nbits >= 8)
+		{
+			*(out++) = acc & 0xff;
+			acc >>= 8;
+			nbits -= 8;
+		}
+	}
+	if(nbits)
+		*out = acc & 0xff;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/**
+	@brief 8 bit packing: arithmetic shift each sample down and narrow with saturation
+
+	@return Number of samples packed
+ */
+size_t PackSamples8_SSE2(const int16_t* in, uint8_t* out, size_t numSamples)
+{
+	size_t i = 0;
+	for(; i + 16 <= numSamples; i += 16)
+	{
+		__m128i a = _mm_srai_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)), 8);
+		__m128i b = _mm_srai_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 8)), 8);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packs_epi16(a, b));
+	}
+	return i;
+}
+
+/**
+	@brief 10 bit packing, 8 samples to 10 bytes
+
+	Pairs of samples are merged into 20-bit values with a multiply-add, pairs of those into 40-bit values per
+	64-bit lane, then a shuffle drops the empty bytes. Each store writes 16 bytes but only advances 10.
+
+	@return Number of samples packed
+ */
+__attribute__((target("ssse3")))
+size_t PackSamples10_SSSE3(const int16_t* in, uint8_t* out, size_t numSamples)
+{
+	__m128i mask = _mm_set1_epi16(0x3ff);
+	__m128i mul = _mm_set1_epi32(0x04000001);
+	__m128i lowmask = _mm_set_epi32(0, -1, 0, -1);
+	__m128i shuf = _mm_setr_epi8(0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1, -1);
+
+	size_t i = 0;
+	for(; i + 8 <= numSamples; i += 8)
+	{
+		__m128i v = _mm_and_si128(_mm_srai_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)), 6), mask);
+		__m128i pairs = _mm_madd_epi16(v, mul);
+		__m128i quads = _mm_or_si128(
+			_mm_and_si128(pairs, lowmask),
+			_mm_slli_epi64(_mm_srli_epi64(pairs, 32), 20));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(quads, shuf));
+		out += 10;
+	}
+	return i;
+}
+
+/**
+	@brief 12 bit packing, 8 samples to 12 bytes
+
+	Pairs of samples are merged into 24-bit values with a multiply-add, then a shuffle drops the empty byte
+	of each 32-bit lane. Each store writes 16 bytes but only advances 12.
+
+	@return Number of samples packed
+ */
+__attribute__((target("ssse3")))
+size_t PackSamples12_SSSE3(const int16_t* in, uint8_t* out, size_t numSamples)
+{
+	__m128i mask = _mm_set1_epi16(0xfff);
+	__m128i mul = _mm_set1_epi32(0x10000001);
+	__m128i shuf = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+	size_t i = 0;
+	for(; i + 8 <= numSamples; i += 8)
+	{
+		__m128i v = _mm_and_si128(_mm_srai_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)), 4), mask);
+		__m128i pairs = _mm_madd_epi16(v, mul);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(pairs, shuf));
+		out += 12;
+	}
+	return i;
+}
+
+#endif
@@ -0,0 +1,189 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Shared memory data plane for clients on the same host
+
+	The server creates a POSIX shared memory object (ShmRingHeader followed by numSlots slots of slotSize bytes each)
+	and writes each waveform into the next slot, in exactly the layout it would have on the socket. The data plane
+	socket then only carries a ShmDoorbell per waveform, and the client's ACKs as usual.
+
+	A slot is only reused once the waveform in it has been ACKed. Waveforms that don't fit in a slot, and streaming
+	mode chunks, are sent inline on the socket right after their doorbell.
+ */
+#include "ps6000d.h"
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+//Data plane transport requested by the client (TRANSPORT), used for the next data plane connection
+DataTransport g_transport = TRANSPORT_TCP;
+
+//Name of the shared memory object, and ring geometry (--shm-slots, --shm-slot-size)
+string g_shmName;
+size_t g_shmSlots = 4;
+size_t g_shmSlotSize = 128 * 1024 * 1024;
+
+//Start of the first slot, leaving room for the header
+static const size_t g_shmSlotOffset = 4096;
+
+/**
+	@brief Creates the shared memory ring
+
+	@return False if it couldn't be created, in which case ShmSend() sends everything inline
+ */
+bool ShmCreate(ShmRing& ring, const string& name, size_t numSlots, size_t slotSize)
+{
+#ifdef _WIN32
+	(void)ring;
+	(void)name;
+	(void)numSlots;
+	(void)slotSize;
+	LogError("Shared memory transport is not supported on Windows\n");
+	return false;
+#else
+	if( (numSlots == 0) || (slotSize == 0) )
+		return false;
+
+	ring.name = name;
+	ring.mapSize = g_shmSlotOffset + numSlots * slotSize;
+
+	//Replace anything left behind by a previous run
+	shm_unlink(name.c_str());
+	ring.fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(ring.fd < 0)
+	{
+		LogError("Failed to create shared memory object %s\n", name.c_str());
+		return false;
+	}
+
+	//Pages are only allocated once touched, so a big ring costs nothing until it's used
+	void* p = MAP_FAILED;
+	if(0 == ftruncate(ring.fd, ring.mapSize))
+		p = mmap(NULL, ring.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, 0);
+	if(p == MAP_FAILED)
+	{
+		LogError("Failed to map %zu bytes of shared memory\n", ring.mapSize);
+		close(ring.fd);
+		shm_unlink(name.c_str());
+		ring.fd = -1;
+		return false;
+	}
+	ring.base = static_cast<uint8_t*>(p);
+	ring.numSlots = numSlots;
+	ring.slotSize = slotSize;
+	ring.nextSlot = 0;
+
+	auto hdr = reinterpret_cast<ShmRingHeader*>(ring.base);
+	hdr->magic = SHM_MAGIC;
+	hdr->version = 1;
+	hdr->numSlots = numSlots;
+	hdr->slotOffset = g_shmSlotOffset;
+	hdr->slotSize = slotSize;
+
+	LogVerbose("Created shared memory ring %s (%zu slots of %zu MB)\n", name.c_str(), numSlots, slotSize >> 20);
+	return true;
+#endif
+}
+
+/**
+	@brief Unmaps and removes the shared memory ring
+ */
+void ShmDestroy(ShmRing& ring)
+{
+#ifndef _WIN32
+	if(ring.base)
+		munmap(ring.base, ring.mapSize);
+	if(ring.fd >= 0)
+	{
+		close(ring.fd);
+		shm_unlink(ring.name.c_str());
+	}
+#endif
+	ring.base = NULL;
+	ring.fd = -1;
+}
+
+/**
+	@brief Sends a doorbell saying the next waveform follows inline on the socket
+ */
+bool ShmSendInline(Socket& sock, uint64_t bytes)
+{
+	ShmDoorbell bell;
+	bell.slot = SHM_SLOT_INLINE;
+	bell.reserved = 0;
+	bell.length = bytes;
+	return sock.SendLooped((uint8_t*)&bell, sizeof(bell));
+}
+
+/**
+	@brief Sends a waveform through the ring, or inline if it doesn't fit in a slot
+
+	The caller must make sure fewer than numSlots waveforms are waiting for an ACK, so the next slot is free.
+
+	@param ring		The ring
+	@param sock		Data plane socket, to send the doorbell on
+	@param chunks	The waveform, as it would be passed to SendGathered()
+	@param bytes	Total size of the chunks
+
+	@return False if the connection was lost
+ */
+bool ShmSend(ShmRing& ring, Socket& sock, const vector<SendChunk>& chunks, uint64_t bytes)
+{
+	if(!ring.base || (bytes > ring.slotSize) )
+	{
+		if(!ShmSendInline(sock, bytes))
+			return false;
+		return SendGathered(sock, chunks);
+	}
+
+	size_t slot = ring.nextSlot;
+	ring.nextSlot = (ring.nextSlot + 1) % ring.numSlots;
+
+	uint8_t* p = ring.base + g_shmSlotOffset + slot * ring.slotSize;
+	for(auto& c : chunks)
+	{
+		memcpy(p, c.data, c.len);
+		p += c.len;
+	}
+
+	ShmDoorbell bell;
+	bell.slot = slot;
+	bell.reserved = 0;
+	bell.length = bytes;
+	return sock.SendLooped((uint8_t*)&bell, sizeof(bell));
+}
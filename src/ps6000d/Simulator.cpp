@@ -0,0 +1,591 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Simulated instrument, for benchmarking the bridge without hardware
+
+	Selected with --simulate on the command line. The simulator implements the subset of the driver API the bridge
+	uses, modelled on the 6000E series: a 5 GS/s timebase, 8/10/12 bit resolution, rapid block mode and hardware
+	downsampling. Captures complete after the acquisition time of the requested memory depth (plus an optional
+	random wait for a trigger), and downloads are throttled to a configurable USB bandwidth, so the data plane sees
+	realistic timing.
+
+	Each channel outputs a sine wave plus noise, with a rising zero crossing at the trigger point.
+	Streaming mode and MSO pods are not simulated.
+ */
+#include "ps6000d.h"
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <math.h>
+#include <string.h>
+
+using namespace std;
+
+//Total sample memory, shared between segments and enabled channels
+#define SIM_MEMORY_DEPTH (256 * 1024 * 1024)
+
+//Fixed driver overheads, roughly what a 6000E on USB 3 shows
+#define SIM_ARM_LATENCY_US		50
+#define SIM_DOWNLOAD_LATENCY_US	100
+
+//Simulated download bandwidth, in MB/s
+double g_simBandwidth = 400;
+
+//Mean trigger rate of the simulated signal, in Hz. 0 = always triggers right away
+double g_simTriggerRate = 0;
+
+struct SimChannel
+{
+	bool enabled;
+	double range;
+	double offset;
+
+	//One or more whole periods of the signal, at the current resolution
+	vector<int16_t> pattern;
+	size_t period;
+};
+
+struct SimBuffer
+{
+	int16_t* max;
+	int16_t* min;
+	int32_t len;
+};
+
+static mutex g_simMutex;
+static condition_variable g_simCond;
+
+static bool g_simOpen = false;
+static int16_t g_simHandle = 0;
+static size_t g_simNumChannels = 0;
+static size_t g_simBits = 8;
+static vector<SimChannel> g_simChannels;
+static map<pair<PICO_CHANNEL, uint64_t>, SimBuffer> g_simBuffers;
+static uint64_t g_simSegments = 1;
+static uint64_t g_simCaptures = 1;
+static uint32_t g_simTriggerTimeoutUs = 0;
+
+//Block capture state
+static bool g_simArmed = false;
+static bool g_simCaptured = false;
+static uint64_t g_simGeneration = 0;
+static chrono::steady_clock::time_point g_simDeadline;
+static simBlockReady g_simCallback = NULL;
+static void* g_simParam = NULL;
+static uint64_t g_simPreTrigger = 0;
+static uint64_t g_simCapturedDepth = 0;
+
+static minstd_rand g_simRandom;
+
+static void SimCaptureThread();
+static void SimGeneratePattern(size_t chan);
+static double SimIntervalNs(uint32_t timebase);
+static size_t SimEnabledChannels();
+static PICO_STATUS SimDownload(
+	uint64_t* noOfSamples,
+	uint64_t fromSegmentIndex,
+	uint64_t toSegmentIndex,
+	uint64_t downSampleRatio,
+	int16_t* overflow);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Unit management
+
+PICO_STATUS simOpenUnit(int16_t* handle, size_t numChannels)
+{
+	lock_guard<mutex> lock(g_simMutex);
+	if(g_simOpen)
+		return PICO_MAX_UNITS_OPENED;
+	if( (numChannels < 1) || (numChannels > 8) )
+		return PICO_INVALID_PARAMETER;
+
+	g_simOpen = true;
+	g_simHandle = 1;
+	g_simNumChannels = numChannels;
+	g_simChannels.resize(numChannels);
+	for(size_t i=0; i<numChannels; i++)
+	{
+		g_simChannels[i].enabled = false;
+		g_simChannels[i].range = 1;
+		g_simChannels[i].offset = 0;
+		SimGeneratePattern(i);
+	}
+	*handle = g_simHandle;
+
+	thread(SimCaptureThread).detach();
+	return PICO_OK;
+}
+
+PICO_STATUS simCloseUnit(int16_t /*handle*/)
+{
+	lock_guard<mutex> lock(g_simMutex);
+	g_simOpen = false;
+	g_simArmed = false;
+	g_simGeneration ++;
+	g_simCond.notify_all();
+	return PICO_OK;
+}
+
+PICO_STATUS simGetUnitInfo(int16_t /*handle*/, int8_t* str, int16_t stringLength, int16_t* requiredSize, PICO_INFO info)
+{
+	string value;
+	switch(info)
+	{
+		case PICO_DRIVER_VERSION:
+		case PICO_FIRMWARE_VERSION_1:
+			value = "1.0.0";
+			break;
+
+		case PICO_VARIANT_INFO:
+			value = "SIM" + to_string(g_simNumChannels);
+			break;
+
+		case PICO_BATCH_AND_SERIAL:
+			value = "SIM/0001";
+			break;
+
+		default:
+			return PICO_INVALID_INFO;
+	}
+
+	*requiredSize = value.length() + 1;
+	if(stringLength < *requiredSize)
+		return PICO_INVALID_PARAMETER;
+	memcpy(str, value.c_str(), value.length() + 1);
+	return PICO_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Front end and timebase
+
+PICO_STATUS simSetChannel(int16_t /*handle*/, size_t channel, bool enabled, double range_V, double offset_V)
+{
+	lock_guard<mutex> lock(g_simMutex);
+	if(channel >= g_simNumChannels)
+		return PICO_INVALID_CHANNEL;
+
+	auto& chan = g_simChannels[channel];
+	chan.enabled = enabled;
+	chan.range = range_V;
+	chan.offset = offset_V;
+	return PICO_OK;
+}
+
+PICO_STATUS simGetAnalogueOffsetLimits(int16_t /*handle*/, double range_V, double* maximumVoltage, double* minimumVoltage)
+{
+	//Same steps as the 6000E
+	double limit;
+	if(range_V <= 0.5)
+		limit = 1.25;
+	else if(range_V <= 5)
+		limit = 20;
+	else
+		limit = 200;
+
+	*maximumVoltage = limit;
+	*minimumVoltage = -limit;
+	return PICO_OK;
+}
+
+PICO_STATUS simGetAdcLimits(int16_t /*handle*/, int16_t* maxValue)
+{
+	lock_guard<mutex> lock(g_simMutex);
+	*maxValue = 32768 - (1 << (16 - g_simBits));
+	return PICO_OK;
+}
+
+PICO_STATUS simSetDeviceResolution(int16_t /*handle*/, size_t bits)
+{
+	if( (bits != 8) && (bits != 10) && (bits != 12) )
+		return PICO_INVALID_DEVICE_RESOLUTION;
+
+	lock_guard<mutex> lock(g_simMutex);
+	g_simBits = bits;
+	for(size_t i=0; i<g_simNumChannels; i++)
+		SimGeneratePattern(i);
+
+	//Like the real driver, a resolution change invalidates the buffers
+	g_simBuffers.clear();
+	g_simCaptured = false;
+	return PICO_OK;
+}
+
+PICO_STATUS simGetTimebase(
+	int16_t /*handle*/,
+	uint32_t timebase,
+	uint64_t /*noSamples*/,
+	double* timeIntervalNanoseconds,
+	uint64_t* maxSamples,
+	uint64_t /*segmentIndex*/)
+{
+	lock_guard<mutex> lock(g_simMutex);
+
+	size_t enabled = SimEnabledChannels();
+	if(enabled == 0)
+		return PICO_NO_CHANNELS_OR_PORTS_ENABLED;
+
+	//Higher resolution and more channels both cost sample rate
+	uint32_t minTimebase = (g_simBits - 8) / 2;
+	uint32_t channelTimebase = 0;
+	while( (1U << channelTimebase) < enabled)
+		channelTimebase ++;
+	minTimebase = max(minTimebase, channelTimebase);
+	if(timebase < minTimebase)
+		return PICO_INVALID_TIMEBASE;
+
+	if(timeIntervalNanoseconds)
+		*timeIntervalNanoseconds = SimIntervalNs(timebase);
+	if(maxSamples)
+		*maxSamples = SIM_MEMORY_DEPTH / g_simSegments / enabled;
+	return PICO_OK;
+}
+
+PICO_STATUS simMemorySegments(int16_t /*handle*/, uint64_t nSegments, uint64_t* nMaxSamples)
+{
+	if(nSegments < 1)
+		return PICO_TOO_MANY_SEGMENTS;
+
+	lock_guard<mutex> lock(g_simMutex);
+	g_simSegments = nSegments;
+	g_simBuffers.clear();
+	if(nMaxSamples)
+		*nMaxSamples = SIM_MEMORY_DEPTH / nSegments;
+	return PICO_OK;
+}
+
+PICO_STATUS simSetNoOfCaptures(int16_t /*handle*/, uint64_t nCaptures)
+{
+	lock_guard<mutex> lock(g_simMutex);
+	if( (nCaptures < 1) || (nCaptures > g_simSegments) )
+		return PICO_INVALID_PARAMETER;
+	g_simCaptures = nCaptures;
+	return PICO_OK;
+}
+
+PICO_STATUS simSetSimpleTrigger(int16_t /*handle*/, uint32_t autoTriggerMicroSeconds)
+{
+	lock_guard<mutex> lock(g_simMutex);
+	g_simTriggerTimeoutUs = autoTriggerMicroSeconds;
+	return PICO_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Block capture
+
+PICO_STATUS simRunBlock(
+	int16_t /*handle*/,
+	uint64_t noOfPreTriggerSamples,
+	uint64_t noOfPostTriggerSamples,
+	uint32_t timebase,
+	double* timeIndisposedMs,
+	uint64_t /*segmentIndex*/,
+	simBlockReady lpReady,
+	void* pParameter)
+{
+	lock_guard<mutex> lock(g_simMutex);
+	if(g_simArmed)
+		return PICO_HARDWARE_CAPTURING_CALL_STOP;
+	if(SimEnabledChannels() == 0)
+		return PICO_NO_CHANNELS_OR_PORTS_ENABLED;
+
+	//Acquisition time of every segment, plus waiting for each trigger
+	uint64_t depth = noOfPreTriggerSamples + noOfPostTriggerSamples;
+	double captureUs = g_simCaptures * depth * SimIntervalNs(timebase) * 1e-3;
+	if(g_simTriggerRate > 0)
+	{
+		exponential_distribution<double> wait(g_simTriggerRate);
+		for(size_t i=0; i<g_simCaptures; i++)
+		{
+			double us = wait(g_simRandom) * 1e6;
+			if(g_simTriggerTimeoutUs)
+				us = min(us, static_cast<double>(g_simTriggerTimeoutUs));
+			captureUs += us;
+		}
+	}
+	if(timeIndisposedMs)
+		*timeIndisposedMs = captureUs * 1e-3;
+
+	g_simPreTrigger = noOfPreTriggerSamples;
+	g_simCapturedDepth = depth;
+	g_simCaptured = false;
+	g_simCallback = lpReady;
+	g_simParam = pParameter;
+	g_simDeadline = chrono::steady_clock::now() +
+		chrono::microseconds(SIM_ARM_LATENCY_US + static_cast<int64_t>(captureUs));
+	g_simArmed = true;
+	g_simGeneration ++;
+	g_simCond.notify_all();
+	return PICO_OK;
+}
+
+PICO_STATUS simStop(int16_t /*handle*/)
+{
+	lock_guard<mutex> lock(g_simMutex);
+	if(g_simArmed)
+	{
+		g_simArmed = false;
+		g_simGeneration ++;
+		g_simCond.notify_all();
+	}
+	return PICO_OK;
+}
+
+/**
+	@brief Completes armed captures once their acquisition time is up, calling the block ready callback
+ */
+static void SimCaptureThread()
+{
+#ifdef __linux__
+	pthread_setname_np(pthread_self(), "SimCapture");
+#endif
+
+	unique_lock<mutex> lock(g_simMutex);
+	while(g_simOpen)
+	{
+		g_simCond.wait(lock, [] { return g_simArmed || !g_simOpen; });
+		if(!g_simOpen)
+			break;
+
+		//Wait out the capture, unless it's stopped or re-armed meanwhile
+		uint64_t generation = g_simGeneration;
+		g_simCond.wait_until(lock, g_simDeadline, [generation] { return g_simGeneration != generation; });
+		if(g_simGeneration != generation)
+			continue;
+
+		g_simArmed = false;
+		g_simCaptured = true;
+		auto callback = g_simCallback;
+		auto param = g_simParam;
+		auto handle = g_simHandle;
+
+		lock.unlock();
+		if(callback)
+			callback(handle, PICO_OK, param);
+		lock.lock();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Download
+
+PICO_STATUS simSetDataBuffer(
+	int16_t handle,
+	PICO_CHANNEL channel,
+	int16_t* buffer,
+	int32_t nSamples,
+	uint64_t segmentIndex,
+	PICO_RATIO_MODE mode,
+	PICO_ACTION action)
+{
+	return simSetDataBuffers(handle, channel, buffer, NULL, nSamples, segmentIndex, mode, action);
+}
+
+PICO_STATUS simSetDataBuffers(
+	int16_t /*handle*/,
+	PICO_CHANNEL channel,
+	int16_t* bufferMax,
+	int16_t* bufferMin,
+	int32_t nSamples,
+	uint64_t segmentIndex,
+	PICO_RATIO_MODE /*mode*/,
+	PICO_ACTION action)
+{
+	lock_guard<mutex> lock(g_simMutex);
+
+	if(action & PICO_CLEAR_ALL)
+		g_simBuffers.clear();
+	if(action & PICO_ADD)
+	{
+		if(static_cast<size_t>(channel) >= g_simNumChannels)
+			return PICO_INVALID_CHANNEL;
+		if(segmentIndex >= g_simSegments)
+			return PICO_SEGMENT_OUT_OF_RANGE;
+		g_simBuffers[make_pair(channel, segmentIndex)] = {bufferMax, bufferMin, nSamples};
+	}
+	return PICO_OK;
+}
+
+PICO_STATUS simGetValues(
+	int16_t /*handle*/,
+	uint64_t /*startIndex*/,
+	uint64_t* noOfSamples,
+	uint64_t downSampleRatio,
+	PICO_RATIO_MODE /*downSampleRatioMode*/,
+	uint64_t segmentIndex,
+	int16_t* overflow)
+{
+	return SimDownload(noOfSamples, segmentIndex, segmentIndex, downSampleRatio, overflow);
+}
+
+PICO_STATUS simGetValuesBulk(
+	int16_t /*handle*/,
+	uint64_t /*startIndex*/,
+	uint64_t* noOfSamples,
+	uint64_t fromSegmentIndex,
+	uint64_t toSegmentIndex,
+	uint64_t downSampleRatio,
+	PICO_RATIO_MODE /*downSampleRatioMode*/,
+	int16_t* overflow)
+{
+	return SimDownload(noOfSamples, fromSegmentIndex, toSegmentIndex, downSampleRatio, overflow);
+}
+
+/**
+	@brief Fills the attached buffers of every enabled channel, taking as long as the transfer would over USB
+
+	Downsampling always decimates (aggregate mode gets the same value for max and min), which doesn't matter
+	for throughput.
+ */
+static PICO_STATUS SimDownload(
+	uint64_t* noOfSamples,
+	uint64_t fromSegmentIndex,
+	uint64_t toSegmentIndex,
+	uint64_t downSampleRatio,
+	int16_t* overflow)
+{
+	auto start = chrono::steady_clock::now();
+	uint64_t bytes = 0;
+	{
+		lock_guard<mutex> lock(g_simMutex);
+		if(!g_simCaptured)
+			return PICO_NO_SAMPLES_AVAILABLE;
+		if( (toSegmentIndex < fromSegmentIndex) || (toSegmentIndex >= g_simCaptures) )
+			return PICO_SEGMENT_OUT_OF_RANGE;
+
+		uint64_t ratio = max(downSampleRatio, static_cast<uint64_t>(1));
+		uint64_t count = min(*noOfSamples, (g_simCapturedDepth + ratio - 1) / ratio);
+
+		for(size_t chan=0; chan<g_simNumChannels; chan++)
+		{
+			auto& sc = g_simChannels[chan];
+			if(!sc.enabled)
+				continue;
+
+			for(uint64_t seg=fromSegmentIndex; seg<=toSegmentIndex; seg++)
+			{
+				auto it = g_simBuffers.find(make_pair(static_cast<PICO_CHANNEL>(chan), seg));
+				if(it == g_simBuffers.end())
+					return PICO_BUFFERS_NOT_SET;
+				auto& buf = it->second;
+				uint64_t n = min(count, static_cast<uint64_t>(buf.len));
+
+				//Random number of whole periods in, then back up so the zero crossing lands on the trigger
+				size_t len = sc.pattern.size();
+				size_t phase = (g_simRandom() % (len / sc.period)) * sc.period;
+				size_t pos = (phase + len - (g_simPreTrigger % len)) % len;
+
+				if(ratio == 1)
+				{
+					for(uint64_t i=0; i<n; )
+					{
+						size_t run = min(static_cast<uint64_t>(len - pos), n - i);
+						memcpy(buf.max + i, &sc.pattern[pos], run * sizeof(int16_t));
+						i += run;
+						pos = 0;
+					}
+				}
+				else
+				{
+					for(uint64_t i=0; i<n; i++)
+					{
+						buf.max[i] = sc.pattern[pos];
+						pos = (pos + ratio) % len;
+					}
+				}
+				if(buf.min)
+					memcpy(buf.min, buf.max, n * sizeof(int16_t));
+
+				bytes += n * sizeof(int16_t);
+			}
+		}
+
+		*noOfSamples = count;
+		for(uint64_t seg=fromSegmentIndex; seg<=toSegmentIndex; seg++)
+			overflow[seg - fromSegmentIndex] = 0;
+	}
+
+	//Hold the caller for as long as the real transfer would take
+	auto duration = chrono::microseconds(SIM_DOWNLOAD_LATENCY_US + static_cast<int64_t>(bytes / g_simBandwidth));
+	this_thread::sleep_until(start + duration);
+	return PICO_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+/**
+	@brief Generates the signal for one channel: a sine wave at 80% of full scale plus some noise
+
+	Must be called with g_simMutex held.
+ */
+static void SimGeneratePattern(size_t chan)
+{
+	auto& sc = g_simChannels[chan];
+
+	//Different frequency on each channel, 64 whole periods in the pattern so it wraps seamlessly
+	sc.period = 1000 + 250*chan;
+	sc.pattern.resize(64 * sc.period);
+
+	int lsb = 1 << (16 - g_simBits);
+	int fullScale = 32768 - lsb;
+	normal_distribution<double> noise(0, 0.005 * fullScale);
+	for(size_t i=0; i<sc.pattern.size(); i++)
+	{
+		double v = 0.8 * fullScale * sin(2 * M_PI * i / sc.period) + noise(g_simRandom);
+		int code = lround(v / lsb) * lsb;
+		sc.pattern[i] = min(max(code, -fullScale), fullScale);
+	}
+}
+
+/**
+	@brief Sample interval of a timebase, using the 6000E numbering
+ */
+static double SimIntervalNs(uint32_t timebase)
+{
+	if(timebase < 5)
+		return (1 << timebase) / 5.0;
+	return (timebase - 4) / 0.15625;
+}
+
+/**
+	@brief Number of enabled channels. Must be called with g_simMutex held.
+ */
+static size_t SimEnabledChannels()
+{
+	size_t enabled = 0;
+	for(auto& c : g_simChannels)
+	{
+		if(c.enabled)
+			enabled ++;
+	}
+	return enabled;
+}
@@ -0,0 +1,274 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Scatter-gather (and optionally zero-copy) sending of waveform data
+ */
+#include "ps6000d.h"
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+#endif
+
+using namespace std;
+
+//Send large waveforms with MSG_ZEROCOPY (--zerocopy, Linux only)
+bool g_zeroCopySend = false;
+
+//Sends made with MSG_ZEROCOPY on the data socket, and how many of them the kernel has finished with
+static uint32_t g_zeroCopySent = 0;
+static uint32_t g_zeroCopyCompleted = 0;
+
+//Don't bother with zero-copy for small sends, pinning pages costs more than copying them
+static const size_t g_zeroCopyThreshold = 256 * 1024;
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY)
+bool WaitForZeroCopyCompletion(ZSOCKET sock);
+#endif
+
+/**
+	@brief Enables MSG_ZEROCOPY on a socket, if the kernel supports it
+
+	@return True if zero-copy sends can be used
+ */
+bool EnableZeroCopySend(Socket& sock)
+{
+	g_zeroCopySent = 0;
+	g_zeroCopyCompleted = 0;
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+	int one = 1;
+	if(0 != setsockopt(static_cast<ZSOCKET>(sock), SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+		return false;
+	return true;
+#else
+	(void)sock;
+	return false;
+#endif
+}
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY)
+/**
+	@brief Blocks until the kernel reports it's done with every zero-copy send we've made
+
+	Completions arrive on the socket error queue as ranges of send counters. Buffers must not be reused
+	(or freed) until they've come back.
+
+	@return False on a socket error
+ */
+bool WaitForZeroCopyCompletion(ZSOCKET sock)
+{
+	while(g_zeroCopyCompleted != g_zeroCopySent)
+	{
+		pollfd pfd;
+		pfd.fd = sock;
+		pfd.events = 0;
+		pfd.revents = 0;
+		if(poll(&pfd, 1, 1000) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		if(!(pfd.revents & POLLERR))
+			continue;
+
+		char control[128];
+		msghdr msg = {};
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if(recvmsg(sock, &msg, MSG_ERRQUEUE) < 0)
+		{
+			if( (errno == EAGAIN) || (errno == EINTR) )
+				continue;
+			return false;
+		}
+
+		for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			auto err = reinterpret_cast<sock_extended_err*>(CMSG_DATA(cm));
+			if( (err->ee_errno != 0) || (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) )
+				continue;
+
+			//ee_info..ee_data is the (inclusive) range of sends that completed
+			g_zeroCopyCompleted = err->ee_data + 1;
+		}
+	}
+	return true;
+}
+#endif
+
+/**
+	@brief Sends a list of buffers with as few system calls as possible
+
+	All headers and sample buffers of a waveform go out in one writev-style call (looping only on short writes),
+	rather than one send per buffer. If zero-copy is enabled and the data is big enough, the kernel sends straight
+	from our buffers; in that case this blocks until it has finished with them, so the caller may reuse them
+	as soon as we return.
+
+	@param allowZeroCopy	Set false for sends from threads other than the waveform thread's sender, since
+							zero-copy completion tracking is per process
+
+	@return False if the connection was lost
+ */
+bool SendGathered(Socket& sock, const vector<SendChunk>& chunks, bool allowZeroCopy)
+{
+	(void)allowZeroCopy;	//only used on Linux
+
+	size_t total = 0;
+	for(auto& c : chunks)
+		total += c.len;
+	if(total == 0)
+		return true;
+
+#ifdef _WIN32
+	vector<WSABUF> bufs;
+	for(auto& c : chunks)
+	{
+		//WSABUF lengths are 32 bits, split anything bigger
+		const uint8_t* p = static_cast<const uint8_t*>(c.data);
+		size_t len = c.len;
+		while(len > 0)
+		{
+			WSABUF b;
+			b.len = (len > 0x40000000) ? 0x40000000 : len;
+			b.buf = (char*)p;
+			bufs.push_back(b);
+			p += b.len;
+			len -= b.len;
+		}
+	}
+
+	size_t first = 0;
+	while(first < bufs.size())
+	{
+		DWORD sent = 0;
+		if(0 != WSASend(static_cast<ZSOCKET>(sock), &bufs[first], bufs.size() - first, &sent, 0, NULL, NULL))
+			return false;
+
+		//Skip whatever went out
+		while( (first < bufs.size()) && (sent >= bufs[first].len) )
+		{
+			sent -= bufs[first].len;
+			first ++;
+		}
+		if(first < bufs.size())
+		{
+			bufs[first].buf += sent;
+			bufs[first].len -= sent;
+		}
+	}
+	return true;
+
+#else
+	ZSOCKET fd = static_cast<ZSOCKET>(sock);
+
+	vector<iovec> iov;
+	iov.reserve(chunks.size());
+	for(auto& c : chunks)
+	{
+		if(c.len == 0)
+			continue;
+		iovec v;
+		v.iov_base = const_cast<void*>(c.data);
+		v.iov_len = c.len;
+		iov.push_back(v);
+	}
+
+	int flags = 0;
+	#ifdef MSG_NOSIGNAL
+		flags |= MSG_NOSIGNAL;
+	#endif
+	#if defined(__linux__) && defined(MSG_ZEROCOPY)
+		bool zeroCopy = allowZeroCopy && g_zeroCopySend && (total >= g_zeroCopyThreshold);
+		if(zeroCopy)
+			flags |= MSG_ZEROCOPY;
+	#endif
+
+	size_t first = 0;
+	while(first < iov.size())
+	{
+		msghdr msg = {};
+		msg.msg_iov = &iov[first];
+		msg.msg_iovlen = min(iov.size() - first, static_cast<size_t>(IOV_MAX));
+
+		ssize_t sent = sendmsg(fd, &msg, flags);
+		if(sent < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			#if defined(__linux__) && defined(MSG_ZEROCOPY)
+				//Out of locked memory for pinning pages, fall back to copying
+				if( (errno == ENOBUFS) && (flags & MSG_ZEROCOPY) )
+				{
+					flags &= ~MSG_ZEROCOPY;
+					continue;
+				}
+			#endif
+
+			return false;
+		}
+
+		#if defined(__linux__) && defined(MSG_ZEROCOPY)
+			if(flags & MSG_ZEROCOPY)
+				g_zeroCopySent ++;
+		#endif
+
+		//Skip whatever went out
+		size_t remaining = sent;
+		while( (first < iov.size()) && (remaining >= iov[first].iov_len) )
+		{
+			remaining -= iov[first].iov_len;
+			first ++;
+		}
+		if(first < iov.size())
+		{
+			iov[first].iov_base = static_cast<uint8_t*>(iov[first].iov_base) + remaining;
+			iov[first].iov_len -= remaining;
+		}
+	}
+
+	#if defined(__linux__) && defined(MSG_ZEROCOPY)
+		if(zeroCopy && !WaitForZeroCopyCompletion(fd))
+			return false;
+	#endif
+
+	return true;
+#endif
+}
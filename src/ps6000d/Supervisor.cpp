@@ -0,0 +1,333 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Multi-instrument mode: one worker process per connected unit
+ */
+#include "ps6000d.h"
+#include <ctype.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+using namespace std;
+
+#ifndef _WIN32
+//Running workers and the unit each one serves
+vector<pair<pid_t, string> > g_workers;
+void OnSupervisorQuit(int sig);
+#endif
+
+vector<int> ShareOfCores(const vector<int>& cores, size_t unit, size_t units);
+string JoinCoreList(const vector<int>& cores);
+
+/**
+	@brief Splits a comma separated list of serial numbers, as returned by psXXXXEnumerateUnits
+ */
+void AppendSerials(vector<string>& serials, const char* list)
+{
+	string s;
+	for(const char* p = list; ; p++)
+	{
+		if( (*p == ',') || (*p == '\0') )
+		{
+			if(!s.empty())
+				serials.push_back(s);
+			s.clear();
+			if(*p == '\0')
+				break;
+		}
+		else if(!isspace(*p))
+			s += *p;
+	}
+}
+
+/**
+	@brief Finds the serial numbers of every instrument we can open
+
+	@param series	Only look for this series (as in --series), or 0 for all
+ */
+vector<string> EnumerateUnits(int series)
+{
+	vector<string> serials;
+
+	int8_t buf[1024];
+	int16_t count;
+	int16_t len;
+
+	if( (series == 0) || (series == 2) )
+	{
+		count = 0;
+		len = sizeof(buf);
+		if(PICO_OK == ps2000aEnumerateUnits(&count, buf, &len))
+			AppendSerials(serials, (const char*)buf);
+	}
+	if( (series == 0) || (series == 3) )
+	{
+		count = 0;
+		len = sizeof(buf);
+		if(PICO_OK == ps3000aEnumerateUnits(&count, buf, &len))
+			AppendSerials(serials, (const char*)buf);
+		count = 0;
+		len = sizeof(buf);
+		if(PICO_OK == psospaEnumerateUnits(&count, buf, &len))
+			AppendSerials(serials, (const char*)buf);
+	}
+	if( (series == 0) || (series == 4) )
+	{
+		count = 0;
+		len = sizeof(buf);
+		if(PICO_OK == ps4000aEnumerateUnits(&count, buf, &len))
+			AppendSerials(serials, (const char*)buf);
+	}
+	if( (series == 0) || (series == 5) )
+	{
+		count = 0;
+		len = sizeof(buf);
+		if(PICO_OK == ps5000aEnumerateUnits(&count, buf, &len))
+			AppendSerials(serials, (const char*)buf);
+	}
+	if( (series == 0) || (series == 6) )
+	{
+		count = 0;
+		len = sizeof(buf);
+		if(PICO_OK == ps6000aEnumerateUnits(&count, buf, &len))
+			AppendSerials(serials, (const char*)buf);
+	}
+
+	return serials;
+}
+
+#ifndef _WIN32
+void OnSupervisorQuit(int sig)
+{
+	for(auto& w : g_workers)
+		kill(w.first, sig);
+}
+#endif
+
+/**
+	@brief Picks the cores of one unit out of a core list shared by all units
+
+	Each unit gets a contiguous slice, so its threads stay close together. With fewer cores than units, units have
+	to share: unit i gets core i modulo the number of cores.
+ */
+vector<int> ShareOfCores(const vector<int>& cores, size_t unit, size_t units)
+{
+	if(cores.empty())
+		return cores;
+	if(cores.size() < units)
+		return vector<int>(1, cores[unit % cores.size()]);
+
+	size_t first = unit * cores.size() / units;
+	size_t last = (unit + 1) * cores.size() / units;
+	return vector<int>(cores.begin() + first, cores.begin() + last);
+}
+
+/**
+	@brief Formats a core list the way ParseCoreList() reads it
+ */
+string JoinCoreList(const vector<int>& cores)
+{
+	string ret;
+	for(auto c : cores)
+	{
+		if(!ret.empty())
+			ret += ",";
+		ret += to_string(c);
+	}
+	return ret;
+}
+
+/**
+	@brief Runs one worker per instrument and waits for them all to exit
+
+	Each worker is a copy of this process (same arguments, minus the multi-instrument ones) opening one unit by serial
+	number. Unit i gets SCPI port scpi_port + 2*i and waveform port waveform_port + 2*i, plus subscriber port
+	subscriber_port + i if subscribers are enabled.
+
+	Instrument state is per process, so this is what keeps one slow or crashed unit from affecting the others, and
+	lets the OS spread the units across cores. --data-cores and --compress-cores are split between the units, and
+	without --compress-cores each unit gets its share of the machine's cores as compression threads, so N units
+	don't contend for the same cores N times over.
+
+	@return Exit code for the supervisor
+ */
+int RunSupervisor(
+	int argc,
+	char* argv[],
+	const vector<string>& serials,
+	uint16_t scpi_port,
+	uint16_t waveform_port,
+	uint16_t subscriber_port)
+{
+	if(serials.empty())
+	{
+		LogError("No instruments found\n");
+		return 1;
+	}
+
+#ifdef _WIN32
+	(void)argc;
+	(void)argv;
+	(void)scpi_port;
+	(void)waveform_port;
+	(void)subscriber_port;
+	LogError("Multi-instrument mode is not supported on Windows, run one ps6000d per unit with --serial\n");
+	return 1;
+#else
+
+	//Pass everything through to the workers except the arguments we set for them
+	vector<string> baseArgs;
+	for(int i=1; i<argc; i++)
+	{
+		string s(argv[i]);
+		if(s == "--all-units")
+			continue;
+		if( (s == "--serials") || (s == "--serial") || (s == "--scpi-port") || (s == "--waveform-port") ||
+			(s == "--subscriber-port") || (s == "--data-cores") || (s == "--compress-cores") ||
+			(s == "--compress-threads") )
+		{
+			i++;
+			continue;
+		}
+		baseArgs.push_back(s);
+	}
+
+	//Don't reallocate under the signal handler
+	g_workers.reserve(serials.size());
+	signal(SIGINT, OnSupervisorQuit);
+	signal(SIGTERM, OnSupervisorQuit);
+
+	if( (g_dataCores.size() < serials.size()) && !g_dataCores.empty() )
+		LogWarning("Fewer data cores than units, some units will share a core\n");
+	if( (g_compressCores.size() < serials.size()) && !g_compressCores.empty() )
+		LogWarning("Fewer compression cores than units, some units will share a core\n");
+
+	//Compression threads per unit when they aren't pinned: the machine's cores less one, split between the units
+	size_t compressThreads = g_compressionThreads;
+	if(compressThreads == 0)
+	{
+		size_t cores = thread::hardware_concurrency();
+		compressThreads = max(static_cast<size_t>(1), (cores > 1 ? cores - 1 : 1) / serials.size());
+	}
+
+	for(size_t i=0; i<serials.size(); i++)
+	{
+		vector<string> args = baseArgs;
+
+		//Each unit's own share of the cores
+		auto dataCores = ShareOfCores(g_dataCores, i, serials.size());
+		auto compressCores = ShareOfCores(g_compressCores, i, serials.size());
+		if(!dataCores.empty())
+		{
+			args.push_back("--data-cores");
+			args.push_back(JoinCoreList(dataCores));
+		}
+		if(!compressCores.empty())
+		{
+			args.push_back("--compress-cores");
+			args.push_back(JoinCoreList(compressCores));
+		}
+		if(compressCores.empty() || (g_compressionThreads != 0) )
+		{
+			args.push_back("--compress-threads");
+			args.push_back(to_string(compressThreads));
+		}
+
+		args.push_back("--serial");
+		args.push_back(serials[i]);
+		args.push_back("--scpi-port");
+		args.push_back(to_string(scpi_port + 2*i));
+		args.push_back("--waveform-port");
+		args.push_back(to_string(waveform_port + 2*i));
+		if(subscriber_port != 0)
+		{
+			args.push_back("--subscriber-port");
+			args.push_back(to_string(subscriber_port + i));
+		}
+
+		LogNotice("Unit %s: ports %zu, %zu\n",
+			serials[i].c_str(), static_cast<size_t>(scpi_port + 2*i), static_cast<size_t>(waveform_port + 2*i));
+
+		pid_t pid = fork();
+		if(pid < 0)
+		{
+			LogError("Failed to start worker for unit %s\n", serials[i].c_str());
+			continue;
+		}
+		if(pid == 0)
+		{
+			vector<char*> cargs;
+			cargs.push_back(argv[0]);
+			for(auto& a : args)
+				cargs.push_back(const_cast<char*>(a.c_str()));
+			cargs.push_back(NULL);
+			execv("/proc/self/exe", &cargs[0]);
+			execvp(argv[0], &cargs[0]);
+			_exit(127);
+		}
+		g_workers.push_back(make_pair(pid, serials[i]));
+	}
+
+	//Wait for everyone to finish
+	int ret = 0;
+	size_t running = g_workers.size();
+	while(running > 0)
+	{
+		int status;
+		pid_t pid = wait(&status);
+		if(pid < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		running --;
+
+		for(auto& w : g_workers)
+		{
+			if(w.first != pid)
+				continue;
+			if(!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+			{
+				LogWarning("Worker for unit %s exited abnormally\n", w.second.c_str());
+				ret = 1;
+			}
+		}
+	}
+	return ret;
+#endif
+}
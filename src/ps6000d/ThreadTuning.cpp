@@ -0,0 +1,382 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief CPU affinity, real-time priority and NUMA placement of the data path
+
+	On a busy host the waveform thread can be descheduled in the middle of a download, or migrate to a core on the
+	other socket from the USB controller and the sample buffers. Optionally pin the data path (waveform and sender
+	threads) and the compression workers to chosen cores, run the data path under SCHED_FIFO, and bind new sample
+	buffers to one NUMA node.
+ */
+#include "ps6000d.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+//Cores the waveform and sender threads run on (--data-cores), empty to leave it to the OS
+vector<int> g_dataCores;
+
+//Cores the compression workers run on (--compress-cores), empty to leave it to the OS
+vector<int> g_compressCores;
+
+//SCHED_FIFO priority of the waveform and sender threads (--rt-priority), 0 for normal scheduling
+int g_rtPriority = 0;
+
+//NUMA node sample buffers are bound to (--numa-node), NUMA_NODE_ANY to leave it to the OS
+int g_numaNode = NUMA_NODE_ANY;
+
+static string FormatCoreList(const vector<int>& cores);
+static bool SetCurrentThreadAffinity(const vector<int>& cores);
+#ifdef __linux__
+static int GetNodeOfSysfsDevice(const string& path);
+static int GetUSBControllerNode();
+static int GetNodeOfCore(int core);
+#endif
+
+/**
+	@brief Parses a core list like "2,3,8-11"
+
+	@param list		The list
+	@param cores	Cores are appended here
+
+	@return False if the list is malformed
+ */
+bool ParseCoreList(const char* list, vector<int>& cores)
+{
+	const char* p = list;
+	while(*p != '\0')
+	{
+		char* end;
+		long first = strtol(p, &end, 10);
+		if( (end == p) || (first < 0) )
+			return false;
+		long last = first;
+		p = end;
+		if(*p == '-')
+		{
+			p++;
+			last = strtol(p, &end, 10);
+			if( (end == p) || (last < first) )
+				return false;
+			p = end;
+		}
+		for(long i=first; i<=last; i++)
+			cores.push_back(i);
+
+		if(*p == ',')
+			p++;
+		else if(*p != '\0')
+			return false;
+	}
+	return !cores.empty();
+}
+
+/**
+	@brief Formats a core list for log messages
+ */
+static string FormatCoreList(const vector<int>& cores)
+{
+	string ret;
+	for(auto c : cores)
+	{
+		if(!ret.empty())
+			ret += ",";
+		ret += to_string(c);
+	}
+	return ret;
+}
+
+/**
+	@brief Restricts the calling thread to a set of cores
+
+	@return False if the OS refused
+ */
+static bool SetCurrentThreadAffinity(const vector<int>& cores)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(auto c : cores)
+	{
+		if(c < CPU_SETSIZE)
+			CPU_SET(c, &set);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+	DWORD_PTR mask = 0;
+	for(auto c : cores)
+	{
+		if(c < static_cast<int>(sizeof(mask) * 8))
+			mask |= static_cast<DWORD_PTR>(1) << c;
+	}
+	return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+	(void)cores;
+	return false;
+#endif
+}
+
+/**
+	@brief Applies the configured affinity and priority to the calling waveform or sender thread
+
+	@param name		Thread name for log messages
+ */
+void TuneDataThread(const char* name)
+{
+	if(!g_dataCores.empty() && !SetCurrentThreadAffinity(g_dataCores))
+		LogWarning("%s: failed to pin to cores %s\n", name, FormatCoreList(g_dataCores).c_str());
+
+	if(g_rtPriority > 0)
+	{
+#ifdef __linux__
+		sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = min(g_rtPriority, sched_get_priority_max(SCHED_FIFO));
+		int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if(err != 0)
+		{
+			LogWarning("%s: failed to set SCHED_FIFO priority %d: %s (needs CAP_SYS_NICE or RLIMIT_RTPRIO)\n",
+				name, param.sched_priority, strerror(err));
+		}
+#elif defined(_WIN32)
+		if(!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+			LogWarning("%s: failed to raise thread priority\n", name);
+#endif
+	}
+}
+
+/**
+	@brief Applies the configured affinity to the calling compression worker
+
+	Workers are never given a real-time priority: they're CPU bound and would starve the rest of the system.
+ */
+void TuneCompressionThread()
+{
+	if(!g_compressCores.empty() && !SetCurrentThreadAffinity(g_compressCores))
+		LogWarning("Compression: failed to pin to cores %s\n", FormatCoreList(g_compressCores).c_str());
+}
+
+#ifdef __linux__
+
+/**
+	@brief Walks up from a sysfs device to the first ancestor (normally the PCI host controller) that has a NUMA node
+
+	@return The node, or NUMA_NODE_ANY if none is known
+ */
+static int GetNodeOfSysfsDevice(const string& path)
+{
+	char real[PATH_MAX];
+	if(realpath(path.c_str(), real) == NULL)
+		return NUMA_NODE_ANY;
+
+	string dir = real;
+	while(dir.length() > strlen("/sys/devices"))
+	{
+		FILE* fp = fopen((dir + "/numa_node").c_str(), "r");
+		if(fp)
+		{
+			int node = NUMA_NODE_ANY;
+			if(1 != fscanf(fp, "%d", &node))
+				node = NUMA_NODE_ANY;
+			fclose(fp);
+			return (node >= 0) ? node : NUMA_NODE_ANY;
+		}
+
+		size_t pos = dir.rfind('/');
+		if(pos == string::npos)
+			break;
+		dir.resize(pos);
+	}
+	return NUMA_NODE_ANY;
+}
+
+/**
+	@brief Finds the NUMA node of the USB controller the instrument is on
+
+	Picks the USB device with Pico's vendor ID and our serial number, or failing that the first Pico device found.
+
+	@return The node, or NUMA_NODE_ANY if it isn't known
+ */
+static int GetUSBControllerNode()
+{
+	DIR* dir = opendir("/sys/bus/usb/devices");
+	if(!dir)
+		return NUMA_NODE_ANY;
+
+	string firstPico;
+	string ours;
+	while(dirent* ent = readdir(dir))
+	{
+		string path = string("/sys/bus/usb/devices/") + ent->d_name;
+
+		char buf[128] = {0};
+		FILE* fp = fopen((path + "/idVendor").c_str(), "r");
+		if(!fp)
+			continue;
+		bool isPico = (fgets(buf, sizeof(buf), fp) != NULL) && (strncmp(buf, "0ce9", 4) == 0);
+		fclose(fp);
+		if(!isPico)
+			continue;
+
+		if(firstPico.empty())
+			firstPico = path;
+
+		fp = fopen((path + "/serial").c_str(), "r");
+		if(fp)
+		{
+			memset(buf, 0, sizeof(buf));
+			if(fgets(buf, sizeof(buf), fp) != NULL)
+				buf[strcspn(buf, "\r\n")] = '\0';
+			fclose(fp);
+			if(!g_serial.empty() && (g_serial == buf))
+				ours = path;
+		}
+	}
+	closedir(dir);
+
+	if(!ours.empty())
+		return GetNodeOfSysfsDevice(ours);
+	if(!firstPico.empty())
+		return GetNodeOfSysfsDevice(firstPico);
+	return NUMA_NODE_ANY;
+}
+
+/**
+	@brief Finds the NUMA node a core is on
+
+	@return The node, or NUMA_NODE_ANY if it isn't known
+ */
+static int GetNodeOfCore(int core)
+{
+	string path = "/sys/devices/system/cpu/cpu" + to_string(core);
+	DIR* dir = opendir(path.c_str());
+	if(!dir)
+		return NUMA_NODE_ANY;
+
+	int node = NUMA_NODE_ANY;
+	while(dirent* ent = readdir(dir))
+	{
+		if( (strncmp(ent->d_name, "node", 4) == 0) && isdigit(ent->d_name[4]) )
+		{
+			node = atoi(ent->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+#endif
+
+/**
+	@brief Resolves --numa-node auto and logs the data path settings
+
+	Called once the instrument is open (so we know which USB device is ours) and before any sample buffers exist.
+ */
+void ApplyThreadTuning()
+{
+	if(g_numaNode == NUMA_NODE_AUTO)
+	{
+		g_numaNode = NUMA_NODE_ANY;
+		const char* source = "";
+#ifdef __linux__
+		g_numaNode = GetUSBControllerNode();
+		source = "USB controller";
+		if( (g_numaNode == NUMA_NODE_ANY) && !g_dataCores.empty())
+		{
+			g_numaNode = GetNodeOfCore(g_dataCores[0]);
+			source = "first data core";
+		}
+#endif
+		if(g_numaNode == NUMA_NODE_ANY)
+			LogWarning("Couldn't find the NUMA node of the instrument, sample buffers will not be bound\n");
+		else
+			LogNotice("Sample buffers on NUMA node %d (%s)\n", g_numaNode, source);
+	}
+	else if(g_numaNode != NUMA_NODE_ANY)
+	{
+#ifdef __linux__
+		LogNotice("Sample buffers on NUMA node %d\n", g_numaNode);
+#else
+		LogWarning("--numa-node is only supported on Linux, ignoring\n");
+		g_numaNode = NUMA_NODE_ANY;
+#endif
+	}
+
+	if(!g_dataCores.empty())
+		LogNotice("Data path threads on cores %s\n", FormatCoreList(g_dataCores).c_str());
+	if(g_rtPriority > 0)
+	{
+#ifdef __linux__
+		LogNotice("Data path threads at SCHED_FIFO priority %d\n", g_rtPriority);
+#else
+		LogNotice("Data path threads at time critical priority\n");
+#endif
+	}
+	if(!g_compressCores.empty())
+		LogNotice("Compression workers on cores %s\n", FormatCoreList(g_compressCores).c_str());
+}
+
+/**
+	@brief Binds a freshly mapped, untouched buffer to the configured NUMA node
+
+	MPOL_PREFERRED rather than MPOL_BIND, so a full node spills over instead of failing the allocation.
+ */
+void BindToNumaNode(void* buf, size_t len)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	if( (g_numaNode < 0) || (g_numaNode >= static_cast<int>(sizeof(unsigned long) * 8)) )
+		return;
+
+	const int MPOL_PREFERRED_MODE = 1;
+	unsigned long mask = 1UL << g_numaNode;
+	if(0 != syscall(SYS_mbind, buf, len, MPOL_PREFERRED_MODE, &mask, sizeof(mask) * 8, 0))
+		LogDebug("mbind of %zu byte buffer to node %d failed: %s\n", len, g_numaNode, strerror(errno));
+#else
+	(void)buf;
+	(void)len;
+#endif
+}
@@ -0,0 +1,602 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* ps6000d                                                                                                              *
+*                                                                                                                      *
+* Copyright (c) 2012-2026 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Window, runt, pulse width and MSO pattern triggers
+
+	These go through the advanced trigger API (conditions, directions and channel properties, plus the pulse width
+	qualifier and digital port properties) so uninteresting events never leave the scope. The 6000E and PSOSPA APIs
+	share the structures; the 5000A V2 API has its own copies with the same layout, channel numbering and enum values.
+ */
+#include "ps6000d.h"
+#include <string.h>
+
+using namespace std;
+
+//Trigger type (TRIG:MODE)
+TriggerMode g_triggerMode = TRIGGER_EDGE;
+
+//Second threshold of window and runt triggers (TRIG:LOWER), TRIG:LEV is the upper one
+float g_triggerLowerVoltage = 0;
+
+//When a window trigger fires (TRIG:WINDOW)
+PICO_THRESHOLD_DIRECTION g_windowDirection = PICO_ENTER;
+
+//Polarity of runt pulses (TRIG:RUNT)
+PICO_THRESHOLD_DIRECTION g_runtDirection = PICO_POSITIVE_RUNT;
+
+//Pulse width qualifier (TRIG:PWTYPE, TRIG:PWLOWER, TRIG:PWUPPER), widths in fs
+PICO_PULSE_WIDTH_TYPE g_pulseWidthType = PICO_PW_TYPE_GREATER_THAN;
+int64_t g_pulseWidthLower = 0;
+int64_t g_pulseWidthUpper = 0;
+
+//MSO pattern (TRIG:PATTERN), one character per lane of each pod: 0, 1, R(ising), F(alling), E(ither edge) or X
+string g_triggerPattern;
+
+//Hysteresis of analog advanced trigger thresholds, in ADC codes
+static const uint16_t g_triggerHysteresis = 256;
+
+//Something other than a simple trigger is programmed into the scope and has to be cleared before the next one
+static bool g_advancedTriggerSet = false;
+
+//Everything one advanced trigger programs into the scope, in the structures of the unified API
+struct AdvancedTrigger
+{
+	vector<PICO_CONDITION> conditions;
+	vector<PICO_DIRECTION> directions;
+	vector<PICO_TRIGGER_CHANNEL_PROPERTIES> properties;
+
+	vector<PICO_CONDITION> pwqConditions;
+	vector<PICO_DIRECTION> pwqDirections;
+	PICO_PULSE_WIDTH_TYPE pwqType = PICO_PW_TYPE_NONE;
+	uint32_t pwqLower = 0;
+	uint32_t pwqUpper = 0;
+
+	//Lane directions of each MSO pod taking part, indexed by pod
+	map<size_t, vector<PICO_DIGITAL_CHANNEL_DIRECTIONS> > ports;
+};
+
+static PICO_CONDITION MakeCondition(PICO_CHANNEL source);
+static PICO_DIRECTION MakeDirection(PICO_CHANNEL channel, PICO_THRESHOLD_DIRECTION direction, PICO_THRESHOLD_MODE mode);
+static uint32_t PulseWidthSamples(int64_t fs);
+static bool BuildAdvancedTrigger(AdvancedTrigger& trig, int16_t upper, int16_t lower);
+static bool ApplyAdvancedTrigger6000(const AdvancedTrigger& trig, uint64_t delay, uint32_t timeout);
+static bool ApplyAdvancedTriggerPSOSPA(const AdvancedTrigger& trig, uint64_t delay, uint32_t timeout);
+static bool ApplyAdvancedTrigger5000(const AdvancedTrigger& trig, uint64_t delay, uint32_t timeout);
+
+static PICO_CONDITION MakeCondition(PICO_CHANNEL source)
+{
+	PICO_CONDITION cond;
+	memset(&cond, 0, sizeof(cond));
+	cond.source = source;
+	cond.condition = PICO_CONDITION_TRUE;
+	return cond;
+}
+
+static PICO_DIRECTION MakeDirection(PICO_CHANNEL channel, PICO_THRESHOLD_DIRECTION direction, PICO_THRESHOLD_MODE mode)
+{
+	PICO_DIRECTION dir;
+	memset(&dir, 0, sizeof(dir));
+	dir.channel = channel;
+	dir.direction = direction;
+	dir.thresholdMode = mode;
+	return dir;
+}
+
+/**
+	@brief Converts a pulse width to the sample intervals the qualifier counts in
+ */
+static uint32_t PulseWidthSamples(int64_t fs)
+{
+	if( (fs <= 0) || (g_sampleInterval <= 0) )
+		return 0;
+	return min(fs / g_sampleInterval, static_cast<int64_t>(UINT32_MAX));
+}
+
+/**
+	@brief Parses a TRIG:PATTERN argument
+
+	@param pattern	One character per lane, pod 0 lane 0 first
+	@param out		Receives the pattern in upper case, padded with X to every lane of every pod
+
+	@return False if the pattern is malformed or too long
+ */
+bool ParseTriggerPattern(const string& pattern, string& out)
+{
+	size_t lanes = 8 * g_numDigitalPods;
+	if(pattern.length() > lanes)
+		return false;
+
+	out.clear();
+	for(auto c : pattern)
+	{
+		c = toupper(c);
+		if(!strchr("01RFEX", c))
+			return false;
+		out += c;
+	}
+	out.resize(lanes, 'X');
+	return true;
+}
+
+/**
+	@brief Works out what to program into the scope for the current trigger settings
+
+	@param trig		Receives the trigger
+	@param upper	TRIG:LEV, in ADC codes
+	@param lower	TRIG:LOWER, in ADC codes
+
+	@return False if the settings can't be used
+ */
+static bool BuildAdvancedTrigger(AdvancedTrigger& trig, int16_t upper, int16_t lower)
+{
+	//Pattern: every pod with a lane that isn't don't care, ANDed together
+	if(g_triggerMode == TRIGGER_PATTERN)
+	{
+		for(size_t i=0; i<g_triggerPattern.length(); i++)
+		{
+			PICO_DIGITAL_DIRECTION dir;
+			switch(g_triggerPattern[i])
+			{
+				case '0':	dir = PICO_DIGITAL_DIRECTION_LOW;				break;
+				case '1':	dir = PICO_DIGITAL_DIRECTION_HIGH;				break;
+				case 'R':	dir = PICO_DIGITAL_DIRECTION_RISING;			break;
+				case 'F':	dir = PICO_DIGITAL_DIRECTION_FALLING;			break;
+				case 'E':	dir = PICO_DIGITAL_DIRECTION_RISING_OR_FALLING;	break;
+				default:	continue;
+			}
+
+			size_t pod = i / 8;
+			if(!g_msoPodEnabled[pod])
+				LogWarning("Trigger pattern uses MSO pod %zu, which is off\n", pod);
+			PICO_DIGITAL_CHANNEL_DIRECTIONS lane;
+			memset(&lane, 0, sizeof(lane));
+			lane.channel = static_cast<PICO_PORT_DIGITAL_CHANNEL>(PICO_PORT_DIGITAL_CHANNEL0 + (i % 8));
+			lane.direction = dir;
+			trig.ports[pod].push_back(lane);
+		}
+
+		for(auto& it : trig.ports)
+			trig.conditions.push_back(MakeCondition(static_cast<PICO_CHANNEL>(PICO_PORT0 + it.first)));
+		if(trig.conditions.empty())
+		{
+			LogError("Trigger pattern has no lanes set\n");
+			return false;
+		}
+		return true;
+	}
+
+	if(g_triggerChannel >= g_numChannels)
+	{
+		LogError("Window, runt and pulse width triggers need an analog source channel\n");
+		return false;
+	}
+
+	PICO_CHANNEL source = static_cast<PICO_CHANNEL>(g_triggerChannel);
+	PICO_TRIGGER_CHANNEL_PROPERTIES prop;
+	memset(&prop, 0, sizeof(prop));
+	prop.thresholdUpper = upper;
+	prop.thresholdUpperHysteresis = g_triggerHysteresis;
+	prop.thresholdLower = lower;
+	prop.thresholdLowerHysteresis = g_triggerHysteresis;
+	prop.channel = source;
+	trig.properties.push_back(prop);
+	trig.conditions.push_back(MakeCondition(source));
+
+	switch(g_triggerMode)
+	{
+		case TRIGGER_WINDOW:
+			trig.directions.push_back(MakeDirection(source, g_windowDirection, PICO_WINDOW));
+			break;
+
+		case TRIGGER_RUNT:
+			trig.directions.push_back(MakeDirection(source, g_runtDirection, PICO_WINDOW));
+			break;
+
+		//The qualifier starts timing on the edge selected by TRIG:EDGE:DIR, and the trigger fires on the opposite
+		//edge that ends the pulse if the width qualifies
+		case TRIGGER_PULSE:
+		{
+			bool positive = (g_triggerDirection != PICO_FALLING);
+			trig.directions.push_back(MakeDirection(source, positive ? PICO_FALLING : PICO_RISING, PICO_LEVEL));
+			trig.pwqDirections.push_back(MakeDirection(source, positive ? PICO_RISING : PICO_FALLING, PICO_LEVEL));
+			trig.pwqConditions.push_back(MakeCondition(source));
+			trig.conditions.push_back(MakeCondition(PICO_PULSE_WIDTH_SOURCE));
+			trig.pwqType = g_pulseWidthType;
+			trig.pwqLower = PulseWidthSamples(g_pulseWidthLower);
+			trig.pwqUpper = PulseWidthSamples(g_pulseWidthUpper);
+		}
+		break;
+
+		default:
+			return false;
+	}
+
+	return true;
+}
+
+/**
+	@brief Programs an advanced trigger into a 6000E series scope
+ */
+static bool ApplyAdvancedTrigger6000(const AdvancedTrigger& trig, uint64_t delay, uint32_t timeout)
+{
+	//All conditions in one call, so they're ANDed
+	ps6000aSetTriggerChannelConditions(g_hScope, NULL, 0, PICO_CLEAR_ALL);
+	PICO_STATUS status = ps6000aSetTriggerChannelConditions(
+		g_hScope, const_cast<PICO_CONDITION*>(&trig.conditions[0]), trig.conditions.size(), PICO_ADD);
+	if(status != PICO_OK)
+	{
+		LogError("ps6000aSetTriggerChannelConditions failed: %x\n", status);
+		return false;
+	}
+
+	status = ps6000aSetTriggerChannelDirections(
+		g_hScope, trig.directions.empty() ? NULL : const_cast<PICO_DIRECTION*>(&trig.directions[0]),
+		trig.directions.size());
+	if(status != PICO_OK)
+	{
+		LogError("ps6000aSetTriggerChannelDirections failed: %x\n", status);
+		return false;
+	}
+
+	//Also sets the auto trigger timeout, so call it even with no analog channels involved
+	status = ps6000aSetTriggerChannelProperties(
+		g_hScope,
+		trig.properties.empty() ? NULL : const_cast<PICO_TRIGGER_CHANNEL_PROPERTIES*>(&trig.properties[0]),
+		trig.properties.size(),
+		0,
+		timeout);
+	if(status != PICO_OK)
+	{
+		LogError("ps6000aSetTriggerChannelProperties failed: %x\n", status);
+		return false;
+	}
+
+	ps6000aSetPulseWidthQualifierConditions(g_hScope, NULL, 0, PICO_CLEAR_ALL);
+	if(!trig.pwqConditions.empty())
+	{
+		status = ps6000aSetPulseWidthQualifierProperties(g_hScope, trig.pwqLower, trig.pwqUpper, trig.pwqType);
+		if(status == PICO_OK)
+		{
+			status = ps6000aSetPulseWidthQualifierConditions(
+				g_hScope, const_cast<PICO_CONDITION*>(&trig.pwqConditions[0]), trig.pwqConditions.size(), PICO_ADD);
+		}
+		if(status == PICO_OK)
+		{
+			status = ps6000aSetPulseWidthQualifierDirections(
+				g_hScope, const_cast<PICO_DIRECTION*>(&trig.pwqDirections[0]), trig.pwqDirections.size());
+		}
+		if(status != PICO_OK)
+		{
+			LogError("ps6000aSetPulseWidthQualifier failed: %x\n", status);
+			return false;
+		}
+	}
+
+	//Pods not in the pattern get no lane directions
+	for(size_t pod=0; pod<g_numDigitalPods; pod++)
+	{
+		auto it = trig.ports.find(pod);
+		PICO_CHANNEL port = static_cast<PICO_CHANNEL>(PICO_PORT0 + pod);
+		if(it == trig.ports.end())
+			status = ps6000aSetTriggerDigitalPortProperties(g_hScope, port, NULL, 0);
+		else
+		{
+			status = ps6000aSetTriggerDigitalPortProperties(
+				g_hScope, port, const_cast<PICO_DIGITAL_CHANNEL_DIRECTIONS*>(&it->second[0]), it->second.size());
+		}
+		if(status != PICO_OK)
+		{
+			LogError("ps6000aSetTriggerDigitalPortProperties failed: %x\n", status);
+			return false;
+		}
+	}
+
+	status = ps6000aSetTriggerDelay(g_hScope, delay);
+	if(status != PICO_OK)
+	{
+		LogError("ps6000aSetTriggerDelay failed: %x\n", status);
+		return false;
+	}
+	return true;
+}
+
+/**
+	@brief Programs an advanced trigger into a PSOSPA (3000E series) scope
+ */
+static bool ApplyAdvancedTriggerPSOSPA(const AdvancedTrigger& trig, uint64_t delay, uint32_t timeout)
+{
+	psospaSetTriggerChannelConditions(g_hScope, NULL, 0, PICO_CLEAR_ALL);
+	PICO_STATUS status = psospaSetTriggerChannelConditions(
+		g_hScope, const_cast<PICO_CONDITION*>(&trig.conditions[0]), trig.conditions.size(), PICO_ADD);
+	if(status != PICO_OK)
+	{
+		LogError("psospaSetTriggerChannelConditions failed: %x\n", status);
+		return false;
+	}
+
+	status = psospaSetTriggerChannelDirections(
+		g_hScope, trig.directions.empty() ? NULL : const_cast<PICO_DIRECTION*>(&trig.directions[0]),
+		trig.directions.size());
+	if(status != PICO_OK)
+	{
+		LogError("psospaSetTriggerChannelDirections failed: %x\n", status);
+		return false;
+	}
+
+	//PSOSPA has no aux output, otherwise the same as the 6000E
+	status = psospaSetTriggerChannelProperties(
+		g_hScope,
+		trig.properties.empty() ? NULL : const_cast<PICO_TRIGGER_CHANNEL_PROPERTIES*>(&trig.properties[0]),
+		trig.properties.size(),
+		timeout);
+	if(status != PICO_OK)
+	{
+		LogError("psospaSetTriggerChannelProperties failed: %x\n", status);
+		return false;
+	}
+
+	psospaSetPulseWidthQualifierConditions(g_hScope, NULL, 0, PICO_CLEAR_ALL);
+	if(!trig.pwqConditions.empty())
+	{
+		status = psospaSetPulseWidthQualifierProperties(g_hScope, trig.pwqLower, trig.pwqUpper, trig.pwqType);
+		if(status == PICO_OK)
+		{
+			status = psospaSetPulseWidthQualifierConditions(
+				g_hScope, const_cast<PICO_CONDITION*>(&trig.pwqConditions[0]), trig.pwqConditions.size(), PICO_ADD);
+		}
+		if(status == PICO_OK)
+		{
+			status = psospaSetPulseWidthQualifierDirections(
+				g_hScope, const_cast<PICO_DIRECTION*>(&trig.pwqDirections[0]), trig.pwqDirections.size());
+		}
+		if(status != PICO_OK)
+		{
+			LogError("psospaSetPulseWidthQualifier failed: %x\n", status);
+			return false;
+		}
+	}
+
+	for(size_t pod=0; pod<g_numDigitalPods; pod++)
+	{
+		auto it = trig.ports.find(pod);
+		PICO_CHANNEL port = static_cast<PICO_CHANNEL>(PICO_PORT0 + pod);
+		if(it == trig.ports.end())
+			status = psospaSetTriggerDigitalPortProperties(g_hScope, port, NULL, 0);
+		else
+		{
+			status = psospaSetTriggerDigitalPortProperties(
+				g_hScope, port, const_cast<PICO_DIGITAL_CHANNEL_DIRECTIONS*>(&it->second[0]), it->second.size());
+		}
+		if(status != PICO_OK)
+		{
+			LogError("psospaSetTriggerDigitalPortProperties failed: %x\n", status);
+			return false;
+		}
+	}
+
+	status = psospaSetTriggerDelay(g_hScope, delay);
+	if(status != PICO_OK)
+	{
+		LogError("psospaSetTriggerDelay failed: %x\n", status);
+		return false;
+	}
+	return true;
+}
+
+/**
+	@brief Programs an advanced trigger into a 5000A series scope, through the V2 trigger API
+ */
+static bool ApplyAdvancedTrigger5000(const AdvancedTrigger& trig, uint64_t delay, uint32_t timeout)
+{
+	vector<PS5000A_CONDITION> conditions;
+	for(auto& c : trig.conditions)
+	{
+		PS5000A_CONDITION cond;
+		cond.source = static_cast<PS5000A_CHANNEL>(c.source);
+		cond.condition = PS5000A_CONDITION_TRUE;
+		conditions.push_back(cond);
+	}
+	vector<PS5000A_DIRECTION> directions;
+	for(auto& d : trig.directions)
+	{
+		PS5000A_DIRECTION dir;
+		dir.source = static_cast<PS5000A_CHANNEL>(d.channel);
+		dir.direction = static_cast<PS5000A_THRESHOLD_DIRECTION>(d.direction);
+		dir.mode = static_cast<PS5000A_THRESHOLD_MODE>(d.thresholdMode);
+		directions.push_back(dir);
+	}
+	vector<PS5000A_TRIGGER_CHANNEL_PROPERTIES_V2> properties;
+	for(auto& p : trig.properties)
+	{
+		PS5000A_TRIGGER_CHANNEL_PROPERTIES_V2 prop;
+		prop.thresholdUpper = p.thresholdUpper;
+		prop.thresholdUpperHysteresis = p.thresholdUpperHysteresis;
+		prop.thresholdLower = p.thresholdLower;
+		prop.thresholdLowerHysteresis = p.thresholdLowerHysteresis;
+		prop.channel = static_cast<PS5000A_CHANNEL>(p.channel);
+		properties.push_back(prop);
+	}
+
+	ps5000aSetTriggerChannelConditionsV2(g_hScope, NULL, 0, PS5000A_CLEAR);
+	PICO_STATUS status = ps5000aSetTriggerChannelConditionsV2(
+		g_hScope, &conditions[0], conditions.size(), PS5000A_ADD);
+	if(status == PICO_OK)
+	{
+		status = ps5000aSetTriggerChannelDirectionsV2(
+			g_hScope, directions.empty() ? NULL : &directions[0], directions.size());
+	}
+	if(status == PICO_OK)
+	{
+		status = ps5000aSetTriggerChannelPropertiesV2(
+			g_hScope, properties.empty() ? NULL : &properties[0], properties.size(), 0);
+	}
+	if(status == PICO_OK)
+		status = ps5000aSetAutoTriggerMicroSeconds(g_hScope, timeout);
+	if(status != PICO_OK)
+	{
+		LogError("ps5000aSetTriggerChannel*V2 failed: %x\n", status);
+		return false;
+	}
+
+	ps5000aSetPulseWidthQualifierConditions(g_hScope, NULL, 0, PS5000A_CLEAR);
+	if(!trig.pwqConditions.empty())
+	{
+		PS5000A_CONDITION cond;
+		cond.source = static_cast<PS5000A_CHANNEL>(trig.pwqConditions[0].source);
+		cond.condition = PS5000A_CONDITION_TRUE;
+		PS5000A_DIRECTION dir;
+		dir.source = static_cast<PS5000A_CHANNEL>(trig.pwqDirections[0].channel);
+		dir.direction = static_cast<PS5000A_THRESHOLD_DIRECTION>(trig.pwqDirections[0].direction);
+		dir.mode = PS5000A_LEVEL;
+
+		status = ps5000aSetPulseWidthQualifierProperties(
+			g_hScope, trig.pwqLower, trig.pwqUpper, static_cast<PS5000A_PULSE_WIDTH_TYPE>(trig.pwqType));
+		if(status == PICO_OK)
+			status = ps5000aSetPulseWidthQualifierConditions(g_hScope, &cond, 1, PS5000A_ADD);
+		if(status == PICO_OK)
+			status = ps5000aSetPulseWidthQualifierDirections(g_hScope, &dir, 1);
+		if(status != PICO_OK)
+		{
+			LogError("ps5000aSetPulseWidthQualifier failed: %x\n", status);
+			return false;
+		}
+	}
+
+	//Lanes are numbered across both pods
+	if(g_numDigitalPods > 0)
+	{
+		vector<PS5000A_DIGITAL_CHANNEL_DIRECTIONS> lanes;
+		for(auto& it : trig.ports)
+		{
+			for(auto& d : it.second)
+			{
+				PS5000A_DIGITAL_CHANNEL_DIRECTIONS lane;
+				lane.channel = static_cast<PS5000A_DIGITAL_CHANNEL>(
+					PS5000A_DIGITAL_CHANNEL_0 + it.first*8 + (d.channel - PICO_PORT_DIGITAL_CHANNEL0));
+				lane.direction = static_cast<PS5000A_DIGITAL_DIRECTION>(d.direction);
+				lanes.push_back(lane);
+			}
+		}
+		status = ps5000aSetTriggerDigitalPortProperties(g_hScope, lanes.empty() ? NULL : &lanes[0], lanes.size());
+		if(status != PICO_OK)
+		{
+			LogError("ps5000aSetTriggerDigitalPortProperties failed: %x\n", status);
+			return false;
+		}
+	}
+
+	status = ps5000aSetTriggerDelay(g_hScope, delay);
+	if(status != PICO_OK)
+	{
+		LogError("ps5000aSetTriggerDelay failed: %x\n", status);
+		return false;
+	}
+	return true;
+}
+
+/**
+	@brief Programs the trigger selected by TRIG:MODE, if it isn't an edge trigger
+
+	Must be called with g_mutex held, from UpdateTrigger().
+
+	@param upper	TRIG:LEV, in ADC codes
+	@param lower	TRIG:LOWER, in ADC codes
+	@param delay	Trigger delay in samples
+	@param timeout	Auto trigger timeout in us (0 = wait forever)
+
+	@return False if the scope can't do it, and a plain edge trigger should be used instead
+ */
+bool UpdateAdvancedTrigger(int16_t upper, int16_t lower, uint64_t delay, uint32_t timeout)
+{
+	AdvancedTrigger trig;
+	if(!BuildAdvancedTrigger(trig, upper, lower))
+		return false;
+
+	bool ok = false;
+	switch(g_pico_type)
+	{
+		case PICO6000A:
+			ok = ApplyAdvancedTrigger6000(trig, delay, timeout);
+			break;
+		case PICOPSOSPA:
+			ok = ApplyAdvancedTriggerPSOSPA(trig, delay, timeout);
+			break;
+		case PICO5000A:
+			ok = ApplyAdvancedTrigger5000(trig, delay, timeout);
+			break;
+
+		default:
+			LogError("Window, runt, pulse width and pattern triggers aren't supported on this model\n");
+			return false;
+	}
+
+	//Whatever got programmed before a failure has to go before the next simple trigger
+	g_advancedTriggerSet = true;
+	return ok;
+}
+
+/**
+	@brief Removes the pulse width qualifier and pattern of an advanced trigger, before a simple trigger is set
+
+	SetSimpleTrigger replaces the channel conditions but leaves the rest. Must be called with g_mutex held.
+ */
+void ClearAdvancedTrigger()
+{
+	if(!g_advancedTriggerSet)
+		return;
+	g_advancedTriggerSet = false;
+
+	switch(g_pico_type)
+	{
+		case PICO6000A:
+			ps6000aSetPulseWidthQualifierConditions(g_hScope, NULL, 0, PICO_CLEAR_ALL);
+			for(size_t pod=0; pod<g_numDigitalPods; pod++)
+				ps6000aSetTriggerDigitalPortProperties(g_hScope, static_cast<PICO_CHANNEL>(PICO_PORT0 + pod), NULL, 0);
+			ps6000aSetTriggerChannelConditions(g_hScope, NULL, 0, PICO_CLEAR_ALL);
+			break;
+		case PICOPSOSPA:
+			psospaSetPulseWidthQualifierConditions(g_hScope, NULL, 0, PICO_CLEAR_ALL);
+			for(size_t pod=0; pod<g_numDigitalPods; pod++)
+				psospaSetTriggerDigitalPortProperties(g_hScope, static_cast<PICO_CHANNEL>(PICO_PORT0 + pod), NULL, 0);
+			psospaSetTriggerChannelConditions(g_hScope, NULL, 0, PICO_CLEAR_ALL);
+			break;
+		case PICO5000A:
+			ps5000aSetPulseWidthQualifierConditions(g_hScope, NULL, 0, PS5000A_CLEAR);
+			if(g_numDigitalPods > 0)
+				ps5000aSetTriggerDigitalPortProperties(g_hScope, NULL, 0);
+			ps5000aSetTriggerChannelConditionsV2(g_hScope, NULL, 0, PS5000A_CLEAR);
+			break;
+		default:
+			break;
+	}
+}
@@ -33,38 +33,394 @@
 	@brief Waveform data thread (data plane traffic only, no control plane SCPI)
  */
 #include "ps6000d.h"
+#include <stddef.h>
 #include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <atomic>
+#ifndef _WIN32
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <errno.h>
+#endif
 
 using namespace std;
 
 volatile bool g_waveformThreadQuit = false;
-float InterpolateTriggerTime(int16_t* buf);
+float InterpolateTriggerTime(int16_t* buf, size_t firstSample);
+void GetTriggerTimeOffsets(size_t numSegments, int64_t* offsets_fs);
 
 vector<PICO_CHANNEL> g_channelIDs;
 
+//Sequence number of the last waveform sent to the controlling client (SEQNUM?)
 uint32_t g_lastTxSeq = 0;
-uint32_t g_lastRxAck = 0;
 
-void CheckForACKs(Socket& client);
+//ACK flow control window (ACK:WINDOW, ACK:BYTES), applied to every data plane connection. Zero means no limit.
+atomic<size_t> g_ackWindowWaveforms(5);
+atomic<uint64_t> g_ackWindowBytes(0);
+
+//One data plane connection and its ACK flow control state. Only touched by the thread sending to it.
+struct DataLink
+{
+	DataLink(Socket* s, bool p)
+	: socket(s)
+	, primary(p)
+	{}
+
+	Socket* socket;
+
+	//The controlling client waits for ACKs, subscribers drop waveforms instead
+	bool primary;
+
+	uint32_t lastTxSeq = 0;
+	uint32_t lastRxAck = 0;
+
+	//Waveforms sent but not yet ACKed, with their size on the wire
+	deque<pair<uint32_t, uint64_t> > unacked;
+	uint64_t unackedBytes = 0;
+
+	uint64_t dropped = 0;
+
+	//Shared memory ring the waveforms go through, if the client asked for TRANSPORT SHM
+	ShmRing* shm = nullptr;
+
+	//Recording the waveforms go to instead of a socket, for the recorder
+	RecordFile* record = nullptr;
+};
+
+//Waveform thread is using the driver without holding g_mutex, see DriverLock
+bool g_driverBusy = false;
+condition_variable g_driverIdle;
+
+//Block mode capture completion, signalled from the driver's callback thread.
+//Each arm gets a new generation number so a late callback from a capture that was stopped early is ignored.
+mutex g_readyMutex;
+condition_variable g_readyCondition;
+bool g_captureReady = false;
+int64_t g_captureReadyTime = 0;
+bool g_fetchRequested = false;
+bool g_fetchRestRequested = false;
+bool g_replayRequested = false;
+uint64_t g_replayFirst = 0;
+uint64_t g_replayLast = 0;
+uintptr_t g_blockReadyGeneration = 0;
+
+//Streaming mode state, protected by g_mutex
+//Buffers are indexed by channel number (analog channels first, then MSO pods)
+map<size_t, int16_t*> g_streamingBuffers;
+size_t g_streamingBufferLen = 0;
+uint64_t g_streamingSampleCount = 0;
+
+//A set of per-channel sample buffers that the driver can download a capture into
+struct WaveformBufferSet
+{
+	//Buffers of the channels enabled in the current capture, as handed to the driver
+	map<size_t, int16_t*> buffers;
+
+	//Every buffer we've allocated and its capacity in samples.
+	//Kept when a channel is turned off or the depth shrinks, so we don't churn memory.
+	map<size_t, int16_t*> storage;
+	map<size_t, size_t> capacity;
+
+	size_t depth = 0;
+	size_t numSegments = 0;
+	DownsampleMode mode = DOWNSAMPLE_NONE;
+};
+
+//Downsampling mode of the buffers currently given to the driver, protected by g_mutex
+DownsampleMode g_attachedDownsampleMode = DOWNSAMPLE_NONE;
+
+//A downloaded block mode capture plus everything needed to send it.
+//Settings are snapshotted at download time since the scope may be re-armed with new ones before it's sent.
+struct CapturedWaveform
+{
+	size_t bufferSet;
+	map<size_t, int16_t*> buffers;
+	int64_t interval;
+	map<size_t, bool> channelOn;
+	bool msoPodEnabled[2];
+	size_t numSegments;
+	size_t segmentDepth;
+	uint64_t numSamples;
+	uint16_t numchans;
+	vector<float> trigphase;
+	map<size_t, float> scale;
+	map<size_t, float> offset;
+	WireFormat format;
+	CompressionMode compression;
+	size_t sampleBits;
+	size_t envelopeColumns;
+
+	//Region of interest: the header carries the time of the first sample from the start of the capture
+	bool roi;
+	int64_t roiOffset;
+
+	//Number of captures averaged into this one (0 = not averaged), and the per-sample variance of each analog channel
+	uint32_t averageCount;
+	map<size_t, shared_ptr<vector<float> > > variance;
+
+	//Wall clock time of the download, and of the driver reporting the capture complete, ns since the epoch
+	int64_t timestamp;
+	int64_t triggerTime;
+
+	//Channels that went over range, a bit per analog channel for each segment
+	vector<uint16_t> overflow;
+
+	//Data plane framing (PROTOCOL)
+	unsigned int protocol;
+};
+
+//Running sums of the captures being averaged, only touched by the waveform thread
+struct AverageState
+{
+	size_t count = 0;
+	size_t depth = 0;
+	map<size_t, float> scale;
+	map<size_t, float> offset;
+	map<size_t, vector<int32_t> > sum;
+	map<size_t, vector<int64_t> > sumsq;
+	double trigphase = 0;
+	uint16_t overflow = 0;
+};
+
+//Hands captures from the waveform thread to the sender thread in pipelined mode
+struct SendPipeline
+{
+	mutex lock;
+	condition_variable cond;
+	deque<CapturedWaveform> queue;
+	vector<size_t> freeSets;
+	vector<int> refs;	//users of each buffer set (queued/being sent, waveform thread, retained for FETCH)
+	bool quit = false;
+	bool failed = false;
+	bool sending = false;	//sender thread has a capture out of the queue
+	thread sender;
+};
+
+//A read-only data plane connection, fed from the same buffer sets as the controlling client.
+//The recorder is one too, with a file instead of a socket.
+struct Subscriber
+{
+	Subscriber(ZSOCKET s)
+	: socket(new Socket(s, AF_INET6))
+	, link(socket.get(), false)
+	{}
+
+	Subscriber(RecordFile* file)
+	: link(nullptr, false)
+	{ link.record = file; }
+
+	unique_ptr<Socket> socket;
+	DataLink link;
+	thread sender;
+
+	//Capture this subscriber is being sent, if busy. One slot only, anything arriving while busy is dropped.
+	bool busy = false;
+	CapturedWaveform wfm;
+	SendPipeline* pipe = nullptr;
+
+	bool dead = false;
+	uint64_t dropped = 0;
+};
+
+//The subscriber list, and each subscriber's slot, are protected by g_subscriberMutex
+mutex g_subscriberMutex;
+condition_variable g_subscriberCondition;
+list<Subscriber*> g_subscribers;
+
+//Maximum number of concurrent subscribers (--max-subscribers), zero if --subscriber-port isn't given.
+//Each one gets a spare buffer set in the waveform thread so a slow subscriber never starves the controlling client.
+size_t g_maxSubscribers = 0;
+
+//Spare buffer sets for the recorder, on top of the subscribers'
+static const size_t g_recorderBufferSets = 1;
+
+bool CheckForACKs(DataLink& link);
+bool ACKWindowOpen(DataLink& link, uint64_t bytes);
+bool WaitForACKWindow(DataLink& link, uint64_t bytes);
+void RecordSentWaveform(DataLink& link, uint64_t bytes);
+void RearmAfterCapture();
+void FreeBufferSets(vector<WaveformBufferSet>& sets);
+bool PrepareBufferSet(WaveformBufferSet& set, size_t depth, size_t numSegments, DownsampleMode mode);
+void DetachBuffers();
+void AttachBufferSet(WaveformBufferSet& set);
+void InterleaveAggregate(WaveformBufferSet& set, size_t numSamples);
+PICO_STATUS DownloadCapture(
+	uint64_t startIndex,
+	uint64_t length,
+	size_t numSegments,
+	uint32_t ratio,
+	DownsampleMode mode,
+	uint64_t& numSamples,
+	vector<int64_t>& triggerOffsets,
+	vector<uint16_t>& overflow);
+bool AccumulateCapture(AverageState& avg, CapturedWaveform& wfm, size_t target, bool variance);
+bool MaskPasses(const MaskSet& mask, const CapturedWaveform& wfm);
+uint32_t GetRecordFlags(const CapturedWaveform& wfm, bool envelope);
+const int16_t* GetChannelSamples(
+	const CapturedWaveform& wfm,
+	size_t i,
+	size_t seg,
+	bool digital,
+	bool envelope,
+	size_t count,
+	vector<int16_t>& ebuf);
+size_t PackChannelSamples(const int16_t* samples, size_t count, size_t bits, bool digital, vector<uint8_t>& pbuf);
+bool SendWaveform(DataLink& link, const CapturedWaveform& wfm);
+bool SendWaveformV2(DataLink& link, const CapturedWaveform& wfm);
+bool DeliverWaveform(
+	DataLink& link,
+	const CapturedWaveform& wfm,
+	const vector<SendChunk>& chunks,
+	uint64_t bytes,
+	uint32_t recordFlags);
+bool SendToClient(DataLink& link, const vector<SendChunk>& chunks, uint64_t bytes);
+bool ReplayRecording(DataLink& link, uint64_t first, uint64_t last);
+void WaveformSenderThread(DataLink* link, SendPipeline* pipe);
+bool AcquireBufferSet(SendPipeline& pipe, size_t& set);
+void ReleaseBufferSet(SendPipeline& pipe, size_t set);
+void UnrefBufferSet(SendPipeline& pipe, size_t set);
+bool WaitForSenderIdle(SendPipeline& pipe);
+void StopSender(SendPipeline& pipe);
+bool StreamingLoop(DataLink& link, WaveformBufferSet& staging);
+void SubscriberThread(Subscriber* sub);
+void OfferToSubscribers(SendPipeline& pipe, const CapturedWaveform& wfm);
+void WaitForSubscribersIdle();
+void ReapSubscribers();
+size_t ReadStreamingData(WaveformBufferSet& chunk, uint64_t& firstSample, uint16_t& overflow);
+void FreeStreamingBuffers();
+bool SendStreamingChunkV2(
+	DataLink& link,
+	const map<size_t, int16_t*>& chunk,
+	size_t numSamples,
+	uint64_t firstSample,
+	uint16_t overflow,
+	int64_t interval,
+	const map<size_t, float>& scale,
+	const map<size_t, float>& offset,
+	size_t bits);
+void RecordStreamingChunk(
+	const vector<SendChunk>& chunks,
+	uint64_t bytes,
+	uint32_t* sequence,
+	uint32_t flags,
+	int64_t interval,
+	const map<size_t, float>& scale,
+	const map<size_t, float>& offset);
+PICO_CHANNEL StreamingChannelID(size_t i);
 
-void CheckForACKs(Socket& client)
+/**
+	@brief Reads any ACKs the client has sent, without blocking
+
+	@return False if the client disconnected
+ */
+bool CheckForACKs(DataLink& link)
 {
-	while(client.GetRxBytesAvailable() >= 4)
+	while(link.socket->GetRxBytesAvailable() >= 4)
 	{
-		if(!client.RecvLooped((uint8_t*)&g_lastRxAck, sizeof(g_lastRxAck)))
-			break;
-		LogTrace("Got ACK %u\n", g_lastRxAck);
+		if(!link.socket->RecvLooped((uint8_t*)&link.lastRxAck, sizeof(link.lastRxAck)))
+			return false;
+		LogTrace("Got ACK %u\n", link.lastRxAck);
+	}
+
+	//Retire everything up to the last ACK (sequence numbers wrap, so compare the difference)
+	while(!link.unacked.empty() && (static_cast<int32_t>(link.unacked.front().first - link.lastRxAck) <= 0) )
+	{
+		link.unackedBytes -= link.unacked.front().second;
+		link.unacked.pop_front();
+	}
+	return true;
+}
+
+/**
+	@brief Checks if the flow control window has room for another waveform
+
+	A waveform is always let through when nothing is in flight, even if it's bigger than the whole byte window.
+
+	@param link		The connection
+	@param bytes	Size of the waveform about to be sent, in bytes
+ */
+bool ACKWindowOpen(DataLink& link, uint64_t bytes)
+{
+	size_t maxWaveforms = g_ackWindowWaveforms;
+	uint64_t maxBytes = g_ackWindowBytes;
+	size_t inFlight = link.unacked.size();
+	bool countOK = (maxWaveforms == 0) || (inFlight + 1 <= maxWaveforms);
+	bool bytesOK = (maxBytes == 0) || (inFlight == 0) || (link.unackedBytes + bytes <= maxBytes);
+
+	//A shared memory slot can't be reused until the waveform in it has been ACKed
+	if(link.shm && link.shm->base && (inFlight >= link.shm->numSlots) )
+		return false;
+
+	return countOK && bytesOK;
+}
+
+/**
+	@brief Blocks until the flow control window has room for another waveform
+
+	Sleeps on the socket rather than spinning, waking up every 100 ms to check for a quit request.
+
+	@param link		The connection
+	@param bytes	Size of the waveform about to be sent, in bytes
+
+	@return False if the client disconnected or we were asked to quit
+ */
+bool WaitForACKWindow(DataLink& link, uint64_t bytes)
+{
+	while(true)
+	{
+		if(!CheckForACKs(link))
+			return false;
+		if(ACKWindowOpen(link, bytes))
+			return true;
+
+		if(g_waveformThreadQuit)
+			return false;
+
+		ZSOCKET sock = static_cast<ZSOCKET>(*link.socket);
+		fd_set readfds;
+		FD_ZERO(&readfds);
+		FD_SET(sock, &readfds);
+		timeval timeout;
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 100 * 1000;
+		int ret = select(sock + 1, &readfds, NULL, NULL, &timeout);
+		if(ret < 0)
+		{
+#ifndef _WIN32
+			if(errno == EINTR)
+				continue;
+#endif
+			return false;
+		}
+
+		//Readable with nothing to read means the client closed the connection
+		if( (ret > 0) && (link.socket->GetRxBytesAvailable() == 0) )
+			return false;
 	}
 }
 
+/**
+	@brief Adds a waveform that was just sent to the flow control window
+ */
+void RecordSentWaveform(DataLink& link, uint64_t bytes)
+{
+	link.unacked.push_back(pair<uint32_t, uint64_t>(link.lastTxSeq, bytes));
+	link.unackedBytes += bytes;
+}
+
 void WaveformServerThread()
 {
 #ifdef __linux__
 	pthread_setname_np(pthread_self(), "WaveformThread");
 #endif
+	TuneDataThread("WaveformThread");
 
 	g_lastTxSeq = 0;
-	g_lastRxAck = 0;
 
 	Socket client = g_dataSocket.Accept();
 	LogVerbose("Client connected to data plane socket\n");
@@ -73,6 +429,27 @@ void WaveformServerThread()
 		return;
 	if(!client.DisableNagle())
 		LogWarning("Failed to disable Nagle on socket, performance may be poor\n");
+	if(g_zeroCopySend && !EnableZeroCopySend(client))
+	{
+		LogWarning("Zero-copy sends not supported, falling back to normal sends\n");
+		g_zeroCopySend = false;
+	}
+	DataLink link(&client, true);
+
+	//Set up the shared memory ring if the client wants one.
+	//If we can't, keep sending doorbells but with every waveform inline, so the client still understands us.
+	ShmRing ring;
+	bool useShm;
+	{
+		lock_guard<mutex> lock(g_mutex);
+		useShm = (g_transport == TRANSPORT_SHM);
+	}
+	if(useShm)
+	{
+		if(!ShmCreate(ring, g_shmName, g_shmSlots, g_shmSlotSize))
+			LogWarning("Sending all waveforms inline on the data plane socket\n");
+		link.shm = &ring;
+	}
 
 	//Set up channel IDs
 	g_channelIDs.clear();
@@ -81,362 +458,2242 @@ void WaveformServerThread()
 	for(size_t i=0; i<g_numDigitalPods; i++)
 		g_channelIDs.push_back((PICO_CHANNEL)(PICO_PORT0 + i));
 
-	map<size_t, int16_t*> waveformBuffers;
-	uint64_t numSamples = 0;
-	uint32_t numSamples_int = 0;
-	uint16_t numchans;
+	//One buffer set per pipeline stage. The driver downloads into a free set, then the scope is re-armed
+	//while the sender thread pushes the previous set to the client.
+	//In envelope mode, one extra set holds the last full capture for FETCH.
+	vector<WaveformBufferSet> bufferSets;
+	SendPipeline pipe;
+
+	//Streaming chunks are copied out of the driver's buffers into these, kept from one chunk to the next
+	vector<WaveformBufferSet> streamingSets(1);
+	size_t attachedSet = SIZE_MAX;
+	size_t pipelineDepth = 0;
+	CapturedWaveform retained;
+	bool haveRetained = false;
+	AverageState average;
 	while(!g_waveformThreadQuit)
 	{
-		int16_t ready;
+		if(pipe.failed)
+			break;
+
+		PerfPeriodicLog();
+
+		//Resize the pipeline if the depth was changed
+		size_t newDepth;
+		size_t newSets;
 		{
 			lock_guard<mutex> lock(g_mutex);
-			switch(g_pico_type)
-			{
-				case PICO2000A:
-					ps2000aIsReady(g_hScope, &ready);
-					break;
-				case PICO3000A:
-					ps3000aIsReady(g_hScope, &ready);
-					break;
-				case PICO4000A:
-					ps4000aIsReady(g_hScope, &ready);
-					break;
-				case PICO5000A:
-					ps5000aIsReady(g_hScope, &ready);
-					break;
-				case PICO6000A:
-					ps6000aIsReady(g_hScope, &ready);
-					break;
-				case PICOPSOSPA:
-					psospaIsReady(g_hScope, &ready);
-					break;
-			}
+			newDepth = g_pipelineDepth;
+			newSets = newDepth + (g_envelopeColumns ? 1 : 0) + g_maxSubscribers + g_recorderBufferSets;
+		}
+		if( (newDepth != pipelineDepth) || (newSets != bufferSets.size()) )
+		{
+			StopSender(pipe);
+			WaitForSubscribersIdle();
+
+			lock_guard<mutex> lock(g_mutex);
+			FreeBufferSets(bufferSets);
+			bufferSets.resize(newSets);
+			attachedSet = SIZE_MAX;
+			pipelineDepth = newDepth;
+			haveRetained = false;
+
+			pipe.freeSets.clear();
+			pipe.refs.assign(newSets, 0);
+			for(size_t i=0; i<newSets; i++)
+				pipe.freeSets.push_back(i);
+			if(pipelineDepth > 1)
+				pipe.sender = thread(WaveformSenderThread, &link, &pipe);
 		}
 
-		if( (ready == 0) || (!g_triggerArmed) )
+		//Streaming mode has its own loop, make sure every queued block is out the door before we start
+		if(g_triggerArmed && g_streamingModeDuringArm)
 		{
-			std::this_thread::sleep_for(std::chrono::microseconds(1000));
+			if(!WaitForSenderIdle(pipe))
+				break;
+			if(!StreamingLoop(link, streamingSets[0]))
+				break;
 			continue;
 		}
 
-		size_t interval;
-		map<size_t, bool> channelOn;
-		bool msoPodEnabled[2];
+		//Wait for the driver to report the capture is complete.
+		//Time out every now and then so we notice a quit request or a switch to streaming mode.
+		bool ready;
+		bool fetch;
+		bool fetchRest;
+		bool replay;
+		uint64_t replayFirst;
+		uint64_t replayLast;
+		int64_t readyTime;
 		{
-			lock_guard<mutex> lock(g_mutex);
+			unique_lock<mutex> lock(g_readyMutex);
+			g_readyCondition.wait_for(lock, chrono::milliseconds(100),
+				[] { return g_captureReady || g_fetchRequested || g_fetchRestRequested || g_replayRequested; });
+			ready = g_captureReady;
+			fetch = g_fetchRequested;
+			fetchRest = g_fetchRestRequested;
+			replay = g_replayRequested;
+			replayFirst = g_replayFirst;
+			replayLast = g_replayLast;
+			readyTime = g_captureReadyTime;
+			g_captureReady = false;
+			g_fetchRequested = false;
+			g_fetchRestRequested = false;
+			g_replayRequested = false;
+		}
 
-			interval = g_sampleIntervalDuringArm;
-			channelOn = g_channelOnDuringArm;
-			msoPodEnabled[0] = g_msoPodEnabledDuringArm[0];
-			msoPodEnabled[1] = g_msoPodEnabledDuringArm[1];
+		//Client wants waveforms back from the recording. The sender must be done with the socket first.
+		if(replay)
+		{
+			if(!WaitForSenderIdle(pipe))
+				break;
+			if(!ReplayRecording(link, replayFirst, replayLast))
+				break;
+		}
 
-			//Stop the trigger
-			PICO_STATUS status = PICO_OPERATION_FAILED;
-			switch(g_pico_type)
+		//Client wants the full data behind the last envelope
+		if(fetch)
+		{
+			if(!haveRetained)
+				LogWarning("FETCH requested, but there is no retained capture\n");
+			else if(pipelineDepth > 1)
 			{
-				case PICO2000A:
-					status = ps2000aStop(g_hScope);
-					break;
-				case PICO3000A:
-					status = ps3000aStop(g_hScope);
-					break;
-				case PICO4000A:
-					status = ps4000aStop(g_hScope);
-					break;
-				case PICO5000A:
-					status = ps5000aStop(g_hScope);
-					break;
-				case PICO6000A:
-					status = ps6000aStop(g_hScope);
-					break;
-				case PICOPSOSPA:
-					status = psospaStop(g_hScope);
-					break;
+				lock_guard<mutex> lock(pipe.lock);
+				pipe.refs[retained.bufferSet] ++;
+				pipe.queue.push_back(retained);
+				pipe.cond.notify_all();
 			}
-			if(PICO_OK != status)
-				LogFatal("psXXXXStop failed (code 0x%x)\n", status);
+			else if(!SendWaveform(link, retained))
+				break;
+		}
 
-			//Verify it's actually stopped
+		//Client wants the whole of the last capture after having been sent its region of interest.
+		//The data is still in the scope as long as it hasn't been re-armed since.
+		bool rest = false;
+		if(fetchRest && ready)
+		{
+			//The capture the client asked about has just been replaced by a new one. Don't drop the request:
+			//it's handled again once the new capture is out, sending its rest if the scope hasn't been re-armed
+			//by then, or warning otherwise.
+			LogDebug("FETCH:REST arrived with a new capture, handling it after this one\n");
+			lock_guard<mutex> lock(g_readyMutex);
+			g_fetchRestRequested = true;
+		}
+		else if(fetchRest)
+		{
+			lock_guard<mutex> lock(g_mutex);
+			rest = g_captureInDriver && !g_triggerArmed;
+			if(!rest)
+				LogWarning("FETCH:REST requested, but the scope has been re-armed since the last capture\n");
+		}
 
-			//Set up buffers if needed
-			if(g_memDepthChanged || waveformBuffers.empty())
-			{
-				//LogVerbose("Reallocating buffers\n");
+		if(!ready && !rest)
+			continue;
 
-				//Clear out old buffers
-				for(auto ch : g_channelIDs)
-				{
-					switch(g_pico_type)
-					{
-						case PICO2000A:
-							ps2000aSetDataBuffer(g_hScope, (PS2000A_CHANNEL)ch, NULL,
-												0, 0, PS2000A_RATIO_MODE_NONE);
-							break;
-						case PICO3000A:
-							ps3000aSetDataBuffer(g_hScope, (PS3000A_CHANNEL)ch, NULL,
-												0, 0, PS3000A_RATIO_MODE_NONE);
-							break;
-						case PICO4000A:
-							ps4000aSetDataBuffer(g_hScope, (PS4000A_CHANNEL)ch, NULL,
-												0, 0, PS4000A_RATIO_MODE_NONE);
-							break;
-						case PICO5000A:
-							ps5000aSetDataBuffer(g_hScope, (PS5000A_CHANNEL)ch, NULL,
-												0, 0, PS5000A_RATIO_MODE_NONE);
-							break;
-						case PICO6000A:
-							ps6000aSetDataBuffer(g_hScope, ch, NULL,
-												0, PICO_INT16_T, 0, PICO_RATIO_MODE_RAW, PICO_CLEAR_ALL);
-							break;
-						case PICOPSOSPA:
-							psospaSetDataBuffer(g_hScope, ch, NULL,
-												0, PICO_INT16_T, 0, PICO_RATIO_MODE_RAW, PICO_CLEAR_ALL);
-							break;
-					}
-				}
+		if(!g_triggerArmed && !rest)
+			continue;
 
-				//Clear out old buffers
-				for(size_t i=0; i<g_channelIDs.size(); i++)
-				{
-					if(waveformBuffers[i])
-					{
-						delete[] waveformBuffers[i];
-						waveformBuffers[i] = NULL;
-					}
-				}
+		//Get a buffer set that isn't being sent. Don't hold the mutex while waiting on the sender.
+		size_t set;
+		if(!AcquireBufferSet(pipe, set))
+			break;
 
-				//Set up new ones
-				//TODO: Only allocate memory if the channel is actually enabled
-				for(size_t i=0; i<g_channelIDs.size(); i++)
-				{
-					//Allocate memory if needed
-					waveformBuffers[i] = new int16_t[g_captureMemDepth];
-					memset(waveformBuffers[i], 0x00, g_captureMemDepth * sizeof(int16_t));
-
-					//Give it to the scope, removing any other buffer we might have
-					auto ch = g_channelIDs[i];
-					switch(g_pico_type)
-					{
-						case PICO2000A:
-							status = ps2000aSetDataBuffer(g_hScope, (PS2000A_CHANNEL)ch, waveformBuffers[i],
-														g_captureMemDepth, 0, PS2000A_RATIO_MODE_NONE);
-							break;
-						case PICO3000A:
-							status = ps3000aSetDataBuffer(g_hScope, (PS3000A_CHANNEL)ch, waveformBuffers[i],
-														g_captureMemDepth, 0, PS3000A_RATIO_MODE_NONE);
-							break;
-						case PICO4000A:
-							status = ps4000aSetDataBuffer(g_hScope, (PS4000A_CHANNEL)ch, waveformBuffers[i],
-														g_captureMemDepth, 0, PS4000A_RATIO_MODE_NONE);
-							break;
-						case PICO5000A:
-							status = ps5000aSetDataBuffer(g_hScope, (PS5000A_CHANNEL)ch, waveformBuffers[i],
-														g_captureMemDepth, 0, PS5000A_RATIO_MODE_NONE);
-							break;
-						case PICO6000A:
-							status = ps6000aSetDataBuffer(g_hScope, (PICO_CHANNEL)ch, waveformBuffers[i],
-														g_captureMemDepth, PICO_INT16_T, 0, PICO_RATIO_MODE_RAW, PICO_ADD);
-							break;
-						case PICOPSOSPA:
-							status = psospaSetDataBuffer(g_hScope, (PICO_CHANNEL)ch, waveformBuffers[i],
-														g_captureMemDepth, PICO_INT16_T, 0, PICO_RATIO_MODE_RAW, PICO_ADD);
-							break;
-					}
-					if(status != PICO_OK)
-						LogFatal("psXXXXSetDataBuffer for channel %d failed (code 0x%x)\n", ch, status);
-				}
+		CapturedWaveform wfm;
+		DownsampleMode dsMode;
+		uint32_t dsRatio;
+		bool depthChanged;
+		uint64_t roiStart;
+		uint64_t roiLength;
+		size_t averageTarget;
+		bool averageVariance;
+		shared_ptr<MaskSet> mask;
+		{
+			lock_guard<mutex> lock(g_mutex);
 
-				g_memDepthChanged = false;
-			}
+			wfm.interval = g_sampleIntervalDuringArm;
+			for(size_t i=0; i<g_numChannels; i++)
+				wfm.channelOn[i] = g_channelOnDuringArm[i];
+			wfm.msoPodEnabled[0] = g_msoPodEnabledDuringArm[0];
+			wfm.msoPodEnabled[1] = g_msoPodEnabledDuringArm[1];
+			wfm.numSegments = g_numSegmentsDuringArm;
+			wfm.segmentDepth = g_captureMemDepth;
+			wfm.bufferSet = set;
 
-			//Download the data from the scope
-			numSamples = g_captureMemDepth;
-			numSamples_int = g_captureMemDepth;
-			int16_t overflow = 0;
-			switch(g_pico_type)
+			//With hardware downsampling, each segment shrinks by the ratio and the sample interval grows by it
+			dsMode = g_downsampleModeDuringArm;
+			dsRatio = (dsMode == DOWNSAMPLE_NONE) ? 1 : g_downsampleRatioDuringArm;
+
+			//Only download the region of interest, if there is one (starting on a downsampling boundary)
+			roiStart = 0;
+			roiLength = wfm.segmentDepth;
+			wfm.roi = rest || (g_roiStart != 0) || (g_roiLength != 0);
+			if(!rest && wfm.roi)
 			{
-				case PICO2000A:
-					status = ps2000aGetValues(g_hScope, 0, &numSamples_int, 1, PS2000A_RATIO_MODE_NONE, 0, &overflow);
-					numSamples = numSamples_int;
-					break;
-				case PICO3000A:
-					status = ps3000aGetValues(g_hScope, 0, &numSamples_int, 1, PS3000A_RATIO_MODE_NONE, 0, &overflow);
-					numSamples = numSamples_int;
-					break;
-				case PICO4000A:
-					status = ps4000aGetValues(g_hScope, 0, &numSamples_int, 1, PS4000A_RATIO_MODE_NONE, 0, &overflow);
-					numSamples = numSamples_int;
-					break;
-				case PICO5000A:
-					status = ps5000aGetValues(g_hScope, 0, &numSamples_int, 1, PS5000A_RATIO_MODE_NONE, 0, &overflow);
-					numSamples = numSamples_int;
-					break;
-				case PICO6000A:
-					status = ps6000aGetValues(g_hScope, 0, &numSamples, 1, PICO_RATIO_MODE_RAW, 0, &overflow);
-					break;
-				case PICOPSOSPA:
-					status = psospaGetValues(g_hScope, 0, &numSamples, 1, PICO_RATIO_MODE_RAW, 0, &overflow);
-					break;
+				roiStart = min(g_roiStart, wfm.segmentDepth - 1);
+				roiStart -= roiStart % dsRatio;
+				roiLength = wfm.segmentDepth - roiStart;
+				if(g_roiLength != 0)
+					roiLength = min(g_roiLength, roiLength);
+				wfm.segmentDepth = roiLength;
 			}
-			if(status == PICO_NO_SAMPLES_AVAILABLE)
+			wfm.roiOffset = roiStart * wfm.interval;
+
+			if(dsRatio > 1)
 			{
-				LogVerbose("PICO_NO_SAMPLES_AVAILABLE\n");
-				//This response will occur if some setting like vertical scale changed just before aGetValues.
-				//flush buffers and update channel
-				g_memDepthChanged = true;
-				UpdateTrigger(true);
-				continue;
+				wfm.segmentDepth = (wfm.segmentDepth + dsRatio - 1) / dsRatio;
+				wfm.interval *= dsRatio;
 			}
-			if(PICO_OK != status)
-				LogFatal("psXXXXGetValues (code 0x%x)\n", status);
 
 			//Figure out how many channels are active in this capture
-			numchans = 0;
+			wfm.numchans = 0;
 			for(size_t i=0; i<g_numChannels; i++)
 			{
 				if(g_channelOnDuringArm[i])
-					numchans ++;
+					wfm.numchans ++;
 			}
 			for(size_t i=0; i<g_numDigitalPods; i++)
 			{
 				if(g_msoPodEnabledDuringArm[i])
-					numchans ++;
+					wfm.numchans ++;
+			}
+
+			//Snapshot everything the sender needs, since settings may change while we download or once we re-arm
+			wfm.format = g_wireFormat;
+			wfm.protocol = g_protocolVersion;
+			wfm.envelopeColumns = g_envelopeColumns;
+			wfm.compression = g_compressionMode;
+			wfm.sampleBits = g_adcBits;
+			if(dsMode == DOWNSAMPLE_AVERAGE)
+				wfm.sampleBits = 16;	//averaging adds precision below the ADC LSB
+			for(size_t i=0; i<g_numChannels; i++)
+			{
+				wfm.scale[i] = g_roundedRange[i] / g_scaleValue;
+				wfm.offset[i] = g_offsetDuringArm[i];
 			}
+
+			wfm.averageCount = 0;
+			averageTarget = g_averageCount;
+			averageVariance = g_averageVariance;
+			if(g_maskEnabled)
+				mask = g_mask;
+
+			depthChanged = g_memDepthChanged;
+			g_memDepthChanged = false;
+
+			//The driver is ours until the download is complete
+			g_driverBusy = true;
+		}
+
+		//Stopping, buffer setup and the download can take hundreds of ms on deep captures.
+		//Do them without g_mutex so the control plane stays responsive. Anything that needs the driver in the
+		//meantime waits for g_driverBusy to clear (see DriverLock).
+
+		//Stop the trigger
+		uint64_t tstart = PerfTimestamp();
+		PICO_STATUS status = PICO_OK;
+		if(!rest)
+			status = g_backend->Stop();
+		if(PICO_OK != status)
+			LogFatal("psXXXXStop failed (code 0x%x)\n", status);
+		PerfRecord(PERF_STOP, tstart);
+
+		//Set up buffers if needed, and point the driver at the set we're downloading into
+		tstart = PerfTimestamp();
+		auto& buffers = bufferSets[set];
+		if(PrepareBufferSet(buffers, wfm.segmentDepth, wfm.numSegments, dsMode) || depthChanged)
+			attachedSet = SIZE_MAX;
+		if(attachedSet != set)
+		{
+			AttachBufferSet(buffers);
+			attachedSet = set;
 		}
+		PerfRecord(PERF_BUFFER_SETUP, tstart);
 
-		//Do *not* hold mutex while sending data to the client
-		//This can take a long time and we don't want to block the control channel
+		//Download the data from the scope
+		tstart = PerfTimestamp();
+		vector<int64_t> triggerOffsets;
+		status = DownloadCapture(roiStart, roiLength, wfm.numSegments, dsRatio, dsMode, wfm.numSamples, triggerOffsets,
+			wfm.overflow);
+		bool noSamples = (status == PICO_NO_SAMPLES_AVAILABLE);
+		if(!noSamples)
 		{
-			//Bump sequence number
-			g_lastTxSeq ++;
+			if(PICO_OK != status)
+				LogFatal("psXXXXGetValues (code 0x%x)\n", status);
+			PerfRecord(PERF_DOWNLOAD, tstart, buffers.buffers.size() * wfm.numSamples * wfm.numSegments *
+				sizeof(int16_t) * ((dsMode == DOWNSAMPLE_AGGREGATE) ? 2 : 1));
 
-			#pragma pack(push, 1)
-			struct
+			//Aggregate mode sends max and min as alternating samples
+			if(dsMode == DOWNSAMPLE_AGGREGATE)
 			{
-				//Sequence number
-				uint32_t sequence;
-
-				//Number of channels in the current waveform
-				uint16_t numChannels;
-
-				//Sample interval.
-				//May be different from m_srate if we changed the rate after the trigger was armed
-				int64_t fs_per_sample;
-			} wfmhdrs;
-			#pragma pack(pop)
-			wfmhdrs.sequence = g_lastTxSeq;
-			wfmhdrs.numChannels = numchans;
-			wfmhdrs.fs_per_sample = interval;
-
-			//Send the top level waveform headers
-			//TODO: send overflow flags to client
-			if(!client.SendLooped((uint8_t*)&wfmhdrs, sizeof(wfmhdrs)))
-				break;
+				InterleaveAggregate(buffers, wfm.numSamples);
+				wfm.numSamples *= 2;
+				wfm.segmentDepth *= 2;
+				wfm.interval /= 2;
+			}
+			wfm.buffers = buffers.buffers;
+		}
+		wfm.timestamp = chrono::duration_cast<chrono::nanoseconds>(
+			chrono::system_clock::now().time_since_epoch()).count();
+		wfm.triggerTime = readyTime;
 
-			//Process incoming ACKs
-			CheckForACKs(client);
+		{
+			lock_guard<mutex> lock(g_mutex);
+			g_driverBusy = false;
+			g_driverIdle.notify_all();
 
-			//Backpressure if we have too many waveforms in flight
-			const int maxWaveformsInFlight = 5;
-			while( (g_lastTxSeq - g_lastRxAck) >= maxWaveformsInFlight)
-				CheckForACKs(client);
+			if(noSamples)
+			{
+				LogVerbose("PICO_NO_SAMPLES_AVAILABLE\n");
+				//This response will occur if some setting like vertical scale changed just before aGetValues.
+				//flush buffers and update channel
+				g_memDepthChanged = true;
+				UpdateTrigger(true);
+				ReleaseBufferSet(pipe, set);
+				continue;
+			}
 
-			//Interpolate trigger position if we're using an analog level trigger
-			bool triggerIsAnalog = (g_triggerChannel < g_numChannels);
-			float trigphase = 0;
-			if(triggerIsAnalog)
-				trigphase = InterpolateTriggerTime(waveformBuffers[g_triggerChannel]);
+			//Until the next arm, the rest of this capture can still be downloaded
+			g_captureInDriver = true;
 
-			//Send data for each channel to the client
-			for(size_t i=0; i<g_channelIDs.size(); i++)
+			//Interpolate trigger position if we're using an analog edge trigger.
+			//Otherwise use the hardware trigger time offset (only available in rapid block mode).
+			//Downsampled data can't be interpolated since the samples around the trigger point are gone,
+			//and neither can a region of interest that doesn't include them.
+			//Window, runt and pulse width triggers don't fire on a crossing of the trigger level.
+			bool triggerIsAnalog = (g_triggerMode == TRIGGER_EDGE) &&
+				(g_triggerChannel < g_numChannels) && buffers.buffers.count(g_triggerChannel) &&
+				(dsRatio == 1) && (g_triggerSampleIndex > roiStart) && (g_triggerSampleIndex < roiStart + roiLength);
+			wfm.trigphase.resize(wfm.numSegments, 0);
+			for(size_t seg=0; seg<wfm.numSegments; seg++)
 			{
-				//Analog channels
-				if((i < g_numChannels) && (channelOn[i]) )
+				if(triggerIsAnalog)
 				{
-					#pragma pack(push, 1)
-					struct
-					{
-						size_t nchan;
-						size_t numSamples;
-						float scale;
-						float offset;
-						float trigphase;
-					} chdrs;
-					#pragma pack(pop)
-
-					chdrs.nchan = i;
-					chdrs.numSamples = numSamples;
-					chdrs.scale = g_roundedRange[i] / g_scaleValue;
-					chdrs.offset = g_offsetDuringArm[i];
-					chdrs.trigphase = trigphase;
-
-					//Send channel headers
-					if(!client.SendLooped((uint8_t*)&chdrs, sizeof(chdrs)))
-						break;
-
-					//Send the actual waveform data
-					if(!client.SendLooped((uint8_t*)waveformBuffers[i], numSamples * sizeof(int16_t)))
-						break;
+					wfm.trigphase[seg] = InterpolateTriggerTime(
+						buffers.buffers[g_triggerChannel] + seg*wfm.segmentDepth, roiStart);
 				}
+				else if(!triggerOffsets.empty() && (wfm.interval != 0))
+					wfm.trigphase[seg] = static_cast<float>(triggerOffsets[seg]) / wfm.interval;
+			}
 
-				//Digital channels
-				else if( (i >= g_numChannels) && (msoPodEnabled[i - g_numChannels]) )
-				{
-					#pragma pack(push, 1)
-					struct
-					{
-						size_t nchan;
-						size_t numSamples;
-						float trigphase;
-					} chdrs;
-					#pragma pack(pop)
-					chdrs.nchan = i;
-					chdrs.numSamples = numSamples;
-					chdrs.trigphase = trigphase;
-
-					if(!client.SendLooped((uint8_t*)&chdrs, sizeof(chdrs)))
-						break;
-					if(!client.SendLooped((uint8_t*)waveformBuffers[i], numSamples * sizeof(int16_t)))
-						break;
-				}
+			//In pipelined mode, the data is safe in our buffers now so re-arm right away
+			if( (pipelineDepth > 1) && !rest)
+			{
+				tstart = PerfTimestamp();
+				RearmAfterCapture();
+				PerfRecord(PERF_REARM, tstart);
 			}
 		}
 
-		//Need mutex here to update global state
-		{
-			lock_guard<mutex> lock(g_mutex);
+		//Averaging: only the capture that completes each group is sent, carrying the mean of the whole group
+		bool skip = false;
+		if(averageTarget <= 1)
+			average.count = 0;
+		else if(!rest && !AccumulateCapture(average, wfm, averageTarget, averageVariance))
+			skip = true;
+
+		//Mask test: captures that stay within the limits are only counted
+		if(!skip && mask && !rest && MaskPasses(*mask, wfm))
+			skip = true;
 
-			//Re-arm the trigger if doing repeating triggers
-			if(g_triggerOneShot)
+		if(skip)
+		{
+			ReleaseBufferSet(pipe, set);
+			if(pipelineDepth <= 1)
 			{
-				g_triggerArmed = false;
+				lock_guard<mutex> lock(g_mutex);
+				tstart = PerfTimestamp();
+				RearmAfterCapture();
+				PerfRecord(PERF_REARM, tstart);
 			}
-			else
-			{
-				if(g_captureMemDepth != g_memDepth)
-					g_memDepthChanged = true;
+			continue;
+		}
 
-				//Restart
-				StartCapture(false);
+		//Keep deep captures around when only the envelope is sent, as long as there's a spare set to hold them
+		if( (wfm.envelopeColumns != 0) && (wfm.numSamples > wfm.envelopeColumns) &&
+			(bufferSets.size() > pipelineDepth + g_maxSubscribers + g_recorderBufferSets) )
+		{
+			{
+				lock_guard<mutex> lock(pipe.lock);
+				pipe.refs[set] ++;
 			}
+			if(haveRetained)
+				ReleaseBufferSet(pipe, retained.bufferSet);
+
+			retained = wfm;
+			retained.envelopeColumns = 0;
+			haveRetained = true;
+		}
+
+		//Subscribers and the recorder get it too, if they're keeping up
+		if(!rest)
+			OfferToSubscribers(pipe, wfm);
+
+		//Hand off to the sender thread
+		if(pipelineDepth > 1)
+		{
+			lock_guard<mutex> lock(pipe.lock);
+			pipe.queue.push_back(wfm);
+			pipe.cond.notify_all();
+		}
+
+		//Legacy serial mode: send, then re-arm
+		else
+		{
+			//Do *not* hold mutex while sending data to the client
+			//This can take a long time and we don't want to block the control channel
+			bool ok = SendWaveform(link, wfm);
+			ReleaseBufferSet(pipe, set);
+			if(!ok)
+				break;
+			if(rest)
+				continue;
+
+			//Need mutex here to update global state
+			lock_guard<mutex> lock(g_mutex);
+			tstart = PerfTimestamp();
+			RearmAfterCapture();
+			PerfRecord(PERF_REARM, tstart);
 		}
 	}
 
+	StopSender(pipe);
+	WaitForSubscribersIdle();
+
 	LogDebug("Client disconnected from data plane socket\n");
 	{
 		lock_guard<mutex> lock(g_mutex);
 		Stop();
+		FreeStreamingBuffers();
+
+		//Clean up temporary buffers
+		FreeBufferSets(bufferSets);
+		FreeBufferSets(streamingSets);
+	}
+
+	if(link.shm)
+		ShmDestroy(ring);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Block mode download and re-arm
+
+/**
+	@brief Waits until the waveform thread isn't using the driver
+
+	@param lock		Lock on g_mutex, released while waiting
+ */
+void WaitForDriverIdle(unique_lock<mutex>& lock)
+{
+	g_driverIdle.wait(lock, [] { return !g_driverBusy; });
+}
+
+/**
+	@brief Re-arms the trigger after a block mode capture has been downloaded
+
+	Must be called with g_mutex held.
+ */
+void RearmAfterCapture()
+{
+	//Re-arm the trigger if doing repeating triggers
+	if(g_triggerOneShot)
+	{
+		g_triggerArmed = false;
+	}
+	else
+	{
+		if(g_captureMemDepth != EffectiveMemDepth())
+			g_memDepthChanged = true;
+
+		//Don't arm with a half applied batch of settings, SETUP:COMMIT will do it
+		if(g_setupBatch)
+		{
+			g_rearmPending = true;
+			return;
+		}
+
+		//Restart
+		StartCapture(false);
+	}
+}
+
+/**
+	@brief Detaches every channel's buffers from the driver and frees all buffer sets
+
+	Must be called with g_mutex held.
+ */
+void FreeBufferSets(vector<WaveformBufferSet>& sets)
+{
+	DetachBuffers();
+	for(auto& set : sets)
+	{
+		for(auto it : set.storage)
+			FreeSampleBuffer(it.second, set.capacity[it.first]);
+		set.storage.clear();
+		set.capacity.clear();
+		set.buffers.clear();
+		set.depth = 0;
+		set.numSegments = 0;
+	}
+}
+
+/**
+	@brief Makes sure a buffer set has a buffer for every enabled channel of the capture being downloaded
+
+	In rapid block mode, each channel gets one contiguous buffer with all segments back to back.
+	Buffers only ever grow; disabled channels keep their memory so turning them back on is free.
+
+	In aggregate mode the driver writes separate max and min buffers (the second and third quarter of the
+	allocation), which InterleaveAggregate() then merges into the first half for sending.
+
+	Must be called with g_mutex held, or by the waveform thread with g_driverBusy set.
+
+	@param set			The buffer set
+	@param depth		Samples per segment after downsampling
+	@param numSegments	Number of segments
+	@param mode			Downsampling mode
+
+	@return True if the buffers changed and need to be given to the driver again
+ */
+bool PrepareBufferSet(WaveformBufferSet& set, size_t depth, size_t numSegments, DownsampleMode mode)
+{
+	bool changed = (set.depth != depth) || (set.numSegments != numSegments) || (set.mode != mode);
+	size_t needed = depth * numSegments;
+	if(mode == DOWNSAMPLE_AGGREGATE)
+		needed *= 4;
+
+	for(size_t i=0; i<g_channelIDs.size(); i++)
+	{
+		bool enabled;
+		if(i < g_numChannels)
+			enabled = g_channelOnDuringArm[i];
+		else
+			enabled = g_msoPodEnabledDuringArm[i - g_numChannels];
+
+		if(!enabled)
+		{
+			if(set.buffers.erase(i))
+				changed = true;
+			continue;
+		}
+
+		//Grow the buffer if needed
+		if(set.capacity[i] < needed)
+		{
+			//LogVerbose("Reallocating buffers\n");
+			FreeSampleBuffer(set.storage[i], set.capacity[i]);
+			set.capacity[i] = RoundUpSampleBuffer(needed);
+			set.storage[i] = AllocateSampleBuffer(set.capacity[i]);
+			if(set.storage[i] == NULL)
+				LogFatal("Failed to allocate buffer for channel %zu\n", i);
+		}
+
+		if(set.buffers[i] != set.storage[i])
+		{
+			set.buffers[i] = set.storage[i];
+			changed = true;
+		}
 	}
 
-	//Clean up temporary buffers
-	for(auto it : waveformBuffers)
-		delete[] it.second;
+	set.depth = depth;
+	set.numSegments = numSegments;
+	set.mode = mode;
+	return changed;
+}
+
+/**
+	@brief Removes all data buffers from the driver
+ */
+void DetachBuffers()
+{
+	for(auto ch : g_channelIDs)
+		g_backend->ClearDataBuffers(ch, g_attachedDownsampleMode);
+	g_attachedDownsampleMode = DOWNSAMPLE_NONE;
+}
+
+/**
+	@brief Gives a buffer set to the driver, removing any other buffers it might have
+
+	Must be called with g_mutex held, or by the waveform thread with g_driverBusy set.
+ */
+void AttachBufferSet(WaveformBufferSet& set)
+{
+	DetachBuffers();
+
+	bool aggregate = (set.mode == DOWNSAMPLE_AGGREGATE);
+	size_t total = set.depth * set.numSegments;
+
+	PICO_STATUS status = PICO_OK;
+	for(auto it : set.buffers)
+	{
+		auto ch = g_channelIDs[it.first];
+		for(size_t seg=0; seg<set.numSegments; seg++)
+		{
+			int16_t* segbuf = it.second + seg*set.depth;
+			int16_t* segmax = it.second + 2*total + seg*set.depth;
+			int16_t* segmin = it.second + 3*total + seg*set.depth;
+			if(aggregate)
+				status = g_backend->SetDataBuffers(ch, segmax, segmin, set.depth, seg, set.mode);
+			else
+				status = g_backend->SetDataBuffer(ch, segbuf, set.depth, seg, set.mode);
+			if(status != PICO_OK)
+			{
+				LogFatal("psXXXXSetDataBuffer for channel %d segment %zu failed (code 0x%x)\n",
+					ch, seg, status);
+			}
+		}
+	}
+	g_attachedDownsampleMode = set.mode;
+}
+
+/**
+	@brief Merges the max and min buffers of an aggregate capture into one max, min, max, min... series per segment
+
+	Sending the pair interleaved at twice the rate keeps the wire format unchanged, and draws as a peak-detect
+	envelope on the client.
+
+	@param set			The buffer set
+	@param numSamples	Number of max/min pairs downloaded per segment
+ */
+void InterleaveAggregate(WaveformBufferSet& set, size_t numSamples)
+{
+	size_t total = set.depth * set.numSegments;
+	for(auto it : set.buffers)
+	{
+		for(size_t seg=0; seg<set.numSegments; seg++)
+		{
+			int16_t* out = it.second + seg*2*set.depth;
+			int16_t* segmax = it.second + 2*total + seg*set.depth;
+			int16_t* segmin = it.second + 3*total + seg*set.depth;
+			for(size_t j=0; j<numSamples; j++)
+			{
+				out[j*2] = segmax[j];
+				out[j*2 + 1] = segmin[j];
+			}
+		}
+	}
+}
+
+/**
+	@brief Downloads a completed block mode capture into the attached buffers
+
+	Must be called with g_mutex held, or by the waveform thread with g_driverBusy set.
+
+	@param numSegments		Number of segments captured (1 for normal block mode)
+	@param ratio			Hardware downsampling ratio (1 for raw data)
+	@param mode				Downsampling mode
+	@param numSamples		Receives the number of samples per segment actually downloaded (after downsampling)
+	@param triggerOffsets	Receives the hardware trigger time offset of each segment, in fs (rapid block mode only)
+	@param overflow			Receives the over range flags of each segment, a bit per analog channel
+ */
+PICO_STATUS DownloadCapture(
+	uint64_t startIndex,
+	uint64_t length,
+	size_t numSegments,
+	uint32_t ratio,
+	DownsampleMode mode,
+	uint64_t& numSamples,
+	vector<int64_t>& triggerOffsets,
+	vector<uint16_t>& overflow)
+{
+	PICO_STATUS status;
+	numSamples = length;
+	vector<int16_t> flags(numSegments, 0);
+	if(numSegments == 1)
+		status = g_backend->GetValues(startIndex, numSamples, ratio, mode, &flags[0]);
+
+	//Rapid block mode: pull every segment in a single bulk transfer
+	else
+	{
+		status = g_backend->GetValuesBulk(startIndex, numSamples, numSegments - 1, ratio, mode, &flags[0]);
+
+		//Hardware trigger time offsets, one per segment
+		if(status == PICO_OK)
+		{
+			triggerOffsets.resize(numSegments);
+			GetTriggerTimeOffsets(numSegments, &triggerOffsets[0]);
+		}
+	}
+
+	overflow.assign(flags.begin(), flags.end());
+	return status;
+}
+
+/**
+	@brief Adds a downloaded capture to the running average
+
+	Each segment of a rapid block capture counts as one capture. The sums restart whenever the depth, channel
+	selection, range or offset changes, since those captures can't be averaged together. Digital channels aren't
+	averaged, the last capture's data is sent as is.
+
+	@param avg		Running sums
+	@param wfm		The capture. When the group is complete, its first segment is replaced by the average.
+	@param target	Number of captures to average
+	@param variance	Compute the per-sample variance as well
+
+	@return True if the group is complete and wfm should be sent
+ */
+bool AccumulateCapture(AverageState& avg, CapturedWaveform& wfm, size_t target, bool variance)
+{
+	size_t depth = wfm.numSamples;
+
+	bool same = (avg.count != 0) && (avg.depth == depth) && (avg.scale == wfm.scale) && (avg.offset == wfm.offset) &&
+		(avg.sumsq.empty() == !variance);
+	for(size_t i=0; same && (i<g_numChannels); i++)
+	{
+		if(wfm.channelOn.at(i) != (avg.sum.count(i) != 0))
+			same = false;
+	}
+
+	if(!same)
+	{
+		avg.count = 0;
+		avg.depth = depth;
+		avg.scale = wfm.scale;
+		avg.offset = wfm.offset;
+		avg.trigphase = 0;
+		avg.overflow = 0;
+		avg.sum.clear();
+		avg.sumsq.clear();
+		for(size_t i=0; i<g_numChannels; i++)
+		{
+			if(!wfm.channelOn.at(i))
+				continue;
+			avg.sum[i].assign(depth, 0);
+			if(variance)
+				avg.sumsq[i].assign(depth, 0);
+		}
+	}
+
+	for(size_t seg=0; seg<wfm.numSegments; seg++)
+	{
+		for(auto& it : avg.sum)
+			AccumulateSamples(wfm.buffers.at(it.first) + seg*wfm.segmentDepth, &it.second[0], depth);
+		for(auto& it : avg.sumsq)
+			AccumulateSquares(wfm.buffers.at(it.first) + seg*wfm.segmentDepth, &it.second[0], depth);
+		avg.trigphase += wfm.trigphase[seg];
+		avg.overflow |= wfm.overflow[seg];
+		avg.count ++;
+	}
+	if(avg.count < target)
+		return false;
+
+	for(auto& it : avg.sum)
+	{
+		FinishAverage(&it.second[0], avg.count, wfm.buffers.at(it.first), depth);
+		if(variance)
+		{
+			auto var = make_shared<vector<float> >(depth);
+			FinishVariance(&it.second[0], &avg.sumsq[it.first][0], avg.count, &(*var)[0], depth);
+			wfm.variance[it.first] = var;
+		}
+	}
+	wfm.trigphase.assign(1, avg.trigphase / avg.count);
+	wfm.overflow.assign(1, avg.overflow);
+	wfm.numSegments = 1;
+	wfm.averageCount = avg.count;
+
+	//The mean has more precision than the ADC
+	wfm.sampleBits = 16;
+
+	//Start the next group, keeping the sums allocated
+	for(auto& it : avg.sum)
+		fill(it.second.begin(), it.second.end(), 0);
+	for(auto& it : avg.sumsq)
+		fill(it.second.begin(), it.second.end(), 0);
+	avg.trigphase = 0;
+	avg.overflow = 0;
+	avg.count = 0;
+	return true;
+}
+
+/**
+	@brief Checks every segment of a capture against the limit mask, and updates the pass/fail counters
+
+	Only the samples covered by a channel's mask are checked, channels without a mask always pass.
+
+	@return True if every segment passed
+ */
+bool MaskPasses(const MaskSet& mask, const CapturedWaveform& wfm)
+{
+	bool allPassed = true;
+	for(size_t seg=0; seg<wfm.numSegments; seg++)
+	{
+		bool passed = true;
+		for(auto& it : mask)
+		{
+			auto buf = wfm.buffers.find(it.first);
+			if( (buf == wfm.buffers.end()) || it.second.lower.empty() )
+				continue;
+
+			size_t count = min(it.second.lower.size(), static_cast<size_t>(wfm.numSamples));
+			if(!CheckMask(buf->second + seg*wfm.segmentDepth, &it.second.lower[0], &it.second.upper[0], count))
+			{
+				passed = false;
+				break;
+			}
+		}
+
+		if(passed)
+			g_maskPassCount ++;
+		else
+		{
+			g_maskFailCount ++;
+			allPassed = false;
+		}
+	}
+	return allPassed;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sending to the client
+
+/**
+	@brief Works out the RecordFlags describing how a capture is laid out on the wire
+ */
+uint32_t GetRecordFlags(const CapturedWaveform& wfm, bool envelope)
+{
+	uint32_t flags = 0;
+	if( (wfm.format == FORMAT_PACKED) || (wfm.compression != COMPRESS_NONE) )
+		flags |= RECORD_PACKED;
+	if(wfm.compression != COMPRESS_NONE)
+		flags |= RECORD_COMPRESSED;
+	if(wfm.roi)
+		flags |= RECORD_ROI;
+	if(wfm.averageCount != 0)
+		flags |= RECORD_AVERAGED;
+	if(!wfm.variance.empty() && !envelope)
+		flags |= RECORD_VARIANCE;
+	if(envelope)
+		flags |= RECORD_ENVELOPE;
+	if(wfm.protocol >= 2)
+		flags |= RECORD_PROTOCOL2;
+	return flags;
+}
+
+/**
+	@brief Gets the samples of one channel of one segment as they are sent: the capture itself, or its envelope
+
+	@param wfm		The capture
+	@param i		Channel index
+	@param seg		Segment index
+	@param digital	True for an MSO pod
+	@param envelope	Reduce to a min/max envelope of wfm.envelopeColumns columns
+	@param count	Number of samples sent
+	@param ebuf		Scratch space for the envelope
+
+	@return The samples
+ */
+const int16_t* GetChannelSamples(
+	const CapturedWaveform& wfm,
+	size_t i,
+	size_t seg,
+	bool digital,
+	bool envelope,
+	size_t count,
+	vector<int16_t>& ebuf)
+{
+	const int16_t* samples = wfm.buffers.at(i) + seg * wfm.segmentDepth;
+	if(!envelope)
+		return samples;
+
+	ebuf.resize(count);
+	if(digital)
+		ComputeDigitalEnvelope(samples, wfm.numSamples, wfm.envelopeColumns, &ebuf[0]);
+	else
+		ComputeEnvelope(samples, wfm.numSamples, wfm.envelopeColumns, &ebuf[0]);
+	return &ebuf[0];
+}
+
+/**
+	@brief Packs one channel's samples to the given width, as in FORMAT PACKED
+
+	@return Size of the packed samples in bytes
+ */
+size_t PackChannelSamples(const int16_t* samples, size_t count, size_t bits, bool digital, vector<uint8_t>& pbuf)
+{
+	if(digital)
+	{
+		pbuf.resize(count + 16);
+		PackDigitalSamples(samples, &pbuf[0], count);
+		return count;
+	}
+
+	pbuf.resize(PackedSampleSize(count, bits) + 16);
+	PackSamples(samples, &pbuf[0], count, bits);
+	return PackedSampleSize(count, bits);
+}
+
+/**
+	@brief Sends a downloaded block mode capture to the client
+
+	In rapid block mode, each segment is sent as a separate waveform, unless in PROTOCOL 2.
+
+	@return False if the client disconnected
+ */
+bool SendWaveform(DataLink& link, const CapturedWaveform& wfm)
+{
+	if(wfm.protocol >= 2)
+		return SendWaveformV2(link, wfm);
+
+	#pragma pack(push, 1)
+	struct WaveformHeader
+	{
+		//Sequence number
+		uint32_t sequence;
+
+		//Number of channels in the current waveform
+		uint16_t numChannels;
+
+		//Sample interval.
+		//May be different from m_srate if we changed the rate after the trigger was armed
+		int64_t fs_per_sample;
+	};
+
+	struct AnalogChannelHeader
+	{
+		size_t nchan;
+		size_t numSamples;
+		float scale;
+		float offset;
+		float trigphase;
+	};
+
+	struct DigitalChannelHeader
+	{
+		size_t nchan;
+		size_t numSamples;
+		float trigphase;
+	};
+	#pragma pack(pop)
+
+	//All headers are built up front so the whole waveform can go out in a single gathered send.
+	//In packed or compressed format each channel header is followed by the sample width in bits,
+	//and when compressed, by the uint64_t length of the compressed stream.
+	bool compressed = (wfm.compression != COMPRESS_NONE);
+	bool packed = (wfm.format == FORMAT_PACKED) || compressed;
+	size_t hdrlen = sizeof(WaveformHeader) + sizeof(int64_t) + sizeof(uint32_t) +
+		g_channelIDs.size() * (sizeof(AnalogChannelHeader) + 1 + sizeof(uint64_t));
+	vector<uint8_t> hdrbuf(hdrlen);
+	vector<SendChunk> chunks;
+	chunks.reserve(1 + 2*g_channelIDs.size());
+
+	//Scratch space for packed and compressed samples, reused across waveforms
+	static thread_local map<size_t, vector<uint8_t> > packBuffers;
+	size_t analogBits = min(wfm.sampleBits, static_cast<size_t>(16));
+	float analogScaleFactor = packed ? (1 << (16 - analogBits)) : 1;
+
+	//Software peak detect replaces each channel by a min/max envelope, with the sample interval and
+	//trigger phase scaled to match. Deep captures stay in our buffers for a FETCH of the full data.
+	bool envelope = (wfm.envelopeColumns != 0) && (wfm.numSamples > wfm.envelopeColumns);
+	size_t count = envelope ? (2 * wfm.envelopeColumns) : wfm.numSamples;
+	double stretch = envelope ? (static_cast<double>(wfm.numSamples) / count) : 1;
+	static thread_local map<size_t, vector<int16_t> > envBuffers;
+
+	//Compressed channels waiting for the worker pool: job, chunk to fill in, where to write the length
+	vector<CompressionJob> jobs;
+	vector<pair<size_t, uint8_t*> > pending;
+
+	//What the recorder needs to know to make sense of the waveform later
+	uint32_t recordFlags = link.record ? GetRecordFlags(wfm, envelope) : 0;
+
+	for(size_t seg=0; seg<wfm.numSegments; seg++)
+	{
+		uint8_t* hdrptr = &hdrbuf[0];
+		chunks.clear();
+		jobs.clear();
+		pending.clear();
+
+		//Bump sequence number
+		link.lastTxSeq ++;
+		if(link.primary)
+			g_lastTxSeq = link.lastTxSeq;
+
+		//Top level waveform headers
+		//Overflow flags are only sent in PROTOCOL 2
+		auto wfmhdrs = reinterpret_cast<WaveformHeader*>(hdrptr);
+		wfmhdrs->sequence = link.lastTxSeq;
+		wfmhdrs->numChannels = wfm.numchans;
+		wfmhdrs->fs_per_sample = envelope ? llround(wfm.interval * stretch) : wfm.interval;
+		chunks.push_back({hdrptr, sizeof(WaveformHeader)});
+		hdrptr += sizeof(WaveformHeader);
+
+		//Region of interest starts somewhere into the capture
+		if(wfm.roi)
+		{
+			memcpy(hdrptr, &wfm.roiOffset, sizeof(int64_t));
+			chunks.push_back({hdrptr, sizeof(int64_t)});
+			hdrptr += sizeof(int64_t);
+		}
+
+		//Number of captures averaged
+		if(wfm.averageCount != 0)
+		{
+			memcpy(hdrptr, &wfm.averageCount, sizeof(uint32_t));
+			chunks.push_back({hdrptr, sizeof(uint32_t)});
+			hdrptr += sizeof(uint32_t);
+		}
+
+		//Data for each channel
+		for(size_t i=0; i<g_channelIDs.size(); i++)
+		{
+			uint8_t* chstart = hdrptr;
+			bool digital = false;
+
+			//Analog channels
+			if((i < g_numChannels) && (wfm.channelOn.at(i)) )
+			{
+				auto chdrs = reinterpret_cast<AnalogChannelHeader*>(hdrptr);
+				chdrs->nchan = i;
+				chdrs->numSamples = count;
+				chdrs->scale = wfm.scale.at(i) * analogScaleFactor;
+				chdrs->offset = wfm.offset.at(i);
+				chdrs->trigphase = wfm.trigphase[seg] / stretch;
+				hdrptr += sizeof(AnalogChannelHeader);
+			}
+
+			//Digital channels
+			else if( (i >= g_numChannels) && (wfm.msoPodEnabled[i - g_numChannels]) )
+			{
+				auto chdrs = reinterpret_cast<DigitalChannelHeader*>(hdrptr);
+				chdrs->nchan = i;
+				chdrs->numSamples = count;
+				chdrs->trigphase = wfm.trigphase[seg] / stretch;
+				hdrptr += sizeof(DigitalChannelHeader);
+				digital = true;
+			}
+
+			else
+				continue;
+
+			const int16_t* samples = GetChannelSamples(wfm, i, seg, digital, envelope, count, envBuffers[i]);
+			size_t bits = digital ? 8 : analogBits;
+			if(packed)
+				*(hdrptr++) = bits;
+
+			//Compressed: length is filled in once the worker pool is done
+			if(compressed)
+			{
+				pending.push_back(pair<size_t, uint8_t*>(chunks.size() + 1, hdrptr));
+				hdrptr += sizeof(uint64_t);
+				chunks.push_back({chstart, static_cast<size_t>(hdrptr - chstart)});
+				chunks.push_back({NULL, 0});
+				jobs.push_back({samples, count, bits, digital, &packBuffers[i]});
+			}
+
+			else
+			{
+				chunks.push_back({chstart, static_cast<size_t>(hdrptr - chstart)});
+
+				//Packed
+				if(packed)
+				{
+					auto& pbuf = packBuffers[i];
+					size_t len = PackChannelSamples(samples, count, bits, digital, pbuf);
+					chunks.push_back({&pbuf[0], len});
+				}
+
+				//The raw waveform data
+				else
+					chunks.push_back({samples, count * sizeof(int16_t)});
+			}
+
+			//Variance of an averaged waveform follows the samples, unless they were reduced to an envelope
+			auto var = wfm.variance.find(i);
+			if( (var != wfm.variance.end()) && !envelope)
+				chunks.push_back({var->second->data(), count * sizeof(float)});
+		}
+
+		//Compress all channels in parallel
+		if(!jobs.empty())
+		{
+			CompressChannels(jobs);
+			for(size_t j=0; j<jobs.size(); j++)
+			{
+				uint64_t len = jobs[j].out->size();
+				memcpy(pending[j].second, &len, sizeof(len));
+				chunks[pending[j].first] = {jobs[j].out->data(), jobs[j].out->size()};
+			}
+		}
+
+		uint64_t bytes = 0;
+		for(auto& c : chunks)
+			bytes += c.len;
+
+		if(!DeliverWaveform(link, wfm, chunks, bytes, recordFlags))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+	@brief Sends a downloaded block mode capture to the client as one PROTOCOL 2 frame
+
+	Every segment of a rapid block capture goes in the same frame, under one sequence number. The headers are built
+	up front with the sample data in between, padded so everything stays 8 byte aligned.
+
+	@return False if the client disconnected
+ */
+bool SendWaveformV2(DataLink& link, const CapturedWaveform& wfm)
+{
+	static const uint8_t padding[8] = {0};
+
+	bool compressed = (wfm.compression != COMPRESS_NONE);
+	bool packed = (wfm.format == FORMAT_PACKED) || compressed;
+	size_t analogBits = min(wfm.sampleBits, static_cast<size_t>(16));
+	float analogScaleFactor = packed ? (1 << (16 - analogBits)) : 1;
+
+	bool envelope = (wfm.envelopeColumns != 0) && (wfm.numSamples > wfm.envelopeColumns);
+	size_t count = envelope ? (2 * wfm.envelopeColumns) : wfm.numSamples;
+	double stretch = envelope ? (static_cast<double>(wfm.numSamples) / count) : 1;
+
+	size_t hdrlen = sizeof(FrameHeader) +
+		wfm.numSegments * (sizeof(FrameWaveformHeader) + wfm.numchans * sizeof(FrameChannelHeader));
+	vector<uint64_t> hdrbuf((hdrlen + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+	uint8_t* hdrptr = reinterpret_cast<uint8_t*>(&hdrbuf[0]);
+	vector<SendChunk> chunks;
+	chunks.reserve(1 + wfm.numSegments * (1 + 4*wfm.numchans));
+
+	//Scratch space, one per channel of each segment since the whole capture goes out at once
+	static thread_local map<size_t, vector<uint8_t> > packBuffers;
+	static thread_local map<size_t, vector<int16_t> > envBuffers;
+
+	//Compressed channels waiting for the worker pool: chunk index of the samples, and their header
+	vector<CompressionJob> jobs;
+	vector<pair<size_t, FrameChannelHeader*> > pending;
+
+	//Each waveform header and the chunk it starts at, to fill in the lengths at the end
+	vector<pair<size_t, FrameWaveformHeader*> > waveforms;
+
+	link.lastTxSeq ++;
+	if(link.primary)
+		g_lastTxSeq = link.lastTxSeq;
+
+	auto frame = reinterpret_cast<FrameHeader*>(hdrptr);
+	frame->magic = FRAME_MAGIC;
+	frame->version = 2;
+	frame->headerSize = sizeof(FrameHeader);
+	frame->sequence = link.lastTxSeq;
+	frame->numWaveforms = wfm.numSegments;
+	chunks.push_back({hdrptr, sizeof(FrameHeader)});
+	hdrptr += sizeof(FrameHeader);
+
+	uint32_t waveformFlags = 0;
+	if(wfm.roi)
+		waveformFlags |= WAVEFORM_ROI;
+	if(wfm.averageCount != 0)
+		waveformFlags |= WAVEFORM_AVERAGED;
+	if(envelope)
+		waveformFlags |= WAVEFORM_ENVELOPE;
+
+	for(size_t seg=0; seg<wfm.numSegments; seg++)
+	{
+		auto whdr = reinterpret_cast<FrameWaveformHeader*>(hdrptr);
+		whdr->fsPerSample = envelope ? llround(wfm.interval * stretch) : wfm.interval;
+		whdr->triggerTime = wfm.triggerTime;
+		whdr->startTime = wfm.roi ? wfm.roiOffset : 0;
+		whdr->segment = seg;
+		whdr->numChannels = wfm.numchans;
+		whdr->averageCount = wfm.averageCount;
+		whdr->flags = waveformFlags;
+		whdr->headerSize = sizeof(FrameWaveformHeader);
+		waveforms.push_back(pair<size_t, FrameWaveformHeader*>(chunks.size(), whdr));
+		chunks.push_back({hdrptr, sizeof(FrameWaveformHeader)});
+		hdrptr += sizeof(FrameWaveformHeader);
+
+		uint16_t overflow = (seg < wfm.overflow.size()) ? wfm.overflow[seg] : 0;
+		for(size_t i=0; i<g_channelIDs.size(); i++)
+		{
+			bool digital;
+			if( (i < g_numChannels) && wfm.channelOn.at(i) )
+				digital = false;
+			else if( (i >= g_numChannels) && wfm.msoPodEnabled[i - g_numChannels] )
+				digital = true;
+			else
+				continue;
+
+			size_t slot = seg * g_channelIDs.size() + i;
+			const int16_t* samples = GetChannelSamples(wfm, i, seg, digital, envelope, count, envBuffers[slot]);
+			size_t bits = digital ? 8 : analogBits;
+
+			auto chdr = reinterpret_cast<FrameChannelHeader*>(hdrptr);
+			chdr->channel = i;
+			if(digital)
+				chdr->flags |= CHANNEL_DIGITAL;
+			else if(overflow & (1 << i))
+				chdr->flags |= CHANNEL_OVERFLOW;
+			chdr->numSamples = count;
+			chdr->trigphase = wfm.trigphase[seg] * wfm.interval;
+			chdr->scale = digital ? 1 : (wfm.scale.at(i) * analogScaleFactor);
+			chdr->offset = digital ? 0 : wfm.offset.at(i);
+			chdr->encoding = packed ? ENCODING_PACKED : ENCODING_INT16;
+			chdr->compression = wfm.compression;
+			chdr->bits = bits;
+			chunks.push_back({hdrptr, sizeof(FrameChannelHeader)});
+			hdrptr += sizeof(FrameChannelHeader);
+
+			//Compressed: length and padding are filled in once the worker pool is done
+			if(compressed)
+			{
+				pending.push_back(pair<size_t, FrameChannelHeader*>(chunks.size(), chdr));
+				chunks.push_back({NULL, 0});
+				chunks.push_back({padding, 0});
+				jobs.push_back({samples, count, bits, digital, &packBuffers[slot]});
+			}
+			else
+			{
+				size_t len;
+				if(packed)
+				{
+					auto& pbuf = packBuffers[slot];
+					len = PackChannelSamples(samples, count, bits, digital, pbuf);
+					chunks.push_back({&pbuf[0], len});
+				}
+				else
+				{
+					len = count * sizeof(int16_t);
+					chunks.push_back({samples, len});
+				}
+				chdr->dataLength = len;
+				chunks.push_back({padding, (8 - (len % 8)) % 8});
+			}
+
+			auto var = wfm.variance.find(i);
+			if( (var != wfm.variance.end()) && !envelope)
+			{
+				chdr->flags |= CHANNEL_VARIANCE;
+				chunks.push_back({var->second->data(), count * sizeof(float)});
+				chunks.push_back({padding, (8 - ((count * sizeof(float)) % 8)) % 8});
+			}
+		}
+	}
+
+	//Compress every channel of every segment in parallel
+	if(!jobs.empty())
+	{
+		CompressChannels(jobs);
+		for(size_t j=0; j<jobs.size(); j++)
+		{
+			size_t len = jobs[j].out->size();
+			pending[j].second->dataLength = len;
+			chunks[pending[j].first] = {jobs[j].out->data(), len};
+			chunks[pending[j].first + 1].len = (8 - (len % 8)) % 8;
+		}
+	}
+
+	//Now everything is the size it's going to be, fill in the lengths
+	uint64_t bytes = 0;
+	for(auto& c : chunks)
+		bytes += c.len;
+	frame->length = bytes;
+	for(size_t w=0; w<waveforms.size(); w++)
+	{
+		size_t end = (w+1 < waveforms.size()) ? waveforms[w+1].first : chunks.size();
+		uint64_t len = 0;
+		for(size_t c=waveforms[w].first; c<end; c++)
+			len += chunks[c].len;
+		waveforms[w].second->length = len;
+	}
+
+	uint32_t recordFlags = link.record ? GetRecordFlags(wfm, envelope) : 0;
+	return DeliverWaveform(link, wfm, chunks, bytes, recordFlags);
+}
+
+/**
+	@brief Hands one encoded waveform (or PROTOCOL 2 frame) to whatever is on the other end of the link
+
+	The recorder writes it to disk, subscribers are sent it only if they're keeping up, and the controlling client
+	waits for the flow control window.
+
+	@return False if the client disconnected, or the recording failed
+ */
+bool DeliverWaveform(
+	DataLink& link,
+	const CapturedWaveform& wfm,
+	const vector<SendChunk>& chunks,
+	uint64_t bytes,
+	uint32_t recordFlags)
+{
+	//The recorder writes it to disk as is
+	if(link.record)
+	{
+		return RecordAppend(*link.record, chunks, bytes, link.lastTxSeq, recordFlags, wfm.timestamp, wfm.interval,
+			wfm.scale, wfm.offset);
+	}
+
+	//Subscribers are only sent what they can keep up with, the gap in sequence numbers shows what was dropped
+	if(!link.primary)
+	{
+		if(!CheckForACKs(link))
+			return false;
+		if(!ACKWindowOpen(link, bytes))
+		{
+			link.dropped ++;
+			return true;
+		}
+		if(!SendGathered(*link.socket, chunks, false))
+			return false;
+		RecordSentWaveform(link, bytes);
+		return true;
+	}
+
+	return SendToClient(link, chunks, bytes);
+}
+
+/**
+	@brief Sends one waveform to the controlling client, once the flow control window has room for it
+
+	@param link		Connection to the controlling client
+	@param chunks	The waveform
+	@param bytes	Total size of the chunks
+
+	@return False if the client disconnected
+ */
+bool SendToClient(DataLink& link, const vector<SendChunk>& chunks, uint64_t bytes)
+{
+	//Backpressure if too much is in flight
+	uint64_t tstart = PerfTimestamp();
+	if(!WaitForACKWindow(link, bytes))
+		return false;
+	PerfRecord(PERF_ACK_WAIT, tstart);
+
+	tstart = PerfTimestamp();
+	if(link.shm)
+	{
+		if(!ShmSend(*link.shm, *link.socket, chunks, bytes))
+			return false;
+	}
+	else if(!SendGathered(*link.socket, chunks))
+		return false;
+	PerfRecord(PERF_SEND, tstart, bytes);
+	RecordSentWaveform(link, bytes);
+	return true;
+}
+
+/**
+	@brief Sends recorded waveforms to the controlling client, exactly as they were recorded but with new sequence
+	numbers
+
+	@param link		Connection to the controlling client
+	@param first	Index of the first waveform to send, starting at 0
+	@param last		Index of the last waveform to send (inclusive), stops early at the end of the recording
+
+	@return False if the client disconnected
+ */
+bool ReplayRecording(DataLink& link, uint64_t first, uint64_t last)
+{
+	vector<uint8_t> buf;
+	for(uint64_t i=first; i<=last; i++)
+	{
+		//The sequence number leads a PROTOCOL 1 waveform, and is in the frame header in PROTOCOL 2
+		uint32_t flags;
+		if(!RecordRead(g_record, i, buf, &flags))
+			break;
+		size_t seqOffset = (flags & RECORD_PROTOCOL2) ? offsetof(FrameHeader, sequence) : 0;
+		if(buf.size() < seqOffset + sizeof(uint32_t))
+			break;
+
+		link.lastTxSeq ++;
+		g_lastTxSeq = link.lastTxSeq;
+		memcpy(&buf[seqOffset], &link.lastTxSeq, sizeof(uint32_t));
+
+		vector<SendChunk> chunks;
+		chunks.push_back({&buf[0], buf.size()});
+		if(!SendToClient(link, chunks, buf.size()))
+			return false;
+	}
+	return true;
+}
+
+/**
+	@brief Sends queued captures to the client while the waveform thread re-arms and downloads the next one
+ */
+void WaveformSenderThread(DataLink* link, SendPipeline* pipe)
+{
+#ifdef __linux__
+	pthread_setname_np(pthread_self(), "WaveformSender");
+#endif
+	TuneDataThread("WaveformSender");
+
+	unique_lock<mutex> lock(pipe->lock);
+	while(true)
+	{
+		pipe->cond.wait(lock, [pipe] { return pipe->quit || !pipe->queue.empty(); });
+		if(pipe->queue.empty())
+			break;
+
+		CapturedWaveform wfm = pipe->queue.front();
+		pipe->queue.pop_front();
+		pipe->sending = true;
+
+		lock.unlock();
+		bool ok = SendWaveform(*link, wfm);
+		lock.lock();
+		pipe->sending = false;
+
+		UnrefBufferSet(*pipe, wfm.bufferSet);
+		if(!ok)
+		{
+			//Client is gone, drop anything else that was queued
+			pipe->failed = true;
+			for(auto& w : pipe->queue)
+				UnrefBufferSet(*pipe, w.bufferSet);
+			pipe->queue.clear();
+		}
+		pipe->cond.notify_all();
+		if(!ok)
+			break;
+	}
+}
+
+/**
+	@brief Waits for a buffer set that isn't queued or being sent
+
+	@return False if the sender failed or we were asked to quit
+ */
+bool AcquireBufferSet(SendPipeline& pipe, size_t& set)
+{
+	unique_lock<mutex> lock(pipe.lock);
+	while(pipe.freeSets.empty())
+	{
+		if(pipe.failed || g_waveformThreadQuit)
+			return false;
+		pipe.cond.wait_for(lock, chrono::milliseconds(100));
+	}
+
+	set = pipe.freeSets.back();
+	pipe.freeSets.pop_back();
+	pipe.refs[set] = 1;
+	return true;
+}
+
+/**
+	@brief Drops one reference to a buffer set, freeing it for reuse once nobody needs it
+
+	Must be called with pipe.lock held.
+ */
+void UnrefBufferSet(SendPipeline& pipe, size_t set)
+{
+	pipe.refs[set] --;
+	if(pipe.refs[set] <= 0)
+	{
+		pipe.refs[set] = 0;
+		pipe.freeSets.push_back(set);
+	}
+}
+
+void ReleaseBufferSet(SendPipeline& pipe, size_t set)
+{
+	lock_guard<mutex> lock(pipe.lock);
+	UnrefBufferSet(pipe, set);
+	pipe.cond.notify_all();
+}
+
+/**
+	@brief Blocks until every queued capture has been sent, and the sender is done with the socket
+
+	@return False if the sender failed
+ */
+bool WaitForSenderIdle(SendPipeline& pipe)
+{
+	unique_lock<mutex> lock(pipe.lock);
+	pipe.cond.wait(lock, [&pipe] { return pipe.failed || (pipe.queue.empty() && !pipe.sending); });
+	return !pipe.failed;
+}
+
+/**
+	@brief Sends everything still queued, then shuts down the sender thread
+ */
+void StopSender(SendPipeline& pipe)
+{
+	if(!pipe.sender.joinable())
+		return;
+
+	{
+		lock_guard<mutex> lock(pipe.lock);
+		pipe.quit = true;
+		pipe.cond.notify_all();
+	}
+	pipe.sender.join();
+	pipe.quit = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Read-only data plane subscribers
+
+/**
+	@brief Accepts subscriber connections on the --subscriber-port socket
+
+	Subscribers get every block mode capture the controlling client does, as long as they keep up: a capture that
+	arrives while a subscriber is still busy with the previous one, or that doesn't fit in its ACK window, is dropped
+	for that subscriber only. They can't control the instrument and don't get streaming mode data or FETCH replies.
+ */
+void SubscriberAcceptThread()
+{
+#ifdef __linux__
+	pthread_setname_np(pthread_self(), "SubscriberAccept");
+#endif
+
+	while(true)
+	{
+		Socket client = g_subscriberSocket.Accept();
+		if(!client.IsValid())
+			break;
+		if(!client.DisableNagle())
+			LogWarning("Failed to disable Nagle on subscriber socket, performance may be poor\n");
+
+		//Don't let a subscriber that stopped reading hold a buffer set forever
+#ifdef _WIN32
+		DWORD timeout = 5000;
+#else
+		timeval timeout;
+		timeout.tv_sec = 5;
+		timeout.tv_usec = 0;
+#endif
+		setsockopt(static_cast<ZSOCKET>(client), SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+
+		lock_guard<mutex> lock(g_subscriberMutex);
+		ReapSubscribers();
+
+		size_t count = 0;
+		for(auto sub : g_subscribers)
+		{
+			if(!sub->link.record)
+				count ++;
+		}
+		if(count >= g_maxSubscribers)
+		{
+			LogWarning("Rejecting subscriber, already have %zu\n", count);
+			continue;
+		}
+
+		LogVerbose("Subscriber connected to data plane\n");
+		auto sub = new Subscriber(client.Detach());
+		sub->sender = thread(SubscriberThread, sub);
+		g_subscribers.push_back(sub);
+	}
+}
+
+/**
+	@brief Cleans up any subscribers that have gone away
+
+	Done for every capture and every new subscriber. The recorder is left alone, StopRecording() takes care of it.
+	Must be called with g_subscriberMutex held.
+ */
+void ReapSubscribers()
+{
+	for(auto it = g_subscribers.begin(); it != g_subscribers.end(); )
+	{
+		auto sub = *it;
+		if(sub->dead && !sub->busy && !sub->link.record)
+		{
+			g_subscriberCondition.notify_all();
+			sub->sender.join();
+			LogDebug("Subscriber disconnected (%" PRIu64 " waveforms dropped)\n", sub->dropped + sub->link.dropped);
+			delete sub;
+			it = g_subscribers.erase(it);
+		}
+		else
+			it ++;
+	}
+}
+
+/**
+	@brief Sends captures to one subscriber, one at a time as OfferToSubscribers() hands them over
+ */
+void SubscriberThread(Subscriber* sub)
+{
+#ifdef __linux__
+	pthread_setname_np(pthread_self(), "Subscriber");
+#endif
+
+	unique_lock<mutex> lock(g_subscriberMutex);
+	while(!sub->dead)
+	{
+		g_subscriberCondition.wait(lock, [sub] { return sub->busy || sub->dead; });
+		if(!sub->busy)
+			break;
+
+		lock.unlock();
+		bool ok = SendWaveform(sub->link, sub->wfm);
+		ReleaseBufferSet(*sub->pipe, sub->wfm.bufferSet);
+		lock.lock();
+
+		sub->busy = false;
+		if(!ok)
+			sub->dead = true;
+		g_subscriberCondition.notify_all();
+	}
+}
+
+/**
+	@brief Gives a capture to every subscriber that's done with the previous one
+
+	Each subscriber that takes it holds a reference on the buffer set until it has been sent.
+ */
+void OfferToSubscribers(SendPipeline& pipe, const CapturedWaveform& wfm)
+{
+	lock_guard<mutex> lock(g_subscriberMutex);
+
+	//Close the sockets of subscribers whose last send failed now, rather than when the next one connects
+	ReapSubscribers();
+
+	for(auto sub : g_subscribers)
+	{
+		if(sub->dead)
+			continue;
+		if(sub->busy)
+		{
+			sub->dropped ++;
+			continue;
+		}
+
+		{
+			lock_guard<mutex> plock(pipe.lock);
+			pipe.refs[wfm.bufferSet] ++;
+		}
+		sub->wfm = wfm;
+		sub->pipe = &pipe;
+		sub->busy = true;
+	}
+	g_subscriberCondition.notify_all();
+}
+
+/**
+	@brief Blocks until no subscriber is holding a buffer set, so they can be freed
+ */
+void WaitForSubscribersIdle()
+{
+	unique_lock<mutex> lock(g_subscriberMutex);
+	g_subscriberCondition.wait(lock, []
+		{
+			for(auto sub : g_subscribers)
+			{
+				if(sub->busy)
+					return false;
+			}
+			return true;
+		});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Record to disk
+
+/**
+	@brief Starts recording every block mode capture to a new file
+
+	The recorder is fed like a subscriber, from its own spare buffer set: a capture that arrives while the previous
+	one is still being written is dropped from the recording rather than holding up the re-arm. The file is kept
+	open after StopRecording() for RECORD:REPLAY, until the next recording starts.
+
+	@param path		Path of the file
+	@param size		Bytes to preallocate
+
+	@return False if the file couldn't be created
+ */
+bool StartRecording(const string& path, uint64_t size)
+{
+	StopRecording();
+	RecordClose(g_record);
+	if(!RecordOpen(g_record, path, size))
+		return false;
+
+	lock_guard<mutex> lock(g_subscriberMutex);
+	auto sub = new Subscriber(&g_record);
+	sub->sender = thread(SubscriberThread, sub);
+	g_subscribers.push_back(sub);
+	return true;
+}
+
+/**
+	@brief Stops feeding the recorder, once the waveform it's writing is done, and flushes the file to disk
+ */
+void StopRecording()
+{
+	Subscriber* rec = nullptr;
+	{
+		unique_lock<mutex> lock(g_subscriberMutex);
+		for(auto sub : g_subscribers)
+		{
+			if(sub->link.record)
+				rec = sub;
+		}
+		if(!rec)
+			return;
+
+		//Stays on the list until it's idle, so WaitForSubscribersIdle() knows it may still be using a buffer set
+		rec->dead = true;
+		g_subscriberCondition.notify_all();
+		g_subscriberCondition.wait(lock, [rec] { return !rec->busy; });
+		g_subscribers.remove(rec);
+	}
+
+	rec->sender.join();
+	LogDebug("Recording stopped (%" PRIu64 " waveforms dropped)\n", rec->dropped);
+	delete rec;
+	RecordFlush(g_record);
+}
+
+/**
+	@brief Checks if captures are being recorded (false once the file is full)
+ */
+bool IsRecording()
+{
+	lock_guard<mutex> lock(g_subscriberMutex);
+	for(auto sub : g_subscribers)
+	{
+		if(sub->link.record)
+			return !sub->dead;
+	}
+	return false;
+}
+
+/**
+	@brief Returns the number of captures the recorder couldn't keep up with
+ */
+uint64_t RecordDropCount()
+{
+	lock_guard<mutex> lock(g_subscriberMutex);
+	for(auto sub : g_subscribers)
+	{
+		if(sub->link.record)
+			return sub->dropped;
+	}
+	return 0;
+}
+
+/**
+	@brief Asks the waveform thread to send recorded waveforms first to last (inclusive, counted from 0)
+ */
+void RequestReplay(uint64_t first, uint64_t last)
+{
+	{
+		lock_guard<mutex> lock(g_readyMutex);
+		g_replayRequested = true;
+		g_replayFirst = first;
+		g_replayLast = last;
+	}
+	g_readyCondition.notify_one();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Block mode capture completion
+
+/**
+	@brief Prepares for a new block mode capture, called right before psXXXXRunBlock
+
+	@return Parameter to pass to psXXXXRunBlock, identifying this capture to OnBlockReady()
+ */
+void* PrepareBlockReady()
+{
+	lock_guard<mutex> lock(g_readyMutex);
+	g_captureReady = false;
+	g_blockReadyGeneration ++;
+	return reinterpret_cast<void*>(g_blockReadyGeneration);
+}
+
+/**
+	@brief Block ready callback, called by the driver from its own thread once a capture is complete
+ */
+void PREF4 OnBlockReady(int16_t /*handle*/, PICO_STATUS status, void* pParameter)
+{
+	//Capture was aborted, nothing to download
+	if(status != PICO_OK)
+	{
+		LogTrace("Block ready callback with status 0x%x\n", status);
+		return;
+	}
+
+	{
+		lock_guard<mutex> lock(g_readyMutex);
+		if(reinterpret_cast<uintptr_t>(pParameter) != g_blockReadyGeneration)
+			return;
+		g_captureReady = true;
+		g_captureReadyTime = chrono::duration_cast<chrono::nanoseconds>(
+			chrono::system_clock::now().time_since_epoch()).count();
+	}
+	PerfMarkReady();
+	g_readyCondition.notify_one();
+}
+
+/**
+	@brief Asks the waveform thread to download and send all of the last capture (after a region of interest)
+ */
+void RequestRestFetch()
+{
+	{
+		lock_guard<mutex> lock(g_readyMutex);
+		g_fetchRestRequested = true;
+	}
+	g_readyCondition.notify_one();
+}
+
+/**
+	@brief Asks the waveform thread to resend the last capture in full (envelope mode only)
+ */
+void RequestFullFetch()
+{
+	{
+		lock_guard<mutex> lock(g_readyMutex);
+		g_fetchRequested = true;
+	}
+	g_readyCondition.notify_one();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Streaming mode
+
+/**
+	@brief Maps a streaming buffer index to the Pico channel ID
+ */
+PICO_CHANNEL StreamingChannelID(size_t i)
+{
+	if(i < g_numChannels)
+		return (PICO_CHANNEL)i;
+	else
+		return (PICO_CHANNEL)(PICO_PORT0 + i - g_numChannels);
+}
+
+/**
+	@brief Frees the buffers given to the driver for streaming
+
+	Must be called with g_mutex held, once the driver has been stopped.
+ */
+void FreeStreamingBuffers()
+{
+	for(auto it : g_streamingBuffers)
+		FreeSampleBuffer(it.second, RoundUpSampleBuffer(g_streamingBufferLen));
+	g_streamingBuffers.clear();
+}
+
+/**
+	@brief Sets up buffers and starts a streaming mode acquisition
+
+	Called from StartInternal() with g_mutex held.
+ */
+PICO_STATUS StartStreaming()
+{
+	FreeStreamingBuffers();
+
+	g_streamingBufferLen = g_memDepth;
+	g_streamingSampleCount = 0;
+
+	//The block mode buffers will no longer be attached to the driver after this
+	g_memDepthChanged = true;
+
+	//Removes every buffer on the 6000E and PSOSPA APIs. On the others block mode buffers of channels that are off
+	//stay attached, which is harmless.
+	g_backend->ClearDataBuffers((PICO_CHANNEL)0, DOWNSAMPLE_NONE);
+
+	//Give the driver a buffer for each channel that's on
+	PICO_STATUS status = PICO_OK;
+	for(size_t i=0; i<g_numChannels + g_numDigitalPods; i++)
+	{
+		if( (i < g_numChannels) && !g_channelOnDuringArm[i])
+			continue;
+		if( (i >= g_numChannels) && !g_msoPodEnabledDuringArm[i - g_numChannels])
+			continue;
+
+		//The driver writes into these continuously, so they come from the same allocator as block mode buffers
+		int16_t* buf = AllocateSampleBuffer(RoundUpSampleBuffer(g_streamingBufferLen));
+		if(buf == NULL)
+			return PICO_MEMORY_FAIL;
+		g_streamingBuffers[i] = buf;
+
+		auto ch = StreamingChannelID(i);
+		status = g_backend->SetDataBuffer(ch, buf, g_streamingBufferLen, 0, DOWNSAMPLE_NONE);
+		if(status != PICO_OK)
+		{
+			LogError("psXXXXSetDataBuffer for streaming channel %d failed (code 0x%x)\n", ch, status);
+			return status;
+		}
+	}
+
+	int64_t interval = g_sampleIntervalDuringArm;
+	status = g_backend->RunStreaming(interval, g_streamingBufferLen);
+
+	//The driver rounds to the closest interval it can actually do
+	if(status == PICO_OK)
+	{
+		g_sampleIntervalDuringArm = interval;
+		LogTrace("Streaming started, %zu samples buffer, %" PRId64 " fs per sample\n",
+			g_streamingBufferLen, g_sampleIntervalDuringArm);
+	}
+	return status;
+}
+
+/**
+	@brief Copies any new streaming samples out of the driver buffers
+
+	Must be called with g_mutex held.
+
+	@param chunk		Receives the new samples of each channel, indexed like g_streamingBuffers
+	@param firstSample	Index of the first new sample, counted from the start of streaming
+	@param overflow		Receives the over range flags of the new samples, a bit per analog channel
+
+	@return Number of new samples per channel
+ */
+size_t ReadStreamingData(WaveformBufferSet& chunk, uint64_t& firstSample, uint16_t& overflow)
+{
+	overflow = 0;
+	if(g_streamingBuffers.empty())
+		return 0;
+
+	vector<PICO_CHANNEL> channels;
+	for(auto it : g_streamingBuffers)
+		channels.push_back(StreamingChannelID(it.first));
+	StreamingValues values;
+	PICO_STATUS status = g_backend->GetStreamingLatestValues(channels, values);
+
+	if(status == PICO_BUSY)
+		return 0;
+	if(status != PICO_OK)
+	{
+		LogWarning("psXXXXGetStreamingLatestValues failed (code 0x%x)\n", status);
+		return 0;
+	}
+
+	overflow = values.overflow;
+	size_t startIndex = min(values.startIndex, g_streamingBufferLen);
+	size_t numSamples = min(values.numSamples, g_streamingBufferLen - startIndex);
+	//Buffers only grow, so after the first chunk this doesn't allocate
+	PrepareBufferSet(chunk, g_streamingBufferLen, 1, DOWNSAMPLE_NONE);
+	for(auto it : g_streamingBuffers)
+		memcpy(chunk.buffers[it.first], it.second + startIndex, numSamples * sizeof(int16_t));
+
+	//Hand the (now copied out) buffers back to the driver
+	if(values.needBuffers)
+	{
+		for(auto it : g_streamingBuffers)
+		{
+			status = g_backend->SetDataBuffer(
+				StreamingChannelID(it.first), it.second, g_streamingBufferLen, 0, DOWNSAMPLE_NONE);
+			if(status != PICO_OK)
+				LogError("psXXXXSetDataBuffer for streaming channel %zu failed (code 0x%x)\n", it.first, status);
+		}
+	}
+
+	firstSample = g_streamingSampleCount;
+	g_streamingSampleCount += numSamples;
+	return numSamples;
+}
+
+/**
+	@brief Sends streaming mode data to the client until streaming stops
+
+	@param link		Data plane connection
+	@param staging	Buffers the new samples are copied into before sending, reused from one chunk to the next
+
+	@return False if the client disconnected
+ */
+bool StreamingLoop(DataLink& link, WaveformBufferSet& staging)
+{
+	Socket& client = *link.socket;
+	while(!g_waveformThreadQuit)
+	{
+		size_t numSamples;
+		uint64_t firstSample = 0;
+		uint16_t overflow;
+		int64_t interval;
+		unsigned int protocol;
+		map<size_t, int16_t*> chunk;
+		map<size_t, float> scale;
+		map<size_t, float> offset;
+		size_t bits;
+		int64_t pollInterval_us;
+		{
+			lock_guard<mutex> lock(g_mutex);
+			if(!g_triggerArmed || !g_streamingModeDuringArm)
+				return true;
+
+			numSamples = ReadStreamingData(staging, firstSample, overflow);
+			interval = g_sampleIntervalDuringArm;
+			protocol = g_protocolVersion;
+			bits = g_adcBits;
+			for(auto it : g_streamingBuffers)
+			{
+				chunk[it.first] = staging.buffers[it.first];
+				if(it.first < g_numChannels)
+				{
+					scale[it.first] = g_roundedRange[it.first] / g_scaleValue;
+					offset[it.first] = g_offsetDuringArm[it.first];
+				}
+			}
+
+			//Poll four times per driver buffer, so it never fills up, but between every 50 us and every ms
+			double fillTime_us = static_cast<double>(g_streamingBufferLen) * interval * 1e-9;
+			pollInterval_us = min(max(static_cast<int64_t>(fillTime_us / 4), static_cast<int64_t>(50)),
+				static_cast<int64_t>(1000));
+		}
+
+		//Nothing new yet. Wait on the ready condition rather than sleeping, with g_mutex free for the control
+		//plane, so any request to the waveform thread also wakes us up.
+		if(numSamples == 0)
+		{
+			unique_lock<mutex> lock(g_readyMutex);
+			g_readyCondition.wait_for(lock, chrono::microseconds(pollInterval_us));
+			continue;
+		}
+
+		if(protocol >= 2)
+		{
+			if(!SendStreamingChunkV2(link, chunk, numSamples, firstSample, overflow, interval, scale, offset, bits))
+				return false;
+			continue;
+		}
+
+		//Bump sequence number
+		link.lastTxSeq ++;
+		g_lastTxSeq = link.lastTxSeq;
+
+		#pragma pack(push, 1)
+		struct
+		{
+			uint32_t sequence;
+			uint16_t numChannels;
+			int64_t fs_per_sample;
+		} wfmhdrs;
+		#pragma pack(pop)
+		wfmhdrs.sequence = link.lastTxSeq;
+		wfmhdrs.numChannels = chunk.size();
+		wfmhdrs.fs_per_sample = interval;
+
+		//Channel headers are the same as in block mode, there's no trigger phase when streaming
+		#pragma pack(push, 1)
+		struct AnalogHeader
+		{
+			size_t nchan;
+			size_t numSamples;
+			float scale;
+			float offset;
+			float trigphase;
+		};
+		struct DigitalHeader
+		{
+			size_t nchan;
+			size_t numSamples;
+			float trigphase;
+		};
+		#pragma pack(pop)
+		vector<AnalogHeader> analogHeaders;
+		vector<DigitalHeader> digitalHeaders;
+		analogHeaders.reserve(chunk.size());
+		digitalHeaders.reserve(chunk.size());
+
+		//Top level header is followed by the running sample counter, then each channel's header and samples
+		vector<SendChunk> chunks;
+		chunks.push_back({&wfmhdrs, sizeof(wfmhdrs)});
+		chunks.push_back({&firstSample, sizeof(firstSample)});
+		size_t len = numSamples * sizeof(int16_t);
+		for(auto& it : chunk)
+		{
+			size_t i = it.first;
+			if(i < g_numChannels)
+			{
+				analogHeaders.push_back({i, numSamples, scale[i], offset[i], 0});
+				chunks.push_back({&analogHeaders.back(), sizeof(AnalogHeader)});
+			}
+			else
+			{
+				digitalHeaders.push_back({i, numSamples, 0});
+				chunks.push_back({&digitalHeaders.back(), sizeof(DigitalHeader)});
+			}
+			chunks.push_back({it.second, len});
+		}
+
+		uint64_t bytes = 0;
+		for(auto& c : chunks)
+			bytes += c.len;
+		RecordStreamingChunk(chunks, bytes, &wfmhdrs.sequence, RECORD_STREAMING, interval, scale, offset);
+		wfmhdrs.sequence = link.lastTxSeq;
+
+		//Backpressure if too much is in flight
+		uint64_t tstart = PerfTimestamp();
+		if(!WaitForACKWindow(link, bytes))
+			return false;
+		PerfRecord(PERF_ACK_WAIT, tstart);
+		RecordSentWaveform(link, bytes);
+
+		//Streaming chunks are small and short lived, they always go on the socket.
+		//No zero copy, the staging buffers are overwritten by the next chunk.
+		if(link.shm && !ShmSendInline(client, bytes))
+			return false;
+		if(!SendGathered(client, chunks, false))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+	@brief Sends one chunk of streaming data as a PROTOCOL 2 frame holding a single waveform
+
+	The scale and offset of each analog channel, and the ADC resolution, are the caller's copies taken under g_mutex
+	along with the samples.
+
+	@return False if the client disconnected
+ */
+bool SendStreamingChunkV2(
+	DataLink& link,
+	const map<size_t, int16_t*>& chunk,
+	size_t numSamples,
+	uint64_t firstSample,
+	uint16_t overflow,
+	int64_t interval,
+	const map<size_t, float>& scale,
+	const map<size_t, float>& offset,
+	size_t bits)
+{
+	static const uint8_t padding[8] = {0};
+	size_t len = numSamples * sizeof(int16_t);
+	size_t pad = (8 - (len % 8)) % 8;
+
+	vector<FrameChannelHeader> chdrs(chunk.size());
+	FrameHeader frame;
+	memset(&frame, 0, sizeof(frame));
+	FrameWaveformHeader whdr;
+	memset(&whdr, 0, sizeof(whdr));
+
+	vector<SendChunk> chunks;
+	chunks.push_back({&frame, sizeof(frame)});
+	chunks.push_back({&whdr, sizeof(whdr)});
+
+	size_t j = 0;
+	for(auto& it : chunk)
+	{
+		size_t i = it.first;
+		auto& chdr = chdrs[j++];
+		chdr.channel = i;
+		chdr.numSamples = numSamples;
+		chdr.dataLength = len;
+		chdr.encoding = ENCODING_INT16;
+		chdr.compression = COMPRESS_NONE;
+		if(i < g_numChannels)
+		{
+			if(overflow & (1 << i))
+				chdr.flags |= CHANNEL_OVERFLOW;
+			chdr.scale = scale.at(i);
+			chdr.offset = offset.at(i);
+			chdr.bits = bits;
+		}
+		else
+		{
+			chdr.flags |= CHANNEL_DIGITAL;
+			chdr.scale = 1;
+			chdr.bits = 8;
+		}
+
+		chunks.push_back({&chdr, sizeof(FrameChannelHeader)});
+		chunks.push_back({it.second, len});
+		chunks.push_back({padding, pad});
+	}
+
+	uint64_t bytes = 0;
+	for(auto& c : chunks)
+		bytes += c.len;
+
+	link.lastTxSeq ++;
+	g_lastTxSeq = link.lastTxSeq;
+
+	frame.magic = FRAME_MAGIC;
+	frame.version = 2;
+	frame.headerSize = sizeof(FrameHeader);
+	frame.sequence = link.lastTxSeq;
+	frame.numWaveforms = 1;
+	frame.length = bytes;
+	frame.flags = FRAME_STREAMING;
+
+	whdr.length = bytes - sizeof(frame);
+	whdr.fsPerSample = interval;
+	whdr.triggerTime = chrono::duration_cast<chrono::nanoseconds>(
+		chrono::system_clock::now().time_since_epoch()).count();
+	whdr.firstSample = firstSample;
+	whdr.numChannels = chunk.size();
+	whdr.headerSize = sizeof(FrameWaveformHeader);
+
+	RecordStreamingChunk(chunks, bytes, &frame.sequence, RECORD_PROTOCOL2 | RECORD_STREAMING, interval, scale, offset);
+	frame.sequence = link.lastTxSeq;
+
+	//Backpressure if too much is in flight
+	uint64_t tstart = PerfTimestamp();
+	if(!WaitForACKWindow(link, bytes))
+		return false;
+	PerfRecord(PERF_ACK_WAIT, tstart);
+	RecordSentWaveform(link, bytes);
+
+	//Streaming chunks are small and short lived, they always go on the socket
+	if(link.shm && !ShmSendInline(*link.socket, bytes))
+		return false;
+	return SendGathered(*link.socket, chunks, false);
+}
+
+/**
+	@brief Appends one chunk of streaming data to the recording, if there is one
+
+	The chunk is written with the recorder's own sequence number, the caller puts back its own afterwards. A full
+	file stops the recording, the same as in block mode.
+
+	@param chunks		The chunk, as it is about to be sent
+	@param bytes		Total size of the chunks
+	@param sequence		Sequence number field in the chunk's header
+	@param flags		RecordFlags describing its layout
+	@param interval		Sample interval in fs
+	@param scale		Scale of each analog channel
+	@param offset		Offset of each analog channel
+ */
+void RecordStreamingChunk(
+	const vector<SendChunk>& chunks,
+	uint64_t bytes,
+	uint32_t* sequence,
+	uint32_t flags,
+	int64_t interval,
+	const map<size_t, float>& scale,
+	const map<size_t, float>& offset)
+{
+	lock_guard<mutex> lock(g_subscriberMutex);
+	for(auto sub : g_subscribers)
+	{
+		if(!sub->link.record || sub->dead || sub->busy)
+			continue;
+
+		sub->link.lastTxSeq ++;
+		*sequence = sub->link.lastTxSeq;
+		int64_t now = chrono::duration_cast<chrono::nanoseconds>(
+			chrono::system_clock::now().time_since_epoch()).count();
+		if(!RecordAppend(*sub->link.record, chunks, bytes, sub->link.lastTxSeq, flags, now, interval, scale, offset))
+		{
+			sub->dead = true;
+			g_subscriberCondition.notify_all();
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+/**
+	@brief Reads the hardware trigger time offsets of all segments of a rapid block capture
+
+	@param numSegments	Number of segments in the capture
+	@param offsets_fs	Output array of numSegments trigger time offsets, in femtoseconds
+ */
+void GetTriggerTimeOffsets(size_t numSegments, int64_t* offsets_fs)
+{
+	PICO_STATUS status = g_backend->GetTriggerTimeOffsets(numSegments, offsets_fs);
+
+	if(status != PICO_OK)
+	{
+		LogWarning("psXXXXGetValuesTriggerTimeOffsetBulk failed (code 0x%x)\n", status);
+		for(size_t i=0; i<numSegments; i++)
+			offsets_fs[i] = 0;
+	}
 }
 
-float InterpolateTriggerTime(int16_t* buf)
+float InterpolateTriggerTime(int16_t* buf, size_t firstSample)
 {
-	if(g_triggerSampleIndex <= 0)
+	if(g_triggerSampleIndex <= firstSample)
 		return 0;
+	size_t index = g_triggerSampleIndex - firstSample;
 
 	//trigger scale value depends on ADC setting and is different for EXT trig input
 	size_t trigmaxcount = g_scaleValue;
@@ -451,8 +2708,8 @@ float InterpolateTriggerTime(int16_t* buf)
 	float trigscale = g_roundedRange[g_triggerChannel] / trigmaxcount;
 	float trigoff = g_offsetDuringArm[g_triggerChannel];
 
-	float fa = buf[g_triggerSampleIndex-1] * trigscale + trigoff;
-	float fb = buf[g_triggerSampleIndex] * trigscale + trigoff;
+	float fa = buf[index-1] * trigscale + trigoff;
+	float fb = buf[index] * trigscale + trigoff;
 
 	//no need to divide by time, sample spacing is normalized to 1 timebase unit
 	float slope = (fb - fa);
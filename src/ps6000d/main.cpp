@@ -43,6 +43,8 @@ PICO_INFO Open3000();
 PICO_INFO Open4000();
 PICO_INFO Open5000();
 PICO_INFO Open6000();
+PICO_INFO OpenSimulator(size_t numChannels);
+PICO_INFO OpenSeries(size_t series);
 
 using namespace std;
 
@@ -56,8 +58,33 @@ void help()
 			"  [general options]:\n"
 			"    --help                        : this message...\n"
 			"    --series <number>             : specifies the model series to look for (2000, 3000, 4000, 5000, 6000)\n"
+			"    --serial <serial>             : open the instrument with this serial number (default: first one found)\n"
+			"    --all-units                   : serve every connected instrument, one worker process per unit\n"
+			"    --serials <serial,serial,...> : serve this list of instruments, one worker process per unit\n"
+			"                                    (unit i uses scpi-port + 2i and waveform-port + 2i, and a share of\n"
+			"                                    --data-cores, --compress-cores and the compression threads)\n"
+			"    --unit-cache <file>           : remember the series of each unit opened here, to open it faster next time\n"
+			"                                    (default ~/.cache/ps6000d-units)\n"
+			"    --no-unit-cache               : don't use the unit cache\n"
+			"    --parallel-probe              : ask every driver API for connected units at once when looking for one\n"
 			"    --scpi-port port              : specifies the SCPI control plane port (default 5025)\n"
 			"    --waveform-port port          : specifies the binary waveform data port (default 5026)\n"
+			"    --subscriber-port port        : accept read-only waveform data subscribers on this port (default off)\n"
+			"    --max-subscribers num         : maximum number of concurrent subscribers (default 4)\n"
+			"    --lock-buffers                : lock sample buffers into RAM (may need a higher RLIMIT_MEMLOCK)\n"
+			"    --data-cores <list>           : pin the waveform and sender threads to these cores (e.g. 2,3 or 2-3)\n"
+			"    --compress-cores <list>       : pin the compression workers to these cores\n"
+			"    --compress-threads num        : number of compression workers (default: one per --compress-cores core,\n"
+			"                                    or all cores but one)\n"
+			"    --rt-priority prio            : run the waveform and sender threads under SCHED_FIFO at this priority\n"
+			"                                    (needs CAP_SYS_NICE or RLIMIT_RTPRIO)\n"
+			"    --numa-node <node>|auto       : allocate sample buffers on this NUMA node, or the USB controller's (Linux only)\n"
+			"    --zerocopy                    : send large waveforms without copying them into the socket (Linux only)\n"
+			"    --shm-slots num               : number of waveform slots for TRANSPORT SHM (default 4)\n"
+			"    --shm-slot-size MB            : size of each TRANSPORT SHM slot in MB (default 128)\n"
+			"    --simulate [channels]         : use a simulated instrument with 1-8 channels (default 4) instead of hardware\n"
+			"    --sim-bandwidth MBps          : simulated download bandwidth in MB/s (default 400)\n"
+			"    --sim-trigger-rate Hz         : mean trigger rate of the simulated signal (default 0 = trigger immediately)\n"
 			"\n"
 			"  [logger options]:\n"
 			"    levels: ERROR, WARNING, NOTICE, VERBOSE, DEBUG\n"
@@ -82,8 +109,13 @@ int16_t g_hScope = 0;
 size_t g_numChannels = 0;
 bool limitChannels = false;
 
+//Serial number of the unit to open, empty to open the first one found
+string g_openSerial;
+int8_t* OpenSerial();
+
 Socket g_scpiSocket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
 Socket g_dataSocket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+Socket g_subscriberSocket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
 
 #ifdef _WIN32
 BOOL WINAPI OnQuit(DWORD signal);
@@ -100,6 +132,11 @@ int main(int argc, char* argv[])
 	//Parse command-line arguments
 	uint16_t scpi_port = 5025;
 	uint16_t waveform_port = 5026;
+	uint16_t subscriber_port = 0;
+	size_t max_subscribers = 4;
+	size_t simChannels = 0;
+	bool allUnits = false;
+	vector<string> serials;
 	for(int i=1; i<argc; i++)
 	{
 		string s(argv[i]);
@@ -125,6 +162,33 @@ int main(int argc, char* argv[])
 			}
 		}
 
+		else if(s == "--serial")
+		{
+			if(i+1 < argc)
+				g_openSerial = argv[++i];
+		}
+
+		else if(s == "--all-units")
+			allUnits = true;
+
+		else if(s == "--serials")
+		{
+			if(i+1 < argc)
+				AppendSerials(serials, argv[++i]);
+		}
+
+		else if(s == "--unit-cache")
+		{
+			if(i+1 < argc)
+				g_unitCachePath = argv[++i];
+		}
+
+		else if(s == "--no-unit-cache")
+			g_unitCachePath = "";
+
+		else if(s == "--parallel-probe")
+			g_parallelProbe = true;
+
 		else if(s == "--scpi-port")
 		{
 			if(i+1 < argc)
@@ -137,6 +201,93 @@ int main(int argc, char* argv[])
 				waveform_port = atoi(argv[++i]);
 		}
 
+		else if(s == "--subscriber-port")
+		{
+			if(i+1 < argc)
+				subscriber_port = atoi(argv[++i]);
+		}
+
+		else if(s == "--max-subscribers")
+		{
+			if(i+1 < argc)
+				max_subscribers = atoi(argv[++i]);
+		}
+
+		else if(s == "--lock-buffers")
+			g_lockSampleBuffers = true;
+
+		else if( (s == "--data-cores") || (s == "--compress-cores") )
+		{
+			if(i+1 < argc)
+			{
+				auto& cores = (s == "--data-cores") ? g_dataCores : g_compressCores;
+				cores.clear();
+				if(!ParseCoreList(argv[++i], cores))
+				{
+					fprintf(stderr, "Invalid core list \"%s\" for %s\n", argv[i], s.c_str());
+					return 1;
+				}
+			}
+		}
+
+		else if(s == "--compress-threads")
+		{
+			if(i+1 < argc)
+				g_compressionThreads = max(atoi(argv[++i]), 1);
+		}
+
+		else if(s == "--rt-priority")
+		{
+			if(i+1 < argc)
+				g_rtPriority = max(atoi(argv[++i]), 0);
+		}
+
+		else if(s == "--numa-node")
+		{
+			if(i+1 < argc)
+			{
+				string node = argv[++i];
+				if(node == "auto")
+					g_numaNode = NUMA_NODE_AUTO;
+				else
+					g_numaNode = max(atoi(node.c_str()), 0);
+			}
+		}
+
+		else if(s == "--zerocopy")
+			g_zeroCopySend = true;
+
+		else if(s == "--shm-slots")
+		{
+			if(i+1 < argc)
+				g_shmSlots = max(atoi(argv[++i]), 1);
+		}
+
+		else if(s == "--shm-slot-size")
+		{
+			if(i+1 < argc)
+				g_shmSlotSize = static_cast<size_t>(max(atoi(argv[++i]), 1)) << 20;
+		}
+
+		else if(s == "--simulate")
+		{
+			simChannels = 4;
+			if( (i+1 < argc) && isdigit(argv[i+1][0]) )
+				simChannels = atoi(argv[++i]);
+		}
+
+		else if(s == "--sim-bandwidth")
+		{
+			if(i+1 < argc)
+				g_simBandwidth = max(atof(argv[++i]), 1.0);
+		}
+
+		else if(s == "--sim-trigger-rate")
+		{
+			if(i+1 < argc)
+				g_simTriggerRate = max(atof(argv[++i]), 0.0);
+		}
+
 		else
 		{
 			fprintf(stderr, "Unrecognized command-line argument \"%s\", use --help\n", s.c_str());
@@ -149,52 +300,45 @@ int main(int argc, char* argv[])
 	g_log_sinks.emplace(g_log_sinks.begin(), new ColoredSTDLogSink(console_verbosity));
 	//g_log_sinks.emplace(g_log_sinks.begin(), new STDLogSink(console_verbosity));
 
-	//For now, open the first instrument we can find.
-	//TODO: implement device selection logic
+	//Multi-instrument mode hands each unit to its own worker
+	if(allUnits)
+		serials = EnumerateUnits(g_series);
+	if(!serials.empty() || allUnits)
+		return RunSupervisor(argc, argv, serials, scpi_port, waveform_port, subscriber_port);
+
+	//Open the requested instrument, or the first one we can find
 	PICO_INFO status = PICO_NOT_FOUND;
-	switch(g_series)
+	if(simChannels)
+		status = OpenSimulator(simChannels);
+	else if(g_series != 0)
+		status = OpenSeries(g_series);
+
+	//Series not given: try the one this unit had last time, then ask the drivers which one has it,
+	//and only if that fails too go through every API in turn
+	else
 	{
-		case 0:
-		{
-			status = Open2000();
-			if(status == 0)
-				break;
-			status = Open3000();
-			if(status == 0)
-				break;
-			status = Open4000();
-			if(status == 0)
-				break;
-			status = Open5000();
-			if(status == 0)
-				break;
-			status = Open6000();
-			break;
-		}
-		case 2:
-		{
-			status = Open2000();
-			break;
-		}
-		case 3:
-		{
-			status = Open3000();
-			break;
-		}
-		case 4:
-		{
-			status = Open4000();
-			break;
-		}
-		case 5:
+		size_t cached = LookupCachedSeries(g_openSerial);
+		if(cached != 0)
+			status = OpenSeries(cached);
+
+		size_t found = 0;
+		if(status != PICO_OK)
 		{
-			status = Open5000();
-			break;
+			found = FindSeriesOfUnit(g_openSerial);
+			if( (found != 0) && (found != cached) )
+				status = OpenSeries(found);
 		}
-		case 6:
+
+		if(status != PICO_OK)
 		{
-			status = Open6000();
-			break;
+			for(size_t series = 2; series <= 6; series++)
+			{
+				if( (series == cached) || (series == found) )
+					continue;
+				status = OpenSeries(series);
+				if(status == PICO_OK)
+					break;
+			}
 		}
 	}
 
@@ -203,25 +347,15 @@ int main(int argc, char* argv[])
 		LogError("Failed to open unit (code %d)\n", status);
 		return 1;
 	}
+	g_backend = CreateBackend(g_pico_type, g_hScope);
 
-	//See what we got
+	//See what we got. Only the model, serial and firmware version are needed, the rest is only worth the
+	//round trips to the instrument when it gets logged.
 	{
 		LogIndenter li;
 
 		char buf[128];
 		int16_t required = 0;
-		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_DRIVER_VERSION);
-		if(status == PICO_OK)
-			LogVerbose("Driver version:   %s\n", buf);
-
-		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_USB_VERSION);
-		if(status == PICO_OK)
-			LogVerbose("USB version:      %s\n", buf);
-
-		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_HARDWARE_VERSION);
-		if(status == PICO_OK)
-			LogVerbose("Hardware version: %s\n", buf);
-
 		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_VARIANT_INFO);
 		if(status == PICO_OK)
 		{
@@ -236,22 +370,6 @@ int main(int argc, char* argv[])
 			g_serial = buf;
 		}
 
-		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_CAL_DATE);
-		if(status == PICO_OK)
-			LogVerbose("Cal date:         %s\n", buf);
-
-		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_KERNEL_VERSION);
-		if(status == PICO_OK)
-			LogVerbose("Kernel ver:       %s\n", buf);
-
-		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_DIGITAL_HARDWARE_VERSION);
-		if(status == PICO_OK)
-			LogVerbose("Digital HW ver:   %s\n", buf);
-
-		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_ANALOGUE_HARDWARE_VERSION);
-		if(status == PICO_OK)
-			LogVerbose("Analog HW ver:    %s\n", buf);
-
 		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_FIRMWARE_VERSION_1);
 		if(status == PICO_OK)
 		{
@@ -259,39 +377,53 @@ int main(int argc, char* argv[])
 			g_fwver = buf;
 		}
 
-		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_FIRMWARE_VERSION_2);
-		if(status == PICO_OK)
-			LogVerbose("FW ver 2:         %s\n", buf);
-
-		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_FIRMWARE_VERSION_3);
-		if(status == PICO_OK)
-			LogVerbose("FW ver 3:         %s\n", buf);
-
-		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_FRONT_PANEL_FIRMWARE_VERSION);
-		if(status == PICO_OK)
-			LogVerbose("Front panel FW:   %s\n", buf);
-
-		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_MAC_ADDRESS);
-		if(status == PICO_OK)
-			LogVerbose("MAC address:      %s\n", buf);
-
-		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_DRIVER_PATH);
-		if(status == PICO_OK)
-			LogVerbose("Driver path:      %s\n", buf);
-
-		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_SHADOW_CAL);
-		if(status == PICO_OK)
-			LogVerbose("Shadow cal:       %s\n", buf);
+		static const struct
+		{
+			PICO_INFO info;
+			const char* name;
+		} details[] =
+		{
+			{PICO_DRIVER_VERSION,				"Driver version:   "},
+			{PICO_USB_VERSION,					"USB version:      "},
+			{PICO_HARDWARE_VERSION,				"Hardware version: "},
+			{PICO_CAL_DATE,						"Cal date:         "},
+			{PICO_KERNEL_VERSION,				"Kernel ver:       "},
+			{PICO_DIGITAL_HARDWARE_VERSION,		"Digital HW ver:   "},
+			{PICO_ANALOGUE_HARDWARE_VERSION,	"Analog HW ver:    "},
+			{PICO_FIRMWARE_VERSION_2,			"FW ver 2:         "},
+			{PICO_FIRMWARE_VERSION_3,			"FW ver 3:         "},
+			{PICO_FRONT_PANEL_FIRMWARE_VERSION,	"Front panel FW:   "},
+			{PICO_MAC_ADDRESS,					"MAC address:      "},
+			{PICO_DRIVER_PATH,					"Driver path:      "},
+			{PICO_SHADOW_CAL,					"Shadow cal:       "},
+			{PICO_IPP_VERSION,					"IPP version:      "}
+		};
+		if(console_verbosity >= Severity::VERBOSE)
+		{
+			for(auto& d : details)
+			{
+				status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, d.info);
+				if(status == PICO_OK)
+					LogVerbose("%s%s\n", d.name, buf);
+			}
+		}
+	}
 
-		status = picoGetUnitInfo(g_hScope, (int8_t*)buf, sizeof(buf), &required, PICO_IPP_VERSION);
-		if(status == PICO_OK)
-			LogVerbose("IPP version:      %s\n", buf);
+	//Next time, open this unit (and whatever unit we'd find without a serial number) with the right API directly
+	if(g_pico_type != PICOSIM)
+	{
+		SaveCachedSeries(g_openSerial, g_series);
+		if(!g_serial.empty() && (g_serial != g_openSerial) )
+			SaveCachedSeries(g_serial, g_series);
 	}
 	LogNotice("Successfully opened instrument %s (%s) on ports %i, %i\n", g_model.c_str(), g_serial.c_str(), scpi_port, waveform_port);
+	ApplyThreadTuning();
 
 	//Limit to two channels only while on USB power
 	if(limitChannels)
 		g_numChannels = '2' - '0';
+	else if(g_pico_type == PICOSIM)
+		g_numChannels = simChannels;
 	else
 		g_numChannels = g_model[1] - '0';
 
@@ -318,6 +450,9 @@ int main(int argc, char* argv[])
 			case PICOPSOSPA:
 				psospaSetChannelOff(g_hScope, (PICO_CHANNEL)i);
 				break;
+			case PICOSIM:
+				simSetChannel(g_hScope, i, false, 1, 0);
+				break;
 		}
 	}
 
@@ -387,6 +522,9 @@ int main(int argc, char* argv[])
 	//Push initial trigger config
 	UpdateTrigger();
 
+	//Probe the capabilities of the initial configuration up front
+	GetCapabilities();
+
 	//Set up signal handlers
 #ifdef _WIN32
 	SetConsoleCtrlHandler(OnQuit, TRUE);
@@ -395,10 +533,20 @@ int main(int argc, char* argv[])
 	signal(SIGPIPE, SIG_IGN);
 #endif
 
-	//Configure the data plane socket
+	//Configure the data plane socket, and name the shared memory ring after it so each instance gets its own
+	g_shmName = "/ps6000d-" + to_string(waveform_port);
 	g_dataSocket.Bind(waveform_port);
 	g_dataSocket.Listen();
 
+	//Configure the subscriber socket, if we have one
+	if(subscriber_port != 0)
+	{
+		g_maxSubscribers = max_subscribers;
+		g_subscriberSocket.Bind(subscriber_port);
+		g_subscriberSocket.Listen();
+		thread(SubscriberAcceptThread).detach();
+	}
+
 	//Launch the control plane socket server
 	g_scpiSocket.Bind(scpi_port);
 	g_scpiSocket.Listen();
@@ -424,27 +572,9 @@ int main(int argc, char* argv[])
 	}
 
 	//Done
-	switch(g_pico_type)
-	{
-		case PICO2000A:
-			ps2000aCloseUnit(g_hScope);
-			break;
-		case PICO3000A:
-			ps3000aCloseUnit(g_hScope);
-			break;
-		case PICO4000A:
-			ps4000aCloseUnit(g_hScope);
-			break;
-		case PICO5000A:
-			ps5000aCloseUnit(g_hScope);
-			break;
-		case PICO6000A:
-			ps6000aCloseUnit(g_hScope);
-			break;
-		case PICOPSOSPA:
-			psospaCloseUnit(g_hScope);
-			break;
-	}
+	StopRecording();
+	RecordClose(g_record);
+	g_backend->CloseUnit();
 
 	return 0;
 }
@@ -459,35 +589,28 @@ void OnQuit(int /*signal*/)
 #endif
 	LogNotice("Shutting down...\n");
 
-	lock_guard<mutex> lock(g_mutex);
-	switch(g_pico_type)
-	{
-		case PICO2000A:
-			ps2000aCloseUnit(g_hScope);
-			break;
-		case PICO3000A:
-			ps3000aCloseUnit(g_hScope);
-			break;
-		case PICO4000A:
-			ps4000aCloseUnit(g_hScope);
-			break;
-		case PICO5000A:
-			ps5000aCloseUnit(g_hScope);
-			break;
-		case PICO6000A:
-			ps6000aCloseUnit(g_hScope);
-			break;
-		case PICOPSOSPA:
-			psospaCloseUnit(g_hScope);
-			break;
-	}
+	StopRecording();
+	RecordClose(g_record);
+
+	DriverLock lock;
+	g_backend->CloseUnit();
 	exit(0);
 }
 
+/**
+	@brief Serial number to pass to psXXXXOpenUnit
+ */
+int8_t* OpenSerial()
+{
+	if(g_openSerial.empty())
+		return NULL;
+	return (int8_t*)g_openSerial.c_str();
+}
+
 PICO_INFO Open2000()
 {
 	LogNotice("Looking for a PicoScope 2000 series instrument to open...\n");
-	PICO_INFO status = ps2000aOpenUnit(&g_hScope, NULL);
+	PICO_INFO status = ps2000aOpenUnit(&g_hScope, OpenSerial());
 	if(status == PICO_OK)
 	{
 		g_series = 2;
@@ -499,7 +622,7 @@ PICO_INFO Open2000()
 PICO_INFO Open3000()
 {
 	LogNotice("Looking for a PicoScope 3000 series instrument to open...\n");
-	PICO_INFO status = ps3000aOpenUnit(&g_hScope, NULL);
+	PICO_INFO status = ps3000aOpenUnit(&g_hScope, OpenSerial());
 	if(status == PICO_POWER_SUPPLY_NOT_CONNECTED)
 	{
 		// switch to USB power
@@ -516,7 +639,7 @@ PICO_INFO Open3000()
 		return status;
 	}
 
-	status = psospaOpenUnit(&g_hScope, NULL, PICO_DR_8BIT, NULL);
+	status = psospaOpenUnit(&g_hScope, OpenSerial(), PICO_DR_8BIT, NULL);
 	if(status == PICO_OK)
 	{
 		g_series = 3;
@@ -529,7 +652,7 @@ PICO_INFO Open3000()
 PICO_INFO Open4000()
 {
 	LogNotice("Looking for a PicoScope 4000 series instrument to open...\n");
-	PICO_INFO status = ps4000aOpenUnit(&g_hScope, NULL);
+	PICO_INFO status = ps4000aOpenUnit(&g_hScope, OpenSerial());
 	if(status == PICO_POWER_SUPPLY_NOT_CONNECTED)
 	{
 		// switch to USB power
@@ -550,7 +673,7 @@ PICO_INFO Open4000()
 PICO_INFO Open5000()
 {
 	LogNotice("Looking for a PicoScope 5000 series instrument to open...\n");
-	PICO_INFO status = ps5000aOpenUnit(&g_hScope, NULL, PS5000A_DR_8BIT);
+	PICO_INFO status = ps5000aOpenUnit(&g_hScope, OpenSerial(), PS5000A_DR_8BIT);
 	if( (status == PICO_POWER_SUPPLY_NOT_CONNECTED) or (status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT) )
 	{
 		// switch to USB power
@@ -570,7 +693,7 @@ PICO_INFO Open5000()
 PICO_INFO Open6000()
 {
 	LogNotice("Looking for a PicoScope 6000 series instrument to open...\n");
-	PICO_INFO status = ps6000aOpenUnit(&g_hScope, NULL, PICO_DR_8BIT);
+	PICO_INFO status = ps6000aOpenUnit(&g_hScope, OpenSerial(), PICO_DR_8BIT);
 	if(status == PICO_OK)
 	{
 		g_series = 6;
@@ -579,3 +702,38 @@ PICO_INFO Open6000()
 	}
 	return status;
 }
+
+/**
+	@brief Opens the first (or the --serial) unit of a series with its API
+ */
+PICO_INFO OpenSeries(size_t series)
+{
+	switch(series)
+	{
+		case 2:
+			return Open2000();
+		case 3:
+			return Open3000();
+		case 4:
+			return Open4000();
+		case 5:
+			return Open5000();
+		case 6:
+			return Open6000();
+		default:
+			return PICO_NOT_FOUND;
+	}
+}
+
+PICO_INFO OpenSimulator(size_t numChannels)
+{
+	LogNotice("Opening a simulated %zu channel instrument...\n", numChannels);
+	PICO_INFO status = simOpenUnit(&g_hScope, numChannels);
+	if(status == PICO_OK)
+	{
+		g_series = 0;
+		g_pico_type = PICOSIM;
+		picoGetUnitInfo = simGetUnitInfo;
+	}
+	return status;
+}
@@ -40,7 +40,11 @@
 
 #include <thread>
 #include <map>
+#include <vector>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
 
 #include "ps6000aApi.h"	//always include this first! 01/26
 #include "ps5000aApi.h"
@@ -58,14 +62,36 @@ enum PicoScopeType
 	PICO4000A,
 	PICO5000A,
 	PICO6000A,
-	PICOPSOSPA
+	PICOPSOSPA,
+	PICOSIM			//simulated instrument, see Simulator.cpp
 };
 
 extern Socket g_scpiSocket;
 extern Socket g_dataSocket;
+extern Socket g_subscriberSocket;
 extern int16_t g_hScope;
 
 void WaveformServerThread();
+void SubscriberAcceptThread();
+extern size_t g_maxSubscribers;
+
+void AppendSerials(std::vector<std::string>& serials, const char* list);
+std::vector<std::string> EnumerateUnits(int series);
+int RunSupervisor(
+	int argc,
+	char* argv[],
+	const std::vector<std::string>& serials,
+	uint16_t scpi_port,
+	uint16_t waveform_port,
+	uint16_t subscriber_port);
+
+//Finding the instrument at startup, see Discovery.cpp
+extern std::string g_unitCachePath;
+extern bool g_parallelProbe;
+std::string DefaultUnitCachePath();
+int LookupCachedSeries(const std::string& serial);
+void SaveCachedSeries(const std::string& serial, int series);
+int FindSeriesOfUnit(const std::string& serial);
 
 extern PicoScopeType g_pico_type;
 extern std::string g_model;		//model number, used to discern features
@@ -80,7 +106,9 @@ extern size_t g_numDigitalPods;
 extern volatile bool g_waveformThreadQuit;
 extern size_t g_captureMemDepth;
 extern size_t g_memDepth;
+extern size_t g_segmentMaxDepth;
 extern size_t g_scaleValue;
+extern size_t g_adcBits;
 extern std::map<size_t, bool> g_channelOnDuringArm;
 extern std::map<size_t, bool> g_channelOn;
 extern std::map<size_t, double> g_roundedRange;
@@ -112,19 +140,515 @@ extern std::map<size_t, double> g_offsetDuringArm;
 extern size_t g_triggerSampleIndex;
 extern size_t g_triggerChannel;
 extern float g_triggerVoltage;
+extern PICO_THRESHOLD_DIRECTION g_triggerDirection;
+
+//Trigger types beyond a simple edge, see Triggers.cpp
+enum TriggerMode
+{
+	TRIGGER_EDGE,
+	TRIGGER_WINDOW,
+	TRIGGER_RUNT,
+	TRIGGER_PULSE,
+	TRIGGER_PATTERN
+};
+extern TriggerMode g_triggerMode;
+extern float g_triggerLowerVoltage;
+extern PICO_THRESHOLD_DIRECTION g_windowDirection;
+extern PICO_THRESHOLD_DIRECTION g_runtDirection;
+extern PICO_PULSE_WIDTH_TYPE g_pulseWidthType;
+extern int64_t g_pulseWidthLower;
+extern int64_t g_pulseWidthUpper;
+extern std::string g_triggerPattern;
+bool ParseTriggerPattern(const std::string& pattern, std::string& out);
+bool UpdateAdvancedTrigger(int16_t upper, int16_t lower, uint64_t delay, uint32_t timeout);
+void ClearAdvancedTrigger();
 
 extern bool g_triggerArmed;
 extern bool g_triggerOneShot;
 extern bool g_memDepthChanged;
 
+extern size_t g_numSegments;
+extern size_t g_numSegmentsDuringArm;
+
+extern bool g_streamingMode;
+extern bool g_streamingModeDuringArm;
+
+extern size_t g_pipelineDepth;
+
+extern std::atomic<size_t> g_ackWindowWaveforms;
+extern std::atomic<uint64_t> g_ackWindowBytes;
+
+enum DownsampleMode
+{
+	DOWNSAMPLE_NONE,
+	DOWNSAMPLE_DECIMATE,
+	DOWNSAMPLE_AVERAGE,
+	DOWNSAMPLE_AGGREGATE
+};
+
+extern uint32_t g_downsampleRatio;
+extern uint32_t g_downsampleRatioDuringArm;
+extern DownsampleMode g_downsampleMode;
+extern DownsampleMode g_downsampleModeDuringArm;
+
+extern bool g_lockSampleBuffers;
+size_t RoundUpSampleBuffer(size_t samples);
+int16_t* AllocateSampleBuffer(size_t samples);
+void FreeSampleBuffer(int16_t* buf, size_t samples);
+
+//Data path CPU affinity, priority and NUMA placement, see ThreadTuning.cpp
+enum
+{
+	NUMA_NODE_ANY = -1,
+	NUMA_NODE_AUTO = -2
+};
+extern std::vector<int> g_dataCores;
+extern std::vector<int> g_compressCores;
+extern int g_rtPriority;
+extern int g_numaNode;
+bool ParseCoreList(const char* list, std::vector<int>& cores);
+void ApplyThreadTuning();
+void TuneDataThread(const char* name);
+void TuneCompressionThread();
+void BindToNumaNode(void* buf, size_t len);
+
+//One buffer in a scatter-gather send
+struct SendChunk
+{
+	const void* data;
+	size_t len;
+};
+
+extern bool g_zeroCopySend;
+bool EnableZeroCopySend(Socket& sock);
+bool SendGathered(Socket& sock, const std::vector<SendChunk>& chunks, bool allowZeroCopy = true);
+
+//Data plane transport, see ShmTransport.cpp
+enum DataTransport
+{
+	TRANSPORT_TCP,	//everything on the data plane socket (default)
+	TRANSPORT_SHM	//waveforms in a shared memory ring, doorbells and ACKs on the socket
+};
+
+#pragma pack(push, 1)
+struct ShmRingHeader
+{
+	uint32_t magic;			//SHM_MAGIC
+	uint32_t version;
+	uint32_t numSlots;
+	uint32_t slotOffset;	//offset of slot 0 from the start of the object
+	uint64_t slotSize;		//bytes per slot
+};
+
+struct ShmDoorbell
+{
+	uint32_t slot;			//slot the waveform is in, or SHM_SLOT_INLINE if it follows on the socket
+	uint32_t reserved;
+	uint64_t length;		//size of the waveform in bytes
+};
+#pragma pack(pop)
+
+#define SHM_MAGIC 0x4d485350		//"PSHM"
+#define SHM_SLOT_INLINE 0xffffffff
+
+struct ShmRing
+{
+	std::string name;
+	int fd = -1;
+	uint8_t* base = nullptr;
+	size_t mapSize = 0;
+	size_t numSlots = 0;
+	size_t slotSize = 0;
+	size_t nextSlot = 0;
+};
+
+extern DataTransport g_transport;
+extern std::string g_shmName;
+extern size_t g_shmSlots;
+extern size_t g_shmSlotSize;
+bool ShmCreate(ShmRing& ring, const std::string& name, size_t numSlots, size_t slotSize);
+void ShmDestroy(ShmRing& ring);
+bool ShmSendInline(Socket& sock, uint64_t bytes);
+bool ShmSend(ShmRing& ring, Socket& sock, const std::vector<SendChunk>& chunks, uint64_t bytes);
+
+//Record to disk (RECORD:BEGIN), see Recorder.cpp
+#define RECORD_MAX_CHANNELS 8
+
+#pragma pack(push, 1)
+struct RecordFileHeader
+{
+	uint32_t magic;			//RECORD_MAGIC
+	uint32_t version;
+	char model[32];
+	char serial[32];
+
+	//Settings of the first recorded waveform, each record's own headers have those it was captured with
+	int64_t fs_per_sample;
+	uint32_t numChannels;	//analog channels
+	uint32_t reserved;
+	float scale[RECORD_MAX_CHANNELS];
+	float offset[RECORD_MAX_CHANNELS];
+
+	uint64_t indexOffset;	//offset of the RecordIndexEntry array from the start of the file
+	uint64_t indexCapacity;	//number of entries it has room for
+	uint64_t dataOffset;	//offset of the data region
+	uint64_t dataSize;		//size of the data region
+	uint64_t recordCount;	//number of complete records, only bumped once a record and its index entry are written
+	uint64_t dataUsed;		//bytes of the data region used by complete records
+};
+
+struct RecordIndexEntry
+{
+	uint32_t sequence;		//sequence number in the recording, starting at 1
+	uint32_t flags;			//RecordFlags
+	int64_t timestamp;		//time of the download, ns since the epoch
+	uint64_t offset;		//offset of the waveform from the start of the data region
+	uint64_t length;		//size of the waveform in bytes
+};
+#pragma pack(pop)
+
+#define RECORD_MAGIC 0x43455250		//"PREC"
+
+//Optional parts of a recorded waveform, which is stored exactly as it would be on the data plane socket
+enum RecordFlags
+{
+	RECORD_PACKED		= 0x01,		//FORMAT PACKED (or compressed): sample width after each channel header
+	RECORD_COMPRESSED	= 0x02,		//COMPRESS RICE
+	RECORD_ROI			= 0x04,		//region of interest offset after the waveform header
+	RECORD_AVERAGED		= 0x08,		//average count after the waveform header
+	RECORD_VARIANCE		= 0x10,		//variance after each analog channel's samples
+	RECORD_ENVELOPE		= 0x20,		//samples are a min/max envelope
+	RECORD_PROTOCOL2	= 0x40,		//a PROTOCOL 2 frame, self describing
+	RECORD_STREAMING	= 0x80		//a streaming mode chunk, with the running sample counter after the waveform header
+};
+
+struct RecordFile
+{
+	std::mutex lock;
+	std::string path;
+	int fd = -1;
+	uint8_t* base = nullptr;
+	size_t mapSize = 0;
+	uint64_t flushed = 0;	//bytes of the data region already handed to the kernel for writeback
+	bool full = false;
+};
+
+extern RecordFile g_record;
+extern uint64_t g_recordSize;
+bool RecordOpen(RecordFile& file, const std::string& path, uint64_t size);
+void RecordFlush(RecordFile& file);
+void RecordClose(RecordFile& file);
+bool RecordAppend(
+	RecordFile& file,
+	const std::vector<SendChunk>& chunks,
+	uint64_t bytes,
+	uint32_t sequence,
+	uint32_t flags,
+	int64_t timestamp,
+	int64_t interval,
+	const std::map<size_t, float>& scale,
+	const std::map<size_t, float>& offset);
+uint64_t RecordCount(RecordFile& file);
+bool RecordRead(RecordFile& file, uint64_t i, std::vector<uint8_t>& out, uint32_t* flags = nullptr);
+bool StartRecording(const std::string& path, uint64_t size);
+void StopRecording();
+bool IsRecording();
+uint64_t RecordDropCount();
+void RequestReplay(uint64_t first, uint64_t last);
+
+//Sample encoding on the data plane socket
+enum WireFormat
+{
+	FORMAT_INT16,	//int16_t per sample, regardless of resolution (default)
+	FORMAT_PACKED	//packed to the ADC resolution, see PackSamples()
+};
+
+extern WireFormat g_wireFormat;
+size_t PackedSampleSize(size_t numSamples, size_t bits);
+void PackSamples(const int16_t* in, uint8_t* out, size_t numSamples, size_t bits);
+void PackDigitalSamples(const int16_t* in, uint8_t* out, size_t numSamples);
+
+//Lossless compression of waveform data
+enum CompressionMode
+{
+	COMPRESS_NONE,
+	COMPRESS_RICE	//delta + adaptive Rice coding, see Compression.cpp
+};
+
+struct CompressionJob
+{
+	const int16_t* in;
+	size_t numSamples;
+	size_t bits;
+	bool digital;
+	std::vector<uint8_t>* out;
+};
+
+extern CompressionMode g_compressionMode;
+extern size_t g_compressionThreads;
+void CompressSamples(const int16_t* in, size_t numSamples, size_t bits, bool digital, std::vector<uint8_t>& out);
+void StartCompressionWorkers();
+void CompressChannels(std::vector<CompressionJob>& jobs);
+
+//Data plane framing version 2 (PROTOCOL 2).
+//Every field is fixed width and naturally aligned, and every header and block of samples starts on an 8 byte
+//boundary from the start of the frame, so a client can parse a frame in place. All values are little endian.
+//A frame is a FrameHeader, then numWaveforms times a FrameWaveformHeader and its numChannels channels.
+//Each channel is a FrameChannelHeader, dataLength bytes of samples and, with CHANNEL_VARIANCE, numSamples float
+//variances, each of the last two padded with zeroes to a multiple of 8 bytes.
+extern unsigned int g_protocolVersion;
+
+#define FRAME_MAGIC 0x32574650		//"PFW2"
+
+struct FrameHeader
+{
+	uint32_t magic;				//FRAME_MAGIC
+	uint16_t version;			//2
+	uint16_t headerSize;		//sizeof(FrameHeader), later versions may append fields
+	uint32_t sequence;			//sequence number to ACK (one per frame)
+	uint32_t numWaveforms;		//every segment of a rapid block capture, otherwise 1
+	uint64_t length;			//total frame length in bytes, including this header
+	uint32_t flags;				//FrameFlags
+	uint32_t reserved;
+};
+
+enum FrameFlags
+{
+	FRAME_STREAMING		= 0x01		//a streaming mode chunk
+};
+
+struct FrameWaveformHeader
+{
+	uint64_t length;			//bytes from the start of this header to the next waveform header
+	int64_t fsPerSample;		//sample interval
+	int64_t triggerTime;		//when the driver reported the capture complete (or the chunk was read), ns since epoch
+	int64_t startTime;			//region of interest: time of the first sample from the start of the capture, in fs
+	uint64_t firstSample;		//streaming: index of the first sample, counted from the start of streaming
+	uint32_t segment;			//index of the segment within the capture
+	uint32_t numChannels;
+	uint32_t averageCount;		//number of captures averaged, 0 if not averaged
+	uint32_t flags;				//WaveformFlags
+	uint16_t headerSize;		//sizeof(FrameWaveformHeader)
+	uint16_t reserved0;
+	uint32_t reserved1;
+};
+
+enum WaveformFlags
+{
+	WAVEFORM_ROI		= 0x01,		//only a region of interest of the capture, see startTime
+	WAVEFORM_AVERAGED	= 0x02,		//mean of averageCount captures
+	WAVEFORM_ENVELOPE	= 0x04		//samples are a min/max envelope, see ENVELOPE
+};
+
+struct FrameChannelHeader
+{
+	uint32_t channel;			//channel index, MSO pods after the analog channels
+	uint32_t flags;				//ChannelFlags
+	uint64_t numSamples;
+	uint64_t dataLength;		//bytes of sample data following this header, before padding
+	double trigphase;			//trigger phase, in fs
+	float scale;				//volts per sample code, 1 for MSO pods
+	float offset;				//volts, 0 for MSO pods
+	uint8_t encoding;			//SampleEncoding
+	uint8_t compression;		//CompressionMode
+	uint8_t bits;				//significant bits per sample
+	uint8_t reserved0;
+	uint32_t reserved1;
+};
+
+enum ChannelFlags
+{
+	CHANNEL_OVERFLOW	= 0x01,		//the input was over range during the capture
+	CHANNEL_DIGITAL		= 0x02,		//an MSO pod, one bit per line
+	CHANNEL_VARIANCE	= 0x04		//variances follow the samples
+};
+
+enum SampleEncoding
+{
+	ENCODING_INT16		= 0,		//int16_t per sample
+	ENCODING_PACKED		= 1			//packed to bits wide as in FORMAT PACKED, one byte per sample for MSO pods
+};
+
+static_assert(sizeof(FrameHeader) == 32, "FrameHeader layout");
+static_assert(sizeof(FrameWaveformHeader) == 64, "FrameWaveformHeader layout");
+static_assert(sizeof(FrameChannelHeader) == 48, "FrameChannelHeader layout");
+
+//Server side averaging (AVERAGE, AVERAGE:VARIANCE)
+extern size_t g_averageCount;
+extern bool g_averageVariance;
+void AccumulateSamples(const int16_t* in, int32_t* sum, size_t count);
+void AccumulateSquares(const int16_t* in, int64_t* sumsq, size_t count);
+void FinishAverage(const int32_t* sum, size_t n, int16_t* out, size_t count);
+void FinishVariance(const int32_t* sum, const int64_t* sumsq, size_t n, float* out, size_t count);
+
+//Limit mask testing (MASK), in ADC codes per sample index
+struct ChannelMask
+{
+	std::vector<int16_t> lower;
+	std::vector<int16_t> upper;
+};
+typedef std::map<size_t, ChannelMask> MaskSet;
+
+extern bool g_maskEnabled;
+extern std::shared_ptr<MaskSet> g_mask;
+extern std::atomic<uint64_t> g_maskPassCount;
+extern std::atomic<uint64_t> g_maskFailCount;
+void SetMaskRegion(ChannelMask& mask, size_t first, size_t last, int16_t lower, int16_t upper);
+bool CheckMask(const int16_t* in, const int16_t* lower, const int16_t* upper, size_t count);
+
+//Software peak detect
+extern size_t g_envelopeColumns;
+void ComputeEnvelope(const int16_t* in, size_t numSamples, size_t columns, int16_t* out);
+void ComputeDigitalEnvelope(const int16_t* in, size_t numSamples, size_t columns, int16_t* out);
+void RequestFullFetch();
+
+//Region of interest of block mode downloads (ROI:FIRST, ROI:LENGTH)
+extern uint64_t g_roiStart;
+extern uint64_t g_roiLength;
+extern bool g_captureInDriver;
+void RequestRestFetch();
+
+//Simulated instrument (--simulate), API modelled on the 6000E driver
+typedef void (PREF4 *simBlockReady)(int16_t handle, PICO_STATUS status, void* pParameter);
+
+extern double g_simBandwidth;
+extern double g_simTriggerRate;
+PICO_STATUS simOpenUnit(int16_t* handle, size_t numChannels);
+PICO_STATUS simCloseUnit(int16_t handle);
+PICO_STATUS simGetUnitInfo(int16_t handle, int8_t* str, int16_t stringLength, int16_t* requiredSize, PICO_INFO info);
+PICO_STATUS simSetChannel(int16_t handle, size_t channel, bool enabled, double range_V, double offset_V);
+PICO_STATUS simGetAnalogueOffsetLimits(int16_t handle, double range_V, double* maximumVoltage, double* minimumVoltage);
+PICO_STATUS simGetAdcLimits(int16_t handle, int16_t* maxValue);
+PICO_STATUS simSetDeviceResolution(int16_t handle, size_t bits);
+PICO_STATUS simGetTimebase(
+	int16_t handle,
+	uint32_t timebase,
+	uint64_t noSamples,
+	double* timeIntervalNanoseconds,
+	uint64_t* maxSamples,
+	uint64_t segmentIndex);
+PICO_STATUS simMemorySegments(int16_t handle, uint64_t nSegments, uint64_t* nMaxSamples);
+PICO_STATUS simSetNoOfCaptures(int16_t handle, uint64_t nCaptures);
+PICO_STATUS simSetSimpleTrigger(int16_t handle, uint32_t autoTriggerMicroSeconds);
+PICO_STATUS simRunBlock(
+	int16_t handle,
+	uint64_t noOfPreTriggerSamples,
+	uint64_t noOfPostTriggerSamples,
+	uint32_t timebase,
+	double* timeIndisposedMs,
+	uint64_t segmentIndex,
+	simBlockReady lpReady,
+	void* pParameter);
+PICO_STATUS simStop(int16_t handle);
+PICO_STATUS simSetDataBuffer(
+	int16_t handle,
+	PICO_CHANNEL channel,
+	int16_t* buffer,
+	int32_t nSamples,
+	uint64_t segmentIndex,
+	PICO_RATIO_MODE mode,
+	PICO_ACTION action);
+PICO_STATUS simSetDataBuffers(
+	int16_t handle,
+	PICO_CHANNEL channel,
+	int16_t* bufferMax,
+	int16_t* bufferMin,
+	int32_t nSamples,
+	uint64_t segmentIndex,
+	PICO_RATIO_MODE mode,
+	PICO_ACTION action);
+PICO_STATUS simGetValues(
+	int16_t handle,
+	uint64_t startIndex,
+	uint64_t* noOfSamples,
+	uint64_t downSampleRatio,
+	PICO_RATIO_MODE downSampleRatioMode,
+	uint64_t segmentIndex,
+	int16_t* overflow);
+PICO_STATUS simGetValuesBulk(
+	int16_t handle,
+	uint64_t startIndex,
+	uint64_t* noOfSamples,
+	uint64_t fromSegmentIndex,
+	uint64_t toSegmentIndex,
+	uint64_t downSampleRatio,
+	PICO_RATIO_MODE downSampleRatioMode,
+	int16_t* overflow);
+
+//Acquisition loop instrumentation
+enum PerfStage
+{
+	PERF_ARM_TO_READY,	//trigger armed until the driver reports the capture complete
+	PERF_STOP,			//psXXXXStop after a capture
+	PERF_BUFFER_SETUP,	//(re)allocating and attaching sample buffers
+	PERF_DOWNLOAD,		//psXXXXGetValues / GetValuesBulk
+	PERF_SEND,			//headers and samples out to the client
+	PERF_ACK_WAIT,		//blocked on client ACKs in the backpressure loop
+	PERF_REARM,			//restarting the capture
+
+	PERF_STAGE_COUNT
+};
+
+uint64_t PerfTimestamp();
+void PerfRecord(PerfStage stage, uint64_t start, uint64_t bytes = 0);
+void PerfMarkArmed();
+void PerfMarkReady();
+void PerfReset();
+std::string PerfReport();
+void PerfPeriodicLog();
+
+//Sample rates and memory depths available in the current configuration
+struct ScopeCapabilities
+{
+	std::vector<size_t> rates;
+	std::map<size_t, uint32_t> timebases;	//sample rate to timebase number
+	std::vector<size_t> depths;
+};
+
+const ScopeCapabilities& GetCapabilities();
+bool HaveCapabilities();
+
 extern std::mutex g_mutex;
 
+//Set (under g_mutex) while the waveform thread is stopping the scope, attaching buffers and downloading a capture
+//without holding g_mutex. Nothing else may call into the driver or touch arm-time state until it's cleared.
+extern bool g_driverBusy;
+extern std::condition_variable g_driverIdle;
+void WaitForDriverIdle(std::unique_lock<std::mutex>& lock);
+
+/**
+	@brief Locks g_mutex once the waveform thread is done with the driver
+
+	Use instead of a plain lock on g_mutex for anything that calls into the driver or changes settings the waveform
+	thread reads during a download. Queries of plain settings only need g_mutex, and don't wait on downloads.
+ */
+class DriverLock
+{
+public:
+	DriverLock()
+	: m_lock(g_mutex)
+	{ WaitForDriverIdle(m_lock); }
+
+protected:
+	std::unique_lock<std::mutex> m_lock;
+};
+
 void Stop();
 void StartCapture(bool stopFirst, bool force = false);
 PICO_STATUS StartInternal();
+PICO_STATUS StartStreaming();
+void* PrepareBlockReady();
+void PREF4 OnBlockReady(int16_t handle, PICO_STATUS status, void* pParameter);
 void UpdateTrigger(bool force = false);
+void CommitSetup();
 void UpdateChannel(size_t chan);
+bool UpdateSegments();
+size_t EffectiveMemDepth();
 
 extern bool g_lastTriggerWasForced;
+extern bool g_setupBatch;
+extern bool g_rearmPending;
+
+#include "PicoBackend.h"
 
 #endif